@@ -0,0 +1,670 @@
+/*
+ * Transaction lifecycle benchmark for libbtrfstrans.
+ *
+ * Fills head with a tree of files, then runs writer and reader processes
+ * concurrently and reports the latency distribution of every transaction
+ * step, followed by the small-file write throughput inside a single
+ * transaction. Every result is one JSON object per line, written to the
+ * file given with -o.
+ *
+ * With -v the tree is then reverted to the generation before a small
+ * commit that many times, which should take as long for any tree size.
+ *
+ * With -t that many one-file commits run back to back, once through the
+ * rename journal and once through snapshots.
+ *
+ * With -D the writers spread over that many domains, writer p working on
+ * domain bench<p % domains>, and every -x'th commit of a writer spans its
+ * domain and the next one. The tree, the readers and the small-file run
+ * use domain bench0.
+ *
+ * Build: see bench/run_bench.sh
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "../libbtrfstrans.h"
+
+#define BENCH_FILES_PER_DIR 1000
+#define BENCH_POPULATE_BATCH 64
+
+enum bench_op {
+    OP_START,
+    OP_COMMIT,
+    OP_ABORT,
+    OP_RO_START,
+    OP_RO_STOP,
+    OP_COUNT
+};
+
+static const char* op_names[OP_COUNT] = {
+    "start_transaction",
+    "commit_transaction",
+    "abort_transaction",
+    "start_ro_transaction",
+    "stop_ro_transaction"
+};
+
+struct bench_opts {
+    const char* root;
+    const char* output;
+    long files;
+    int writers;
+    int readers;
+    int iterations;
+    int mode;
+    int durability;
+    int small_files;
+    size_t small_size;
+    int reverts;
+    int tiny_commits;
+    int domains;        // 0: the volume itself
+    int multi_every;    // 0: no multi-domain commits
+};
+
+/*
+ * Latencies in ns, shared with the worker processes:
+ * samples[(op * procs + proc) * iterations + i]. A value of 0 is a
+ * failed operation.
+ */
+static unsigned long long* samples;
+static int procs;
+
+static FILE* out;
+
+static unsigned long long now_ns() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned long long* sample(struct bench_opts* o, int op, int proc, int i) {
+    return &samples[((size_t)op * procs + proc) * o->iterations + i];
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr, "usage: %s -p volume_root [-o results.jsonl] [-f files] [-w writers]\n"
+        "          [-r readers] [-n iterations] [-m pessimistic|optimistic]\n"
+        "          [-d durability 0-3] [-s small_files] [-b small_file_bytes]\n"
+        "          [-v reverts] [-t tiny_commits] [-D domains] [-x multi_domain_commit_interval]\n", prog);
+    exit(2);
+}
+
+// opens the volume, or domain number domain of it with -D
+static int open_ctx(struct bench_opts* o, int domain, btrfstrans_ctx** ctx) {
+    char name[32];
+    int ret;
+
+    if (o->domains > 0) {
+        snprintf(name, sizeof(name), "bench%d", domain % o->domains);
+        ret = btrfstrans_ctx_open_domain(o->root, name, ctx);
+    } else {
+        ret = btrfstrans_ctx_open(o->root, ctx);
+    }
+    if (ret) {
+        fprintf(stderr, "ERROR: can't open %s (%d)\n", o->root, ret);
+        return ret;
+    }
+    btrfstrans_ctx_set_mode(*ctx, o->mode);
+    btrfstrans_ctx_set_durability(*ctx, o->durability);
+    return SUCCESS;
+}
+
+/*
+ * Adds files tree/d<n>/f<m> to head until it holds o->files of them.
+ */
+static int populate(struct bench_opts* o, btrfstrans_ctx* ctx) {
+    struct btrfstrans_op ops[3 * BENCH_POPULATE_BATCH];
+    char paths[BENCH_POPULATE_BATCH][64];
+    char dir[32];
+    btrfstrans_txn* txn;
+    struct stat st;
+    unsigned long long t0;
+    long created = 0;
+    int n, ret;
+
+    ret = btrfstrans_txn_begin(ctx, &txn);
+    if (ret) {
+        return ret;
+    }
+
+    t0 = now_ns();
+    btrfstrans_txn_mkdir(txn, "tree", 0755);
+    for (long f = 0; f < o->files; f += n) {
+        n = 0;
+        if (f % BENCH_FILES_PER_DIR == 0) {
+            snprintf(dir, sizeof(dir), "tree/d%ld", f / BENCH_FILES_PER_DIR);
+            if (btrfstrans_txn_stat(txn, dir, &st)) {
+                btrfstrans_txn_mkdir(txn, dir, 0755);
+            }
+        }
+
+        // a batch never crosses into the next directory
+        for (int i = 0; i < BENCH_POPULATE_BATCH && f + i < o->files &&
+            (i == 0 || (f + i) % BENCH_FILES_PER_DIR); i++) {
+            struct btrfstrans_op* op = &ops[3 * i];
+
+            snprintf(paths[i], sizeof(paths[i]), "tree/d%ld/f%ld",
+                (f + i) / BENCH_FILES_PER_DIR, (f + i) % BENCH_FILES_PER_DIR);
+            memset(op, 0, 3 * sizeof(*op));
+            op[0].opcode = BTRFSTRANS_OP_OPEN;
+            op[0].flags = BTRFSTRANS_OP_LINK;
+            op[0].path = paths[i];
+            op[0].open_flags = O_WRONLY | O_CREAT | O_EXCL;
+            op[0].mode = 0644;
+            op[0].file = i;
+            op[1].opcode = BTRFSTRANS_OP_WRITE;
+            op[1].flags = BTRFSTRANS_OP_LINK;
+            op[1].file = i;
+            op[1].buf = paths[i];
+            op[1].len = strlen(paths[i]);
+            op[2].opcode = BTRFSTRANS_OP_CLOSE;
+            op[2].file = i;
+            n++;
+        }
+
+        // files that exist from an earlier run fail with EEXIST, that's fine
+        btrfstrans_txn_submit(txn, ops, 3 * n);
+        for (int i = 0; i < n; i++) {
+            created += ops[3 * i + 2].result == 0;
+        }
+    }
+
+    ret = btrfstrans_txn_commit(txn, NULL);
+
+    fprintf(out, "{\"bench\":\"populate\",\"files\":%ld,\"created\":%ld,\"seconds\":%.3f,\"ok\":%s}\n",
+        o->files, created, (now_ns() - t0) / 1e9, ret ? "false" : "true");
+    fflush(out);
+    return ret;
+}
+
+static void write_marker(btrfstrans_txn* txn, int proc, int i) {
+    char path[64];
+    FILE* fp;
+
+    snprintf(path, sizeof(path), "bench_w%d", proc);
+    fp = btrfstrans_txn_fopen(txn, path, "w");
+    if (fp) {
+        fprintf(fp, "%d\n", i);
+        fclose(fp);
+    }
+}
+
+/*
+ * A commit over the domain of the writer and the next one, its latency
+ * counts as start and commit like a single-domain one.
+ */
+static void run_multi(struct bench_opts* o, btrfstrans_ctx** ctxs, int proc, int i) {
+    btrfstrans_multi* multi;
+    unsigned long long t;
+
+    t = now_ns();
+    if (btrfstrans_multi_begin(ctxs, 2, &multi) != SUCCESS) {
+        return;
+    }
+    *sample(o, OP_START, proc, i) = now_ns() - t;
+    write_marker(btrfstrans_multi_txn(multi, 0), proc, i);
+    write_marker(btrfstrans_multi_txn(multi, 1), proc, i);
+    t = now_ns();
+    if (btrfstrans_multi_commit(multi) == SUCCESS) {
+        *sample(o, OP_COMMIT, proc, i) = now_ns() - t;
+    }
+}
+
+static void run_writer(struct bench_opts* o, btrfstrans_ctx* ctx, int proc) {
+    btrfstrans_ctx* ctxs[2] = { ctx, NULL };
+    btrfstrans_txn* txn;
+    unsigned long long t;
+
+    if (o->domains > 1 && o->multi_every > 0 && open_ctx(o, proc + 1, &ctxs[1])) {
+        return;
+    }
+
+    for (int i = 0; i < o->iterations; i++) {
+        if (ctxs[1] && i % o->multi_every == 0) {
+            run_multi(o, ctxs, proc, i);
+        } else {
+            t = now_ns();
+            if (btrfstrans_txn_begin(ctx, &txn) == SUCCESS) {
+                *sample(o, OP_START, proc, i) = now_ns() - t;
+                write_marker(txn, proc, i);
+                t = now_ns();
+                if (btrfstrans_txn_commit(txn, NULL) == SUCCESS) {
+                    *sample(o, OP_COMMIT, proc, i) = now_ns() - t;
+                }
+            }
+        }
+
+        if (btrfstrans_txn_begin(ctx, &txn) == SUCCESS) {
+            write_marker(txn, proc, i);
+            t = now_ns();
+            if (btrfstrans_txn_abort(txn) == SUCCESS) {
+                *sample(o, OP_ABORT, proc, i) = now_ns() - t;
+            }
+        }
+    }
+    btrfstrans_ctx_close(ctxs[1]);
+}
+
+static void run_reader(struct bench_opts* o, btrfstrans_ctx* ctx, int proc) {
+    btrfstrans_txn* txn;
+    unsigned long long t;
+    struct stat st;
+    char path[64];
+    long f;
+
+    for (int i = 0; i < o->iterations; i++) {
+        t = now_ns();
+        if (btrfstrans_txn_begin_ro(ctx, &txn) != SUCCESS) {
+            continue;
+        }
+        *sample(o, OP_RO_START, proc, i) = now_ns() - t;
+
+        if (o->files > 0) {
+            f = random() % o->files;
+            snprintf(path, sizeof(path), "tree/d%ld/f%ld", f / BENCH_FILES_PER_DIR, f % BENCH_FILES_PER_DIR);
+            btrfstrans_txn_stat(txn, path, &st);
+        }
+
+        t = now_ns();
+        if (btrfstrans_txn_end(txn) == SUCCESS) {
+            *sample(o, OP_RO_STOP, proc, i) = now_ns() - t;
+        }
+    }
+}
+
+static int cmp_ull(const void* a, const void* b) {
+    unsigned long long x = *(const unsigned long long*)a;
+    unsigned long long y = *(const unsigned long long*)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_us(unsigned long long* v, size_t n, double q) {
+    size_t i = (size_t)(q * n);
+
+    return v[i < n ? i : n - 1] / 1e3;
+}
+
+static void report_op(struct bench_opts* o, int op, int first_proc, int nprocs) {
+    unsigned long long* v = malloc(sizeof(*v) * nprocs * o->iterations);
+    unsigned long long sum = 0;
+    size_t n = 0, errors = 0;
+
+    if (!v) {
+        return;
+    }
+    for (int p = first_proc; p < first_proc + nprocs; p++) {
+        for (int i = 0; i < o->iterations; i++) {
+            if (*sample(o, op, p, i)) {
+                v[n++] = *sample(o, op, p, i);
+                sum += v[n - 1];
+            } else {
+                errors++;
+            }
+        }
+    }
+
+    if (n > 0) {
+        qsort(v, n, sizeof(*v), cmp_ull);
+        fprintf(out, "{\"bench\":\"lifecycle\",\"op\":\"%s\",\"files\":%ld,\"writers\":%d,\"readers\":%d,"
+            "\"domains\":%d,\"mode\":\"%s\",\"durability\":%d,\"samples\":%zu,\"errors\":%zu,"
+            "\"mean_us\":%.1f,\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,\"max_us\":%.1f}\n",
+            op_names[op], o->files, o->writers, o->readers, o->domains,
+            o->mode == BTRFSTRANS_MODE_OPTIMISTIC ? "optimistic" : "pessimistic", o->durability,
+            n, errors, sum / 1e3 / n, percentile_us(v, n, 0.5), percentile_us(v, n, 0.99),
+            percentile_us(v, n, 0.999), v[n - 1] / 1e3);
+    }
+    free(v);
+}
+
+/*
+ * Runs o->writers writer and o->readers reader processes at the same time.
+ */
+static int run_lifecycle(struct bench_opts* o) {
+    unsigned long long t0, commits = 0;
+    int gate[2];
+    char c;
+    pid_t pid;
+    int status, failed = 0;
+
+    procs = o->writers + o->readers;
+    if (procs == 0) {
+        return SUCCESS;
+    }
+
+    samples = mmap(NULL, sizeof(*samples) * OP_COUNT * procs * o->iterations,
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (samples == MAP_FAILED || pipe(gate)) {
+        fprintf(stderr, "ERROR: can't set up workers - %s\n", strerror(errno));
+        return E_UNSPECIFIED;
+    }
+
+    for (int p = 0; p < procs; p++) {
+        pid = fork();
+        if (pid < 0) {
+            fprintf(stderr, "ERROR: fork - %s\n", strerror(errno));
+            return E_UNSPECIFIED;
+        }
+        if (pid == 0) {
+            btrfstrans_ctx* ctx;
+
+            close(gate[1]);
+            srandom(getpid());
+            // readers stay on the domain with the tree
+            if (open_ctx(o, p < o->writers ? p : 0, &ctx)) {
+                _exit(1);
+            }
+            // start together once everybody has opened the volume
+            read(gate[0], &c, 1);
+            if (p < o->writers) {
+                run_writer(o, ctx, p);
+            } else {
+                run_reader(o, ctx, p);
+            }
+            btrfstrans_ctx_close(ctx);
+            _exit(0);
+        }
+    }
+
+    close(gate[0]);
+    usleep(100000);
+    t0 = now_ns();
+    close(gate[1]);
+
+    while ((pid = wait(&status)) > 0) {
+        failed |= !WIFEXITED(status) || WEXITSTATUS(status);
+    }
+
+    // aggregate rate of all writers, what domains are meant to scale
+    if (o->writers) {
+        double seconds = (now_ns() - t0) / 1e9;
+
+        for (int p = 0; p < o->writers; p++) {
+            for (int i = 0; i < o->iterations; i++) {
+                commits += *sample(o, OP_COMMIT, p, i) != 0;
+            }
+        }
+        fprintf(out, "{\"bench\":\"throughput\",\"files\":%ld,\"writers\":%d,\"readers\":%d,"
+            "\"domains\":%d,\"multi_every\":%d,\"mode\":\"%s\",\"durability\":%d,"
+            "\"commits\":%llu,\"seconds\":%.3f,\"commits_per_second\":%.1f}\n",
+            o->files, o->writers, o->readers, o->domains, o->multi_every,
+            o->mode == BTRFSTRANS_MODE_OPTIMISTIC ? "optimistic" : "pessimistic", o->durability,
+            commits, seconds, commits / seconds);
+    }
+
+    if (o->writers) {
+        report_op(o, OP_START, 0, o->writers);
+        report_op(o, OP_COMMIT, 0, o->writers);
+        report_op(o, OP_ABORT, 0, o->writers);
+    }
+    if (o->readers) {
+        report_op(o, OP_RO_START, o->writers, o->readers);
+        report_op(o, OP_RO_STOP, o->writers, o->readers);
+    }
+    fflush(out);
+
+    munmap(samples, sizeof(*samples) * OP_COUNT * procs * o->iterations);
+    return failed ? E_UNSPECIFIED : SUCCESS;
+}
+
+/*
+ * Writes o->small_files files of o->small_size bytes in one transaction,
+ * once through stdio and once as a single btrfstrans_submit() batch.
+ */
+static int run_small_files(struct bench_opts* o, btrfstrans_ctx* ctx) {
+    struct btrfstrans_op ops[3];
+    btrfstrans_txn* txn;
+    unsigned long long t0, t1, t2;
+    char* buf;
+    char path[64];
+    FILE* fp;
+    int ret;
+
+    if (o->small_files <= 0) {
+        return SUCCESS;
+    }
+
+    buf = malloc(o->small_size ? o->small_size : 1);
+    if (!buf) {
+        return E_UNSPECIFIED;
+    }
+    memset(buf, 'x', o->small_size);
+
+    for (int variant = 0; variant < 2; variant++) {
+        ret = btrfstrans_txn_begin(ctx, &txn);
+        if (ret) {
+            break;
+        }
+        snprintf(path, sizeof(path), "small%d", variant);
+        btrfstrans_txn_mkdir(txn, path, 0755);
+
+        t0 = now_ns();
+        for (int i = 0; i < o->small_files; i++) {
+            snprintf(path, sizeof(path), "small%d/f%d", variant, i);
+            if (variant == 0) {
+                fp = btrfstrans_txn_fopen(txn, path, "w");
+                if (fp) {
+                    fwrite(buf, 1, o->small_size, fp);
+                    fclose(fp);
+                }
+            } else {
+                memset(ops, 0, sizeof(ops));
+                ops[0].opcode = BTRFSTRANS_OP_OPEN;
+                ops[0].flags = BTRFSTRANS_OP_LINK;
+                ops[0].path = path;
+                ops[0].open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+                ops[0].mode = 0644;
+                ops[1].opcode = BTRFSTRANS_OP_WRITE;
+                ops[1].flags = BTRFSTRANS_OP_LINK;
+                ops[1].buf = buf;
+                ops[1].len = o->small_size;
+                ops[2].opcode = BTRFSTRANS_OP_CLOSE;
+                btrfstrans_txn_submit(txn, ops, 3);
+            }
+        }
+        t1 = now_ns();
+        ret = btrfstrans_txn_commit(txn, NULL);
+        t2 = now_ns();
+
+        fprintf(out, "{\"bench\":\"small_files\",\"api\":\"%s\",\"files\":%d,\"file_bytes\":%zu,"
+            "\"durability\":%d,\"write_seconds\":%.3f,\"commit_seconds\":%.3f,"
+            "\"files_per_second\":%.1f,\"mb_per_second\":%.2f,\"ok\":%s}\n",
+            variant ? "submit" : "stdio", o->small_files, o->small_size, o->durability,
+            (t1 - t0) / 1e9, (t2 - t1) / 1e9,
+            o->small_files / ((t2 - t0) / 1e9),
+            (double)o->small_files * o->small_size / (1 << 20) / ((t2 - t0) / 1e9),
+            ret ? "false" : "true");
+        fflush(out);
+    }
+
+    free(buf);
+    return ret;
+}
+
+static int newest_retained(unsigned long long seq, long long retired, void* arg) {
+    *(unsigned long long*)arg = seq;
+    return 1;
+}
+
+/*
+ * Commits a marker and reverts it, o->reverts times, with a retention of
+ * one generation.
+ */
+static int run_revert(struct bench_opts* o, btrfstrans_ctx* ctx) {
+    unsigned long long *v, t, sum = 0, seq;
+    btrfstrans_txn* txn;
+    size_t n = 0;
+    int ret;
+
+    if (o->reverts <= 0) {
+        return SUCCESS;
+    }
+
+    v = malloc(sizeof(*v) * o->reverts);
+    if (!v) {
+        return E_UNSPECIFIED;
+    }
+    ret = btrfstrans_ctx_set_retention(ctx, 1, 0);
+
+    for (int i = 0; i < o->reverts && !ret; i++) {
+        ret = btrfstrans_txn_begin(ctx, &txn);
+        if (ret) {
+            break;
+        }
+        write_marker(txn, 0, i);
+        ret = btrfstrans_txn_commit(txn, NULL);
+        if (ret || btrfstrans_ctx_list_retained(ctx, newest_retained, &seq) != 1) {
+            ret = ret ? ret : E_UNSPECIFIED;
+            break;
+        }
+
+        t = now_ns();
+        ret = btrfstrans_ctx_revert(ctx, seq);
+        if (!ret) {
+            v[n++] = now_ns() - t;
+            sum += v[n - 1];
+        }
+    }
+    btrfstrans_ctx_set_retention(ctx, 0, 0);
+
+    if (n > 0) {
+        qsort(v, n, sizeof(*v), cmp_ull);
+        fprintf(out, "{\"bench\":\"revert\",\"files\":%ld,\"durability\":%d,\"samples\":%zu,"
+            "\"mean_us\":%.1f,\"p50_us\":%.1f,\"max_us\":%.1f,\"ok\":%s}\n",
+            o->files, o->durability, n, sum / 1e3 / n, percentile_us(v, n, 0.5), v[n - 1] / 1e3,
+            ret ? "false" : "true");
+        fflush(out);
+    }
+    free(v);
+    return ret;
+}
+
+/*
+ * Commits a one-line file o->tiny_commits times with the journal limit
+ * journal_files, 0 meaning a snapshot per commit.
+ */
+static int run_tiny(struct bench_opts* o, btrfstrans_ctx* ctx, int journal_files) {
+    btrfstrans_txn* txn;
+    unsigned long long t;
+    int done = 0, ret = SUCCESS;
+
+    btrfstrans_ctx_set_journal_files(ctx, journal_files);
+    t = now_ns();
+    for (int i = 0; i < o->tiny_commits && !ret; i++) {
+        ret = btrfstrans_txn_begin(ctx, &txn);
+        if (ret) {
+            break;
+        }
+        write_marker(txn, 0, i);
+        ret = btrfstrans_txn_commit(txn, NULL);
+        done += !ret;
+    }
+    t = now_ns() - t;
+    btrfstrans_ctx_set_journal_files(ctx, BTRFSTRANS_JOURNAL_DEFAULT_FILES);
+
+    fprintf(out, "{\"bench\":\"tiny_commits\",\"engine\":\"%s\",\"commits\":%d,\"durability\":%d,"
+        "\"seconds\":%.6f,\"commits_per_second\":%.1f,\"ok\":%s}\n",
+        journal_files ? "journal" : "snapshot", done, o->durability, t / 1e9, done / (t / 1e9),
+        ret ? "false" : "true");
+    fflush(out);
+    return ret;
+}
+
+static int run_tiny_commits(struct bench_opts* o, btrfstrans_ctx* ctx) {
+    int ret;
+
+    if (o->tiny_commits <= 0) {
+        return SUCCESS;
+    }
+    ret = run_tiny(o, ctx, BTRFSTRANS_JOURNAL_DEFAULT_FILES);
+    if (!ret) {
+        ret = run_tiny(o, ctx, 0);
+    }
+    return ret;
+}
+
+int main(int argc, char* argv[]) {
+    struct bench_opts o = {
+        .output = "-",
+        .files = 1000,
+        .writers = 1,
+        .readers = 1,
+        .iterations = 1000,
+        .mode = BTRFSTRANS_MODE_PESSIMISTIC,
+        .durability = BTRFSTRANS_DURABILITY_SYNCFS,
+        .small_files = 1000,
+        .small_size = 4096
+    };
+    btrfstrans_ctx* ctx;
+    int opt, ret;
+
+    while ((opt = getopt(argc, argv, "p:o:f:w:r:n:m:d:s:b:v:t:D:x:")) != -1) {
+        switch (opt) {
+        case 'p': o.root = optarg; break;
+        case 'o': o.output = optarg; break;
+        case 'f': o.files = atol(optarg); break;
+        case 'w': o.writers = atoi(optarg); break;
+        case 'r': o.readers = atoi(optarg); break;
+        case 'n': o.iterations = atoi(optarg); break;
+        case 'm':
+            o.mode = strcmp(optarg, "optimistic") ? BTRFSTRANS_MODE_PESSIMISTIC : BTRFSTRANS_MODE_OPTIMISTIC;
+            break;
+        case 'd': o.durability = atoi(optarg); break;
+        case 's': o.small_files = atoi(optarg); break;
+        case 'b': o.small_size = atol(optarg); break;
+        case 'v': o.reverts = atoi(optarg); break;
+        case 't': o.tiny_commits = atoi(optarg); break;
+        case 'D': o.domains = atoi(optarg); break;
+        case 'x': o.multi_every = atoi(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (!o.root || o.iterations <= 0 || o.domains < 0 || o.multi_every < 0) {
+        usage(argv[0]);
+    }
+
+    out = strcmp(o.output, "-") ? fopen(o.output, "a") : stdout;
+    if (!out) {
+        fprintf(stderr, "ERROR: can't open %s - %s\n", o.output, strerror(errno));
+        return 1;
+    }
+
+    if (open_ctx(&o, 0, &ctx)) {
+        return 1;
+    }
+    ret = populate(&o, ctx);
+    // the workers open their own contexts
+    btrfstrans_ctx_close(ctx);
+
+    if (!ret) {
+        ret = run_lifecycle(&o);
+    }
+
+    if (!ret && !open_ctx(&o, 0, &ctx)) {
+        ret = run_small_files(&o, ctx);
+        if (!ret) {
+            ret = run_revert(&o, ctx);
+        }
+        if (!ret) {
+            ret = run_tiny_commits(&o, ctx);
+        }
+        btrfstrans_ctx_close(ctx);
+    }
+
+    btrfstrans_reaper_flush();
+    if (out != stdout) {
+        fclose(out);
+    }
+    return ret ? 1 : 0;
+}
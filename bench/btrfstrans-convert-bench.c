@@ -0,0 +1,204 @@
+/*
+ * Benchmark of converting a directory into a subvolume.
+ *
+ * Creates a tree of -f files under the btrfs directory given with -p,
+ * converts it with btrfstrans_make_subvolume() and, for comparison, with
+ * what make_subvolume() used to run: 'cp --reflink', 'rm -rf' and 'mv'
+ * into a fresh subvolume. Afterwards the file count of the subvolume is
+ * checked. Every conversion is one JSON object per line, written to the
+ * file given with -o.
+ *
+ * Build: see bench/run_bench.sh
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "../libbtrfstrans.h"
+
+#define BENCH_FILES_PER_DIR 1000
+
+struct convert_opts {
+    const char* root;
+    const char* output;
+    const char* api;
+    long files;
+    int threads;
+    int rounds;
+};
+
+static FILE* out;
+
+static double now() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr, "usage: %s -p btrfs_dir [-o results.jsonl] [-f files] [-t threads]\n"
+        "          [-a native|shell|both] [-n rounds]\n", prog);
+    exit(2);
+}
+
+// files spread over directories of BENCH_FILES_PER_DIR, every one with a line of data
+static int populate(const char* path, long files) {
+    char name[PATH_MAX];
+    int fd;
+
+    if (mkdir(path, 0755) && errno != EEXIST) {
+        return -1;
+    }
+    for (long i = 0; i < files; i++) {
+        if (i % BENCH_FILES_PER_DIR == 0) {
+            snprintf(name, sizeof(name), "%s/d%ld", path, i / BENCH_FILES_PER_DIR);
+            if (mkdir(name, 0755)) {
+                return -1;
+            }
+        }
+        snprintf(name, sizeof(name), "%s/d%ld/f%ld", path, i / BENCH_FILES_PER_DIR, i);
+        fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            return -1;
+        }
+        if (dprintf(fd, "file %ld\n", i) < 0) {
+            close(fd);
+            return -1;
+        }
+        close(fd);
+    }
+    return 0;
+}
+
+static long count_files(const char* path) {
+    char sub[PATH_MAX];
+    struct dirent* de;
+    long n = 0, m;
+    DIR* dir;
+
+    dir = opendir(path);
+    if (!dir) {
+        return -1;
+    }
+    while ((de = readdir(dir))) {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) {
+            continue;
+        }
+        if (de->d_type == DT_DIR) {
+            snprintf(sub, sizeof(sub), "%s/%s", path, de->d_name);
+            m = count_files(sub);
+            if (m < 0) {
+                n = -1;
+                break;
+            }
+            n += m;
+        } else {
+            n++;
+        }
+    }
+    closedir(dir);
+    return n;
+}
+
+// the conversion make_subvolume() did before it was native
+static int convert_shell(const char* path) {
+    char svol_path[PATH_MAX], cmd[3 * PATH_MAX];
+
+    snprintf(svol_path, sizeof(svol_path), "%s_svol", path);
+    if (create_subvolume(svol_path)) {
+        return -1;
+    }
+    snprintf(cmd, sizeof(cmd), "cp -a --reflink=always '%s'/. '%s' && rm -rf '%s' && mv '%s' '%s'",
+        path, svol_path, path, svol_path, path);
+    return system(cmd) ? -1 : 0;
+}
+
+static int run_convert(struct convert_opts* o, const char* api, int round) {
+    char path[PATH_MAX];
+    double t0, t1;
+    long found;
+    int ret;
+
+    snprintf(path, sizeof(path), "%s/convert_bench", o->root);
+    if (populate(path, o->files)) {
+        fprintf(stderr, "ERROR: can't create the tree at %s - %s\n", path, strerror(errno));
+        return 1;
+    }
+    // the tree should come from disk as it would in practice
+    sync();
+
+    t0 = now();
+    ret = strcmp(api, "shell") ? btrfstrans_make_subvolume(path, o->threads) : convert_shell(path);
+    t1 = now();
+
+    found = ret ? -1 : count_files(path);
+    fprintf(out, "{\"api\":\"%s\",\"round\":%d,\"files\":%ld,\"threads\":%d,\"seconds\":%.6f,"
+        "\"files_per_s\":%.1f,\"subvolume\":%s,\"files_found\":%ld,\"ok\":%s}\n",
+        api, round, o->files, strcmp(api, "shell") ? o->threads : 1, t1 - t0,
+        o->files / (t1 - t0), test_issubvolume(path) == 1 ? "true" : "false", found,
+        !ret && found == o->files ? "true" : "false");
+    fflush(out);
+
+    if (test_issubvolume(path) == 1) {
+        delete_subvolume(path);
+    }
+    return ret || found != o->files;
+}
+
+int main(int argc, char** argv) {
+    struct convert_opts o = {
+        .output = "-",
+        .api = "both",
+        .files = 100000,
+        .rounds = 1
+    };
+    int failed = 0, opt;
+
+    while ((opt = getopt(argc, argv, "p:o:f:t:a:n:")) != -1) {
+        switch (opt) {
+        case 'p': o.root = optarg; break;
+        case 'o': o.output = optarg; break;
+        case 'f': o.files = atol(optarg); break;
+        case 't': o.threads = atoi(optarg); break;
+        case 'a': o.api = optarg; break;
+        case 'n': o.rounds = atoi(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (!o.root || o.files <= 0 || o.threads < 0 || o.rounds <= 0 ||
+        (strcmp(o.api, "native") && strcmp(o.api, "shell") && strcmp(o.api, "both"))) {
+        usage(argv[0]);
+    }
+
+    out = strcmp(o.output, "-") ? fopen(o.output, "a") : stdout;
+    if (!out) {
+        fprintf(stderr, "ERROR: can't open %s - %s\n", o.output, strerror(errno));
+        return 1;
+    }
+
+    for (int round = 0; round < o.rounds; round++) {
+        if (strcmp(o.api, "shell")) {
+            failed += run_convert(&o, "native", round);
+        }
+        if (strcmp(o.api, "native")) {
+            failed += run_convert(&o, "shell", round);
+        }
+    }
+
+    if (out != stdout) {
+        fclose(out);
+    }
+    if (failed) {
+        fprintf(stderr, "%d conversions failed\n", failed);
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,416 @@
+/*
+ * Fault injection harness for commit recovery.
+ *
+ * For every crash point of btrfstrans_txn_commit() a child process
+ * commits a new value of the file 'crashtest' and is killed at that
+ * point. The harness then opens the volume like the next user would,
+ * times how long it takes until a write transaction commits again, and
+ * checks that head holds either the old or the new value, that the
+ * intent and journal records are gone and that no writable snapshot or
+ * staging directory is left over. -e picks the commit engine: the
+ * snapshot swap or the rename journal. With the journal a last step
+ * checks isolation: a thread keeps starting read-only transactions while
+ * journal transactions stage and commit, and none of them may see the
+ * staging directory or a staged file. Every round is one JSON object per
+ * line, written to the file given with -o.
+ *
+ * The library must be built with -DBTRFSTRANS_FAULT_INJECTION:
+ *   gcc -O2 -Wall -DBTRFSTRANS_FAULT_INJECTION -o btrfstrans-crashtest \
+ *       bench/btrfstrans-crashtest.c libbtrfstrans.c -L../btrfs-progs -lbtrfs -lpthread
+ * and run on a volume created with 'drive_operator.sh create'.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <dirent.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/xattr.h>
+
+#include "../libbtrfstrans.h"
+
+// must match the crash_point() calls in btrfstrans_txn_commit()
+static const char* snapshot_steps[] = {
+    "rename_locked",
+    "merged",           // optimistic mode only, the child forces a merge
+    "txlog",
+    "intent",
+    "swapped",
+    "reaped",
+    "intent_cleared",
+    "unlocked",
+    NULL
+};
+
+// and in commit_journal()
+static const char* journal_steps[] = {
+    "rename_locked",
+    "txlog",
+    "journal",
+    "published",
+    "journal_cleared",
+    "unlocked",
+    NULL
+};
+
+struct crash_opts {
+    const char* root;
+    const char* output;
+    const char* engine;
+    int rounds;
+    int mode;
+};
+
+static FILE* out;
+
+static unsigned long long now_ns() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr, "usage: %s -p volume_root [-o results.jsonl] [-n rounds]\n"
+        "          [-m pessimistic|optimistic] [-e snapshot|journal]\n", prog);
+    exit(2);
+}
+
+static int write_value(btrfstrans_txn* txn, const char* path, long value) {
+    FILE* fp = btrfstrans_txn_fopen(txn, path, "w");
+
+    if (!fp) {
+        return E_ACCESS;
+    }
+    fprintf(fp, "%ld\n", value);
+    return fclose(fp) ? E_ACCESS : SUCCESS;
+}
+
+static long read_value(const char* root) {
+    char path[4096];
+    long value = -1;
+    FILE* fp;
+
+    snprintf(path, sizeof(path), "%s/head/crashtest", root);
+    fp = fopen(path, "r");
+    if (fp) {
+        if (fscanf(fp, "%ld", &value) != 1) {
+            value = -1;
+        }
+        fclose(fp);
+    }
+    return value;
+}
+
+/*
+ * The victim: commits value, which $BTRFSTRANS_CRASH_AT interrupts. For
+ * the merge step a second transaction commits first, so head moves under
+ * the first one.
+ */
+static int run_child(struct crash_opts* o, long value, int force_merge) {
+    btrfstrans_ctx* ctx;
+    btrfstrans_txn *txn, *other;
+    int ret;
+
+    if (btrfstrans_ctx_open(o->root, &ctx)) {
+        return 1;
+    }
+    btrfstrans_ctx_set_mode(ctx, o->mode);
+    if (!strcmp(o->engine, "snapshot")) {
+        btrfstrans_ctx_set_journal_files(ctx, 0);
+    }
+
+    ret = btrfstrans_txn_begin(ctx, &txn);
+    if (ret) {
+        return 1;
+    }
+    write_value(txn, "crashtest", value);
+
+    if (force_merge && btrfstrans_txn_begin(ctx, &other) == SUCCESS) {
+        // the crash point is armed for the commit of txn only
+        char* at = getenv("BTRFSTRANS_CRASH_AT");
+        char* saved = at ? strdup(at) : NULL;
+
+        unsetenv("BTRFSTRANS_CRASH_AT");
+        write_value(other, "crashtest_other", value);
+        btrfstrans_txn_commit(other, NULL);
+        if (saved) {
+            setenv("BTRFSTRANS_CRASH_AT", saved, 1);
+            free(saved);
+        }
+    }
+
+    ret = btrfstrans_txn_commit(txn, NULL);
+    btrfstrans_ctx_close(ctx);
+    btrfstrans_reaper_flush();
+    // only reached if the crash point was not
+    return ret ? 1 : 0;
+}
+
+// writable snapshots in the root and staging directories in head
+static int leftovers(const char* root) {
+    char path[4096];
+    struct dirent* de;
+    int n = 0;
+    DIR* dir;
+
+    dir = opendir(root);
+    if (!dir) {
+        return -1;
+    }
+    while ((de = readdir(dir))) {
+        n += !strncmp(de->d_name, "wr_", 3);
+    }
+    closedir(dir);
+
+    snprintf(path, sizeof(path), "%s/head/.btrfstrans_journal", root);
+    dir = opendir(path);
+    if (dir) {
+        while ((de = readdir(dir))) {
+            n += de->d_name[0] != '.';
+        }
+        closedir(dir);
+    }
+    return n;
+}
+
+struct isolation_reader {
+    btrfstrans_ctx* ctx;
+    int stop;
+    long reads;
+    long violations;
+};
+
+// what a reader must never see: staging directories and uncommitted files
+static void* isolation_main(void* arg) {
+    struct isolation_reader* r = arg;
+    btrfstrans_txn* txn;
+    struct stat st;
+
+    while (!__atomic_load_n(&r->stop, __ATOMIC_ACQUIRE)) {
+        if (btrfstrans_txn_begin_ro(r->ctx, &txn)) {
+            continue;
+        }
+        if (!btrfstrans_txn_stat(txn, ".btrfstrans_journal", &st) ||
+            !btrfstrans_txn_stat(txn, "isolation_staged", &st)) {
+            r->violations++;
+        }
+        btrfstrans_txn_end(txn);
+        r->reads++;
+    }
+    return NULL;
+}
+
+/*
+ * The isolation step: every round stages a file in one journal
+ * transaction, commits another one past it and aborts the first, while
+ * the reader thread checks every generation it gets.
+ */
+static int run_isolation(struct crash_opts* o) {
+    struct isolation_reader r = { 0 };
+    btrfstrans_txn *staged, *other;
+    pthread_t thread;
+    char path[4096];
+    int staged_rounds = 0, ret = 0;
+
+    if (btrfstrans_ctx_open(o->root, &r.ctx)) {
+        fprintf(stderr, "ERROR: can't open %s\n", o->root);
+        return 1;
+    }
+    btrfstrans_ctx_set_mode(r.ctx, BTRFSTRANS_MODE_OPTIMISTIC);
+    if (pthread_create(&thread, NULL, isolation_main, &r)) {
+        btrfstrans_ctx_close(r.ctx);
+        return 1;
+    }
+
+    snprintf(path, sizeof(path), "%s/head/.btrfstrans_journal", o->root);
+    for (int round = 0; !ret && round < o->rounds; round++) {
+        ret = btrfstrans_txn_begin(r.ctx, &staged);
+        if (ret) {
+            break;
+        }
+        write_value(staged, "isolation_staged", round);
+        staged_rounds += access(path, F_OK) == 0;
+
+        ret = btrfstrans_txn_begin(r.ctx, &other);
+        if (!ret) {
+            write_value(other, "isolation_other", round);
+            ret = btrfstrans_txn_commit(other, NULL);
+        }
+        btrfstrans_txn_abort(staged);
+    }
+
+    __atomic_store_n(&r.stop, 1, __ATOMIC_RELEASE);
+    pthread_join(thread, NULL);
+    btrfstrans_ctx_close(r.ctx);
+
+    fprintf(out, "{\"step\":\"isolation\",\"rounds\":%d,\"engine\":\"%s\",\"staged_rounds\":%d,"
+        "\"reads\":%ld,\"violations\":%ld,\"ok\":%s}\n",
+        o->rounds, o->engine, staged_rounds, r.reads, r.violations,
+        !ret && staged_rounds && !r.violations ? "true" : "false");
+    fflush(out);
+    return ret || !staged_rounds || r.violations;
+}
+
+/*
+ * One round: kill a child at step, recover and check the volume.
+ */
+static int run_round(struct crash_opts* o, const char* prog, const char* step, int round, long* committed) {
+    unsigned long long t0, t_open, t_commit;
+    long value = *committed + 1, found;
+    char value_arg[32], mode_arg[16];
+    char* args[12];
+    int argc = 0;
+    btrfstrans_ctx* ctx;
+    btrfstrans_txn* txn;
+    int status, killed, consistent, intent_left, left, ret;
+    pid_t pid;
+
+    snprintf(value_arg, sizeof(value_arg), "%ld", value);
+    snprintf(mode_arg, sizeof(mode_arg), "%s", o->mode == BTRFSTRANS_MODE_OPTIMISTIC ? "optimistic" : "pessimistic");
+
+    pid = fork();
+    if (pid < 0) {
+        fprintf(stderr, "ERROR: fork - %s\n", strerror(errno));
+        return 1;
+    }
+    if (pid == 0) {
+        // exec, the library must not inherit the state of our threads
+        args[argc++] = (char*)prog;
+        args[argc++] = "-p";
+        args[argc++] = (char*)o->root;
+        args[argc++] = "-m";
+        args[argc++] = mode_arg;
+        args[argc++] = "-e";
+        args[argc++] = (char*)o->engine;
+        args[argc++] = "-x";
+        args[argc++] = value_arg;
+        if (!strcmp(step, "merged")) {
+            args[argc++] = "-M";
+        }
+        args[argc] = NULL;
+        setenv("BTRFSTRANS_CRASH_AT", step, 1);
+        execv(prog, args);
+        _exit(127);
+    }
+    if (waitpid(pid, &status, 0) < 0) {
+        return 1;
+    }
+    killed = WIFSIGNALED(status) && WTERMSIG(status) == SIGKILL;
+
+    // what the next user of the volume goes through
+    t0 = now_ns();
+    ret = btrfstrans_ctx_open(o->root, &ctx);
+    t_open = now_ns();
+    if (ret) {
+        fprintf(stderr, "ERROR: can't open %s after crash at %s (%d)\n", o->root, step, ret);
+        return 1;
+    }
+    btrfstrans_ctx_set_mode(ctx, o->mode);
+    ret = btrfstrans_txn_begin_timeout(ctx, &txn, 10000);
+    if (!ret) {
+        write_value(txn, "crashtest_probe", value);
+        ret = btrfstrans_txn_commit(txn, NULL);
+    }
+    t_commit = now_ns();
+
+    found = read_value(o->root);
+    consistent = found == *committed || found == value;
+    if (found == value) {
+        *committed = value;
+    }
+    intent_left = getxattr(o->root, "user.btrfstrans.intent", NULL, 0) >= 0 ||
+        getxattr(o->root, "user.btrfstrans.journal", NULL, 0) >= 0;
+    left = leftovers(o->root);
+    btrfstrans_ctx_close(ctx);
+
+    fprintf(out, "{\"step\":\"%s\",\"round\":%d,\"mode\":\"%s\",\"engine\":\"%s\",\"killed\":%s,"
+        "\"committed\":%s,\"consistent\":%s,\"intent_left\":%s,\"leftover_snapshots\":%d,"
+        "\"open_ns\":%llu,\"recovered_commit_ns\":%llu,\"ok\":%s}\n",
+        step, round, mode_arg, o->engine, killed ? "true" : "false",
+        found == value ? "true" : "false", consistent ? "true" : "false",
+        intent_left ? "true" : "false", left, t_open - t0, t_commit - t0,
+        !ret && consistent && !intent_left && left == 0 ? "true" : "false");
+    fflush(out);
+    return ret || !consistent || intent_left || left;
+}
+
+int main(int argc, char** argv) {
+    struct crash_opts o = {
+        .output = "-",
+        .engine = "snapshot",
+        .rounds = 10,
+        .mode = BTRFSTRANS_MODE_PESSIMISTIC
+    };
+    const char** steps;
+    long child_value = -1, committed;
+    int force_merge = 0, failed = 0, opt;
+
+    while ((opt = getopt(argc, argv, "p:o:n:m:e:x:M")) != -1) {
+        switch (opt) {
+        case 'p': o.root = optarg; break;
+        case 'o': o.output = optarg; break;
+        case 'n': o.rounds = atoi(optarg); break;
+        case 'm':
+            o.mode = strcmp(optarg, "optimistic") ? BTRFSTRANS_MODE_PESSIMISTIC : BTRFSTRANS_MODE_OPTIMISTIC;
+            break;
+        case 'e': o.engine = optarg; break;
+        // internal: run as the child that gets killed
+        case 'x': child_value = atol(optarg); break;
+        case 'M': force_merge = 1; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (!o.root || o.rounds <= 0 || (strcmp(o.engine, "snapshot") && strcmp(o.engine, "journal"))) {
+        usage(argv[0]);
+    }
+
+    if (child_value >= 0) {
+        return run_child(&o, child_value, force_merge);
+    }
+
+    out = strcmp(o.output, "-") ? fopen(o.output, "a") : stdout;
+    if (!out) {
+        fprintf(stderr, "ERROR: can't open %s - %s\n", o.output, strerror(errno));
+        return 1;
+    }
+
+    // every round shows up as it ends, also in a pipe
+    if (out == stdout) {
+        setvbuf(stdout, NULL, _IOLBF, 0);
+    }
+
+    committed = read_value(o.root);
+    if (committed < 0) {
+        committed = 0;
+    }
+
+    steps = strcmp(o.engine, "journal") ? snapshot_steps : journal_steps;
+    for (int step = 0; steps[step]; step++) {
+        if (!strcmp(steps[step], "merged") && o.mode != BTRFSTRANS_MODE_OPTIMISTIC) {
+            continue;
+        }
+        for (int round = 0; round < o.rounds; round++) {
+            failed += run_round(&o, argv[0], steps[step], round, &committed);
+        }
+    }
+    if (!strcmp(o.engine, "journal")) {
+        failed += run_isolation(&o);
+    }
+
+    btrfstrans_reaper_flush();
+    if (out != stdout) {
+        fclose(out);
+    }
+    if (failed) {
+        fprintf(stderr, "%d rounds failed\n", failed);
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,271 @@
+/*
+ * Soak test for leaks in long-running processes.
+ *
+ * Runs -n cycles on the volume root given with -p, every one a write
+ * transaction that commits a small file and one that writes and aborts.
+ * Every -s cycles create_subvolume(), create_snapshot() and
+ * delete_subvolume() run on paths in the root as well. malloc() and
+ * friends are wrapped to count heap allocations and the blocks still
+ * live. Every -r cycles, once the reaper is idle, the RSS, the live blocks
+ * and the allocations per commit since the last report are written as one
+ * JSON object per line to the file given with -o, followed by a summary
+ * of the growth after the first report: the run is ok when the number of
+ * live blocks didn't grow.
+ *
+ * Under valgrind --leak-check=full the wrappers must be left out with
+ * -DSOAK_NO_MALLOC_COUNT, and the allocation counts are then 0.
+ *
+ * Build: see bench/run_bench.sh
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <limits.h>
+
+#include "../libbtrfstrans.h"
+
+struct soak_opts {
+    const char* root;
+    const char* output;
+    long cycles;
+    long report_every;
+    long subvol_every;
+};
+
+static FILE* out;
+
+static unsigned long long allocs;
+static unsigned long long frees;
+
+#ifndef SOAK_NO_MALLOC_COUNT
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t nmemb, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+extern void* __libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void* ptr);
+
+void* malloc(size_t size) {
+    __atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t nmemb, size_t size) {
+    __atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(nmemb, size);
+}
+
+void* realloc(void* ptr, size_t size) {
+    if (!ptr) {
+        __atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+    } else if (!size) {
+        __atomic_add_fetch(&frees, 1, __ATOMIC_RELAXED);
+    }
+    return __libc_realloc(ptr, size);
+}
+
+int posix_memalign(void** ptr, size_t alignment, size_t size) {
+    *ptr = __libc_memalign(alignment, size);
+    if (!*ptr) {
+        return ENOMEM;
+    }
+    __atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+void* memalign(size_t alignment, size_t size) {
+    __atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+    return __libc_memalign(alignment, size);
+}
+
+void* aligned_alloc(size_t alignment, size_t size) {
+    __atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+    return __libc_memalign(alignment, size);
+}
+
+void free(void* ptr) {
+    if (ptr) {
+        __atomic_add_fetch(&frees, 1, __ATOMIC_RELAXED);
+    }
+    __libc_free(ptr);
+}
+#endif
+
+static double now() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long rss_kb() {
+    long size, resident = -1;
+    FILE* fp = fopen("/proc/self/statm", "r");
+
+    if (fp) {
+        if (fscanf(fp, "%ld %ld", &size, &resident) != 2) {
+            resident = -1;
+        }
+        fclose(fp);
+    }
+    return resident < 0 ? -1 : resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr, "usage: %s -p volume_root [-o results.jsonl] [-n cycles] [-r report_every]\n"
+        "          [-s subvolume_every]\n", prog);
+    exit(2);
+}
+
+static int write_value(btrfstrans_txn* txn, long value) {
+    FILE* fp = btrfstrans_txn_fopen(txn, "soak", "w");
+
+    if (!fp) {
+        return E_ACCESS;
+    }
+    fprintf(fp, "%ld\n", value);
+    return fclose(fp) ? E_ACCESS : SUCCESS;
+}
+
+static int run_cycle(btrfstrans_ctx* ctx, long cycle) {
+    btrfstrans_txn* txn;
+    int ret;
+
+    ret = btrfstrans_txn_begin(ctx, &txn);
+    if (ret) {
+        return ret;
+    }
+    ret = write_value(txn, cycle);
+    if (ret) {
+        btrfstrans_txn_abort(txn);
+        return ret;
+    }
+    ret = btrfstrans_txn_commit(txn, NULL);
+    if (ret) {
+        return ret;
+    }
+
+    ret = btrfstrans_txn_begin(ctx, &txn);
+    if (ret) {
+        return ret;
+    }
+    write_value(txn, -cycle);
+    return btrfstrans_txn_abort(txn);
+}
+
+// the path based calls, outside of any transaction
+static int run_subvolumes(const char* root) {
+    char sv_path[PATH_MAX], snap_path[PATH_MAX];
+    int ret;
+
+    snprintf(sv_path, sizeof(sv_path), "%s/soak_sv", root);
+    snprintf(snap_path, sizeof(snap_path), "%s/soak_snap", root);
+
+    ret = create_subvolume(sv_path);
+    if (ret) {
+        return ret;
+    }
+    ret = create_snapshot(sv_path, snap_path, 1, 0);
+    if (!ret) {
+        ret = delete_subvolume(snap_path);
+    }
+    if (delete_subvolume(sv_path) && !ret) {
+        ret = E_DELETE;
+    }
+    return ret;
+}
+
+static void report(long cycle, double elapsed, unsigned long long commit_allocs, long commits) {
+    unsigned long long live = __atomic_load_n(&allocs, __ATOMIC_RELAXED) - __atomic_load_n(&frees, __ATOMIC_RELAXED);
+
+    fprintf(out, "{\"bench\":\"soak\",\"cycle\":%ld,\"seconds\":%.3f,\"rss_kb\":%ld,\"live_blocks\":%llu,"
+        "\"allocs_per_commit\":%.2f}\n",
+        cycle, elapsed, rss_kb(), live, commits ? (double)commit_allocs / commits : 0.0);
+    fflush(out);
+}
+
+int main(int argc, char** argv) {
+    struct soak_opts o = {
+        .output = "-",
+        .cycles = 1000000,
+        .report_every = 10000,
+        .subvol_every = 100
+    };
+    unsigned long long base_live = 0, live, interval_allocs = 0, a0;
+    long base_rss = 0, rss, interval_commits = 0, cycle;
+    int failed = 0, opt, ret;
+    btrfstrans_ctx* ctx;
+    double t0;
+
+    while ((opt = getopt(argc, argv, "p:o:n:r:s:")) != -1) {
+        switch (opt) {
+        case 'p': o.root = optarg; break;
+        case 'o': o.output = optarg; break;
+        case 'n': o.cycles = atol(optarg); break;
+        case 'r': o.report_every = atol(optarg); break;
+        case 's': o.subvol_every = atol(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (!o.root || o.cycles <= 0 || o.report_every <= 0 || o.subvol_every < 0) {
+        usage(argv[0]);
+    }
+
+    out = strcmp(o.output, "-") ? fopen(o.output, "a") : stdout;
+    if (!out) {
+        fprintf(stderr, "ERROR: can't open %s - %s\n", o.output, strerror(errno));
+        return 1;
+    }
+
+    ret = btrfstrans_ctx_open(o.root, &ctx);
+    if (ret) {
+        fprintf(stderr, "ERROR: can't open %s (%d)\n", o.root, ret);
+        return 1;
+    }
+
+    t0 = now();
+    for (cycle = 1; cycle <= o.cycles; cycle++) {
+        a0 = __atomic_load_n(&allocs, __ATOMIC_RELAXED);
+        ret = run_cycle(ctx, cycle);
+        interval_allocs += __atomic_load_n(&allocs, __ATOMIC_RELAXED) - a0;
+        interval_commits++;
+        if (ret) {
+            fprintf(stderr, "ERROR: cycle %ld failed (%d)\n", cycle, ret);
+            failed++;
+        }
+        if (o.subvol_every && cycle % o.subvol_every == 0 && run_subvolumes(o.root)) {
+            fprintf(stderr, "ERROR: subvolume calls of cycle %ld failed\n", cycle);
+            failed++;
+        }
+
+        if (cycle % o.report_every == 0 || cycle == o.cycles) {
+            // the reaper's queue comes and goes with the load
+            btrfstrans_reaper_flush();
+            report(cycle, now() - t0, interval_allocs, interval_commits);
+            // the first interval warms up the caches and pools
+            if (cycle <= o.report_every) {
+                base_live = __atomic_load_n(&allocs, __ATOMIC_RELAXED) - __atomic_load_n(&frees, __ATOMIC_RELAXED);
+                base_rss = rss_kb();
+            }
+            interval_allocs = 0;
+            interval_commits = 0;
+        }
+    }
+
+    btrfstrans_reaper_flush();
+    live = __atomic_load_n(&allocs, __ATOMIC_RELAXED) - __atomic_load_n(&frees, __ATOMIC_RELAXED);
+    rss = rss_kb();
+    fprintf(out, "{\"bench\":\"soak_summary\",\"cycles\":%ld,\"failed\":%d,\"seconds\":%.3f,"
+        "\"rss_growth_kb\":%ld,\"live_block_growth\":%lld,\"ok\":%s}\n",
+        o.cycles, failed, now() - t0, rss - base_rss, (long long)(live - base_live),
+        !failed && live <= base_live ? "true" : "false");
+
+    btrfstrans_ctx_close(ctx);
+    if (out != stdout) {
+        fclose(out);
+    }
+    return failed || live > base_live ? 1 : 0;
+}
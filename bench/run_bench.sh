@@ -0,0 +1,101 @@
+#!/bin/bash
+#
+# Runs btrfstrans-bench over a matrix of tree sizes and writer/reader
+# process counts. Every tree size gets a fresh loopback btrfs volume, set
+# up the same way as 'drive_operator.sh create'. Results are appended to
+# $results as JSON lines, together with the time btrfstrans-convert-bench
+# takes to turn a directory of that size into a subvolume. A soak test
+# for leaks runs last.
+#
+# usage: bench/run_bench.sh [results.jsonl]
+
+bench_dir=$(cd "$(dirname "$0")" && pwd)
+repo_dir=$(dirname "$bench_dir")
+
+base_dir=${BENCH_BASE_DIR:-/tmp/btrfstrans-bench}
+img_path=$base_dir/img
+global_path=$base_dir/mounted
+results=${1:-$bench_dir/results.jsonl}
+
+tree_sizes=${BENCH_TREE_SIZES:-"1000 10000 100000 1000000"}
+process_counts=${BENCH_PROCESSES:-"1:0 1:4 4:0 4:4 16:16"}   # writers:readers
+modes=${BENCH_MODES:-"pessimistic optimistic"}
+domain_counts=${BENCH_DOMAINS:-"0"}    # e.g. "0 1 4 16", 0: no domains
+iterations=${BENCH_ITERATIONS:-1000}
+durability=${BENCH_DURABILITY:-2}
+soak_cycles=${BENCH_SOAK_CYCLES:-1000000}   # 0: no soak test
+btrfs_progs=${BTRFS_PROGS:-$repo_dir/../btrfs-progs}
+
+sem_names="/dev/shm/sem.libbtrfstranssemaphorelock /dev/shm/sem.libbtrfstranssemaphoreread
+    /dev/shm/sem.libbtrfstranssemaphorerename /dev/shm/libbtrfstransshm /dev/shm/libbtrfstransshm_*"
+
+function create_volume {
+    # a few KB of metadata per file, plus room for the snapshots
+    local size=$(( $1 / 1000 * 8 + 1024 ))M
+
+    mkdir -p $global_path
+    truncate -s $size $img_path
+    mkfs.btrfs -q -f -m single $img_path > /dev/null || exit 1
+    sudo mount -o loop $img_path $global_path || exit 1
+    sudo chown -R $(id -u):$(id -g) $global_path
+}
+
+function remove_volume {
+    sudo umount $global_path 2> /dev/null
+    rmdir $global_path 2> /dev/null
+    rm -f $img_path
+    sudo rm -f $sem_names
+}
+
+mkdir -p $base_dir
+gcc -O2 -Wall -o $base_dir/btrfstrans-bench $bench_dir/btrfstrans-bench.c \
+    $repo_dir/libbtrfstrans.c -L$btrfs_progs -lbtrfs -lpthread || exit 1
+gcc -O2 -Wall -o $base_dir/btrfstrans-convert-bench $bench_dir/btrfstrans-convert-bench.c \
+    $repo_dir/libbtrfstrans.c -L$btrfs_progs -lbtrfs -lpthread || exit 1
+gcc -O2 -Wall -o $base_dir/btrfstrans-soak $bench_dir/btrfstrans-soak.c \
+    $repo_dir/libbtrfstrans.c -L$btrfs_progs -lbtrfs -lpthread || exit 1
+
+trap remove_volume EXIT
+
+for files in $tree_sizes; do
+    remove_volume
+    create_volume $files
+
+    # converting a plain directory of that size, before the library sets up the volume
+    $base_dir/btrfstrans-convert-bench -p $global_path -o $results -f $files > /dev/null ||
+        echo "FAILED: convert $files" >&2
+
+    first=1
+    for mode in $modes; do
+        for procs in $process_counts; do
+            for domains in $domain_counts; do
+                writers=${procs%:*}
+                readers=${procs#*:}
+                echo "files=$files mode=$mode writers=$writers readers=$readers domains=$domains" >&2
+
+                # the tree, the small-file, revert and tiny commit runs only need to happen once per size
+                small_files=0
+                reverts=0
+                tiny_commits=0
+                if [[ $first = 1 ]]; then
+                    small_files=1000
+                    reverts=20
+                    tiny_commits=1000
+                    first=0
+                fi
+
+                $base_dir/btrfstrans-bench -p $global_path -o $results -f $files \
+                    -w $writers -r $readers -n $iterations -m $mode -d $durability \
+                    -s $small_files -v $reverts -t $tiny_commits -D $domains > /dev/null || echo "FAILED: $files $mode $procs $domains" >&2
+            done
+        done
+    done
+done
+
+# leaks over a long run, on a small volume of its own
+if [[ $soak_cycles -gt 0 ]]; then
+    echo "soak cycles=$soak_cycles" >&2
+    remove_volume
+    create_volume 1000
+    $base_dir/btrfstrans-soak -p $global_path -o $results -n $soak_cycles > /dev/null || echo "FAILED: soak" >&2
+fi
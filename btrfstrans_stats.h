@@ -0,0 +1,116 @@
+#ifndef BTRFSTRANS_STATS_H_
+#define BTRFSTRANS_STATS_H_
+
+#include <stdint.h>
+
+/*
+ * Layout of the statistics segment shared by all processes using
+ * libbtrfstrans and read by btrfstrans-stat. Every phase has a log-linear
+ * latency histogram: values below 2^SUB_BITS ns have a bucket each, above
+ * that every power of two is split into 2^SUB_BITS linear buckets, so a
+ * bucket is at most 12.5% wide. All fields are only ever updated with
+ * relaxed atomic adds.
+ */
+#define BTRFSTRANS_STATS_SHM_NAME "/libbtrfstransstats"
+#define BTRFSTRANS_STATS_MAGIC 0x62747374
+#define BTRFSTRANS_STATS_VERSION 5
+
+#define BTRFSTRANS_HIST_SUB_BITS 3
+#define BTRFSTRANS_HIST_BUCKETS (64 << BTRFSTRANS_HIST_SUB_BITS)
+
+enum btrfstrans_phase
+{
+    BTRFSTRANS_PHASE_START,             // whole start_transaction()
+    BTRFSTRANS_PHASE_COMMIT,            // whole commit_transaction()
+    BTRFSTRANS_PHASE_ABORT,             // whole abort_transaction()
+    BTRFSTRANS_PHASE_RO_START,          // whole start_ro_transaction()
+    BTRFSTRANS_PHASE_RO_END,            // whole stop_ro_transaction()
+    BTRFSTRANS_PHASE_WRITE_LOCK,        // waiting for the write lock
+    BTRFSTRANS_PHASE_RENAME_LOCK,       // waiting for the rename lock
+    BTRFSTRANS_PHASE_RO_LOCK,           // waiting for the read-only lock
+    BTRFSTRANS_PHASE_SNAPSHOT,          // snapshot ioctl
+    BTRFSTRANS_PHASE_CONFLICT_CHECK,    // reading the txlog of newer commits
+    BTRFSTRANS_PHASE_MERGE,             // replaying the write set onto head
+    BTRFSTRANS_PHASE_TXLOG,             // writing the txlog entry and intent record
+    BTRFSTRANS_PHASE_HEAD_SWAP,         // renameat2() exchange of head
+    BTRFSTRANS_PHASE_FSYNC,             // fsync of the write set
+    BTRFSTRANS_PHASE_FLUSH,             // syncfs()/fsync()/start sync of the volume
+    BTRFSTRANS_PHASE_REAP,              // rename to reap_* and queueing
+    BTRFSTRANS_PHASE_DESTROY,           // subvolume destroy ioctl
+    BTRFSTRANS_PHASE_SAVEPOINT,         // btrfstrans_savepoint()
+    BTRFSTRANS_PHASE_ROLLBACK,          // btrfstrans_rollback_to()
+    BTRFSTRANS_PHASE_SUBMIT,            // btrfstrans_submit()
+    BTRFSTRANS_PHASE_CHANGESET,         // finding what a commit changed
+    BTRFSTRANS_PHASE_EXPORT,            // send stream of a committed head
+    BTRFSTRANS_PHASE_PUBLISH,           // renaming staged files into head
+    BTRFSTRANS_PHASE_COUNT
+};
+
+#define BTRFSTRANS_PHASE_NAMES { \
+    "start", "commit", "abort", "ro_start", "ro_end", \
+    "write_lock", "rename_lock", "ro_lock", "snapshot", "conflict_check", \
+    "merge", "txlog", "head_swap", "fsync", "flush", \
+    "reap", "destroy", "savepoint", "rollback", "submit", \
+    "changeset", "export", "publish" }
+
+enum btrfstrans_counter
+{
+    BTRFSTRANS_COUNTER_CONFLICTS,       // commits refused with E_CONFLICT
+    BTRFSTRANS_COUNTER_COMMIT_ERRORS,   // commits failed otherwise
+    BTRFSTRANS_COUNTER_MERGES,          // commits merged onto a newer head
+    BTRFSTRANS_COUNTER_PREWARM_HITS,    // starts that claimed wr_prewarm
+    BTRFSTRANS_COUNTER_REAP_INLINE,     // deletions done inline, reaper full
+    BTRFSTRANS_COUNTER_LOCK_TAKEOVERS,  // locks taken over from a dead holder
+    BTRFSTRANS_COUNTER_LEASE_EXPIRIES,  // write locks revoked by a lease
+    BTRFSTRANS_COUNTER_EXPORT_BYTES,    // size of the send streams written
+    BTRFSTRANS_COUNTER_JOURNAL_COMMITS, // commits through the rename journal
+    BTRFSTRANS_COUNTER_JOURNAL_SWITCHES, // journal transactions that took a snapshot
+    BTRFSTRANS_COUNTER_COUNT
+};
+
+#define BTRFSTRANS_COUNTER_NAMES { \
+    "conflicts", "commit_errors", "merges", "prewarm_hits", "reap_inline", \
+    "lock_takeovers", "lease_expiries", "export_bytes", "journal_commits", \
+    "journal_switches" }
+
+struct btrfstrans_hist
+{
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t max_ns;
+    uint64_t buckets[BTRFSTRANS_HIST_BUCKETS];
+};
+
+struct btrfstrans_stats
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t phases;
+    uint32_t buckets;
+    uint64_t counters[BTRFSTRANS_COUNTER_COUNT];
+    struct btrfstrans_hist hist[BTRFSTRANS_PHASE_COUNT];
+};
+
+static inline int btrfstrans_hist_bucket(uint64_t ns) {
+    int msb;
+
+    if (ns < (1 << BTRFSTRANS_HIST_SUB_BITS)) {
+        return ns;
+    }
+    msb = 63 - __builtin_clzll(ns);
+    return ((msb - BTRFSTRANS_HIST_SUB_BITS + 1) << BTRFSTRANS_HIST_SUB_BITS) +
+        ((ns >> (msb - BTRFSTRANS_HIST_SUB_BITS)) & ((1 << BTRFSTRANS_HIST_SUB_BITS) - 1));
+}
+
+// smallest value that falls into bucket
+static inline uint64_t btrfstrans_hist_lower(int bucket) {
+    int group = bucket >> BTRFSTRANS_HIST_SUB_BITS;
+    int msb = group + BTRFSTRANS_HIST_SUB_BITS - 1;
+
+    if (group == 0) {
+        return bucket;
+    }
+    return (1ULL << msb) + ((uint64_t)(bucket & ((1 << BTRFSTRANS_HIST_SUB_BITS) - 1)) << (msb - BTRFSTRANS_HIST_SUB_BITS));
+}
+
+#endif /* BTRFSTRANS_STATS_H_ */
@@ -11,11 +11,15 @@ global_path=$base_dir/$global_dir
 sem_lock_name=/dev/shm/sem.libbtrfstranssemaphorelock
 sem_ro_name=/dev/shm/sem.libbtrfstranssemaphoreread
 sem_rename_name=/dev/shm/sem.libbtrfstranssemaphorerename
+shm_name=/dev/shm/libbtrfstransshm
+stats_name=/dev/shm/libbtrfstransstats
 
 function delete_semaphores {
     sudo rm -f $sem_lock_name
         sudo rm -f $sem_ro_name
         sudo rm -f $sem_rename_name
+        sudo rm -f $shm_name ${shm_name}_*
+        sudo rm -f $stats_name
 }
 
 if [[ -z $operation ]]
@@ -24,7 +28,8 @@ echo "ERROR: you need to call this script with: $0 operation"
 echo "valid operations are"
 echo " 'create' : create the btrfs volume"
 echo " 'remove' : remove the btrfs volume"
-echo " 'unlock' : unlock semaphore (to be used after a crash)"
+echo " 'unlock' : remove the shared lock state (locks of crashed processes are released on their own)"
+echo " 'replay' spool target : receive the exported send streams of spool into the btrfs directory target"
 fi
 
 if [[ $operation = "create" ]]
@@ -64,3 +69,36 @@ if [[ $operation = "unlock" ]]
 then
 delete_semaphores
 fi
+
+
+if [[ $operation = "replay" ]]
+then
+spool_dir=$2
+target_dir=$3
+if [[ -z $spool_dir || -z $target_dir ]]
+then
+echo "ERROR: usage: $0 replay spool_dir target_dir"
+exit 1
+fi
+# continue after the newest snapshot received so far
+last=$(ls $target_dir | sed -n 's/^send_\([0-9]*\)$/\1/p' | sort -n | tail -1)
+last=${last:-0}
+# names sort in commit order; every stream needs the snapshot the previous one created
+for stream in $(ls $spool_dir | grep '^[0-9]*-[0-9]*\.btrfs$' | sort)
+do
+parent=send_$((10#${stream%%-*}))
+seq=${stream#*-}
+seq=$((10#${seq%.btrfs}))
+if (( seq <= last ))
+then
+continue
+fi
+sudo btrfs receive -f $spool_dir/$stream $target_dir || exit 1
+# only the newest snapshot is needed for the next stream
+if [[ $parent != send_0 && -e $target_dir/$parent ]]
+then
+sudo btrfs subvolume delete $target_dir/$parent > /dev/null
+fi
+last=$seq
+done
+fi
@@ -1,29 +1,45 @@
+#define _GNU_SOURCE
 #include <unistd.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
 
 #include <sys/ioctl.h>
 #include <btrfs/ioctl.h>
-#include <libgen.h>
 #include <fcntl.h>
 #include <errno.h>
-#include <semaphore.h>
 #include <dirent.h>
 #include <uuid/uuid.h>
 #include <blkid/blkid.h>
 #include <sys/stat.h>
+#include <sys/xattr.h>
+#include <linux/fs.h>
 #include <signal.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <endian.h>
+#include <limits.h>
+#include <sys/syscall.h>
+#include <sys/file.h>
+#include <linux/futex.h>
 
 #include "../btrfs-progs/utils.h"
 #include "../btrfs-progs/btrfs-list.h"
 
+#ifdef BTRFSTRANS_HAVE_LIBURING
+#include <liburing.h>
+#endif
+
 #include "libbtrfstrans.h"
+#include "btrfstrans_stats.h"
 
-#define BTRFSTRANS_LOCK_SEM_NAME "libbtrfstranssemaphorelock"
-#define BTRFSTRANS_READONLY_SEM_NAME "libbtrfstranssemaphoreread"
-#define BTRFSTRANS_RENAME_SEM_NAME "libbtrfstranssemaphorerename"
+// prefix of the segment of every volume, see shm_name_of()
+#define BTRFSTRANS_SHM_NAME "/libbtrfstransshm"
+#define BTRFSTRANS_SHM_MAGIC 0x6274736d
+#define BTRFSTRANS_SHM_VERSION 1
 
 #define BTRFSTRANS_WRITABLE 0
 #define BTRFSTRANS_READONLY 1
@@ -34,985 +50,8434 @@
 #define BTRFSTRANS_HEAD_OLD_SV_NAME "/head_old/"
 #define BTRFSTRANS_WRITABLE_SV_NAME "/wr_snap/"
 #define BTRFSTRANS_READONLY_SV_NAME "/ro_snaps/"
-
-#define LIBBTRFSTRANS_RO_SNAP_NAME_PREFIX "ro_snap_"
-#define BTRFSTRANS_MAX_NUM_RO_TRANS 1
-#define MAX_PATH_LEN 256
+#define BTRFSTRANS_TXLOG_DIR_NAME "/txlog/"
+#define BTRFSTRANS_DOMAINS_DIR_NAME "/domains"
+
+// names relative to the volume root
+#define BTRFSTRANS_HEAD_NAME "head"
+#define BTRFSTRANS_HEAD_OLD_NAME "head_old"
+#define BTRFSTRANS_WRITABLE_NAME "wr_snap"
+#define BTRFSTRANS_PREWARM_NAME "wr_prewarm"
+#define BTRFSTRANS_CHANGES_NAME "changes"
+#define BTRFSTRANS_RETAINED_NAME "retained"
+#define BTRFSTRANS_SEND_NEW_NAME "send_new"
+// in head: staged files of rename-journal transactions, one directory each
+#define BTRFSTRANS_JOURNAL_DIR_NAME ".btrfstrans_journal"
+#define BTRFSTRANS_MANIFEST_NAME "manifest"
+
+#define LIBBTRFSTRANS_RO_SNAP_NAME_PREFIX "gen_"
+#define LIBBTRFSTRANS_WR_SNAP_NAME_PREFIX "wr_snap_"
+#define LIBBTRFSTRANS_MERGE_SNAP_NAME_PREFIX "wr_merge_"
+#define LIBBTRFSTRANS_REAP_NAME_PREFIX "reap_"
+#define LIBBTRFSTRANS_SAVEPOINT_NAME_PREFIX "wr_sp_"
+// read-only parents of the incremental export, see export_head()
+#define LIBBTRFSTRANS_SEND_SNAP_NAME_PREFIX "send_"
+#define BTRFSTRANS_STREAM_SUFFIX ".btrfs"
+// per-reader snapshots of versions before generations were shared
+#define LIBBTRFSTRANS_LEGACY_RO_SNAP_NAME_PREFIX "ro_snap_"
+
+// subvolumes waiting for the reaper, beyond that deletion is synchronous
+#define BTRFSTRANS_REAPER_QUEUE_LEN 256
+// deletions issued by the reaper in one go
+#define BTRFSTRANS_REAPER_BATCH 16
+#define BTRFSTRANS_REAPER_DEFAULT_RATE 20
+
+// polling interval bounds of timed write lock acquisition, in us
+#define BTRFSTRANS_LOCK_POLL_MIN 50
+#define BTRFSTRANS_LOCK_POLL_MAX 2000
+
+// make_subvolume(): most threads walking the tree, buckets of the hardlink table
+#define BTRFSTRANS_CONVERT_MAX_THREADS 64
+#define BTRFSTRANS_CONVERT_LINK_BUCKETS 4096
+
+// btrfstrans_submit(): io_uring queue depth, enough for the longest chain, and threads of the fallback pool
+#define BTRFSTRANS_BATCH_RING_ENTRIES BTRFSTRANS_BATCH_MAX_CHAIN
+#define BTRFSTRANS_BATCH_THREADS 8
+
+// most threads running asynchronous starts and commits
+#define BTRFSTRANS_ASYNC_THREADS 4
+
+// commit sequence number of a head, travels with every snapshot of it
+#define BTRFSTRANS_SEQ_XATTR "user.btrfstrans.seq"
+// intent record of the commit swapping head, on the volume root
+#define BTRFSTRANS_INTENT_XATTR "user.btrfstrans.intent"
+#define BTRFSTRANS_INTENT_MAGIC 0x62746e74
+// retention policy of the volume, on the volume root, see retain_head()
+#define BTRFSTRANS_RETENTION_XATTR "user.btrfstrans.retention"
+// when a retained generation stopped being head, in seconds since the epoch
+#define BTRFSTRANS_RETIRED_XATTR "user.btrfstrans.retired"
+// commit records of multi-domain transactions, on domains/
+#define BTRFSTRANS_GROUP_XATTR_PREFIX "user.btrfstrans.group."
+#define BTRFSTRANS_GROUP_MAGIC 0x62746770
+// redo record of the rename-journal commit in progress, on the volume root
+#define BTRFSTRANS_JOURNAL_XATTR "user.btrfstrans.journal"
+#define BTRFSTRANS_JOURNAL_MAGIC 0x62746a6e
+// number of committed write sets kept in txlog/ for conflict detection
+#define BTRFSTRANS_TXLOG_KEEP 1024
+// and of changesets in changes/ for subscribers
+#define BTRFSTRANS_CHANGES_KEEP BTRFSTRANS_TXLOG_KEEP
+// longest a subscriber sleeps before looking at head again
+#define BTRFSTRANS_CHANGES_WAIT_SLICE_MS 1000
+#define BTRFSTRANS_MAX_NUM_RO_TRANS 1024
+#define BTRFSTRANS_MAX_RO_GENERATIONS 64
+/*
+ * Longest volume root: the absolute paths kept for messages are the root,
+ * a directory like /ro_snaps/ and one subvolume name, and must fit into
+ * PATH_MAX.
+ */
+#define BTRFSTRANS_ROOT_PATH_MAX (PATH_MAX - BTRFS_VOL_NAME_MAX - 16)
 
 enum libbtrfstrans_state_enum {
     STATE_UNINITIALIZED = 1,
     STATE_INITIALIZED,
     STATE_READ,
     STATE_WRITE,
+    STATE_ASYNC,  // a start or commit of the original API is pending
     STATE_ERROR
 };
 
-static int acquire_write_lock();
-static int release_write_lock();
-static int wait_ro_sem();
-static int release_ro_sem();
-static int wait_rename_sem();
-static int release_rename_sem();
+/*
+ * A context is one volume root opened by the process. Any number of
+ * threads may share it; the settings are read and written atomically and
+ * everything else is immutable after btrfstrans_ctx_open().
+ */
+struct btrfstrans_ctx {
+    char root_path[PATH_MAX];
+    char head_subvolume_path[PATH_MAX];
+    char head_old_subvolume_path[PATH_MAX];
+    char readonly_subvolumes_path[PATH_MAX];
+    char txlog_path[PATH_MAX];
+
+    /*
+     * Name of the domain, empty for a plain volume. A domain is a volume
+     * of its own below <root>/domains; domains_fd is that directory, which
+     * holds the commit records of transactions over several domains.
+     */
+    char domain[BTRFSTRANS_DOMAIN_NAME_MAX+1];
+    int domains_fd;
+
+    // the volume root, parent directory of head and all writable snapshots
+    int root_fd;
+    int ro_snaps_fd;
+    int txlog_fd;
+    // changes/, -1 until some process enabled changesets for the volume
+    int changes_fd;
+    // retained/, the heads kept by the retention policy; retain_mutex
+    // lets one thread of the context prune them
+    int retained_fd;
+    pthread_mutex_t retain_mutex;
+
+    /*
+     * The shm segment of the volume or domain, holding its read-only
+     * tables and lock owners. Named after the root, see shm_name_of().
+     */
+    char shm_name[NAME_MAX+1];
+    struct btrfstrans_shm* shm;
+
+    /*
+     * Our open file description of the shm object, which carries the
+     * read-only and rename locks. The mutexes keep threads of the context
+     * from sharing them: OFD locks don't exclude their own description.
+     */
+    int lock_fd;
+    pthread_mutex_t ro_mutex;
+    pthread_mutex_t rename_mutex;
+
+    // defaults for transactions started from now on
+    int mode;
+    int durability;
+    int write_lease_ms;
+    int journal_files;  // most files committed through the rename journal
+
+    /*
+     * Pre-warm mode: after every commit or abort a background thread
+     * snapshots the current head to wr_prewarm, and the next
+     * start_transaction() of any process claims it with a rename instead
+     * of paying for the snapshot. Transactions on the rename journal
+     * start without a snapshot, so it idles while journal_files > 0.
+     */
+    pthread_mutex_t prewarm_mutex;
+    pthread_cond_t prewarm_cond;
+    pthread_t prewarm_thread;
+    int prewarm_enabled;
+    int prewarm_running;
+    int prewarm_requested;
+    int prewarm_stopping;
+
+    /*
+     * Incremental export: after every commit a background thread writes a
+     * send stream of the new head to the spool directory spool_fd (-1:
+     * off). export_idle_cond is signalled whenever an export finished.
+     */
+    pthread_mutex_t export_mutex;
+    pthread_cond_t export_cond;
+    pthread_cond_t export_idle_cond;
+    pthread_t export_thread;
+    int spool_fd;
+    int export_running;
+    int export_requested;
+    int export_busy;
+    int export_stopping;
+};
+
+/*
+ * A transaction handle belongs to the thread that uses it: different
+ * handles may be used concurrently, one handle by one thread at a time.
+ */
+struct btrfstrans_txn {
+    btrfstrans_ctx* ctx;
+    int state;          // STATE_READ or STATE_WRITE
+    int mode;
+    int durability;
+
+    char writable_subvolume_name[BTRFS_VOL_NAME_MAX+1];
+    char writable_subvolume_path[PATH_MAX];
+    char merge_subvolume_name[BTRFS_VOL_NAME_MAX+1];
+    char merge_subvolume_path[PATH_MAX];
+    char specific_readonly_sv_name[BTRFS_VOL_NAME_MAX+1];
+    char specific_readonly_sv_path[PATH_MAX];
+
+    /*
+     * All file operations of a transaction are relative to the cached fd
+     * of its subvolume. head is always looked up by name below root_fd,
+     * since other processes may swap it at any time.
+     */
+    int writable_fd;
+    int readonly_fd;
+    int ro_reader_slot;
+
+    // own open file description of the shm object holding the write lock
+    int write_lock_fd;
+
+    /*
+     * Write lease, see lease_main(). Protected by lease_mutex; while
+     * lease_busy is set the lease is not revoked.
+     */
+    unsigned long long lease_expiry;
+    btrfstrans_txn* lease_next;
+    int lease_busy;
+    int lease_revoked;
+
+    // bookkeeping for conflict detection
+    unsigned long long base_seq;
+    // btrfs generation the writable snapshot was created in, 0 if unknown
+    unsigned long long base_gen;
+    char** write_set;
+    int write_set_len;
+    int write_set_cap;
+
+    // read-only snapshots of the writable subvolume, oldest first
+    struct savepoint* savepoints;
+    int savepoints_len;
+    int savepoints_cap;
+
+    /*
+     * Rename journal, see journal_fopen(). While journal is set there is
+     * no writable snapshot: entry i of the write set is staged as file
+     * <i> of stage_fd, a directory in head, which journal_fds[i] keeps
+     * open (-1: unlinked). After a switch to a snapshot the first
+     * journal_len entries were copied into it, journal_ctime tells which
+     * staged files were written to since.
+     */
+    int journal;
+    int journal_limit;
+    int journal_len;
+    int stage_fd;
+    char stage_name[32];
+    int journal_fds[BTRFSTRANS_JOURNAL_MAX_FILES];
+    struct timespec journal_ctime[BTRFSTRANS_JOURNAL_MAX_FILES];
+};
+
+struct savepoint {
+    char name[BTRFS_VOL_NAME_MAX+1];
+    int write_set_len;  // entries of the write set recorded before it
+};
+
+static int acquire_write_lock(btrfstrans_txn* txn, int timeout_ms);
+static int release_write_lock(btrfstrans_txn* txn);
+static int acquire_ro_lock(btrfstrans_ctx* ctx);
+static int release_ro_lock(btrfstrans_ctx* ctx);
+static int acquire_rename_lock(btrfstrans_ctx* ctx);
+static int release_rename_lock(btrfstrans_ctx* ctx);
+static void recover_write_lock(btrfstrans_ctx* ctx);
+static int reap_dead_writers(btrfstrans_ctx* ctx, pid_t pid);
+static void lease_begin(btrfstrans_txn* txn);
+static int lease_hold(btrfstrans_txn* txn);
+static void lease_unhold(btrfstrans_txn* txn);
+static int lease_end(btrfstrans_txn* txn);
+static int copy_fd_range(int fd_src, off_t src_offset, int fd_dst, off_t dst_offset, off_t length);
 
 static int exists(const char* path);
 static int exists_one_of(const char* path1, const char* path2, const char* path3);
-static int exist_both_of(const char* path1, const char* path2);
-static int create_path_vars(const char* path);
-static int create_initial_subvolumes();
+static int create_path_vars(btrfstrans_ctx* ctx, const char* path);
+static int create_initial_subvolumes(btrfstrans_ctx* ctx);
 static void signal_callback_handler(int signum);
 
+static int read_seq(int parent_fd, const char* name, unsigned long long* seq);
+static int write_seq(int sv_fd, unsigned long long seq);
+static int record_write(btrfstrans_txn* txn, const char* filename);
+static void clear_write_set(btrfstrans_txn* txn);
+static int check_conflicts(btrfstrans_txn* txn, unsigned long long from_seq, unsigned long long to_seq);
+static int write_txlog(btrfstrans_txn* txn, unsigned long long seq);
+static int subvolume_generation(int sv_fd, unsigned long long* gen);
+static int open_changes(btrfstrans_ctx* ctx);
+static void collect_changes(btrfstrans_txn* txn, char** buf, size_t* len);
+static int write_changes(btrfstrans_ctx* ctx, unsigned long long seq, const char* buf, size_t len);
+static void notify_commit(btrfstrans_ctx* ctx);
+static int write_intent(btrfstrans_txn* txn, unsigned long long seq);
+static void clear_intent(btrfstrans_ctx* ctx);
+static int recover_intent(btrfstrans_ctx* ctx);
+static int write_group(btrfstrans_multi* multi, const unsigned long long* head_seqs, char* xattr, size_t size);
+static void clear_group(btrfstrans_ctx* ctx, const char* xattr);
+static int group_needs(btrfstrans_ctx* ctx, const char* name);
+static int recover_groups(btrfstrans_ctx* ctx);
+static int merge_write_set(btrfstrans_txn* txn, int src_fd, int dst_fd);
+static int discard_transaction(btrfstrans_txn* txn);
+static int prepare_commit(btrfstrans_txn* txn, char** changes, size_t* changes_len);
+static int merge_onto_head(btrfstrans_txn* txn, unsigned long long head_seq);
+static int stage_commit(btrfstrans_txn* txn, unsigned long long seq, const char* changes, size_t changes_len,
+    int* changes_written, unsigned long long* t_txlog);
+static void unstage_changes(btrfstrans_ctx* ctx, unsigned long long seq);
+static int swap_head(btrfstrans_txn* txn);
+static void retire_old_head(btrfstrans_txn* txn, unsigned long long seq);
+static void prune_retained(btrfstrans_ctx* ctx);
+static int finish_commit(btrfstrans_txn* txn, unsigned long long seq, char* changes, unsigned long long* transid);
+static void drop_savepoints(btrfstrans_txn* txn, int from);
+static int fsync_write_set(btrfstrans_txn* txn, int sv_fd);
+static int make_durable(btrfstrans_txn* txn, unsigned long long* transid);
+static int open_volume(btrfstrans_ctx* ctx);
+static int finish_init(btrfstrans_ctx* ctx);
+static int reap_subvolume(int parent_fd, const char* name);
+static int reap_leftovers(int parent_fd);
+static int destroy_subvolume_at(int parent_fd, const char* name);
+static int snapshot_at(int src_parent_fd, const char* src_name, int parent_fd, const char* name, int readonly);
+static int snapshot_committed(int src_parent_fd, const char* src_name, int parent_fd, const char* name);
+static int seal_snapshot(int sv_fd);
+static int exists_at(int dirfd, const char* name);
+static int open_ctx(const char* path, const char* domain, btrfstrans_ctx** ctx);
+static int begin_ro(btrfstrans_ctx* ctx, const unsigned long long* at, btrfstrans_txn** txnp);
+static int claim_prewarmed(btrfstrans_txn* txn);
+static int begin_write(btrfstrans_ctx* ctx, btrfstrans_txn** txnp, int timeout_ms, int journal_files);
+static void close_journal(btrfstrans_txn* txn);
+static void drop_stage(btrfstrans_txn* txn);
+static int switch_to_snapshot(btrfstrans_txn* txn);
+static int sync_staged(btrfstrans_txn* txn);
+static int commit_journal(btrfstrans_txn* txn, unsigned long long* transid);
+static void strip_journal(int sv_fd);
+static int recover_journal(btrfstrans_ctx* ctx);
+static int journal_needs(btrfstrans_ctx* ctx, const char* name);
+static int publish_journal(int head_fd, int stage_fd, char* manifest, unsigned long long seq);
+static void remove_stage(int dir_fd, const char* name);
+static int fsync_published(btrfstrans_txn* txn);
+static int restage(btrfstrans_txn* txn, int head_fd);
+static int make_parents(int sv_fd, const char* rel);
+static int prewarm_wanted(btrfstrans_ctx* ctx);
+static void request_prewarm(btrfstrans_ctx* ctx);
+static void stop_prewarm(btrfstrans_ctx* ctx);
+static void request_export(btrfstrans_ctx* ctx);
+static void stop_export(btrfstrans_ctx* ctx);
+static int open_shm(btrfstrans_ctx* ctx);
+static int shm_name_of(btrfstrans_ctx* ctx);
+static void open_stats();
+static int reclaim_ro_generations(btrfstrans_ctx* ctx, unsigned long long current_seq);
+static int reap_orphan_generations(btrfstrans_ctx* ctx);
 
-static sem_t* sem_lock;
-static sem_t* sem_ro;
-static sem_t* sem_rename;
 
-static char head_subvolume_path[MAX_PATH_LEN+1];
-static char head_old_subvolume_path[MAX_PATH_LEN+1];
-static char writable_subvolume_path[MAX_PATH_LEN+1];
-static char readonly_subvolumes_path[MAX_PATH_LEN+1];
-static char specific_readonly_sv_path[MAX_PATH_LEN+1];
+/*
+ * Read-only transactions share one snapshot ro_snaps/gen_<seq> per
+ * committed head. The table of generations and the readers pinning them
+ * lives in shared memory and is protected by the read-only lock.
+ */
+struct ro_generation {
+    unsigned long long seq;
+    int refcount;
+    int valid;
+};
 
-static int state = STATE_UNINITIALIZED;
+struct ro_reader {
+    pid_t pid;          // 0 -> free
+    int generation;     // index into ro_generations
+};
 
+/*
+ * The inter-process locks are OFD byte range locks on the shm object, one
+ * byte each. Unlike semaphores they are dropped by the kernel when their
+ * holder dies. The holder notes its pid in lock_owners and clears it
+ * before unlocking, so finding a pid there means the previous holder
+ * died with the lock and left its snapshots behind.
+ */
+enum btrfstrans_lock {
+    BTRFSTRANS_LOCK_WRITE,      // pessimistic writers, from start to commit/abort
+    BTRFSTRANS_LOCK_RO,         // the read-only tables
+    BTRFSTRANS_LOCK_RENAME,     // reading the sequence of head and swapping it
+    BTRFSTRANS_LOCK_COUNT
+};
 
-// --------------------------------------------------------
+static const char* lock_names[BTRFSTRANS_LOCK_COUNT] = { "write", "read-only", "rename" };
 
+struct lock_owner {
+    pid_t pid;          // 0 -> released properly
+};
 
-// code from cmd_subvol_get_default() from btrfs progs cmds-subvolume.c
-int init_libbtrfstrans(const char* path) {
-    if ( state != STATE_UNINITIALIZED ) {
-        fprintf(stderr, "ERROR: libbtrfstrans was already initialized\n");
-        state = STATE_ERROR;
-        return E_WRONGSTATE;
-    }
+/*
+ * New fields go to the end: the segment outlives library upgrades. A
+ * change of the existing ones needs a new version, open_shm() refuses
+ * segments of another one.
+ */
+struct btrfstrans_shm {
+    uint32_t magic;
+    uint32_t version;
+    struct ro_generation ro_generations[BTRFSTRANS_MAX_RO_GENERATIONS];
+    struct ro_reader ro_readers[BTRFSTRANS_MAX_NUM_RO_TRANS];
+    struct lock_owner lock_owners[BTRFSTRANS_LOCK_COUNT];
+    // bumped after every head swap, subscribers wait on it with futex()
+    uint32_t commit_futex;
+};
 
-    printf("Initializing library for %s...\n", path);
-    printf("Registering signal handlers...\n");
-    //signal(SIGABRT, signal_callback_handler);
-    //signal(SIGFPE, signal_callback_handler);
-    //signal(SIGILL, signal_callback_handler);
-    //signal(SIGINT, signal_callback_handler);
-    //signal(SIGSEGV, signal_callback_handler);
-    //signal(SIGTERM, signal_callback_handler);
-    printf("%d %d %d %d %d %d\n", SIGABRT, SIGFPE, SIGILL, SIGINT, SIGSEGV,
-    SIGTERM);
-    printf("Signal handlers registered...\n");
+// the statistics are mapped once per process, by the first context opened
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
 
-    create_path_vars(path);
+/*
+ * Latency histograms and counters of all processes, see btrfstrans_stats.h.
+ * NULL if the segment couldn't be mapped; building with
+ * BTRFSTRANS_NO_STATS compiles the instrumentation away.
+ */
+#ifndef BTRFSTRANS_NO_STATS
+static struct btrfstrans_stats* stats;
+#endif
 
-    if (!exists_one_of(head_subvolume_path, head_old_subvolume_path,\
-        readonly_subvolumes_path)) { //subvolume is empty
-        int ret = create_initial_subvolumes();
-        if (ret){
-            state = STATE_ERROR;
-            return ret;
-        }
-        printf("Any one of subvolume is existing, state is initialized\
-        now.\n");
-        state = STATE_INITIALIZED;
-        return SUCCESS;
-    }
+static inline unsigned long long monotonic_ns() {
+    struct timespec ts;
 
-    if (exist_both_of(readonly_subvolumes_path, head_subvolume_path) &&
-        !exists(head_old_subvolume_path)) {
-        printf("Both head and ro_subvol exist, state is initialized\
-        now.\n");
-        state = STATE_INITIALIZED;
-        return SUCCESS;
-    }
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
-    if (exist_both_of(readonly_subvolumes_path, head_old_subvolume_path) &&
-        !exists(head_subvolume_path)) {
-        if (rename(head_old_subvolume_path, head_subvolume_path)) {
-            fprintf(stderr, "ERROR: renaming %s to %s\n",
-            head_old_subvolume_path, head_subvolume_path);
-            state = STATE_ERROR;
-            return E_RENAME;
-        }
-        printf("Both head_old and ro_subvol exist, and head doesn't, renaming.\
-        state is initialized now.\n");
-        state = STATE_INITIALIZED;
-        return SUCCESS;
+static inline unsigned long long stats_now() {
+#ifdef BTRFSTRANS_NO_STATS
+    return 0;
+#else
+    return monotonic_ns();
+#endif
+}
+
+// adds the time since start (from stats_now()) to the histogram of phase
+static inline void stats_record(int phase, unsigned long long start) {
+#ifndef BTRFSTRANS_NO_STATS
+    struct btrfstrans_hist* hist;
+    uint64_t ns, max;
+
+    if (!stats) {
+        return;
     }
+    ns = stats_now() - start;
+    hist = &stats->hist[phase];
+    __atomic_fetch_add(&hist->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist->sum_ns, ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist->buckets[btrfstrans_hist_bucket(ns)], 1, __ATOMIC_RELAXED);
+    max = __atomic_load_n(&hist->max_ns, __ATOMIC_RELAXED);
+    while (ns > max && !__atomic_compare_exchange_n(&hist->max_ns, &max, ns, 1,
+        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+#endif
+}
 
-    state = STATE_ERROR;
-    return E_CORRUPT;
+static inline void stats_add(int counter, unsigned long long n) {
+#ifndef BTRFSTRANS_NO_STATS
+    if (stats) {
+        __atomic_fetch_add(&stats->counters[counter], n, __ATOMIC_RELAXED);
+    }
+#endif
 }
 
-static int create_path_vars(const char* path){
-    strcpy(head_subvolume_path, path);
-    strcat(head_subvolume_path, BTRFSTRANS_HEAD_SV_NAME);
+static inline void stats_count(int counter) {
+    stats_add(counter, 1);
+}
 
-    strcpy(head_old_subvolume_path, path);
-    strcat(head_old_subvolume_path, BTRFSTRANS_HEAD_OLD_SV_NAME);
+#ifdef BTRFSTRANS_FAULT_INJECTION
+/*
+ * Kills the process at the commit step named by $BTRFSTRANS_CRASH_AT,
+ * see bench/btrfstrans-crashtest.c.
+ */
+static void crash_point(const char* step) {
+    const char* at = getenv("BTRFSTRANS_CRASH_AT");
 
-    strcpy(writable_subvolume_path, path);
-    strcat(writable_subvolume_path, BTRFSTRANS_WRITABLE_SV_NAME);
+    if (at && !strcmp(at, step)) {
+        kill(getpid(), SIGKILL);
+    }
+}
+#else
+#define crash_point(step)
+#endif
 
-    strcpy(readonly_subvolumes_path, path);
-    strcat(readonly_subvolumes_path, BTRFSTRANS_READONLY_SV_NAME);
+/*
+ * Logging. Messages up to BTRFSTRANS_LOG_COMPILED_LEVEL are compiled in,
+ * those of a higher level compile away; of the rest only those up to the
+ * level set at runtime (default $BTRFSTRANS_LOG_LEVEL, else nothing) are
+ * formatted, so a disabled statement costs a load and a compare. Errors
+ * are always formatted: the last one of every thread is kept for
+ * btrfstrans_last_error(). Messages go to the sink directly, or in async
+ * mode into a ring that a background thread drains.
+ */
+#ifndef BTRFSTRANS_LOG_COMPILED_LEVEL
+#define BTRFSTRANS_LOG_COMPILED_LEVEL BTRFSTRANS_LOG_INFO
+#endif
+
+// message length, longer ones are cut
+#define BTRFSTRANS_LOG_MSG_MAX 256
+// slots of the ring of async mode, a power of 2; messages beyond are dropped
+#define BTRFSTRANS_LOG_RING_SLOTS 256
+// longest the drain thread sleeps without being woken
+#define BTRFSTRANS_LOG_DRAIN_SLICE_MS 100
+
+struct log_slot {
+    // next position to write the slot at, +1 once it's written
+    unsigned int seq;
+    int level;
+    char msg[BTRFSTRANS_LOG_MSG_MAX];
+};
 
-    return SUCCESS;
+static const char* log_level_names[] = { "none", "error", "warning", "info", "debug" };
+
+// < 0 until read from the environment
+static int log_level = -1;
+static btrfstrans_log_fn log_fn;
+static void* log_arg;
+static __thread char last_error[BTRFSTRANS_LOG_MSG_MAX];
+
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int log_async;
+static int log_drain_running;
+static struct log_slot log_ring[BTRFSTRANS_LOG_RING_SLOTS];
+static unsigned int log_ring_head;
+static unsigned int log_ring_tail;
+static uint32_t log_ring_futex;
+static int log_ring_sleeping;
+// threads in btrfstrans_log_flush(), waiting on log_ring_tail
+static int log_flush_waiters;
+static unsigned long long log_dropped;
+
+static int log_level_from_env() {
+    const char* env = getenv("BTRFSTRANS_LOG_LEVEL");
+    int level = 0;
+
+    if (env) {
+        level = atoi(env);
+        for (int i = 0; i <= BTRFSTRANS_LOG_DEBUG; i++) {
+            if (!strcmp(env, log_level_names[i])) {
+                level = i;
+            }
+        }
+    }
+    if (level < 0 || level > BTRFSTRANS_LOG_DEBUG) {
+        level = 0;
+    }
+    __atomic_store_n(&log_level, level, __ATOMIC_RELAXED);
+    return level;
 }
 
-static int create_initial_subvolumes(){
-    int ret = create_subvolume(head_subvolume_path);
-    if (ret) {
-        fprintf(stderr, "ERROR in %s: can't create subvolume '%s'\n", __func__, head_subvolume_path);
-        return E_UNSPECIFIED;
-    }
+static inline int log_enabled(int level) {
+    int current = __atomic_load_n(&log_level, __ATOMIC_RELAXED);
 
-    ret = create_subvolume(readonly_subvolumes_path);
-    if (ret) {
-        fprintf(stderr, "ERROR in %s: can't create subvolume '%s'\n", __func__, readonly_subvolumes_path);
-        return E_UNSPECIFIED;
+    if (current < 0) {
+        current = log_level_from_env();
     }
-
-    return SUCCESS;
+    return level <= current;
 }
 
+// the default sink, one write() per message so lines of threads don't mix
+static void log_to_stderr(int level, const char* msg, void* arg) {
+    char line[BTRFSTRANS_LOG_MSG_MAX + 32];
+    int len;
 
+    len = snprintf(line, sizeof(line), "libbtrfstrans: %s: %s\n", log_level_names[level], msg);
+    if (len >= (int)sizeof(line)) {
+        len = sizeof(line) - 1;
+        line[len - 1] = '\n';
+    }
+    if (write(STDERR_FILENO, line, len) < 0) {
+        // nowhere left to report it
+    }
+}
 
-int start_transaction() {
-    //printf("libbtrfstrans: Starting transaction\n");
+static void log_deliver(int level, const char* msg) {
+    btrfstrans_log_fn fn = __atomic_load_n(&log_fn, __ATOMIC_ACQUIRE);
 
-    if ( state != STATE_INITIALIZED) {
-        fprintf(stderr, "ERROR: libbtrfstrans was not configured or is in the wrong state (state=%d)\n", state);
-        return E_WRONGSTATE;
+    if (fn) {
+        fn(level, msg, __atomic_load_n(&log_arg, __ATOMIC_RELAXED));
+    } else {
+        log_to_stderr(level, msg, NULL);
     }
+}
 
-    acquire_write_lock();
+static void log_wake_drain() {
+    __atomic_fetch_add(&log_ring_futex, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&log_ring_sleeping, __ATOMIC_SEQ_CST)) {
+        syscall(SYS_futex, &log_ring_futex, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+}
 
-    create_snapshot(head_subvolume_path, writable_subvolume_path, BTRFSTRANS_WRITABLE, BTRFSTRANS_ASYNCHR);
+// lock-free for any number of writers, see log_drain() for the reader; -1 if full
+static int log_ring_push(int level, const char* msg) {
+    unsigned int pos = __atomic_load_n(&log_ring_head, __ATOMIC_RELAXED);
+    struct log_slot* slot;
+    int diff;
+
+    for (;;) {
+        slot = &log_ring[pos & (BTRFSTRANS_LOG_RING_SLOTS - 1)];
+        diff = (int)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&log_ring_head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            __atomic_fetch_add(&log_dropped, 1, __ATOMIC_RELAXED);
+            return -1;
+        } else {
+            pos = __atomic_load_n(&log_ring_head, __ATOMIC_RELAXED);
+        }
+    }
 
-    state = STATE_WRITE;
+    slot->level = level;
+    memcpy(slot->msg, msg, strlen(msg) + 1);
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
 
-    //printf("libbtrfstrans: Finished starting transaction\n");
-    return SUCCESS;
+    log_wake_drain();
+    return 0;
 }
 
-int commit_transaction() {
-    int ret;
-    //printf("libbtrfstrans: Committing transaction\n");
-
-    if ( state != STATE_WRITE) {
-        fprintf(stderr, "ERROR: transaction was not started or libbtrfstrans is in the wrong state(state=%d)\n", state);
-        return E_WRONGSTATE;
+// delivers what the ring holds, only called by the drain thread
+static int log_drain() {
+    unsigned int tail = __atomic_load_n(&log_ring_tail, __ATOMIC_RELAXED);
+    unsigned long long dropped;
+    struct log_slot* slot;
+    char msg[BTRFSTRANS_LOG_MSG_MAX];
+    int n = 0;
+
+    for (;; tail++, n++) {
+        slot = &log_ring[tail & (BTRFSTRANS_LOG_RING_SLOTS - 1)];
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != tail + 1) {
+            break;
+        }
+        log_deliver(slot->level, slot->msg);
+        __atomic_store_n(&slot->seq, tail + BTRFSTRANS_LOG_RING_SLOTS, __ATOMIC_RELEASE);
+        __atomic_store_n(&log_ring_tail, tail + 1, __ATOMIC_RELEASE);
     }
 
-    wait_rename_sem();
-
-    //puts("libbtrfstrans: Going to rename 'head' to 'head_old'. Ok?");
-    //getchar();
+    // a flusher either sees the new tail or is counted here and woken, see btrfstrans_log_flush()
+    if (n) {
+        __atomic_store_n(&log_ring_tail, tail, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&log_flush_waiters, __ATOMIC_SEQ_CST)) {
+            syscall(SYS_futex, &log_ring_tail, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+        }
+    }
 
-    // rename stale subvolume
-    if (rename(head_subvolume_path, head_old_subvolume_path)) {
-        fprintf(stderr, "ERROR: renaming %s to %s\n", head_subvolume_path, head_old_subvolume_path);
-        state = STATE_ERROR;
-        return E_RENAME;
+    dropped = __atomic_exchange_n(&log_dropped, 0, __ATOMIC_RELAXED);
+    if (dropped) {
+        snprintf(msg, sizeof(msg), "%llu messages dropped, the log ring was full", dropped);
+        log_deliver(BTRFSTRANS_LOG_WARN, msg);
     }
+    return n;
+}
 
-    sync();
-    //sleep(4); // for demonstration purposes only
+static void* log_main(void* arg) {
+    struct timespec ts = {
+        .tv_sec = BTRFSTRANS_LOG_DRAIN_SLICE_MS / 1000,
+        .tv_nsec = (BTRFSTRANS_LOG_DRAIN_SLICE_MS % 1000) * 1000000L
+    };
+    uint32_t word;
 
-    //puts("libbtrfstra/dir1_svolns: Going to rename 'wr_snap' to 'head'. Ok?");
-    //getchar();
+    for (;;) {
+        while (log_drain());
 
-    if (rename(writable_subvolume_path, head_subvolume_path)) {
-        fprintf(stderr, "ERROR: renaming %s to %s\n", writable_subvolume_path, head_subvolume_path);
-        state = STATE_ERROR;
-        return E_RENAME;
+        __atomic_store_n(&log_ring_sleeping, 1, __ATOMIC_SEQ_CST);
+        word = __atomic_load_n(&log_ring_futex, __ATOMIC_SEQ_CST);
+        if (!log_drain()) {
+            syscall(SYS_futex, &log_ring_futex, FUTEX_WAIT_PRIVATE, word, &ts, NULL, 0);
+        }
+        __atomic_store_n(&log_ring_sleeping, 0, __ATOMIC_RELAXED);
     }
+    return NULL;
+}
 
-    release_rename_sem();
-
-    //sleep(4); // for demonstration purposes only
+static void log_write(int level, const char* format, ...) __attribute__((format(printf, 2, 3)));
 
+static void log_write(int level, const char* format, ...) {
+    char msg[BTRFSTRANS_LOG_MSG_MAX];
+    int saved_errno = errno;
+    va_list ap;
 
-    //puts("libbtrfstrans: Going to delete 'head_old'. Ok?");
-    //getchar();
+    va_start(ap, format);
+    vsnprintf(msg, sizeof(msg), format, ap);
+    va_end(ap);
 
-    ret = delete_subvolume(head_old_subvolume_path);
-    if (ret) {
-        fprintf(stderr, "ERROR: couldn't delete subvolume %s to commit the transaction\n", head_old_subvolume_path);
-        state = STATE_ERROR;
-        return ret;
+    if (level == BTRFSTRANS_LOG_ERROR) {
+        memcpy(last_error, msg, sizeof(msg));
+    }
+    if (level > BTRFSTRANS_LOG_COMPILED_LEVEL || !log_enabled(level)) {
+        errno = saved_errno;
+        return;
     }
+    if (__atomic_load_n(&log_async, __ATOMIC_ACQUIRE)) {
+        log_ring_push(level, msg);
+    } else {
+        log_deliver(level, msg);
+    }
+    errno = saved_errno;
+}
 
-    release_write_lock();
+#define log_at(level, ...) do { \
+    if ((level) <= BTRFSTRANS_LOG_COMPILED_LEVEL && log_enabled(level)) { \
+        log_write(level, __VA_ARGS__); \
+    } \
+} while (0)
 
-    state = STATE_INITIALIZED;
+// not compiled away: btrfstrans_last_error() needs them
+#define log_error(...) log_write(BTRFSTRANS_LOG_ERROR, __VA_ARGS__)
+#define log_warn(...) log_at(BTRFSTRANS_LOG_WARN, __VA_ARGS__)
+#define log_info(...) log_at(BTRFSTRANS_LOG_INFO, __VA_ARGS__)
+#define log_debug(...) log_at(BTRFSTRANS_LOG_DEBUG, __VA_ARGS__)
 
-    printf("libbtrfstrans: Finished committing transaction\n");
+int btrfstrans_set_log_level(int level) {
+    if (level < 0 || level > BTRFSTRANS_LOG_DEBUG) {
+        return E_UNSPECIFIED;
+    }
+    __atomic_store_n(&log_level, level, __ATOMIC_RELAXED);
+    return SUCCESS;
+}
 
+int btrfstrans_set_log_sink(btrfstrans_log_fn fn, void* arg) {
+    // a message in flight may still see the old arg with the new fn
+    __atomic_store_n(&log_arg, arg, __ATOMIC_RELAXED);
+    __atomic_store_n(&log_fn, fn, __ATOMIC_RELEASE);
     return SUCCESS;
 }
 
-int abort_transaction() {
+int btrfstrans_set_log_async(int enabled) {
+    pthread_t thread;
 
-    printf("libbtrfstrans: Aborting transaction\n");
-    if ( state != STATE_WRITE) {
-        fprintf(stderr, "ERROR: transaction was not started or libbtrfstrans is in the wrong state\n");
-        return E_WRONGSTATE;
+    pthread_mutex_lock(&log_mutex);
+    if (enabled && !log_drain_running) {
+        for (int i = 0; i < BTRFSTRANS_LOG_RING_SLOTS; i++) {
+            log_ring[i].seq = i;
+        }
+        if (pthread_create(&thread, NULL, log_main, NULL)) {
+            pthread_mutex_unlock(&log_mutex);
+            log_error("can't start the log thread");
+            return E_UNSPECIFIED;
+        }
+        pthread_detach(thread);
+        __atomic_store_n(&log_drain_running, 1, __ATOMIC_RELEASE);
     }
+    __atomic_store_n(&log_async, !!enabled, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&log_mutex);
 
-    int ret = delete_subvolume(writable_subvolume_path);
-    if (ret) {
-        fprintf(stderr, "ERROR: couldn't delete subvolume %s to abort the transaction\n", head_old_subvolume_path);
-        state = STATE_ERROR;
-        return ret;
+    if (!enabled) {
+        btrfstrans_log_flush();
     }
-
-    release_write_lock();
-
-    state = STATE_INITIALIZED;
     return SUCCESS;
 }
 
-int start_ro_transaction() {
-    int done = 0;
-    char nr_buf[10];
-
-    printf("libbtrfstrans: Starting read-only transaction\n");
+/*
+ * Waits until the messages queued before the call are delivered: the
+ * drain thread wakes the flushers on log_ring_tail once it moved.
+ */
+int btrfstrans_log_flush() {
+    unsigned int head = __atomic_load_n(&log_ring_head, __ATOMIC_ACQUIRE);
+    unsigned int tail;
 
-    if (state != STATE_INITIALIZED) {
-        fprintf(stderr, "ERROR: libbtrfstrans was not configured or is in the wrong state\n");
-        return E_WRONGSTATE;
+    if (!__atomic_load_n(&log_drain_running, __ATOMIC_ACQUIRE)) {
+        return SUCCESS;
     }
-
-    //wait_ro_sem();
-    printf("Sema acquired\n");
-
-    for (int i=0; i<BTRFSTRANS_MAX_NUM_RO_TRANS; i++) {
-        strcpy(specific_readonly_sv_path, readonly_subvolumes_path);
-        strcat(specific_readonly_sv_path, "/");
-        strcat(specific_readonly_sv_path, LIBBTRFSTRANS_RO_SNAP_NAME_PREFIX);
-        sprintf(nr_buf, "%d", i);
-        strcat(specific_readonly_sv_path, nr_buf);
-        strcat(specific_readonly_sv_path, "/");
-
-        printf("Creating snpshot of %s at %s\n", head_subvolume_path,
-            specific_readonly_sv_path);
-        if (!exists(specific_readonly_sv_path)){
-            //wait_rename_sem();
-            create_snapshot(head_subvolume_path, specific_readonly_sv_path,\
-            BTRFSTRANS_READONLY, BTRFSTRANS_ASYNCHR);
-            //release_rename_sem();
-            done = 1;
+    __atomic_fetch_add(&log_flush_waiters, 1, __ATOMIC_SEQ_CST);
+    for (;;) {
+        tail = __atomic_load_n(&log_ring_tail, __ATOMIC_SEQ_CST);
+        if ((int)(tail - head) >= 0) {
             break;
         }
+        log_wake_drain();
+        syscall(SYS_futex, &log_ring_tail, FUTEX_WAIT_PRIVATE, tail, NULL, NULL, 0);
     }
-    if (!done) {
-        fprintf(stderr, "ERROR: couldn't find empty slot for read-only subvolume\n");
-        state = STATE_ERROR;
-        return E_UNSPECIFIED;
-    }
-
-    printf("libbtrfstrans: Finished starting read-only transaction\n");
-
-    state = STATE_READ;
-    printf("State is %d.\n", state);
+    __atomic_fetch_sub(&log_flush_waiters, 1, __ATOMIC_RELAXED);
     return SUCCESS;
 }
 
+const char* btrfstrans_last_error() {
+    return last_error;
+}
 
-int stop_ro_transaction() {
-    //printf("libbtrfstrans: Stopping read-only transaction\n");
-    int ret;
-
-    if ( state != STATE_READ) {
-        fprintf(stderr, "ERROR: read-only transaction was not started or\
-            libbtrfstrans is in the wrong state\n");
-        return E_WRONGSTATE;
+const char* btrfstrans_strerror(int err) {
+    static const char* const messages[] = {
+        [E_UNSPECIFIED - E_UNSPECIFIED] = "unspecified error",
+        [E_ACCESS - E_UNSPECIFIED] = "can't access a path",
+        [E_NOTASUBVOLUME - E_UNSPECIFIED] = "not a subvolume",
+        [E_EXISTSANDNOTADIR - E_UNSPECIFIED] = "exists and is not a directory",
+        [E_INCORRECTSNAPNAME - E_UNSPECIFIED] = "incorrect snapshot name",
+        [E_SNAPNAMETOOLONG - E_UNSPECIFIED] = "snapshot name too long",
+        [E_INCORRECTSVNAME - E_UNSPECIFIED] = "incorrect subvolume name",
+        [E_SVNAMETOOLONG - E_UNSPECIFIED] = "subvolume name too long",
+        [E_RENAME - E_UNSPECIFIED] = "rename failed",
+        [E_DELETE - E_UNSPECIFIED] = "subvolume deletion failed",
+        [E_WRONGSTATE - E_UNSPECIFIED] = "wrong state",
+        [E_CORRUPT - E_UNSPECIFIED] = "volume is corrupt",
+        [E_INVALIDNAME - E_UNSPECIFIED] = "invalid file name",
+        [E_CONFLICT - E_UNSPECIFIED] = "conflict with a committed transaction",
+        [E_TIMEOUT - E_UNSPECIFIED] = "timed out",
+        [E_LEASEEXPIRED - E_UNSPECIFIED] = "write lease expired",
+        [E_CANCELED - E_UNSPECIFIED] = "canceled"
+    };
+
+    if (err == SUCCESS) {
+        return "success";
+    }
+    if (err >= E_UNSPECIFIED && err < E_UNSPECIFIED + (int)(sizeof(messages) / sizeof(messages[0]))) {
+        return messages[err - E_UNSPECIFIED];
     }
+    // some calls return -errno, the file operations errno
+    return strerror(err < 0 ? -err : err);
+}
+
+/*
+ * Subvolumes are not deleted inline: they are renamed to a unique
+ * reap_<pid>_<n> name and handed to a background thread that destroys
+ * them in batches at a limited rate. The reaper is shared by all contexts
+ * of the process and owns a duplicate of each parent fd, so a context can
+ * be closed while its subvolumes are still queued.
+ */
+struct reaper_entry {
+    int parent_fd;
+    char name[BTRFS_VOL_NAME_MAX+1];
+};
 
-    //puts("libbtrfstrans: Going to delete 'ro_snap_X'. Ok?");
-    //getchar();
+static pthread_mutex_t reaper_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reaper_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t reaper_idle_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t reaper_thread;
+static int reaper_running;
+static int reaper_stopping;
+static unsigned int reaper_rate = BTRFSTRANS_REAPER_DEFAULT_RATE;
+static struct reaper_entry reaper_queue[BTRFSTRANS_REAPER_QUEUE_LEN];
+static int reaper_head;
+static int reaper_len;
+static int reaper_in_flight;
+static unsigned int reap_counter;
+
+// numbers the writable snapshots of optimistic transactions, atomic
+static unsigned int tx_counter;
+// numbers savepoint subvolumes, atomic
+static unsigned int savepoint_counter;
 
-    ret = delete_subvolume(specific_readonly_sv_path);
-    if (ret) {
-        fprintf(stderr, "ERROR: couldn't delete subvolume %s to commit the\
-            transaction\n", head_old_subvolume_path);
-        state = STATE_ERROR;
-        return ret;
-    }
+/*
+ * Pessimistic write transactions with a lease, in no particular order. A
+ * single thread per process revokes the expired ones.
+ */
+static pthread_mutex_t lease_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t lease_cond;
+static pthread_t lease_thread;
+static int lease_running;
+static btrfstrans_txn* lease_list;
 
+/*
+ * The original API below works on one implicit context and transaction
+ * per process and is not thread-safe; state only describes that pair.
+ * Settings made before init_libbtrfstrans() are applied to the context
+ * once it is opened.
+ */
+static btrfstrans_ctx* legacy_ctx;
+static btrfstrans_txn* legacy_txn;
+static int state = STATE_UNINITIALIZED;
+static int legacy_mode = BTRFSTRANS_MODE_PESSIMISTIC;
+static int legacy_durability = BTRFSTRANS_DURABILITY_SYNCFS;
+static int legacy_prewarm;
+static char legacy_spool_path[PATH_MAX];
+static int legacy_write_lease_ms;
+static int legacy_journal_files = BTRFSTRANS_JOURNAL_DEFAULT_FILES;
 
-    //release_ro_sem();
 
-    state = STATE_INITIALIZED;
-    return SUCCESS;
-}
+// --------------------------------------------------------
 
-static int acquire_write_lock() {
-    //printf("libbtrfstrans: Acquiring write lock\n");
-    sem_lock = sem_open(BTRFSTRANS_LOCK_SEM_NAME, O_CREAT, 0644, 1); /* open or create semaphore */
-    if (sem_lock == SEM_FAILED) {
-        fprintf(stderr, "ERROR in %s (sem_open()) = %d\n", __func__, errno);
-        state = STATE_ERROR;
-        return errno;
-    }
 
-    int ret = sem_wait(sem_lock);
-    if (ret != 0) {
-        fprintf(stderr, "ERROR in %s, (sem_wait()) = %d\n", __func__, ret);
-        state = STATE_ERROR;
-        return ret;
-    }
-    return SUCCESS;
+/*
+ * Opens the transactional volume rooted at path, setting it up if it is
+ * empty, and returns a new context in *ctx.
+ */
+int btrfstrans_ctx_open(const char* path, btrfstrans_ctx** ctx) {
+    return open_ctx(path, NULL, ctx);
 }
 
-static int release_write_lock(){
-    //printf("libbtrfstrans: Releasing write lock\n");
+/*
+ * Opens the domain named domain of the volume rooted at root, creating it
+ * if it doesn't exist yet. Every domain has its own head, snapshots,
+ * txlog and locks, so transactions on different domains don't wait for
+ * each other; btrfstrans_multi_begin() spans several of them.
+ */
+int btrfstrans_ctx_open_domain(const char* root, const char* domain, btrfstrans_ctx** ctx) {
+    char path[PATH_MAX];
+    size_t len = strlen(domain);
 
-    int ret = sem_post(sem_lock);
-    if (ret != 0) {
-        fprintf(stderr, "ERROR in %s (sem_post())= %d\n", __func__, ret);
-        state = STATE_ERROR;
-        return ret;
+    *ctx = NULL;
+
+    if (len == 0 || len > BTRFSTRANS_DOMAIN_NAME_MAX || strspn(domain,
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789_-") != len) {
+        log_error("invalid domain name '%s'", domain);
+        return E_INVALIDNAME;
     }
 
-    ret = sem_close(sem_lock);
-    if (ret != 0) {
-        fprintf(stderr, "ERROR in %s (sem_close())= %d\n", __func__, ret);
-        state = STATE_ERROR;
-        return ret;
+    if (snprintf(path, sizeof(path), "%s%s", root, BTRFSTRANS_DOMAINS_DIR_NAME) >= (int)sizeof(path)) {
+        log_error("path of the volume root is too long");
+        return E_INVALIDNAME;
+    }
+    if (mkdir(path, 0755) && errno != EEXIST) {
+        log_error("can't create domain directory %s - %s", path, strerror(errno));
+        return E_ACCESS;
     }
 
-    // we don't delete the semaphore here: other processes may want continue to use it.
+    if (snprintf(path, sizeof(path), "%s%s/%s", root, BTRFSTRANS_DOMAINS_DIR_NAME, domain) >= (int)sizeof(path)) {
+        log_error("path of the volume root is too long");
+        return E_INVALIDNAME;
+    }
+    // an empty directory is set up like a new volume
+    if (mkdir(path, 0755) && errno != EEXIST) {
+        log_error("can't create domain %s - %s", path, strerror(errno));
+        return E_ACCESS;
+    }
 
-    return SUCCESS;
+    return open_ctx(path, domain, ctx);
 }
 
-static int wait_ro_sem() {
-    printf("Sema opening, name: %s...\n", BTRFSTRANS_READONLY_SEM_NAME);
+static int open_ctx(const char* path, const char* domain, btrfstrans_ctx** ctx) {
+    char parent[PATH_MAX];
+    btrfstrans_ctx* c;
+    int ret;
 
-    sem_t* (*sem_fnp)(const char *, int, mode_t, unsigned int);
-    sem_fnp = &sem_open;
-    if (!sem_fnp)
-        printf("Function pointer to sem_open() is %x\n.", sem_fnp);
-    else
-        printf("Function pointer to sem_open() is NULL.\n");
+    *ctx = NULL;
 
-    //sem_ro = sem_open(BTRFSTRANS_READONLY_SEM_NAME, O_CREAT, 0644, BTRFSTRANS_MAX_NUM_RO_TRANS); /* open or create semaphore */
-    if (sem_ro == SEM_FAILED) {
-        printf("Sema failed!\n");
-        fprintf(stderr, "ERROR in %s (sem_open()) = %d\n", __func__, errno);
-        state = STATE_ERROR;
-        return errno;
+    if (strlen(path) > BTRFSTRANS_ROOT_PATH_MAX) {
+        log_error("path of the volume root is too long");
+        return E_INVALIDNAME;
     }
-    printf("Sema opened!\n");
 
-    int ret = sem_wait(sem_ro);
-    if (ret != 0) {
-        fprintf(stderr, "ERROR in %s, (sem_wait()) = %d\n", __func__, ret);
-        state = STATE_ERROR;
+    c = calloc(1, sizeof(*c));
+    if (!c) {
+        log_error("can't allocate context for %s", path);
+        return E_UNSPECIFIED;
+    }
+    c->domains_fd = -1;
+    c->root_fd = -1;
+    c->ro_snaps_fd = -1;
+    c->txlog_fd = -1;
+    c->changes_fd = -1;
+    c->retained_fd = -1;
+    c->lock_fd = -1;
+    c->spool_fd = -1;
+    c->mode = BTRFSTRANS_MODE_PESSIMISTIC;
+    c->durability = BTRFSTRANS_DURABILITY_SYNCFS;
+    c->journal_files = BTRFSTRANS_JOURNAL_DEFAULT_FILES;
+    pthread_mutex_init(&c->ro_mutex, NULL);
+    pthread_mutex_init(&c->rename_mutex, NULL);
+    pthread_mutex_init(&c->retain_mutex, NULL);
+    pthread_mutex_init(&c->prewarm_mutex, NULL);
+    pthread_cond_init(&c->prewarm_cond, NULL);
+    pthread_mutex_init(&c->export_mutex, NULL);
+    pthread_cond_init(&c->export_cond, NULL);
+    pthread_cond_init(&c->export_idle_cond, NULL);
+
+    create_path_vars(c, path);
+
+    // every domain has its own segment, and so its own locks
+    if (domain) {
+        strcpy(c->domain, domain);
+        snprintf(parent, sizeof(parent), "%s/..", path);
+        c->domains_fd = open(parent, O_RDONLY | O_DIRECTORY);
+        if (c->domains_fd < 0) {
+            log_error("can't open %s - %s", parent, strerror(errno));
+            btrfstrans_ctx_close(c);
+            return E_ACCESS;
+        }
+    }
+
+    ret = open_volume(c);
+    if (ret) {
+        btrfstrans_ctx_close(c);
         return ret;
     }
 
+    *ctx = c;
     return SUCCESS;
 }
 
+/*
+ * Closes a context. All transactions started from it must have been
+ * committed, aborted or ended before.
+ */
+int btrfstrans_ctx_close(btrfstrans_ctx* ctx) {
+    if (!ctx) {
+        return SUCCESS;
+    }
 
+    stop_prewarm(ctx);
+    stop_export(ctx);
 
-static int release_ro_sem() {
-    int ret = sem_post(sem_ro);
-    if (ret != 0) {
-        fprintf(stderr, "ERROR in %s (sem_post())= %d\n", __func__, ret);
-        state = STATE_ERROR;
-        return ret;
+    if (ctx->spool_fd >= 0) {
+        close(ctx->spool_fd);
     }
-
-    ret = sem_close(sem_ro);
-    if (ret != 0) {
-        fprintf(stderr, "ERROR in %s (sem_close())= %d\n", __func__, ret);
-        state = STATE_ERROR;
-        return ret;
+    if (ctx->domains_fd >= 0) {
+        close(ctx->domains_fd);
     }
-
-    // we don't delete the semaphore here: other processes may want continue to use it.
-
-
-    return SUCCESS;
-}
-
-static int wait_rename_sem() {
-    sem_rename = sem_open(BTRFSTRANS_RENAME_SEM_NAME, O_CREAT, 0644, 1); /* open or create
-                                                                            aphore */
-    if (sem_rename == SEM_FAILED) {
-        fprintf(stderr, "ERROR in %s (sem_open()) = %d\n", __func__, errno);
-        state = STATE_ERROR;
-        return errno;
+    if (ctx->root_fd >= 0) {
+        close(ctx->root_fd);
+    }
+    if (ctx->ro_snaps_fd >= 0) {
+        close(ctx->ro_snaps_fd);
+    }
+    if (ctx->txlog_fd >= 0) {
+        close(ctx->txlog_fd);
+    }
+    if (ctx->changes_fd >= 0) {
+        close(ctx->changes_fd);
+    }
+    if (ctx->retained_fd >= 0) {
+        close(ctx->retained_fd);
     }
 
-    int ret = sem_wait(sem_rename);
-    if (ret != 0) {
-        fprintf(stderr, "ERROR in %s, (sem_wait()) = %d\n", __func__, ret);
-        state = STATE_ERROR;
-        return ret;
+    if (ctx->lock_fd >= 0) {
+        close(ctx->lock_fd);
+    }
+    if (ctx->shm) {
+        munmap(ctx->shm, sizeof(struct btrfstrans_shm));
     }
 
+    pthread_mutex_destroy(&ctx->ro_mutex);
+    pthread_mutex_destroy(&ctx->rename_mutex);
+    pthread_mutex_destroy(&ctx->retain_mutex);
+    pthread_mutex_destroy(&ctx->prewarm_mutex);
+    pthread_cond_destroy(&ctx->prewarm_cond);
+    pthread_mutex_destroy(&ctx->export_mutex);
+    pthread_cond_destroy(&ctx->export_cond);
+    pthread_cond_destroy(&ctx->export_idle_cond);
+    free(ctx);
     return SUCCESS;
 }
 
+// code from cmd_subvol_get_default() from btrfs progs cmds-subvolume.c
+int init_libbtrfstrans(const char* path) {
+    int ret;
 
-
-static int release_rename_sem() {
-    int ret = sem_post(sem_rename);
-    if (ret != 0) {
-        fprintf(stderr, "ERROR in %s (sem_post())= %d\n", __func__, ret);
+    if ( state != STATE_UNINITIALIZED ) {
+        log_error("libbtrfstrans was already initialized");
         state = STATE_ERROR;
-        return ret;
+        return E_WRONGSTATE;
     }
 
-    ret = sem_close(sem_rename);
-    if (ret != 0) {
-        fprintf(stderr, "ERROR in %s (sem_close())= %d\n", __func__, ret);
+    log_info("initializing library for %s", path);
+    //signal(SIGABRT, signal_callback_handler);
+    //signal(SIGFPE, signal_callback_handler);
+    //signal(SIGILL, signal_callback_handler);
+    //signal(SIGINT, signal_callback_handler);
+    //signal(SIGSEGV, signal_callback_handler);
+    //signal(SIGTERM, signal_callback_handler);
+
+    ret = btrfstrans_ctx_open(path, &legacy_ctx);
+    if (ret) {
         state = STATE_ERROR;
         return ret;
     }
 
-    // we don't delete the semaphore here: other processes may want continue to use it.
+    btrfstrans_ctx_set_mode(legacy_ctx, legacy_mode);
+    btrfstrans_ctx_set_durability(legacy_ctx, legacy_durability);
+    btrfstrans_ctx_set_prewarm(legacy_ctx, legacy_prewarm);
+    if (legacy_spool_path[0]) {
+        btrfstrans_ctx_set_spool(legacy_ctx, legacy_spool_path);
+    }
+    btrfstrans_ctx_set_write_lease(legacy_ctx, legacy_write_lease_ms);
+    btrfstrans_ctx_set_journal_files(legacy_ctx, legacy_journal_files);
 
+    state = STATE_INITIALIZED;
     return SUCCESS;
 }
 
 /*
-  these functions redefined here from btrfs-progs. There is some linker error
-  and hence this ugly way out is done */
-
+ * Opens the volume root and brings it into a consistent state.
+ */
+static int open_volume(btrfstrans_ctx* ctx) {
+    ctx->root_fd = open(ctx->root_path, O_RDONLY | O_DIRECTORY);
+    if (ctx->root_fd < 0) {
+        log_error("can't open %s - %s", ctx->root_path, strerror(errno));
+        return E_ACCESS;
+    }
+
+    if (mkdir(ctx->txlog_path, 0755) && errno != EEXIST) {
+        log_error("can't create commit log directory %s", ctx->txlog_path);
+        return E_ACCESS;
+    }
+
+    ctx->txlog_fd = open(ctx->txlog_path, O_RDONLY | O_DIRECTORY);
+    if (ctx->txlog_fd < 0) {
+        log_error("can't open commit log directory %s", ctx->txlog_path);
+        return E_ACCESS;
+    }
+
+    if (mkdirat(ctx->root_fd, BTRFSTRANS_RETAINED_NAME, 0755) && errno != EEXIST) {
+        log_error("can't create directory %s/%s", ctx->root_path, BTRFSTRANS_RETAINED_NAME);
+        return E_ACCESS;
+    }
+    ctx->retained_fd = openat(ctx->root_fd, BTRFSTRANS_RETAINED_NAME, O_RDONLY | O_DIRECTORY);
+    if (ctx->retained_fd < 0) {
+        log_error("can't open directory %s/%s", ctx->root_path, BTRFSTRANS_RETAINED_NAME);
+        return E_ACCESS;
+    }
+
+    if (!exists_one_of(ctx->head_subvolume_path, ctx->head_old_subvolume_path,\
+        ctx->readonly_subvolumes_path)) { //subvolume is empty
+        int ret = create_initial_subvolumes(ctx);
+        if (ret){
+            return ret;
+        }
+        log_info("created the initial subvolumes of %s", ctx->root_path);
+        return finish_init(ctx);
+    }
+
+    // 'head_old' is only left behind by versions of the library that
+    // swapped heads with two renames: without 'head' it is the last
+    // committed head, next to 'head' it is the one before
+    if (exists(ctx->head_old_subvolume_path)) {
+        if (!exists(ctx->head_subvolume_path)) {
+            if (rename(ctx->head_old_subvolume_path, ctx->head_subvolume_path)) {
+                log_error("renaming %s to %s",
+                ctx->head_old_subvolume_path, ctx->head_subvolume_path);
+                return E_RENAME;
+            }
+            log_warn("head_old exists and head doesn't, renaming");
+        } else if (reap_subvolume(ctx->root_fd, BTRFSTRANS_HEAD_OLD_NAME)) {
+            return E_DELETE;
+        }
+    }
+
+    if (!exists(ctx->head_subvolume_path)) {
+        log_error("%s has no head subvolume", ctx->root_path);
+        return E_CORRUPT;
+    }
+
+    if (!exists(ctx->readonly_subvolumes_path) && create_subvolume(ctx->readonly_subvolumes_path)) {
+        log_error("can't create subvolume '%s'", ctx->readonly_subvolumes_path);
+        return E_UNSPECIFIED;
+    }
+
+    log_debug("both head and ro_subvol exist, state is initialized now");
+    return finish_init(ctx);
+}
+
 /*
- * test if path is a subvolume:
- * this function return
- * 0-> path exists but it is not a subvolume
- * 1-> path exists and it is a subvolume
- * -1 -> path is unaccessible
+ * Last step of a successful open: caches the ro_snaps dirfd, opens the
+ * locks and queues subvolumes that previous processes handed to their
+ * reaper or left behind when they died.
  */
-int test_issubvolume(const char *path) {// from btrfs progs: cmds-subvolume.c
-    struct stat st;
-    int res;
+static int finish_init(btrfstrans_ctx* ctx) {
+    ctx->ro_snaps_fd = open(ctx->readonly_subvolumes_path, O_RDONLY | O_DIRECTORY);
+    if (ctx->ro_snaps_fd < 0) {
+        log_error("can't open %s - %s", ctx->readonly_subvolumes_path, strerror(errno));
+        return E_ACCESS;
+    }
 
-    res = stat(path, &st);
-    if(res < 0 )
-        return -1;
+    if (shm_name_of(ctx) || open_shm(ctx)) {
+        return E_ACCESS;
+    }
 
-    return (st.st_ino == 256) && S_ISDIR(st.st_mode);
+    ctx->lock_fd = shm_open(ctx->shm_name, O_RDWR, 0);
+    if (ctx->lock_fd < 0) {
+        log_error("%s (shm_open()) = %d", __func__, errno);
+        return E_ACCESS;
+    }
+
+    // a commit interrupted by a crash of the whole machine; after a crash
+    // of a process the next holder of the rename lock does it
+    if (acquire_rename_lock(ctx) == SUCCESS) {
+        recover_journal(ctx);
+        recover_intent(ctx);
+        recover_groups(ctx);
+        release_rename_lock(ctx);
+    }
+
+    reap_leftovers(ctx->root_fd);
+    reap_leftovers(ctx->ro_snaps_fd);
+    reap_leftovers(ctx->retained_fd);
+    reap_orphan_generations(ctx);
+    reap_dead_writers(ctx, 0);
+    recover_write_lock(ctx);
+
+    return SUCCESS;
+}
+
+/*
+ * Enables or disables pre-warmed writable snapshots. They only serve
+ * transactions started without the rename journal: while journal_files
+ * is > 0 none are taken, see btrfstrans_ctx_set_journal_files().
+ */
+int btrfstrans_ctx_set_prewarm(btrfstrans_ctx* ctx, int enabled) {
+    pthread_mutex_lock(&ctx->prewarm_mutex);
+    __atomic_store_n(&ctx->prewarm_enabled, enabled, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&ctx->prewarm_mutex);
+
+    if (enabled) {
+        request_prewarm(ctx);
+    }
+    return SUCCESS;
 }
 
+int btrfstrans_set_prewarm(int enabled) {
+    legacy_prewarm = enabled;
+    return legacy_ctx ? btrfstrans_ctx_set_prewarm(legacy_ctx, enabled) : SUCCESS;
+}
 
 /*
- * test if path is a directory
- * this function return
- * 0-> path exists but it is not a directory
- * 1-> path exists and it is a directory
- * -1 -> path is unaccessible
+ * Sets up to how many files transactions started from now on commit
+ * through the rename journal; 0 turns it off.
  */
-int test_isdir(const char *path) {// from btrfs progs: cmds-subvolume.c
-    struct stat st;
-    int res;
+int btrfstrans_ctx_set_journal_files(btrfstrans_ctx* ctx, int max_files) {
+    if (max_files < 0 || max_files > BTRFSTRANS_JOURNAL_MAX_FILES) {
+        log_error("the rename journal takes 0 to %d files, not %d", BTRFSTRANS_JOURNAL_MAX_FILES, max_files);
+        return E_UNSPECIFIED;
+    }
 
-    res = stat(path, &st);
-    if(res < 0 )
-        return -1;
+    __atomic_store_n(&ctx->journal_files, max_files, __ATOMIC_RELAXED);
+    if (max_files == 0) {
+        // pre-warming was idle while the journal was on
+        request_prewarm(ctx);
+    }
+    return SUCCESS;
+}
 
-    return S_ISDIR(st.st_mode);
+int btrfstrans_set_journal_files(int max_files) {
+    if (legacy_ctx) {
+        return btrfstrans_ctx_set_journal_files(legacy_ctx, max_files);
+    }
+    if (max_files < 0 || max_files > BTRFSTRANS_JOURNAL_MAX_FILES) {
+        log_error("the rename journal takes 0 to %d files, not %d", BTRFSTRANS_JOURNAL_MAX_FILES, max_files);
+        return E_UNSPECIFIED;
+    }
+
+    legacy_journal_files = max_files;
+    return SUCCESS;
 }
 
-int open_file_or_dir3(const char *fname, DIR **dirstream, int open_flags)
-{
-	int ret;
-	struct stat st;
-	int fd;
-
-	ret = stat(fname, &st);
-	if (ret < 0) {
-		return -1;
-	}
-	if (S_ISDIR(st.st_mode)) {
-		*dirstream = opendir(fname);
-		if (!*dirstream)
-			return -1;
-		fd = dirfd(*dirstream);
-	} else if (S_ISREG(st.st_mode) || S_ISLNK(st.st_mode)) {
-		fd = open(fname, open_flags);
-	} else {
-		/*
-		 * we set this on purpose, in case the caller output
-		 * strerror(errno) as success
-		 */
-		errno = EINVAL;
-		return -1;
-	}
-	if (fd < 0) {
-		fd = -1;
-		if (*dirstream) {
-			closedir(*dirstream);
-			*dirstream = NULL;
-		}
-	}
-	return fd;
-}
-
-
-int open_file_or_dir(const char *fname, DIR **dirstream)
-{
-	return open_file_or_dir3(fname, dirstream, O_RDWR);
+static void* prewarm_main(void* arg) {
+    btrfstrans_ctx* ctx = arg;
+    unsigned long long head_seq, prewarm_seq;
+
+    pthread_mutex_lock(&ctx->prewarm_mutex);
+    for (;;) {
+        while (!ctx->prewarm_requested && !ctx->prewarm_stopping) {
+            pthread_cond_wait(&ctx->prewarm_cond, &ctx->prewarm_mutex);
+        }
+        if (ctx->prewarm_stopping) {
+            break;
+        }
+        ctx->prewarm_requested = 0;
+        if (!prewarm_wanted(ctx)) {
+            continue;
+        }
+        pthread_mutex_unlock(&ctx->prewarm_mutex);
+
+        // like begin_write(): a journal commit must not be half published in the snapshot
+        if (acquire_rename_lock(ctx) == SUCCESS) {
+            if (read_seq(ctx->root_fd, BTRFSTRANS_HEAD_NAME, &head_seq) == SUCCESS) {
+                if (exists_at(ctx->root_fd, BTRFSTRANS_PREWARM_NAME)) {
+                    // the snapshot is stale if head moved since it was taken
+                    if (read_seq(ctx->root_fd, BTRFSTRANS_PREWARM_NAME, &prewarm_seq) != SUCCESS || prewarm_seq != head_seq) {
+                        reap_subvolume(ctx->root_fd, BTRFSTRANS_PREWARM_NAME);
+                    }
+                }
+                if (!exists_at(ctx->root_fd, BTRFSTRANS_PREWARM_NAME)) {
+                    // may lose against a snapshot of another process, that's fine
+                    snapshot_at(ctx->root_fd, BTRFSTRANS_HEAD_NAME, ctx->root_fd, BTRFSTRANS_PREWARM_NAME, BTRFSTRANS_WRITABLE);
+                }
+            }
+            release_rename_lock(ctx);
+        }
+
+        pthread_mutex_lock(&ctx->prewarm_mutex);
+    }
+    pthread_mutex_unlock(&ctx->prewarm_mutex);
+
+    return NULL;
 }
 
-#define strncpy_null(dest, src) __strncpy_null(dest, src, sizeof(dest))
-char *__strncpy_null(char *dest, const char *src, size_t n)
-{
-	strncpy(dest, src, n);
-	if (n > 0)
-		dest[n - 1] = '\0';
-	return dest;
+/*
+ * Whether a snapshot in wr_prewarm can be claimed at all: begin_write()
+ * doesn't look for one when the transaction starts on the journal, and
+ * an unclaimed snapshot would only cost a snapshot under the rename lock
+ * per commit. Called with prewarm_mutex held.
+ */
+static int prewarm_wanted(btrfstrans_ctx* ctx) {
+    return ctx->prewarm_enabled && __atomic_load_n(&ctx->journal_files, __ATOMIC_RELAXED) == 0;
 }
 
+static void request_prewarm(btrfstrans_ctx* ctx) {
+    pthread_mutex_lock(&ctx->prewarm_mutex);
+    if (!prewarm_wanted(ctx) || ctx->prewarm_stopping) {
+        pthread_mutex_unlock(&ctx->prewarm_mutex);
+        return;
+    }
+    if (!ctx->prewarm_running) {
+        if (pthread_create(&ctx->prewarm_thread, NULL, prewarm_main, ctx)) {
+            pthread_mutex_unlock(&ctx->prewarm_mutex);
+            return;
+        }
+        ctx->prewarm_running = 1;
+    }
+    ctx->prewarm_requested = 1;
+    pthread_cond_signal(&ctx->prewarm_cond);
+    pthread_mutex_unlock(&ctx->prewarm_mutex);
+}
 
-int create_snapshot(const char* subvol, char* dst, int readonly, int async) // from btrfs progs: cmds-subvolume.c
-{
-    int res, retval;
-    int fd = -1, fddst = -1;
-    int len;
-    char *newname;
-    char *dstdir;
-    struct btrfs_ioctl_vol_args_v2 args;
+static void stop_prewarm(btrfstrans_ctx* ctx) {
+    pthread_mutex_lock(&ctx->prewarm_mutex);
+    ctx->prewarm_stopping = 1;
+    if (!ctx->prewarm_running) {
+        pthread_mutex_unlock(&ctx->prewarm_mutex);
+        return;
+    }
+    pthread_cond_signal(&ctx->prewarm_cond);
+    pthread_mutex_unlock(&ctx->prewarm_mutex);
 
-    memset(&args, 0, sizeof(args));
+    pthread_join(ctx->prewarm_thread, NULL);
+}
 
-    //printf("libbtrfstrans: create_snapshot(): subvol = %s, dst = %s, readonly = %d\n", subvol, dst, readonly);
+/*
+ * Incremental export. After every commit the exporter thread snapshots
+ * head read-only as send_<seq> and writes a send stream of it against the
+ * previous send_<seq> into the spool directory, as <parent>-<seq>.btrfs
+ * (parent 0: a full stream), then drops the previous snapshot. Each stream
+ * holds what changed since its parent only, and 'btrfs receive' of the
+ * streams in name order replays the history on another volume. Commits
+ * made while an export runs are folded into the next stream.
+ *
+ * Exporters of all processes take turns by flock() on the spool
+ * directory. The newest stream in it names the parent; other send_*
+ * snapshots were left by an exporter that died and are reaped.
+ */
+static unsigned long long last_exported(int spool_fd) {
+    unsigned long long from, to, last = 0;
+    struct dirent* de;
+    DIR* dir;
+    int fd, n;
+
+    fd = dup(spool_fd);
+    dir = fd < 0 ? NULL : fdopendir(fd);
+    if (!dir) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return 0;
+    }
+    // the offset is shared with spool_fd
+    rewinddir(dir);
+    while ((de = readdir(dir))) {
+        if (sscanf(de->d_name, "%llu-%llu" BTRFSTRANS_STREAM_SUFFIX "%n", &from, &to, &n) == 2 &&
+            de->d_name[n] == '\0' && to > last) {
+            last = to;
+        }
+    }
+    closedir(dir);
+    return last;
+}
 
-    retval = E_UNSPECIFIED; /* failure */
-    res = test_issubvolume(subvol);
-    if (res < 0) {
-        fprintf(stderr, "ERROR: error accessing '%s'\n", subvol);
-        retval = E_ACCESS;
-        goto out;
+// reaps all send_* snapshots but the one of keep_seq
+static void reap_send_snapshots(btrfstrans_ctx* ctx, unsigned long long keep_seq) {
+    size_t prefix_len = strlen(LIBBTRFSTRANS_SEND_SNAP_NAME_PREFIX);
+    char keep[64];
+    struct dirent* de;
+    DIR* dir;
+    int fd;
+
+    snprintf(keep, sizeof(keep), "%s%llu", LIBBTRFSTRANS_SEND_SNAP_NAME_PREFIX, keep_seq);
+
+    fd = dup(ctx->root_fd);
+    dir = fd < 0 ? NULL : fdopendir(fd);
+    if (!dir) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
     }
-    if (!res) {
-        fprintf(stderr, "ERROR: '%s' is not a subvolume\n", subvol);
-        retval = E_NOTASUBVOLUME;
-        goto out;
+    rewinddir(dir);
+    while ((de = readdir(dir))) {
+        if (!strncmp(de->d_name, LIBBTRFSTRANS_SEND_SNAP_NAME_PREFIX, prefix_len) && strcmp(de->d_name, keep)) {
+            reap_subvolume(ctx->root_fd, de->d_name);
+        }
     }
+    closedir(dir);
+}
 
-    res = test_isdir(dst);
-    if (res == 0) {
-        fprintf(stderr, "ERROR: '%s' exists and it is not a directory\n", dst);
-        retval = E_EXISTSANDNOTADIR;
-        goto out;
+/*
+ * Writes the stream of the snapshot sv_fd against the snapshot parent_fd
+ * (-1: a full stream) to out_fd.
+ */
+static int send_stream(int sv_fd, int parent_fd, int out_fd) {
+    struct btrfs_ioctl_get_subvol_info_args info;
+    struct btrfs_ioctl_send_args args;
+    __u64 parent_root;
+
+    memset(&args, 0, sizeof(args));
+    args.send_fd = out_fd;
+    if (parent_fd >= 0) {
+        if (ioctl(parent_fd, BTRFS_IOC_GET_SUBVOL_INFO, &info) < 0) {
+            log_error("can't look up the parent of the send stream - %s", strerror(errno));
+            return E_ACCESS;
+        }
+        parent_root = info.treeid;
+        // the parent is also where unchanged extents are cloned from
+        args.parent_root = parent_root;
+        args.clone_sources = &parent_root;
+        args.clone_sources_count = 1;
     }
-    if (res > 0) { //path exists and is directory
-        newname = strdup(subvol);
-        newname = basename(newname);
-        dstdir = dst;
-    } else { //path is unaccessible
-        newname = strdup(dst);
-        newname = basename(newname);
-        dstdir = strdup(dst);
-        dstdir = dirname(dstdir);
+    if (ioctl(sv_fd, BTRFS_IOC_SEND, &args) < 0) {
+        log_error("send failed - %s", strerror(errno));
+        return E_ACCESS;
     }
+    return SUCCESS;
+}
 
-    if (!strcmp(newname, ".") || !strcmp(newname, "..") || strchr(newname, '/')) {
-        fprintf(stderr, "ERROR: incorrect snapshot name ('%s')\n", newname);
-        retval = E_INCORRECTSNAPNAME;
-        goto out;
+/*
+ * Exports head into the spool directory spool_fd, if it was committed
+ * after the last export.
+ */
+static int export_head(btrfstrans_ctx* ctx, int spool_fd) {
+    unsigned long long t = stats_now();
+    unsigned long long parent_seq, seq;
+    char parent[64], name[64], stream[96], tmp[sizeof(stream)+5];
+    int sv_fd = -1, parent_fd = -1, out_fd = -1;
+    struct stat st;
+    int ret;
+
+    if (flock(spool_fd, LOCK_EX)) {
+        log_error("can't lock the spool directory - %s", strerror(errno));
+        return E_ACCESS;
     }
 
-    len = strlen(newname);
-    if (len == 0 || len >= BTRFS_VOL_NAME_MAX) {
-        fprintf(stderr, "ERROR: snapshot name too long ('%s)\n", newname);
-        retval = E_SNAPNAMETOOLONG;
-        goto out;
+    parent_seq = last_exported(spool_fd);
+    snprintf(parent, sizeof(parent), "%s%llu", LIBBTRFSTRANS_SEND_SNAP_NAME_PREFIX, parent_seq);
+    if (parent_seq && !exists_at(ctx->root_fd, parent)) {
+        log_error("parent %s of the next send stream is gone, exporting all of head", parent);
+        parent_seq = 0;
     }
+    reap_send_snapshots(ctx, parent_seq);
 
-    DIR *dirstream;
-    fddst = open_file_or_dir(dstdir, &dirstream);
-    if (fddst < 0) {
-        fprintf(stderr, "ERROR: can't access to '%s'\n", dstdir);
-        retval = E_ACCESS;
+    // named after its sequence before sending, 'btrfs receive' creates it under that name;
+    // under the rename lock, so a journal commit is in the stream completely or not at all
+    ret = acquire_rename_lock(ctx);
+    if (ret) {
         goto out;
     }
-
-    fd = open_file_or_dir(subvol, &dirstream);
-    if (fd < 0) {
-        fprintf(stderr, "ERROR: can't access to '%s'\n", dstdir);
-        retval = E_ACCESS;
+    ret = snapshot_committed(ctx->root_fd, BTRFSTRANS_HEAD_NAME, ctx->root_fd, BTRFSTRANS_SEND_NEW_NAME);
+    release_rename_lock(ctx);
+    if (ret) {
+        goto out;
+    }
+    ret = read_seq(ctx->root_fd, BTRFSTRANS_SEND_NEW_NAME, &seq);
+    if (ret || seq == parent_seq) {
+        // nothing committed since the last export
+        reap_subvolume(ctx->root_fd, BTRFSTRANS_SEND_NEW_NAME);
+        goto out;
+    }
+    snprintf(name, sizeof(name), "%s%llu", LIBBTRFSTRANS_SEND_SNAP_NAME_PREFIX, seq);
+    if (renameat(ctx->root_fd, BTRFSTRANS_SEND_NEW_NAME, ctx->root_fd, name)) {
+        log_error("can't rename %s to %s - %s", BTRFSTRANS_SEND_NEW_NAME, name, strerror(errno));
+        reap_subvolume(ctx->root_fd, BTRFSTRANS_SEND_NEW_NAME);
+        ret = E_RENAME;
         goto out;
     }
 
-    if (readonly) {
-        args.flags |= BTRFS_SUBVOL_RDONLY;
-        //printf("libbtrfstrans: Create a readonly snapshot of '%s' in '%s/%s'\n", subvol, dstdir, newname);
+    snprintf(stream, sizeof(stream), "%020llu-%020llu" BTRFSTRANS_STREAM_SUFFIX, parent_seq, seq);
+    snprintf(tmp, sizeof(tmp), ".%s.tmp", stream);
+    sv_fd = openat(ctx->root_fd, name, O_RDONLY | O_DIRECTORY);
+    parent_fd = parent_seq ? openat(ctx->root_fd, parent, O_RDONLY | O_DIRECTORY) : -1;
+    out_fd = openat(spool_fd, tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (sv_fd < 0 || (parent_seq && parent_fd < 0) || out_fd < 0) {
+        log_error("can't set up send stream %s - %s", stream, strerror(errno));
+        ret = E_ACCESS;
     } else {
-        //printf("libbtrfstrans: Create a snapshot of '%s' in '%s/%s'\n", subvol, dstdir, newname);
+        ret = send_stream(sv_fd, parent_fd, out_fd);
     }
 
-    if (async != 0) {
-        args.flags |= BTRFS_SUBVOL_CREATE_ASYNC;
+    // the stream must be complete on disk before it counts as exported
+    if (!ret && (fsync(out_fd) || renameat(spool_fd, tmp, spool_fd, stream) || fsync(spool_fd))) {
+        log_error("can't store send stream %s - %s", stream, strerror(errno));
+        ret = E_ACCESS;
+    }
+    if (ret) {
+        unlinkat(spool_fd, tmp, 0);
+        reap_subvolume(ctx->root_fd, name);
+        goto out;
     }
 
+    if (!fstat(out_fd, &st)) {
+        stats_add(BTRFSTRANS_COUNTER_EXPORT_BYTES, st.st_size);
+    }
+    // the new snapshot is the parent from now on
+    if (parent_seq) {
+        reap_subvolume(ctx->root_fd, parent);
+    }
+    stats_record(BTRFSTRANS_PHASE_EXPORT, t);
 
-    args.fd = fd;
+out:
+    if (out_fd >= 0) {
+        close(out_fd);
+    }
+    if (parent_fd >= 0) {
+        close(parent_fd);
+    }
+    if (sv_fd >= 0) {
+        close(sv_fd);
+    }
+    flock(spool_fd, LOCK_UN);
+    return ret;
+}
 
-    strncpy_null(args.name, newname);
-    printf("Creating the snapshot\n");
+static void* export_main(void* arg) {
+    btrfstrans_ctx* ctx = arg;
+    int spool_fd;
 
-    res = ioctl(fddst, BTRFS_IOC_SNAP_CREATE_V2, &args);
+    pthread_mutex_lock(&ctx->export_mutex);
+    for (;;) {
+        // a context being closed still exports its last commit
+        while (!ctx->export_requested && !ctx->export_stopping) {
+            pthread_cond_wait(&ctx->export_cond, &ctx->export_mutex);
+        }
+        if (!ctx->export_requested) {
+            break;
+        }
+        ctx->export_requested = 0;
+        spool_fd = ctx->spool_fd < 0 ? -1 : dup(ctx->spool_fd);
+        ctx->export_busy = 1;
+        pthread_mutex_unlock(&ctx->export_mutex);
+
+        if (spool_fd >= 0) {
+            export_head(ctx, spool_fd);
+            close(spool_fd);
+        }
 
-    if (res < 0) {
-        fprintf( stderr, "ERROR: cannot snapshot '%s' - %s\n", subvol, strerror(errno));
-        goto out;
+        pthread_mutex_lock(&ctx->export_mutex);
+        ctx->export_busy = 0;
+        pthread_cond_broadcast(&ctx->export_idle_cond);
     }
+    pthread_mutex_unlock(&ctx->export_mutex);
 
-    retval = SUCCESS;
+    return NULL;
+}
 
-out:
-    if (fd != -1) {
-        close(fd);
+static void request_export(btrfstrans_ctx* ctx) {
+    pthread_mutex_lock(&ctx->export_mutex);
+    if (ctx->spool_fd < 0 || ctx->export_stopping) {
+        pthread_mutex_unlock(&ctx->export_mutex);
+        return;
     }
-    if (fddst != -1) {
-        close(fddst);
+    if (!ctx->export_running) {
+        if (pthread_create(&ctx->export_thread, NULL, export_main, ctx)) {
+            pthread_mutex_unlock(&ctx->export_mutex);
+            return;
+        }
+        ctx->export_running = 1;
     }
+    ctx->export_requested = 1;
+    pthread_cond_signal(&ctx->export_cond);
+    pthread_mutex_unlock(&ctx->export_mutex);
+}
 
-    return retval;
+static void stop_export(btrfstrans_ctx* ctx) {
+    pthread_mutex_lock(&ctx->export_mutex);
+    ctx->export_stopping = 1;
+    if (!ctx->export_running) {
+        pthread_mutex_unlock(&ctx->export_mutex);
+        return;
+    }
+    pthread_cond_signal(&ctx->export_cond);
+    pthread_mutex_unlock(&ctx->export_mutex);
+
+    pthread_join(ctx->export_thread, NULL);
 }
 
+/*
+ * Exports every committed generation as an incremental send stream into
+ * the directory spool_path, see export_head(); NULL turns it off. Only one
+ * spool directory per volume: they would share the parent snapshots.
+ */
+int btrfstrans_ctx_set_spool(btrfstrans_ctx* ctx, const char* spool_path) {
+    int fd = -1;
+
+    if (spool_path) {
+        fd = open(spool_path, O_RDONLY | O_DIRECTORY);
+        if (fd < 0) {
+            log_error("can't open spool directory %s - %s", spool_path, strerror(errno));
+            return E_ACCESS;
+        }
+    }
 
-int create_subvolume(const char* dst) // from btrfs progs: cmds-subvolume.c
-{
-    int retval, res, len;
-    int fddst = -1;
-    char *newname;
-    char *dstdir;
-    struct btrfs_qgroup_inherit *inherit = NULL;
+    pthread_mutex_lock(&ctx->export_mutex);
+    if (ctx->spool_fd >= 0) {
+        close(ctx->spool_fd);
+    }
+    ctx->spool_fd = fd;
+    pthread_mutex_unlock(&ctx->export_mutex);
 
-    retval = E_UNSPECIFIED; /* failure */
-    res = test_isdir(dst);
-    if (res >= 0) {
-        fprintf(stderr, "ERROR: '%s' exists\n", dst);
-        goto out;
+    // catch up with the commits made without us
+    request_export(ctx);
+    return SUCCESS;
+}
+
+int btrfstrans_set_spool(const char* spool_path) {
+    if (spool_path && strlen(spool_path) >= sizeof(legacy_spool_path)) {
+        log_error("path of the spool directory is too long");
+        return E_INVALIDNAME;
     }
 
-    newname = strdup(dst);
-    newname = basename(newname);
-    dstdir = strdup(dst);
-    dstdir = dirname(dstdir);
+    if (spool_path) {
+        strcpy(legacy_spool_path, spool_path);
+    } else {
+        legacy_spool_path[0] = '\0';
+    }
+    return legacy_ctx ? btrfstrans_ctx_set_spool(legacy_ctx, spool_path) : SUCCESS;
+}
 
-    if (!strcmp(newname, ".") || !strcmp(newname, "..") || strchr(newname, '/') ) {
-        fprintf(stderr, "ERROR: incorrect subvolume name ('%s')\n", newname);
-        retval = E_INCORRECTSVNAME;
-        goto out;
+/*
+ * Waits until the commits made through ctx so far are exported.
+ */
+int btrfstrans_ctx_flush_spool(btrfstrans_ctx* ctx) {
+    pthread_mutex_lock(&ctx->export_mutex);
+    while (ctx->export_running && (ctx->export_requested || ctx->export_busy)) {
+        pthread_cond_wait(&ctx->export_idle_cond, &ctx->export_mutex);
     }
+    pthread_mutex_unlock(&ctx->export_mutex);
+    return SUCCESS;
+}
 
-    len = strlen(newname);
-    if (len == 0 || len >= BTRFS_VOL_NAME_MAX) {
-        fprintf(stderr, "ERROR: subvolume name too long ('%s)\n", newname);
-        retval = E_SVNAMETOOLONG;
-        goto out;
+int btrfstrans_flush_spool() {
+    if (!legacy_ctx) {
+        log_error("libbtrfstrans was not configured");
+        return E_WRONGSTATE;
     }
+    return btrfstrans_ctx_flush_spool(legacy_ctx);
+}
 
-    DIR *dirstream;
-    fddst = open_file_or_dir(dstdir, &dirstream);
-    if (fddst < 0) {
-        fprintf(stderr, "ERROR: can't access to '%s'\n", dstdir);
-        retval = E_ACCESS;
-        goto out;
+/*
+ * Retention: with a policy set, a commit doesn't reap the head it
+ * replaced but moves it to retained/<seq>, and after the commit it is
+ * made read-only and stamped with the time it stopped being head. A
+ * generation is kept while it is one of the last keep ones or was head
+ * less than seconds ago; 0 turns the rule off. The policy is an xattr of
+ * the volume root, since the commits of all processes prune. Commits that
+ * recovery completes after a crash don't retain the head they replaced.
+ */
+struct retention {
+    int keep;
+    long long seconds;
+};
+
+// 0 if retention is on for the volume
+static int read_retention(btrfstrans_ctx* ctx, struct retention* r) {
+    char buf[64];
+    ssize_t len;
+
+    len = fgetxattr(ctx->root_fd, BTRFSTRANS_RETENTION_XATTR, buf, sizeof(buf) - 1);
+    if (len <= 0) {
+        return 1;
     }
+    buf[len] = '\0';
+    if (sscanf(buf, "%d %lld", &r->keep, &r->seconds) != 2) {
+        return 1;
+    }
+    return r->keep > 0 || r->seconds > 0 ? 0 : 1;
+}
+
+/*
+ * Sets the retention policy of the volume; keep = seconds = 0 turns
+ * retention off and drops all retained generations.
+ */
+int btrfstrans_ctx_set_retention(btrfstrans_ctx* ctx, int keep, long long seconds) {
+    char buf[64];
+    int len;
+
+    if (keep < 0 || seconds < 0) {
+        log_error("invalid retention %d generations, %lld seconds", keep, seconds);
+        return E_UNSPECIFIED;
+    }
+
+    if (keep == 0 && seconds == 0) {
+        if (fremovexattr(ctx->root_fd, BTRFSTRANS_RETENTION_XATTR) && errno != ENODATA) {
+            log_error("can't remove retention policy - %s", strerror(errno));
+            return E_ACCESS;
+        }
+    } else {
+        len = snprintf(buf, sizeof(buf), "%d %lld", keep, seconds);
+        if (fsetxattr(ctx->root_fd, BTRFSTRANS_RETENTION_XATTR, buf, len, 0)) {
+            log_error("can't write retention policy - %s", strerror(errno));
+            return E_ACCESS;
+        }
+    }
+
+    prune_retained(ctx);
+    return SUCCESS;
+}
+
+int btrfstrans_set_retention(int keep, long long seconds) {
+    if (!legacy_ctx) {
+        log_error("libbtrfstrans was not configured");
+        return E_WRONGSTATE;
+    }
+    return btrfstrans_ctx_set_retention(legacy_ctx, keep, seconds);
+}
+
+/*
+ * Moves the old head, which now carries the name of the snapshot and has
+ * sequence number seq, to retained/ if the policy asks for it and to the
+ * reaper otherwise, so the name is free before the next writer may need
+ * it, and before the commit record that describes it goes away.
+ */
+static void retire_old_head(btrfstrans_txn* txn, unsigned long long seq) {
+    btrfstrans_ctx* ctx = txn->ctx;
+    struct retention r;
+    char name[32];
+
+    if (read_retention(ctx, &r) == SUCCESS) {
+        snprintf(name, sizeof(name), "%llu", seq);
+        if (!renameat(ctx->root_fd, txn->writable_subvolume_name, ctx->retained_fd, name)) {
+            return;
+        }
+        log_error("can't retain generation %llu - %s", seq, strerror(errno));
+    }
+
+    if (reap_subvolume(ctx->root_fd, txn->writable_subvolume_name)) {
+        log_error("couldn't retire old head %s after committing the transaction", txn->writable_subvolume_path);
+    }
+}
+
+// makes retained/<name> read-only and stamps it; 0 and *retired on success
+static int finalize_retained(btrfstrans_ctx* ctx, const char* name, long long* retired) {
+    char buf[32];
+    ssize_t len;
+    int fd, ret = SUCCESS;
+
+    fd = openat(ctx->retained_fd, name, O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        return E_ACCESS;
+    }
+
+    len = fgetxattr(fd, BTRFSTRANS_RETIRED_XATTR, buf, sizeof(buf) - 1);
+    if (len > 0) {
+        buf[len] = '\0';
+        *retired = atoll(buf);
+        close(fd);
+        return SUCCESS;
+    }
+
+    *retired = time(NULL);
+    len = snprintf(buf, sizeof(buf), "%lld", *retired);
+    if (fsetxattr(fd, BTRFSTRANS_RETIRED_XATTR, buf, len, 0) || seal_snapshot(fd)) {
+        ret = E_ACCESS;
+    }
+    if (ret) {
+        log_error("can't make retained generation %s read-only - %s", name, strerror(errno));
+    }
+    close(fd);
+    return ret;
+}
+
+struct retained_gen {
+    unsigned long long seq;
+    long long retired;
+};
+
+static int cmp_retained_desc(const void* a, const void* b) {
+    const struct retained_gen* x = a;
+    const struct retained_gen* y = b;
+
+    return x->seq > y->seq ? -1 : x->seq < y->seq;
+}
+
+/*
+ * Returns the retained generations, newest first, in *gens (to be freed)
+ * and finalizes the ones a commit or a crash left unfinished.
+ */
+static int list_retained(btrfstrans_ctx* ctx, struct retained_gen** gens) {
+    struct retained_gen* v = NULL;
+    struct retained_gen* tmp;
+    struct dirent* de;
+    int n = 0, cap = 0;
+    char* end;
+    DIR* dir;
+    int fd;
+
+    *gens = NULL;
+    fd = dup(ctx->retained_fd);
+    dir = fd < 0 ? NULL : fdopendir(fd);
+    if (!dir) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    rewinddir(dir);
+
+    while ((de = readdir(dir))) {
+        unsigned long long seq = strtoull(de->d_name, &end, 10);
+
+        if (*end || end == de->d_name) {
+            continue;
+        }
+        if (n == cap) {
+            cap = cap ? 2 * cap : 64;
+            tmp = realloc(v, cap * sizeof(*v));
+            if (!tmp) {
+                break;
+            }
+            v = tmp;
+        }
+        v[n].seq = seq;
+        if (finalize_retained(ctx, de->d_name, &v[n].retired) == SUCCESS) {
+            n++;
+        }
+    }
+    closedir(dir);
+
+    qsort(v, n, sizeof(*v), cmp_retained_desc);
+    *gens = v;
+    return n;
+}
+
+/*
+ * Reaps the retained generations the policy doesn't keep anymore. One
+ * process at a time; the others skip it, whatever they would reap is
+ * reaped by this one or the next commit.
+ */
+static void prune_retained(btrfstrans_ctx* ctx) {
+    struct retention r = { 0, 0 };
+    struct retained_gen* gens;
+    long long now = time(NULL);
+    char name[32];
+    int n;
+
+    if (pthread_mutex_trylock(&ctx->retain_mutex)) {
+        return;
+    }
+    if (flock(ctx->retained_fd, LOCK_EX | LOCK_NB)) {
+        pthread_mutex_unlock(&ctx->retain_mutex);
+        return;
+    }
+
+    read_retention(ctx, &r);
+    n = list_retained(ctx, &gens);
+    for (int i = 0; i < n; i++) {
+        if ((r.keep > 0 && i < r.keep) || (r.seconds > 0 && now - gens[i].retired < r.seconds)) {
+            continue;
+        }
+        snprintf(name, sizeof(name), "%llu", gens[i].seq);
+        reap_subvolume(ctx->retained_fd, name);
+    }
+    free(gens);
+
+    flock(ctx->retained_fd, LOCK_UN);
+    pthread_mutex_unlock(&ctx->retain_mutex);
+}
+
+/*
+ * Calls fn for every retained generation, newest first, with the time it
+ * stopped being head. A non-zero return of fn stops and is returned.
+ */
+int btrfstrans_ctx_list_retained(btrfstrans_ctx* ctx, btrfstrans_generation_fn fn, void* arg) {
+    struct retained_gen* gens;
+    int n, ret = SUCCESS;
+
+    n = list_retained(ctx, &gens);
+    if (n < 0) {
+        log_error("can't read retained generations of %s", ctx->root_path);
+        return E_ACCESS;
+    }
+    for (int i = 0; i < n && !ret; i++) {
+        ret = fn(gens[i].seq, gens[i].retired, arg);
+    }
+    free(gens);
+    return ret;
+}
+
+int btrfstrans_list_retained(btrfstrans_generation_fn fn, void* arg) {
+    if (!legacy_ctx) {
+        log_error("libbtrfstrans was not configured");
+        return E_WRONGSTATE;
+    }
+    return btrfstrans_ctx_list_retained(legacy_ctx, fn, arg);
+}
+
+/*
+ * Takes over wr_prewarm as the writable snapshot of the transaction. The
+ * rename is atomic, so only one thread or process can claim it. A
+ * snapshot of an outdated head is reaped and E_WRONGSTATE is returned.
+ */
+static int claim_prewarmed(btrfstrans_txn* txn) {
+    int root_fd = txn->ctx->root_fd;
+    unsigned long long head_seq;
+
+    if (renameat(root_fd, BTRFSTRANS_PREWARM_NAME, root_fd, txn->writable_subvolume_name)) {
+        return E_ACCESS;
+    }
+
+    if (read_seq(root_fd, BTRFSTRANS_HEAD_NAME, &head_seq) != SUCCESS ||
+        read_seq(root_fd, txn->writable_subvolume_name, &txn->base_seq) != SUCCESS ||
+        head_seq != txn->base_seq) {
+        reap_subvolume(root_fd, txn->writable_subvolume_name);
+        return E_WRONGSTATE;
+    }
+
+    return SUCCESS;
+}
+
+/*
+ * Sets the concurrency mode of transactions started from now on; running
+ * transactions keep the mode they were started with.
+ */
+int btrfstrans_ctx_set_mode(btrfstrans_ctx* ctx, int new_mode) {
+    if (new_mode != BTRFSTRANS_MODE_PESSIMISTIC && new_mode != BTRFSTRANS_MODE_OPTIMISTIC) {
+        log_error("unknown transaction mode %d", new_mode);
+        return E_UNSPECIFIED;
+    }
+
+    __atomic_store_n(&ctx->mode, new_mode, __ATOMIC_RELAXED);
+    return SUCCESS;
+}
+
+int btrfstrans_set_mode(int new_mode) {
+    if (state != STATE_UNINITIALIZED && state != STATE_INITIALIZED) {
+        log_error("mode can't be changed while a transaction is running (state=%d)", state);
+        return E_WRONGSTATE;
+    }
+
+    if (legacy_ctx) {
+        return btrfstrans_ctx_set_mode(legacy_ctx, new_mode);
+    }
+
+    if (new_mode != BTRFSTRANS_MODE_PESSIMISTIC && new_mode != BTRFSTRANS_MODE_OPTIMISTIC) {
+        log_error("unknown transaction mode %d", new_mode);
+        return E_UNSPECIFIED;
+    }
+
+    legacy_mode = new_mode;
+    return SUCCESS;
+}
+
+/*
+ * Sets the durability level of transactions started from now on.
+ */
+int btrfstrans_ctx_set_durability(btrfstrans_ctx* ctx, int level) {
+    if (level < BTRFSTRANS_DURABILITY_NONE || level > BTRFSTRANS_DURABILITY_FSYNC) {
+        log_error("unknown durability level %d", level);
+        return E_UNSPECIFIED;
+    }
+
+    __atomic_store_n(&ctx->durability, level, __ATOMIC_RELAXED);
+    return SUCCESS;
+}
+
+int btrfstrans_set_durability(int level) {
+    if (legacy_ctx) {
+        return btrfstrans_ctx_set_durability(legacy_ctx, level);
+    }
+
+    if (level < BTRFSTRANS_DURABILITY_NONE || level > BTRFSTRANS_DURABILITY_FSYNC) {
+        log_error("unknown durability level %d", level);
+        return E_UNSPECIFIED;
+    }
+
+    legacy_durability = level;
+    return SUCCESS;
+}
+
+/*
+ * Overrides the durability level of the context for one write transaction.
+ */
+int btrfstrans_txn_set_durability(btrfstrans_txn* txn, int level) {
+    if (!txn || txn->state != STATE_WRITE) {
+        log_error("not a write transaction");
+        return E_WRONGSTATE;
+    }
+
+    if (level < BTRFSTRANS_DURABILITY_NONE || level > BTRFSTRANS_DURABILITY_FSYNC) {
+        log_error("unknown durability level %d", level);
+        return E_UNSPECIFIED;
+    }
+
+    txn->durability = level;
+    return SUCCESS;
+}
+
+int btrfstrans_set_txn_durability(int level) {
+    if (state != STATE_WRITE) {
+        log_error("transaction was not started or libbtrfstrans is in the wrong state(state=%d)", state);
+        return E_WRONGSTATE;
+    }
+
+    return btrfstrans_txn_set_durability(legacy_txn, level);
+}
+
+static int create_path_vars(btrfstrans_ctx* ctx, const char* path){
+    strcpy(ctx->root_path, path);
+
+    strcpy(ctx->head_subvolume_path, path);
+    strcat(ctx->head_subvolume_path, BTRFSTRANS_HEAD_SV_NAME);
+
+    strcpy(ctx->head_old_subvolume_path, path);
+    strcat(ctx->head_old_subvolume_path, BTRFSTRANS_HEAD_OLD_SV_NAME);
+
+    strcpy(ctx->readonly_subvolumes_path, path);
+    strcat(ctx->readonly_subvolumes_path, BTRFSTRANS_READONLY_SV_NAME);
+
+    strcpy(ctx->txlog_path, path);
+    strcat(ctx->txlog_path, BTRFSTRANS_TXLOG_DIR_NAME);
+
+    return SUCCESS;
+}
+
+static int create_initial_subvolumes(btrfstrans_ctx* ctx){
+    int ret = create_subvolume(ctx->head_subvolume_path);
+    if (ret) {
+        log_error("%s: can't create subvolume '%s'", __func__, ctx->head_subvolume_path);
+        return E_UNSPECIFIED;
+    }
+
+    ret = create_subvolume(ctx->readonly_subvolumes_path);
+    if (ret) {
+        log_error("%s: can't create subvolume '%s'", __func__, ctx->readonly_subvolumes_path);
+        return E_UNSPECIFIED;
+    }
+
+    return SUCCESS;
+}
+
+static btrfstrans_txn* new_txn(btrfstrans_ctx* ctx, int txn_state) {
+    btrfstrans_txn* txn = calloc(1, sizeof(*txn));
+
+    if (!txn) {
+        log_error("can't allocate transaction");
+        return NULL;
+    }
+    txn->ctx = ctx;
+    txn->state = txn_state;
+    txn->mode = __atomic_load_n(&ctx->mode, __ATOMIC_RELAXED);
+    txn->durability = __atomic_load_n(&ctx->durability, __ATOMIC_RELAXED);
+    txn->writable_fd = -1;
+    txn->readonly_fd = -1;
+    txn->ro_reader_slot = -1;
+    txn->write_lock_fd = -1;
+    txn->stage_fd = -1;
+    for (int i = 0; i < BTRFSTRANS_JOURNAL_MAX_FILES; i++) {
+        txn->journal_fds[i] = -1;
+    }
+    return txn;
+}
+
+static void free_txn(btrfstrans_txn* txn) {
+    close_journal(txn);
+    clear_write_set(txn);
+    free(txn->write_set);
+    free(txn->savepoints);
+    free(txn);
+}
+
+/*
+ * Starts a write transaction on ctx and returns its handle in *txn.
+ */
+int btrfstrans_txn_begin(btrfstrans_ctx* ctx, btrfstrans_txn** txnp) {
+    return btrfstrans_txn_begin_timeout(ctx, txnp, -1);
+}
+
+/*
+ * Like btrfstrans_txn_begin(), but gives up with E_TIMEOUT if the write
+ * lock (pessimistic mode) can't be taken within timeout_ms; 0 only tries,
+ * a negative timeout waits forever.
+ */
+int btrfstrans_txn_begin_timeout(btrfstrans_ctx* ctx, btrfstrans_txn** txnp, int timeout_ms) {
+    return begin_write(ctx, txnp, timeout_ms, __atomic_load_n(&ctx->journal_files, __ATOMIC_RELAXED));
+}
+
+/*
+ * Starts a write transaction, on the rename journal if journal_files > 0:
+ * then it only needs to know which head it started from.
+ */
+static int begin_write(btrfstrans_ctx* ctx, btrfstrans_txn** txnp, int timeout_ms, int journal_files) {
+    unsigned long long t = stats_now();
+    btrfstrans_txn* txn;
+    unsigned int n;
+    int ret;
+    log_debug("starting transaction");
+
+    *txnp = NULL;
+    txn = new_txn(ctx, STATE_WRITE);
+    if (!txn) {
+        return E_UNSPECIFIED;
+    }
+
+    if (txn->mode == BTRFSTRANS_MODE_OPTIMISTIC) {
+        // every optimistic writer gets its own writable snapshot
+        n = __atomic_add_fetch(&tx_counter, 1, __ATOMIC_RELAXED);
+        snprintf(txn->writable_subvolume_name, sizeof(txn->writable_subvolume_name), "%s%d_%u",
+            LIBBTRFSTRANS_WR_SNAP_NAME_PREFIX, getpid(), n);
+        snprintf(txn->merge_subvolume_name, sizeof(txn->merge_subvolume_name), "%s%d_%u",
+            LIBBTRFSTRANS_MERGE_SNAP_NAME_PREFIX, getpid(), n);
+    } else {
+        strcpy(txn->writable_subvolume_name, BTRFSTRANS_WRITABLE_NAME);
+        strcpy(txn->merge_subvolume_name, LIBBTRFSTRANS_MERGE_SNAP_NAME_PREFIX "0");
+    }
+    if (snprintf(txn->writable_subvolume_path, sizeof(txn->writable_subvolume_path), "%s/%s/",
+            ctx->root_path, txn->writable_subvolume_name) >= (int)sizeof(txn->writable_subvolume_path)
+        || snprintf(txn->merge_subvolume_path, sizeof(txn->merge_subvolume_path), "%s/%s/",
+            ctx->root_path, txn->merge_subvolume_name) >= (int)sizeof(txn->merge_subvolume_path)) {
+        log_error("path of the volume root is too long");
+        free_txn(txn);
+        return E_INVALIDNAME;
+    }
+    if (txn->mode != BTRFSTRANS_MODE_OPTIMISTIC) {
+        ret = acquire_write_lock(txn, timeout_ms);
+        if (ret) {
+            free_txn(txn);
+            return ret;
+        }
+    }
+
+    if (journal_files > 0) {
+        txn->journal = 1;
+        txn->journal_limit = journal_files;
+        snprintf(txn->stage_name, sizeof(txn->stage_name), "%d_%u", getpid(), __atomic_add_fetch(&tx_counter, 1, __ATOMIC_RELAXED));
+        ret = read_seq(ctx->root_fd, BTRFSTRANS_HEAD_NAME, &txn->base_seq);
+    } else if (__atomic_load_n(&ctx->prewarm_enabled, __ATOMIC_RELAXED) && claim_prewarmed(txn) == SUCCESS) {
+        stats_count(BTRFSTRANS_COUNTER_PREWARM_HITS);
+        ret = SUCCESS;
+    } else {
+        // head must not be swapped between reading its sequence and snapshotting it
+        ret = acquire_rename_lock(ctx);
+        if (!ret) {
+            ret = read_seq(ctx->root_fd, BTRFSTRANS_HEAD_NAME, &txn->base_seq);
+            if (!ret) {
+                ret = snapshot_at(ctx->root_fd, BTRFSTRANS_HEAD_NAME, ctx->root_fd, txn->writable_subvolume_name, BTRFSTRANS_WRITABLE);
+            }
+            release_rename_lock(ctx);
+        }
+    }
+
+    if (!ret && !txn->journal) {
+        txn->writable_fd = openat(ctx->root_fd, txn->writable_subvolume_name, O_RDONLY | O_DIRECTORY);
+        if (txn->writable_fd < 0) {
+            reap_subvolume(ctx->root_fd, txn->writable_subvolume_name);
+            ret = E_ACCESS;
+        } else {
+            // changesets are what changed after this generation
+            subvolume_generation(txn->writable_fd, &txn->base_gen);
+        }
+    }
+
+    if (ret) {
+        log_error("couldn't start write transaction on %s", txn->writable_subvolume_path);
+        if (txn->mode == BTRFSTRANS_MODE_PESSIMISTIC) {
+            release_write_lock(txn);
+        }
+        free_txn(txn);
+        return ret;
+    }
+
+    if (txn->mode == BTRFSTRANS_MODE_PESSIMISTIC) {
+        lease_begin(txn);
+    }
+
+    *txnp = txn;
+    stats_record(BTRFSTRANS_PHASE_START, t);
+    log_debug("finished starting transaction");
+    return SUCCESS;
+}
+
+int start_transaction() {
+    return start_transaction_timeout(-1);
+}
+
+int start_transaction_timeout(int timeout_ms) {
+    int ret;
+
+    if ( state != STATE_INITIALIZED) {
+        log_error("libbtrfstrans was not configured or is in the wrong state (state=%d)", state);
+        return E_WRONGSTATE;
+    }
+
+    ret = btrfstrans_txn_begin_timeout(legacy_ctx, &legacy_txn, timeout_ms);
+    if (ret) {
+        return ret;
+    }
+
+    state = STATE_WRITE;
+    return SUCCESS;
+}
+
+int commit_transaction() {
+    return btrfstrans_commit(NULL);
+}
+
+/*
+ * Commits the running transaction. If transid is not NULL it receives the
+ * btrfs transaction that makes the commit durable (0 if the commit already
+ * is as durable as requested).
+ */
+int btrfstrans_commit(unsigned long long* transid) {
+    btrfstrans_txn* txn = legacy_txn;
+
+    if ( state != STATE_WRITE) {
+        log_error("transaction was not started or libbtrfstrans is in the wrong state(state=%d)", state);
+        return E_WRONGSTATE;
+    }
+
+    legacy_txn = NULL;
+    state = STATE_INITIALIZED;
+    return btrfstrans_txn_commit(txn, transid);
+}
+
+/*
+ * Commits a write transaction; see btrfstrans_commit() for transid. The
+ * handle is released in any case: a transaction that can't be committed
+ * is aborted.
+ */
+int btrfstrans_txn_commit(btrfstrans_txn* txn, unsigned long long* transid) {
+    unsigned long long t = stats_now(), t_phase;
+    btrfstrans_ctx* ctx;
+    struct retention r;
+    unsigned long long head_seq;
+    char* changes = NULL;
+    size_t changes_len = 0;
+    int changes_written = 0;
+    int intent = 0;
+    int ret;
+    log_debug("committing transaction");
+
+    if (!txn || txn->state != STATE_WRITE) {
+        log_error("not a write transaction");
+        return E_WRONGSTATE;
+    }
+    ctx = txn->ctx;
+
+    if (txn->journal) {
+        // a retained generation is a whole head, only a snapshot makes one
+        if (read_retention(ctx, &r) != SUCCESS) {
+            return commit_journal(txn, transid);
+        }
+        ret = switch_to_snapshot(txn);
+        if (ret) {
+            stats_count(BTRFSTRANS_COUNTER_COMMIT_ERRORS);
+            discard_transaction(txn);
+            return ret;
+        }
+    }
+
+    ret = prepare_commit(txn, &changes, &changes_len);
+    if (ret) {
+        stats_count(BTRFSTRANS_COUNTER_COMMIT_ERRORS);
+        discard_transaction(txn);
+        return ret;
+    }
+
+    ret = acquire_rename_lock(ctx);
+    if (ret) {
+        free(changes);
+        stats_count(BTRFSTRANS_COUNTER_COMMIT_ERRORS);
+        discard_transaction(txn);
+        return ret;
+    }
+    crash_point("rename_locked");
+
+    // a journal commit left half published goes first
+    ret = recover_journal(ctx);
+    if (!ret || ret == E_CORRUPT) {
+        ret = read_seq(ctx->root_fd, BTRFSTRANS_HEAD_NAME, &head_seq);
+    }
+    if (!ret) {
+        ret = merge_onto_head(txn, head_seq);
+    }
+    if (!ret) {
+        ret = stage_commit(txn, head_seq + 1, changes, changes_len, &changes_written, &t_phase);
+    }
+    if (ret) {
+        goto discard;
+    }
+
+    ret = write_intent(txn, head_seq + 1);
+    if (ret) {
+        goto discard;
+    }
+    intent = 1;
+    stats_record(BTRFSTRANS_PHASE_TXLOG, t_phase);
+    crash_point("intent");
+
+    ret = swap_head(txn);
+    if (ret) {
+        goto discard;
+    }
+    crash_point("swapped");
+
+    retire_old_head(txn, head_seq);
+    crash_point("reaped");
+
+    clear_intent(ctx);
+    crash_point("intent_cleared");
+
+    release_rename_lock(ctx);
+
+    ret = finish_commit(txn, head_seq + 1, changes, transid);
+    if (ret) {
+        return ret;
+    }
+    stats_record(BTRFSTRANS_PHASE_COMMIT, t);
+
+    log_debug("finished committing transaction");
+
+    return SUCCESS;
+
+discard:
+    if (intent) {
+        clear_intent(ctx);
+    }
+    if (changes_written) {
+        unstage_changes(ctx, head_seq + 1);
+    }
+    free(changes);
+    release_rename_lock(ctx);
+    discard_transaction(txn);
+    stats_count(ret == E_CONFLICT ? BTRFSTRANS_COUNTER_CONFLICTS : BTRFSTRANS_COUNTER_COMMIT_ERRORS);
+    return ret;
+}
+
+/*
+ * The steps of a commit, shared by btrfstrans_txn_commit() and
+ * btrfstrans_multi_commit(). Everything between merge_onto_head() and
+ * retire_old_head() runs under the rename lock of the domain.
+ */
+
+/*
+ * Ends the write lease and drops the savepoints; from here on the commit
+ * can't lose the write lock anymore. Also finds the changeset, which is
+ * done outside of the rename lock: a merge replays exactly these paths,
+ * so it stays the same whichever head we end up on.
+ */
+static int prepare_commit(btrfstrans_txn* txn, char** changes, size_t* changes_len) {
+    unsigned long long t_phase;
+    int ret;
+
+    ret = lease_end(txn);
+    if (ret) {
+        log_error("the write lease of the transaction expired");
+        return ret;
+    }
+
+    drop_savepoints(txn, 0);
+
+    ret = sync_staged(txn);
+    if (ret) {
+        return ret;
+    }
+
+    if (open_changes(txn->ctx) >= 0) {
+        t_phase = stats_now();
+        collect_changes(txn, changes, changes_len);
+        stats_record(BTRFSTRANS_PHASE_CHANGESET, t_phase);
+    }
+    return SUCCESS;
+}
+
+/*
+ * If other transactions were committed since our snapshot was taken, only
+ * disjoint changes can be merged into the new head: the write set is
+ * checked against theirs and replayed onto a snapshot of head_seq, which
+ * then becomes the snapshot to install.
+ */
+static int merge_onto_head(btrfstrans_txn* txn, unsigned long long head_seq) {
+    btrfstrans_ctx* ctx = txn->ctx;
+    unsigned long long t_phase;
+    int merge_fd;
+    int ret;
+
+    if (head_seq == txn->base_seq) {
+        return SUCCESS;
+    }
+
+    t_phase = stats_now();
+    ret = check_conflicts(txn, txn->base_seq, head_seq);
+    stats_record(BTRFSTRANS_PHASE_CONFLICT_CHECK, t_phase);
+    if (ret) {
+        return ret;
+    }
+
+    ret = snapshot_at(ctx->root_fd, BTRFSTRANS_HEAD_NAME, ctx->root_fd, txn->merge_subvolume_name, BTRFSTRANS_WRITABLE);
+    if (ret) {
+        return ret;
+    }
+
+    t_phase = stats_now();
+    merge_fd = openat(ctx->root_fd, txn->merge_subvolume_name, O_RDONLY | O_DIRECTORY);
+    ret = merge_fd < 0 ? E_ACCESS : merge_write_set(txn, txn->writable_fd, merge_fd);
+    stats_record(BTRFSTRANS_PHASE_MERGE, t_phase);
+    if (ret) {
+        if (merge_fd >= 0) {
+            close(merge_fd);
+        }
+        reap_subvolume(ctx->root_fd, txn->merge_subvolume_name);
+        return ret;
+    }
+
+    if (reap_subvolume(ctx->root_fd, txn->writable_subvolume_name)) {
+        log_error("couldn't delete merged subvolume %s", txn->writable_subvolume_path);
+    }
+
+    // from now on the merged snapshot is the one to install
+    close(txn->writable_fd);
+    txn->writable_fd = merge_fd;
+    strcpy(txn->writable_subvolume_name, txn->merge_subvolume_name);
+    strcpy(txn->writable_subvolume_path, txn->merge_subvolume_path);
+    stats_count(BTRFSTRANS_COUNTER_MERGES);
+    crash_point("merged");
+    return SUCCESS;
+}
+
+/*
+ * Makes the snapshot ready to become head number seq: flushes the write
+ * set if asked to and writes the txlog entry, the changeset and the
+ * sequence number. *t_txlog receives the start of the txlog phase, which
+ * ends once the commit record is written.
+ */
+static int stage_commit(btrfstrans_txn* txn, unsigned long long seq, const char* changes, size_t changes_len,
+    int* changes_written, unsigned long long* t_txlog) {
+    unsigned long long t_phase;
+    int ret;
+
+    if (txn->durability == BTRFSTRANS_DURABILITY_FSYNC) {
+        t_phase = stats_now();
+        ret = fsync_write_set(txn, txn->writable_fd);
+        stats_record(BTRFSTRANS_PHASE_FSYNC, t_phase);
+        if (ret) {
+            return ret;
+        }
+    }
+
+    *t_txlog = stats_now();
+    ret = write_txlog(txn, seq);
+    if (!ret && changes) {
+        ret = write_changes(txn->ctx, seq, changes, changes_len);
+        *changes_written = !ret;
+    }
+    if (!ret) {
+        // what other transactions had staged when the snapshot was taken
+        strip_journal(txn->writable_fd);
+        ret = write_seq(txn->writable_fd, seq);
+    }
+    if (ret) {
+        return ret;
+    }
+    crash_point("txlog");
+    return SUCCESS;
+}
+
+// unlike txlog entries a dangling changeset would be delivered
+static void unstage_changes(btrfstrans_ctx* ctx, unsigned long long seq) {
+    char name[32];
+
+    snprintf(name, sizeof(name), "%llu", seq);
+    unlinkat(ctx->changes_fd, name, 0);
+}
+
+/*
+ * Swaps the new head in with a single atomic exchange: 'head' never
+ * disappears and the old head ends up under the name of the snapshot.
+ */
+static int swap_head(btrfstrans_txn* txn) {
+    btrfstrans_ctx* ctx = txn->ctx;
+    unsigned long long t_phase = stats_now();
+
+    if (renameat2(ctx->root_fd, txn->writable_subvolume_name, ctx->root_fd, BTRFSTRANS_HEAD_NAME, RENAME_EXCHANGE)) {
+        log_error("exchanging %s and %s - %s", txn->writable_subvolume_path, ctx->head_subvolume_path, strerror(errno));
+        return E_RENAME;
+    }
+    stats_record(BTRFSTRANS_PHASE_HEAD_SWAP, t_phase);
+    return SUCCESS;
+}
+
+/*
+ * What is left of a commit once the rename lock is released: drops the
+ * write lock, wakes subscribers and background threads and makes the new
+ * head as durable as requested. Releases txn and changes.
+ */
+static int finish_commit(btrfstrans_txn* txn, unsigned long long seq, char* changes, unsigned long long* transid) {
+    btrfstrans_ctx* ctx = txn->ctx;
+    struct retention r;
+    unsigned long long t_phase;
+    int ret;
+
+    // the cached fd now refers to the new head, which is not ours anymore
+    if (txn->writable_fd >= 0) {
+        close(txn->writable_fd);
+        txn->writable_fd = -1;
+    }
+
+    if (txn->mode == BTRFSTRANS_MODE_PESSIMISTIC) {
+        release_write_lock(txn);
+    }
+    crash_point("unlocked");
+
+    free(changes);
+    notify_commit(ctx);
+    request_prewarm(ctx);
+    request_export(ctx);
+
+    // the previous head generation may now be unused by readers
+    if (acquire_ro_lock(ctx) == SUCCESS) {
+        reclaim_ro_generations(ctx, seq);
+        release_ro_lock(ctx);
+    }
+    if (read_retention(ctx, &r) == SUCCESS) {
+        prune_retained(ctx);
+    }
+
+    // btrfs commits the exchange and the new head atomically, so flushing
+    // after the swap can only lose the whole commit, never half of it
+    t_phase = stats_now();
+    ret = make_durable(txn, transid);
+    free_txn(txn);
+    if (ret) {
+        stats_count(BTRFSTRANS_COUNTER_COMMIT_ERRORS);
+        return ret;
+    }
+    stats_record(BTRFSTRANS_PHASE_FLUSH, t_phase);
+    return SUCCESS;
+}
+
+/*
+ * Transactions over several domains. The domains are locked in the order
+ * of their names, the write locks by btrfstrans_multi_begin() and the
+ * rename locks by the commit, so multi-domain transactions can't deadlock
+ * with each other or with single-domain ones. Holding all rename locks
+ * the commit stages every domain, writes one group record with the new
+ * sequence number and snapshot of each and only then swaps the heads.
+ * With the record written the commit is decided: after a crash recovery
+ * completes the swaps left undone instead of undoing the others, see
+ * recover_groups().
+ */
+struct btrfstrans_multi {
+    int n;
+    // in lock order, order[k] is the index the caller gave txns[k]
+    btrfstrans_txn* txns[BTRFSTRANS_MAX_DOMAINS];
+    int order[BTRFSTRANS_MAX_DOMAINS];
+};
+
+/*
+ * Starts a write transaction on each of the n domains ctxs and returns
+ * them as one in *multi.
+ */
+int btrfstrans_multi_begin(btrfstrans_ctx** ctxs, int n, btrfstrans_multi** multip) {
+    btrfstrans_multi* multi;
+    struct stat st, first;
+    int ret;
+
+    *multip = NULL;
+
+    if (n < 1 || n > BTRFSTRANS_MAX_DOMAINS) {
+        log_error("a multi-domain transaction spans 1 to %d domains, not %d", BTRFSTRANS_MAX_DOMAINS, n);
+        return E_UNSPECIFIED;
+    }
+
+    for (int i = 0; i < n; i++) {
+        if (!ctxs[i]->domain[0] || fstat(ctxs[i]->domains_fd, &st)) {
+            log_error("%s is not a domain", ctxs[i]->root_path);
+            return E_WRONGSTATE;
+        }
+        if (i == 0) {
+            first = st;
+        } else if (st.st_dev != first.st_dev || st.st_ino != first.st_ino) {
+            log_error("domains %s and %s belong to different volumes", ctxs[0]->domain, ctxs[i]->domain);
+            return E_WRONGSTATE;
+        }
+    }
+
+    multi = calloc(1, sizeof(*multi));
+    if (!multi) {
+        log_error("can't allocate multi-domain transaction");
+        return E_UNSPECIFIED;
+    }
+    multi->n = n;
+
+    for (int i = 0; i < n; i++) {
+        int k = i;
+
+        while (k > 0 && strcmp(ctxs[multi->order[k - 1]]->domain, ctxs[i]->domain) > 0) {
+            multi->order[k] = multi->order[k - 1];
+            k--;
+        }
+        multi->order[k] = i;
+    }
+    for (int k = 1; k < n; k++) {
+        if (!strcmp(ctxs[multi->order[k - 1]]->domain, ctxs[multi->order[k]]->domain)) {
+            log_error("domain %s is part of the transaction twice", ctxs[multi->order[k]]->domain);
+            free(multi);
+            return E_WRONGSTATE;
+        }
+    }
+
+    // the group record describes snapshots, so no rename journal here
+    for (int k = 0; k < n; k++) {
+        ret = begin_write(ctxs[multi->order[k]], &multi->txns[k], -1, 0);
+        if (ret) {
+            while (k-- > 0) {
+                btrfstrans_txn_abort(multi->txns[k]);
+            }
+            free(multi);
+            return ret;
+        }
+    }
+
+    *multip = multi;
+    return SUCCESS;
+}
+
+/*
+ * The write transaction on ctxs[i] of btrfstrans_multi_begin().
+ */
+btrfstrans_txn* btrfstrans_multi_txn(btrfstrans_multi* multi, int i) {
+    if (!multi) {
+        return NULL;
+    }
+
+    for (int k = 0; k < multi->n; k++) {
+        if (multi->order[k] == i) {
+            return multi->txns[k];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Commits a multi-domain transaction. If a domain can't be committed, none
+ * is. The handle is released in any case.
+ */
+int btrfstrans_multi_commit(btrfstrans_multi* multi) {
+    unsigned long long t = stats_now(), t_phase;
+    unsigned long long head_seqs[BTRFSTRANS_MAX_DOMAINS];
+    char* changes[BTRFSTRANS_MAX_DOMAINS] = { NULL };
+    size_t changes_len[BTRFSTRANS_MAX_DOMAINS] = { 0 };
+    int changes_written[BTRFSTRANS_MAX_DOMAINS] = { 0 };
+    char xattr[64];
+    int n, locked = 0, swapped = 0, recorded = 0;
+    int ret = SUCCESS, err;
+
+    if (!multi) {
+        log_error("not a multi-domain transaction");
+        return E_WRONGSTATE;
+    }
+    n = multi->n;
+
+    for (int k = 0; k < n; k++) {
+        err = prepare_commit(multi->txns[k], &changes[k], &changes_len[k]);
+        if (err && !ret) {
+            ret = err;
+        }
+    }
+    if (ret) {
+        goto discard;
+    }
+
+    for (; locked < n; locked++) {
+        ret = acquire_rename_lock(multi->txns[locked]->ctx);
+        if (ret) {
+            goto discard;
+        }
+    }
+    crash_point("rename_locked");
+
+    for (int k = 0; k < n; k++) {
+        btrfstrans_txn* txn = multi->txns[k];
+
+        ret = read_seq(txn->ctx->root_fd, BTRFSTRANS_HEAD_NAME, &head_seqs[k]);
+        if (!ret) {
+            ret = merge_onto_head(txn, head_seqs[k]);
+        }
+        if (!ret) {
+            ret = stage_commit(txn, head_seqs[k] + 1, changes[k], changes_len[k], &changes_written[k], &t_phase);
+        }
+        if (ret) {
+            goto discard;
+        }
+    }
+
+    ret = write_group(multi, head_seqs, xattr, sizeof(xattr));
+    if (ret) {
+        goto discard;
+    }
+    recorded = 1;
+    stats_record(BTRFSTRANS_PHASE_TXLOG, t_phase);
+    crash_point("intent");
+
+    for (; swapped < n; swapped++) {
+        ret = swap_head(multi->txns[swapped]);
+        if (ret) {
+            // exchanging again puts the old heads back
+            while (swapped-- > 0) {
+                if (swap_head(multi->txns[swapped])) {
+                    log_error("can't restore head of domain %s", multi->txns[swapped]->ctx->domain);
+                }
+            }
+            goto discard;
+        }
+    }
+    crash_point("swapped");
+
+    for (int k = 0; k < n; k++) {
+        retire_old_head(multi->txns[k], head_seqs[k]);
+    }
+    crash_point("reaped");
+
+    clear_group(multi->txns[0]->ctx, xattr);
+    crash_point("intent_cleared");
+
+    while (locked-- > 0) {
+        release_rename_lock(multi->txns[locked]->ctx);
+    }
+
+    for (int k = 0; k < n; k++) {
+        err = finish_commit(multi->txns[k], head_seqs[k] + 1, changes[k], NULL);
+        if (err && !ret) {
+            ret = err;
+        }
+    }
+    free(multi);
+    if (ret) {
+        return ret;
+    }
+    stats_record(BTRFSTRANS_PHASE_COMMIT, t);
+
+    log_debug("finished committing transaction over %d domains", n);
+
+    return SUCCESS;
+
+discard:
+    if (recorded) {
+        clear_group(multi->txns[0]->ctx, xattr);
+    }
+    for (int k = 0; k < n; k++) {
+        if (changes_written[k]) {
+            unstage_changes(multi->txns[k]->ctx, head_seqs[k] + 1);
+        }
+        free(changes[k]);
+    }
+    while (locked-- > 0) {
+        release_rename_lock(multi->txns[locked]->ctx);
+    }
+    for (int k = 0; k < n; k++) {
+        discard_transaction(multi->txns[k]);
+    }
+    free(multi);
+    stats_count(ret == E_CONFLICT ? BTRFSTRANS_COUNTER_CONFLICTS : BTRFSTRANS_COUNTER_COMMIT_ERRORS);
+    return ret;
+}
+
+/*
+ * Aborts a multi-domain transaction and releases its handle.
+ */
+int btrfstrans_multi_abort(btrfstrans_multi* multi) {
+    int ret = SUCCESS, err;
+
+    if (!multi) {
+        log_error("not a multi-domain transaction");
+        return E_WRONGSTATE;
+    }
+
+    for (int k = multi->n - 1; k >= 0; k--) {
+        err = btrfstrans_txn_abort(multi->txns[k]);
+        if (err && !ret) {
+            ret = err;
+        }
+    }
+    free(multi);
+    return ret;
+}
+
+/*
+ * Makes retained generation seq the head again. This is a commit like any
+ * other, with a new sequence number, so the head it replaces is retained
+ * in turn and the revert can be reverted. Its txlog entry is the empty
+ * path, which overlaps every path: running optimistic transactions that
+ * started before it can't merge onto it. The cost is one snapshot and one
+ * exchange, whatever the amount of data.
+ */
+int btrfstrans_ctx_revert(btrfstrans_ctx* ctx, unsigned long long seq) {
+    unsigned long long t = stats_now(), t_phase;
+    btrfstrans_txn* txn;
+    unsigned long long head_seq;
+    char all[] = { BTRFSTRANS_CHANGE_ALL, '\n', '\0' };
+    char* changes = NULL;
+    char name[32];
+    int changes_written = 0;
+    int intent = 0;
+    int ret;
+
+    txn = new_txn(ctx, STATE_WRITE);
+    if (!txn) {
+        return E_UNSPECIFIED;
+    }
+    // named like the snapshot of an optimistic writer, so the sweeps
+    // find it if we die
+    txn->mode = BTRFSTRANS_MODE_OPTIMISTIC;
+    snprintf(txn->writable_subvolume_name, sizeof(txn->writable_subvolume_name), "%s%d_%u",
+        LIBBTRFSTRANS_WR_SNAP_NAME_PREFIX, getpid(), __atomic_add_fetch(&tx_counter, 1, __ATOMIC_RELAXED));
+    if (snprintf(txn->writable_subvolume_path, sizeof(txn->writable_subvolume_path), "%s/%s/",
+            ctx->root_path, txn->writable_subvolume_name) >= (int)sizeof(txn->writable_subvolume_path)) {
+        log_error("path of the volume root is too long");
+        free_txn(txn);
+        return E_INVALIDNAME;
+    }
+    snprintf(name, sizeof(name), "%llu", seq);
+
+    ret = record_write(txn, "");
+    if (ret) {
+        free_txn(txn);
+        return E_UNSPECIFIED;
+    }
+    if (open_changes(ctx) >= 0) {
+        changes = strdup(all);
+    }
+
+    ret = acquire_rename_lock(ctx);
+    if (ret) {
+        free(changes);
+        free_txn(txn);
+        return ret;
+    }
+
+    ret = read_seq(ctx->root_fd, BTRFSTRANS_HEAD_NAME, &head_seq);
+    if (ret) {
+        goto fail;
+    }
+    if (seq == head_seq) {
+        release_rename_lock(ctx);
+        free(changes);
+        free_txn(txn);
+        return SUCCESS;
+    }
+
+    ret = snapshot_at(ctx->retained_fd, name, ctx->root_fd, txn->writable_subvolume_name, BTRFSTRANS_WRITABLE);
+    if (ret) {
+        log_error("generation %llu is not retained", seq);
+        goto fail;
+    }
+    txn->writable_fd = openat(ctx->root_fd, txn->writable_subvolume_name, O_RDONLY | O_DIRECTORY);
+    if (txn->writable_fd < 0) {
+        ret = E_ACCESS;
+        goto discard;
+    }
+    txn->base_seq = head_seq;
+
+    ret = stage_commit(txn, head_seq + 1, changes, changes ? strlen(changes) : 0, &changes_written, &t_phase);
+    if (ret) {
+        goto discard;
+    }
+    ret = write_intent(txn, head_seq + 1);
+    if (ret) {
+        goto discard;
+    }
+    intent = 1;
+    stats_record(BTRFSTRANS_PHASE_TXLOG, t_phase);
+
+    ret = swap_head(txn);
+    if (ret) {
+        goto discard;
+    }
+    retire_old_head(txn, head_seq);
+    clear_intent(ctx);
+    release_rename_lock(ctx);
+
+    log_info("reverted to generation %llu as %llu", seq, head_seq + 1);
+    ret = finish_commit(txn, head_seq + 1, changes, NULL);
+    if (!ret) {
+        stats_record(BTRFSTRANS_PHASE_COMMIT, t);
+    }
+    return ret;
+
+discard:
+    if (intent) {
+        clear_intent(ctx);
+    }
+    if (changes_written) {
+        unstage_changes(ctx, head_seq + 1);
+    }
+    free(changes);
+    release_rename_lock(ctx);
+    discard_transaction(txn);
+    stats_count(BTRFSTRANS_COUNTER_COMMIT_ERRORS);
+    return ret;
+
+fail:
+    free(changes);
+    release_rename_lock(ctx);
+    free_txn(txn);
+    return ret;
+}
+
+int btrfstrans_revert(unsigned long long seq) {
+    if (state != STATE_INITIALIZED) {
+        log_error("libbtrfstrans was not configured or is in the wrong state (state=%d)", state);
+        return E_WRONGSTATE;
+    }
+    return btrfstrans_ctx_revert(legacy_ctx, seq);
+}
+
+int abort_transaction() {
+    btrfstrans_txn* txn = legacy_txn;
+
+    if ( state != STATE_WRITE) {
+        log_error("transaction was not started or libbtrfstrans is in the wrong state");
+        return E_WRONGSTATE;
+    }
+
+    legacy_txn = NULL;
+    state = STATE_INITIALIZED;
+    return btrfstrans_txn_abort(txn);
+}
+
+/*
+ * Aborts a write transaction and releases its handle.
+ */
+int btrfstrans_txn_abort(btrfstrans_txn* txn) {
+    unsigned long long t = stats_now();
+    int ret;
+
+    log_debug("aborting transaction");
+    if (!txn || txn->state != STATE_WRITE) {
+        log_error("not a write transaction");
+        return E_WRONGSTATE;
+    }
+
+    ret = discard_transaction(txn);
+    stats_record(BTRFSTRANS_PHASE_ABORT, t);
+    return ret;
+}
+
+/*
+ * Flushes the files written by the transaction in the subvolume sv_fd.
+ */
+static int fsync_write_set(btrfstrans_txn* txn, int sv_fd) {
+    int fd;
+
+    for (int i = 0; i < txn->write_set_len; i++) {
+        fd = openat(sv_fd, txn->write_set[i], O_RDONLY);
+        if (fd < 0) {
+            continue; // removed by the transaction
+        }
+        if (fsync(fd)) {
+            log_error("can't fsync %s - %s", txn->write_set[i], strerror(errno));
+            close(fd);
+            return E_ACCESS;
+        }
+        close(fd);
+    }
+    return SUCCESS;
+}
+
+/*
+ * Makes a finished head swap durable according to the durability level of
+ * the transaction.
+ */
+static int make_durable(btrfstrans_txn* txn, unsigned long long* transid) {
+    btrfstrans_ctx* ctx = txn->ctx;
+    __u64 id = 0;
+    int ret = 0;
+
+    switch (txn->durability) {
+    case BTRFSTRANS_DURABILITY_NONE:
+        break;
+    case BTRFSTRANS_DURABILITY_ASYNC:
+        ret = ioctl(ctx->root_fd, BTRFS_IOC_START_SYNC, &id);
+        break;
+    case BTRFSTRANS_DURABILITY_SYNCFS:
+        ret = syncfs(ctx->root_fd);
+        break;
+    case BTRFSTRANS_DURABILITY_FSYNC:
+        // a journal commit changed head in place
+        ret = txn->journal ? fsync_published(txn) : fsync(ctx->root_fd);
+        break;
+    }
+    if (ret < 0) {
+        log_error("can't flush %s - %s", ctx->root_path, strerror(errno));
+        return E_UNSPECIFIED;
+    }
+
+    if (transid) {
+        *transid = id;
+    }
+    return SUCCESS;
+}
+
+/*
+ * Waits until the btrfs transaction returned by btrfstrans_txn_commit()
+ * is on disk. A transid of 0 means the commit is already durable.
+ */
+int btrfstrans_ctx_wait_durable(btrfstrans_ctx* ctx, unsigned long long transid) {
+    __u64 id = transid;
+
+    if (transid == 0) {
+        return SUCCESS;
+    }
+
+    if (ioctl(ctx->root_fd, BTRFS_IOC_WAIT_SYNC, &id) < 0) {
+        log_error("waiting for transid %llu - %s", transid, strerror(errno));
+        return E_UNSPECIFIED;
+    }
+    return SUCCESS;
+}
+
+/*
+ * btrfs transactions are committed in order, so waiting for the newest
+ * transid of a batch covers all of them.
+ */
+int btrfstrans_ctx_wait_durable_batch(btrfstrans_ctx* ctx, const unsigned long long* transids, int n) {
+    unsigned long long newest = 0;
+
+    for (int i = 0; i < n; i++) {
+        if (transids[i] > newest) {
+            newest = transids[i];
+        }
+    }
+    return btrfstrans_ctx_wait_durable(ctx, newest);
+}
+
+int btrfstrans_wait_durable(unsigned long long transid) {
+    if (!legacy_ctx) {
+        log_error("libbtrfstrans was not configured");
+        return E_WRONGSTATE;
+    }
+    return btrfstrans_ctx_wait_durable(legacy_ctx, transid);
+}
+
+int btrfstrans_wait_durable_batch(const unsigned long long* transids, int n) {
+    if (!legacy_ctx) {
+        log_error("libbtrfstrans was not configured");
+        return E_WRONGSTATE;
+    }
+    return btrfstrans_ctx_wait_durable_batch(legacy_ctx, transids, n);
+}
+
+/*
+ * Throws away the writable snapshot of the transaction, gives back the
+ * write lock (pessimistic mode only) and releases the handle.
+ */
+static int discard_transaction(btrfstrans_txn* txn) {
+    btrfstrans_ctx* ctx = txn->ctx;
+    int ret = SUCCESS;
+
+    drop_savepoints(txn, 0);
+
+    if (txn->writable_fd >= 0) {
+        close(txn->writable_fd);
+        txn->writable_fd = -1;
+    }
+    // the staging directory is ours alone, whatever happened to the lease
+    drop_stage(txn);
+
+    // a revoked lease took the snapshot and the write lock with it: the
+    // name may belong to the next writer by now
+    if (lease_end(txn) == SUCCESS) {
+        if (!txn->journal) {
+            ret = reap_subvolume(ctx->root_fd, txn->writable_subvolume_name);
+            if (ret) {
+                log_error("couldn't delete subvolume %s to abort the transaction", txn->writable_subvolume_path);
+            }
+        }
+
+        if (txn->mode == BTRFSTRANS_MODE_PESSIMISTIC) {
+            release_write_lock(txn);
+        }
+    }
+
+    request_prewarm(ctx);
+
+    free_txn(txn);
+    return ret;
+}
+
+/*
+ * Savepoints are read-only snapshots of the writable subvolume next to it
+ * in the volume root. Rolling back snapshots the savepoint once more and
+ * exchanges the copy with the writable subvolume, so it takes the same
+ * time whatever the transaction wrote, and the savepoint stays usable.
+ * Files opened before a rollback still refer to the discarded state.
+ */
+static int savepoint_name(char* name, size_t len) {
+    return snprintf(name, len, "%s%d_%u", LIBBTRFSTRANS_SAVEPOINT_NAME_PREFIX,
+        getpid(), __atomic_add_fetch(&savepoint_counter, 1, __ATOMIC_RELAXED));
+}
+
+/*
+ * Reaps the savepoints from index from on.
+ */
+static void drop_savepoints(btrfstrans_txn* txn, int from) {
+    while (txn->savepoints_len > from) {
+        txn->savepoints_len--;
+        reap_subvolume(txn->ctx->root_fd, txn->savepoints[txn->savepoints_len].name);
+    }
+}
+
+/*
+ * Sets a savepoint in the write transaction txn and returns its number in
+ * *savepoint. Data still buffered by stdio is not part of it.
+ */
+int btrfstrans_txn_savepoint(btrfstrans_txn* txn, int* savepoint) {
+    unsigned long long t = stats_now();
+    struct savepoint* sp;
+    int ret;
+
+    if (!txn || txn->state != STATE_WRITE) {
+        log_error("not a write transaction");
+        return E_WRONGSTATE;
+    }
+
+    if (txn->savepoints_len == txn->savepoints_cap) {
+        int cap = txn->savepoints_cap ? 2 * txn->savepoints_cap : 8;
+        struct savepoint* tmp = realloc(txn->savepoints, cap * sizeof(struct savepoint));
+        if (!tmp) {
+            return E_UNSPECIFIED;
+        }
+        txn->savepoints = tmp;
+        txn->savepoints_cap = cap;
+    }
+
+    // savepoints are snapshots of the snapshot
+    ret = txn->journal ? switch_to_snapshot(txn) : SUCCESS;
+    if (!ret) {
+        ret = sync_staged(txn);
+    }
+    if (ret) {
+        return ret;
+    }
+
+    sp = &txn->savepoints[txn->savepoints_len];
+    savepoint_name(sp->name, sizeof(sp->name));
+    sp->write_set_len = txn->write_set_len;
+
+    ret = lease_hold(txn);
+    if (ret) {
+        return ret;
+    }
+    ret = snapshot_at(txn->ctx->root_fd, txn->writable_subvolume_name, txn->ctx->root_fd, sp->name, BTRFSTRANS_READONLY);
+    lease_unhold(txn);
+    if (ret) {
+        log_error("couldn't create savepoint of %s", txn->writable_subvolume_path);
+        return ret;
+    }
+
+    *savepoint = txn->savepoints_len++;
+    stats_record(BTRFSTRANS_PHASE_SAVEPOINT, t);
+    return SUCCESS;
+}
+
+/*
+ * Undoes everything txn did after savepoint was set. Later savepoints are
+ * released, savepoint itself is kept.
+ */
+int btrfstrans_txn_rollback_to(btrfstrans_txn* txn, int savepoint) {
+    unsigned long long t = stats_now();
+    btrfstrans_ctx* ctx;
+    char name[BTRFS_VOL_NAME_MAX+1];
+    int fd, ret;
+
+    if (!txn || txn->state != STATE_WRITE) {
+        log_error("not a write transaction");
+        return E_WRONGSTATE;
+    }
+    if (savepoint < 0 || savepoint >= txn->savepoints_len) {
+        log_error("unknown savepoint %d", savepoint);
+        return E_UNSPECIFIED;
+    }
+    ctx = txn->ctx;
+
+    drop_savepoints(txn, savepoint + 1);
+
+    savepoint_name(name, sizeof(name));
+    ret = snapshot_at(ctx->root_fd, txn->savepoints[savepoint].name, ctx->root_fd, name, BTRFSTRANS_WRITABLE);
+    if (ret) {
+        log_error("couldn't copy savepoint %d", savepoint);
+        return ret;
+    }
+
+    ret = lease_hold(txn);
+    if (ret) {
+        reap_subvolume(ctx->root_fd, name);
+        return ret;
+    }
+
+    if (renameat2(ctx->root_fd, name, ctx->root_fd, txn->writable_subvolume_name, RENAME_EXCHANGE)) {
+        log_error("exchanging %s with savepoint %d - %s", txn->writable_subvolume_path, savepoint, strerror(errno));
+        lease_unhold(txn);
+        reap_subvolume(ctx->root_fd, name);
+        return E_RENAME;
+    }
+
+    // the rolled back state now carries the name of the copy
+    reap_subvolume(ctx->root_fd, name);
+
+    fd = openat(ctx->root_fd, txn->writable_subvolume_name, O_RDONLY | O_DIRECTORY);
+    lease_unhold(txn);
+    if (fd < 0) {
+        log_error("can't open %s - %s", txn->writable_subvolume_path, strerror(errno));
+        return E_ACCESS;
+    }
+    close(txn->writable_fd);
+    txn->writable_fd = fd;
+
+    while (txn->write_set_len > txn->savepoints[savepoint].write_set_len) {
+        free(txn->write_set[--txn->write_set_len]);
+    }
+    stats_record(BTRFSTRANS_PHASE_ROLLBACK, t);
+    return SUCCESS;
+}
+
+/*
+ * Releases savepoint and all savepoints set after it. Their changes stay
+ * part of the transaction.
+ */
+int btrfstrans_txn_release_savepoint(btrfstrans_txn* txn, int savepoint) {
+    if (!txn || txn->state != STATE_WRITE) {
+        log_error("not a write transaction");
+        return E_WRONGSTATE;
+    }
+    if (savepoint < 0 || savepoint >= txn->savepoints_len) {
+        log_error("unknown savepoint %d", savepoint);
+        return E_UNSPECIFIED;
+    }
+
+    drop_savepoints(txn, savepoint);
+    return SUCCESS;
+}
+
+int btrfstrans_savepoint(int* savepoint) {
+    return btrfstrans_txn_savepoint(legacy_txn, savepoint);
+}
+
+int btrfstrans_rollback_to(int savepoint) {
+    return btrfstrans_txn_rollback_to(legacy_txn, savepoint);
+}
+
+int btrfstrans_release_savepoint(int savepoint) {
+    return btrfstrans_txn_release_savepoint(legacy_txn, savepoint);
+}
+
+/*
+ * Starts a read-only transaction on the current head of ctx and returns
+ * its handle in *txn.
+ */
+int btrfstrans_txn_begin_ro(btrfstrans_ctx* ctx, btrfstrans_txn** txnp) {
+    return begin_ro(ctx, NULL, txnp);
+}
+
+/*
+ * Starts a read-only transaction on generation seq, which must be the
+ * current head or retained, see btrfstrans_ctx_set_retention().
+ */
+int btrfstrans_txn_begin_ro_at(btrfstrans_ctx* ctx, unsigned long long seq, btrfstrans_txn** txnp) {
+    return begin_ro(ctx, &seq, txnp);
+}
+
+/*
+ * Readers of a retained generation share its gen_<seq> snapshot like
+ * those of head, it is just taken from retained/ instead.
+ */
+static int begin_ro(btrfstrans_ctx* ctx, const unsigned long long* at, btrfstrans_txn** txnp) {
+    unsigned long long t = stats_now();
+    struct btrfstrans_shm* shm = ctx->shm;
+    btrfstrans_txn* txn;
+    unsigned long long seq;
+    char retained[32];
+    int src_fd = ctx->root_fd;
+    const char* src = BTRFSTRANS_HEAD_NAME;
+    int gen = -1, reader = -1, fd;
+    int ret;
+
+    log_debug("starting read-only transaction");
+
+    *txnp = NULL;
+    txn = new_txn(ctx, STATE_READ);
+    if (!txn) {
+        return E_UNSPECIFIED;
+    }
+
+    ret = acquire_ro_lock(ctx);
+    if (ret) {
+        free_txn(txn);
+        return ret;
+    }
+
+    for (int i = 0; i < BTRFSTRANS_MAX_NUM_RO_TRANS; i++) {
+        if (shm->ro_readers[i].pid == 0) {
+            reader = i;
+            break;
+        }
+    }
+    if (reader < 0) {
+        log_error("couldn't find empty slot for read-only transaction");
+        ret = E_UNSPECIFIED;
+        goto out;
+    }
+
+    // head must not be swapped between reading its sequence and snapshotting it
+    ret = acquire_rename_lock(ctx);
+    if (ret) {
+        goto out;
+    }
+
+    ret = read_seq(ctx->root_fd, BTRFSTRANS_HEAD_NAME, &seq);
+    if (ret) {
+        release_rename_lock(ctx);
+        goto out;
+    }
+    if (at && *at != seq) {
+        seq = *at;
+        snprintf(retained, sizeof(retained), "%llu", seq);
+        src_fd = ctx->retained_fd;
+        src = retained;
+    }
+
+    snprintf(txn->specific_readonly_sv_name, sizeof(txn->specific_readonly_sv_name), "%s%llu",
+        LIBBTRFSTRANS_RO_SNAP_NAME_PREFIX, seq);
+    if (snprintf(txn->specific_readonly_sv_path, sizeof(txn->specific_readonly_sv_path), "%s%s/",
+            ctx->readonly_subvolumes_path, txn->specific_readonly_sv_name) >= (int)sizeof(txn->specific_readonly_sv_path)) {
+        log_error("path of the volume root is too long");
+        release_rename_lock(ctx);
+        ret = E_INVALIDNAME;
+        goto out;
+    }
+
+    for (int i = 0; i < BTRFSTRANS_MAX_RO_GENERATIONS; i++) {
+        if (shm->ro_generations[i].valid && shm->ro_generations[i].seq == seq) {
+            gen = i;
+            break;
+        }
+    }
+
+    if (gen < 0) {
+        // first reader of this generation
+        for (int i = 0; i < BTRFSTRANS_MAX_RO_GENERATIONS; i++) {
+            if (!shm->ro_generations[i].valid) {
+                gen = i;
+                break;
+            }
+        }
+        if (gen < 0) {
+            log_error("too many read-only generations pinned");
+            release_rename_lock(ctx);
+            ret = E_UNSPECIFIED;
+            goto out;
+        }
+
+        log_debug("creating snapshot of %s at %s", src, txn->specific_readonly_sv_path);
+        if (!exists_at(ctx->ro_snaps_fd, txn->specific_readonly_sv_name)) {
+            ret = snapshot_committed(src_fd, src, ctx->ro_snaps_fd, txn->specific_readonly_sv_name);
+            if (ret) {
+                log_error("couldn't create read-only snapshot %s%s", txn->specific_readonly_sv_path,
+                    src_fd == ctx->root_fd ? "" : ", generation not retained?");
+                release_rename_lock(ctx);
+                goto out;
+            }
+        } else {
+            // a crash may have left it before it was sealed
+            fd = openat(ctx->ro_snaps_fd, txn->specific_readonly_sv_name, O_RDONLY | O_DIRECTORY);
+            ret = fd < 0 ? E_ACCESS : seal_snapshot(fd);
+            if (fd >= 0) {
+                close(fd);
+            }
+            if (ret) {
+                log_error("can't make %s read-only - %s", txn->specific_readonly_sv_path, strerror(errno));
+                release_rename_lock(ctx);
+                goto out;
+            }
+        }
+
+        shm->ro_generations[gen].seq = seq;
+        shm->ro_generations[gen].refcount = 0;
+        shm->ro_generations[gen].valid = 1;
+    }
+
+    release_rename_lock(ctx);
+
+    txn->readonly_fd = openat(ctx->ro_snaps_fd, txn->specific_readonly_sv_name, O_RDONLY | O_DIRECTORY);
+    if (txn->readonly_fd < 0) {
+        log_error("can't open read-only snapshot %s", txn->specific_readonly_sv_path);
+        ret = E_ACCESS;
+        goto out;
+    }
+
+    shm->ro_generations[gen].refcount++;
+    shm->ro_readers[reader].generation = gen;
+    shm->ro_readers[reader].pid = getpid();
+    txn->ro_reader_slot = reader;
+
+out:
+    release_ro_lock(ctx);
+    if (ret) {
+        free_txn(txn);
+        return ret;
+    }
+
+    log_debug("finished starting read-only transaction");
+
+    *txnp = txn;
+    stats_record(BTRFSTRANS_PHASE_RO_START, t);
+    return SUCCESS;
+}
+
+int start_ro_transaction() {
+    int ret;
+
+    if (state != STATE_INITIALIZED) {
+        log_error("libbtrfstrans was not configured or is in the wrong state");
+        return E_WRONGSTATE;
+    }
+
+    ret = btrfstrans_txn_begin_ro(legacy_ctx, &legacy_txn);
+    if (ret) {
+        return ret;
+    }
+
+    state = STATE_READ;
+    return SUCCESS;
+}
+
+int start_ro_transaction_at(unsigned long long generation) {
+    int ret;
+
+    if (state != STATE_INITIALIZED) {
+        log_error("libbtrfstrans was not configured or is in the wrong state");
+        return E_WRONGSTATE;
+    }
+
+    ret = btrfstrans_txn_begin_ro_at(legacy_ctx, generation, &legacy_txn);
+    if (ret) {
+        return ret;
+    }
+
+    state = STATE_READ;
+    return SUCCESS;
+}
+
+/*
+ * Ends a read-only transaction and releases its handle.
+ */
+int btrfstrans_txn_end(btrfstrans_txn* txn) {
+    unsigned long long t = stats_now();
+    struct btrfstrans_shm* shm;
+    btrfstrans_ctx* ctx;
+    unsigned long long seq;
+    int ret;
+    log_debug("stopping read-only transaction");
+
+    if (!txn || txn->state != STATE_READ) {
+        log_error("not a read-only transaction");
+        return E_WRONGSTATE;
+    }
+    ctx = txn->ctx;
+    shm = ctx->shm;
+
+    close(txn->readonly_fd);
+
+    ret = acquire_ro_lock(ctx);
+    if (ret) {
+        // the slot is dropped once this process is gone
+        free_txn(txn);
+        return ret;
+    }
+
+    shm->ro_generations[shm->ro_readers[txn->ro_reader_slot].generation].refcount--;
+    shm->ro_readers[txn->ro_reader_slot].pid = 0;
+
+    // the snapshot stays around while its generation is the current head
+    ret = read_seq(ctx->root_fd, BTRFSTRANS_HEAD_NAME, &seq);
+    if (!ret) {
+        ret = reclaim_ro_generations(ctx, seq);
+    }
+
+    release_ro_lock(ctx);
+
+    free_txn(txn);
+    stats_record(BTRFSTRANS_PHASE_RO_END, t);
+    return ret;
+}
+
+int stop_ro_transaction() {
+    int ret;
+
+    if ( state != STATE_READ) {
+        log_error("read-only transaction was not started or\
+            libbtrfstrans is in the wrong state");
+        return E_WRONGSTATE;
+    }
+
+    ret = btrfstrans_txn_end(legacy_txn);
+    legacy_txn = NULL;
+    state = STATE_INITIALIZED;
+    return ret;
+}
+
+/*
+ * Reaps the snapshots of all generations that have no readers and are
+ * superseded by current_seq. Readers of crashed processes are dropped
+ * first. Must be called with the read-only lock held.
+ */
+static int reclaim_ro_generations(btrfstrans_ctx* ctx, unsigned long long current_seq) {
+    struct btrfstrans_shm* shm = ctx->shm;
+    struct ro_reader* reader;
+    struct ro_generation* gen;
+    char name[BTRFS_VOL_NAME_MAX+1];
+    int ret = SUCCESS;
+
+    for (int i = 0; i < BTRFSTRANS_MAX_NUM_RO_TRANS; i++) {
+        reader = &shm->ro_readers[i];
+        if (reader->pid && kill(reader->pid, 0) && errno == ESRCH) {
+            shm->ro_generations[reader->generation].refcount--;
+            reader->pid = 0;
+        }
+    }
+
+    for (int i = 0; i < BTRFSTRANS_MAX_RO_GENERATIONS; i++) {
+        gen = &shm->ro_generations[i];
+        if (gen->valid && gen->refcount <= 0 && gen->seq != current_seq) {
+            snprintf(name, sizeof(name), "%s%llu", LIBBTRFSTRANS_RO_SNAP_NAME_PREFIX, gen->seq);
+            if (reap_subvolume(ctx->ro_snaps_fd, name)) {
+                ret = E_DELETE;
+            }
+            gen->valid = 0;
+        }
+    }
+
+    return ret;
+}
+
+/*
+ * Reaps gen_* snapshots that are not in the generation table, e.g. after
+ * a reboot cleared the shared memory, and ro_snap_* ones of old versions.
+ */
+static int reap_orphan_generations(btrfstrans_ctx* ctx) {
+    struct btrfstrans_shm* shm = ctx->shm;
+    struct dirent* de;
+    unsigned long long seq;
+    size_t prefix_len = strlen(LIBBTRFSTRANS_RO_SNAP_NAME_PREFIX);
+    int known, fd;
+    DIR* dir;
+
+    if (acquire_ro_lock(ctx)) {
+        return E_UNSPECIFIED;
+    }
+
+    fd = dup(ctx->ro_snaps_fd);
+    dir = fd < 0 ? NULL : fdopendir(fd);
+    if (!dir) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        release_ro_lock(ctx);
+        return E_ACCESS;
+    }
+
+    while ((de = readdir(dir))) {
+        if (!strncmp(de->d_name, LIBBTRFSTRANS_LEGACY_RO_SNAP_NAME_PREFIX, strlen(LIBBTRFSTRANS_LEGACY_RO_SNAP_NAME_PREFIX))) {
+            reap_subvolume(ctx->ro_snaps_fd, de->d_name);
+            continue;
+        }
+        if (strncmp(de->d_name, LIBBTRFSTRANS_RO_SNAP_NAME_PREFIX, prefix_len)) {
+            continue;
+        }
+        seq = strtoull(de->d_name + prefix_len, NULL, 10);
+        known = 0;
+        for (int i = 0; i < BTRFSTRANS_MAX_RO_GENERATIONS; i++) {
+            if (shm->ro_generations[i].valid && shm->ro_generations[i].seq == seq) {
+                known = 1;
+                break;
+            }
+        }
+        if (!known) {
+            reap_subvolume(ctx->ro_snaps_fd, de->d_name);
+        }
+    }
+    closedir(dir);
+
+    release_ro_lock(ctx);
+    return SUCCESS;
+}
+
+/*
+ * Names the segment of ctx after the identity of its root: the fsid of
+ * the filesystem and the device and inode number of the root directory.
+ * Every volume and every domain has its own, whatever the sequence
+ * numbers of their heads.
+ */
+static int shm_name_of(btrfstrans_ctx* ctx) {
+    struct btrfs_ioctl_fs_info_args info;
+    char fsid[2 * BTRFS_FSID_SIZE + 1];
+    struct stat st;
+
+    memset(&info, 0, sizeof(info));
+    if (fstat(ctx->root_fd, &st) || ioctl(ctx->root_fd, BTRFS_IOC_FS_INFO, &info) < 0) {
+        log_error("can't identify the filesystem of %s - %s", ctx->root_path, strerror(errno));
+        return E_ACCESS;
+    }
+    for (int i = 0; i < BTRFS_FSID_SIZE; i++) {
+        sprintf(fsid + 2 * i, "%02x", info.fsid[i]);
+    }
+    snprintf(ctx->shm_name, sizeof(ctx->shm_name), "%s_%s_%llx_%llx", BTRFSTRANS_SHM_NAME, fsid,
+        (unsigned long long)st.st_dev, (unsigned long long)st.st_ino);
+    return SUCCESS;
+}
+
+/*
+ * Maps the shared memory segment of ctx, creating it zero-filled (that is
+ * empty) if this is the first process.
+ */
+static int open_shm(btrfstrans_ctx* ctx) {
+    struct btrfstrans_shm* map;
+    struct stat st;
+    uint32_t magic;
+    int fd;
+
+    fd = shm_open(ctx->shm_name, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        log_error("%s (shm_open()) = %d", __func__, errno);
+        return E_ACCESS;
+    }
+
+    // only grows the segment, existing contents are kept
+    if (fstat(fd, &st) || (st.st_size < (off_t)sizeof(struct btrfstrans_shm) &&
+        ftruncate(fd, sizeof(struct btrfstrans_shm)))) {
+        log_error("%s (ftruncate()) = %d", __func__, errno);
+        close(fd);
+        return E_ACCESS;
+    }
+
+    map = mmap(NULL, sizeof(struct btrfstrans_shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        log_error("%s (mmap()) = %d", __func__, errno);
+        return E_ACCESS;
+    }
+
+    // concurrent first users write the same header
+    magic = __atomic_load_n(&map->magic, __ATOMIC_ACQUIRE);
+    if (magic == 0) {
+        map->version = BTRFSTRANS_SHM_VERSION;
+        magic = BTRFSTRANS_SHM_MAGIC;
+        __atomic_store_n(&map->magic, magic, __ATOMIC_RELEASE);
+    }
+    if (magic != BTRFSTRANS_SHM_MAGIC || map->version != BTRFSTRANS_SHM_VERSION) {
+        log_error("shared memory segment %s has another layout, used by another version of the library?",
+            ctx->shm_name);
+        munmap(map, sizeof(struct btrfstrans_shm));
+        return E_ACCESS;
+    }
+
+    ctx->shm = map;
+    pthread_once(&stats_once, open_stats);
+    return SUCCESS;
+}
+
+/*
+ * Maps the statistics segment. Statistics are optional: any failure just
+ * leaves them off.
+ */
+static void open_stats() {
+#ifndef BTRFSTRANS_NO_STATS
+    struct btrfstrans_stats* map;
+    int fd;
+
+    fd = shm_open(BTRFSTRANS_STATS_SHM_NAME, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        return;
+    }
+    if (ftruncate(fd, sizeof(struct btrfstrans_stats))) {
+        close(fd);
+        return;
+    }
+    map = mmap(NULL, sizeof(struct btrfstrans_stats), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return;
+    }
+
+    // concurrent first users write the same header
+    if (map->magic == 0) {
+        map->version = BTRFSTRANS_STATS_VERSION;
+        map->phases = BTRFSTRANS_PHASE_COUNT;
+        map->buckets = BTRFSTRANS_HIST_BUCKETS;
+        __atomic_store_n(&map->magic, BTRFSTRANS_STATS_MAGIC, __ATOMIC_RELEASE);
+    }
+    if (map->magic != BTRFSTRANS_STATS_MAGIC || map->version != BTRFSTRANS_STATS_VERSION ||
+        map->phases != BTRFSTRANS_PHASE_COUNT || map->buckets != BTRFSTRANS_HIST_BUCKETS) {
+        log_error("statistics segment %s has another layout, statistics are off", BTRFSTRANS_STATS_SHM_NAME);
+        munmap(map, sizeof(struct btrfstrans_stats));
+        return;
+    }
+    stats = map;
+#endif
+}
+
+/*
+ * OFD lock on byte which of the shm object opened as fd. A negative
+ * timeout blocks, otherwise the lock is polled with a growing interval
+ * until timeout_ms passed.
+ */
+static int ofd_lock(int fd, int which, int timeout_ms) {
+    struct flock fl = { .l_type = F_WRLCK, .l_whence = SEEK_SET, .l_start = which, .l_len = 1 };
+    unsigned int poll_us = BTRFSTRANS_LOCK_POLL_MIN;
+    unsigned long long deadline;
+
+    if (timeout_ms < 0) {
+        while (fcntl(fd, F_OFD_SETLKW, &fl)) {
+            if (errno != EINTR) {
+                log_error("can't take the %s lock - %s", lock_names[which], strerror(errno));
+                return E_UNSPECIFIED;
+            }
+        }
+        return SUCCESS;
+    }
+
+    deadline = monotonic_ns() + timeout_ms * 1000000ULL;
+    while (fcntl(fd, F_OFD_SETLK, &fl)) {
+        if (errno != EAGAIN && errno != EACCES && errno != EINTR) {
+            log_error("can't take the %s lock - %s", lock_names[which], strerror(errno));
+            return E_UNSPECIFIED;
+        }
+        if (monotonic_ns() >= deadline) {
+            return E_TIMEOUT;
+        }
+        usleep(poll_us);
+        if (poll_us < BTRFSTRANS_LOCK_POLL_MAX) {
+            poll_us *= 2;
+        }
+    }
+    return SUCCESS;
+}
+
+static void ofd_unlock(int fd, int which) {
+    struct flock fl = { .l_type = F_UNLCK, .l_whence = SEEK_SET, .l_start = which, .l_len = 1 };
+
+    fcntl(fd, F_OFD_SETLK, &fl);
+}
+
+/*
+ * Under the write lock no pessimistic writer is running, so wr_snap and
+ * its merge snapshot can only be left over from one that died. A
+ * multi-domain commit that died after its group record still needs them.
+ */
+static void reap_pessimistic_leftovers(btrfstrans_ctx* ctx) {
+    if (exists_at(ctx->root_fd, BTRFSTRANS_WRITABLE_NAME) && !group_needs(ctx, BTRFSTRANS_WRITABLE_NAME)) {
+        reap_subvolume(ctx->root_fd, BTRFSTRANS_WRITABLE_NAME);
+    }
+    if (exists_at(ctx->root_fd, LIBBTRFSTRANS_MERGE_SNAP_NAME_PREFIX "0") &&
+        !group_needs(ctx, LIBBTRFSTRANS_MERGE_SNAP_NAME_PREFIX "0")) {
+        reap_subvolume(ctx->root_fd, LIBBTRFSTRANS_MERGE_SNAP_NAME_PREFIX "0");
+    }
+}
+
+/*
+ * Records us as the holder of a lock we just took. If the previous holder
+ * died with it, its snapshots are cleaned up first.
+ */
+static void lock_taken(btrfstrans_ctx* ctx, int which) {
+    pid_t dead = ctx->shm->lock_owners[which].pid;
+
+    ctx->shm->lock_owners[which].pid = getpid();
+    if (!dead) {
+        return;
+    }
+
+    log_error("process %d died holding the %s lock, cleaning up after it", dead, lock_names[which]);
+    stats_count(BTRFSTRANS_COUNTER_LOCK_TAKEOVERS);
+    if (which == BTRFSTRANS_LOCK_WRITE) {
+        reap_pessimistic_leftovers(ctx);
+    } else if (which == BTRFSTRANS_LOCK_RENAME) {
+        recover_journal(ctx);
+        recover_intent(ctx);
+        recover_groups(ctx);
+    }
+    // a recycled pid can't be told apart from ourselves, leave it to
+    // reap_dead_writers(ctx, 0) of a later process
+    if (dead != getpid()) {
+        reap_dead_writers(ctx, dead);
+    }
+}
+
+/*
+ * The write lock is held from start to commit or abort, which may happen
+ * in different threads, so every transaction locks through its own open
+ * file description instead of the mutex protected one of the context.
+ */
+static int acquire_write_lock(btrfstrans_txn* txn, int timeout_ms) {
+    unsigned long long t = stats_now();
+    int ret;
+
+    txn->write_lock_fd = shm_open(txn->ctx->shm_name, O_RDWR, 0);
+    if (txn->write_lock_fd < 0) {
+        log_error("%s (shm_open()) = %d", __func__, errno);
+        return E_ACCESS;
+    }
+
+    ret = ofd_lock(txn->write_lock_fd, BTRFSTRANS_LOCK_WRITE, timeout_ms);
+    if (ret) {
+        close(txn->write_lock_fd);
+        txn->write_lock_fd = -1;
+        return ret;
+    }
+
+    lock_taken(txn->ctx, BTRFSTRANS_LOCK_WRITE);
+    stats_record(BTRFSTRANS_PHASE_WRITE_LOCK, t);
+    return SUCCESS;
+}
+
+static int release_write_lock(btrfstrans_txn* txn) {
+    if (txn->write_lock_fd < 0) {
+        return SUCCESS;
+    }
+
+    txn->ctx->shm->lock_owners[BTRFSTRANS_LOCK_WRITE].pid = 0;
+    // closing the only fd of the description drops the lock
+    close(txn->write_lock_fd);
+    txn->write_lock_fd = -1;
+    return SUCCESS;
+}
+
+/*
+ * Cleans up after a pessimistic writer that died while the lock table
+ * wasn't there to tell, e.g. before a reboot, unless a writer is running.
+ */
+static void recover_write_lock(btrfstrans_ctx* ctx) {
+    btrfstrans_txn txn = { .ctx = ctx, .write_lock_fd = -1 };
+
+    if (acquire_write_lock(&txn, 0) == SUCCESS) {
+        reap_pessimistic_leftovers(ctx);
+        release_write_lock(&txn);
+    }
+}
+
+static int ctx_lock(btrfstrans_ctx* ctx, pthread_mutex_t* mutex, int which, int phase) {
+    unsigned long long t = stats_now();
+    int ret;
+
+    pthread_mutex_lock(mutex);
+    ret = ofd_lock(ctx->lock_fd, which, -1);
+    if (ret) {
+        pthread_mutex_unlock(mutex);
+        return ret;
+    }
+
+    lock_taken(ctx, which);
+    stats_record(phase, t);
+    return SUCCESS;
+}
+
+static int ctx_unlock(btrfstrans_ctx* ctx, pthread_mutex_t* mutex, int which) {
+    ctx->shm->lock_owners[which].pid = 0;
+    ofd_unlock(ctx->lock_fd, which);
+    pthread_mutex_unlock(mutex);
+    return SUCCESS;
+}
+
+// protects the read-only tables in shared memory
+static int acquire_ro_lock(btrfstrans_ctx* ctx) {
+    return ctx_lock(ctx, &ctx->ro_mutex, BTRFSTRANS_LOCK_RO, BTRFSTRANS_PHASE_RO_LOCK);
+}
+
+static int release_ro_lock(btrfstrans_ctx* ctx) {
+    return ctx_unlock(ctx, &ctx->ro_mutex, BTRFSTRANS_LOCK_RO);
+}
+
+static int acquire_rename_lock(btrfstrans_ctx* ctx) {
+    return ctx_lock(ctx, &ctx->rename_mutex, BTRFSTRANS_LOCK_RENAME, BTRFSTRANS_PHASE_RENAME_LOCK);
+}
+
+static int release_rename_lock(btrfstrans_ctx* ctx) {
+    return ctx_unlock(ctx, &ctx->rename_mutex, BTRFSTRANS_LOCK_RENAME);
+}
+
+/*
+ * Removes the staging directories of journal transactions of dead
+ * processes from head, like reap_dead_writers() for their snapshots.
+ */
+static void reap_dead_stages(btrfstrans_ctx* ctx, pid_t pid) {
+    struct dirent* de;
+    pid_t owner;
+    char* end;
+    DIR* dir;
+    int head_fd, fd;
+
+    head_fd = openat(ctx->root_fd, BTRFSTRANS_HEAD_NAME, O_RDONLY | O_DIRECTORY);
+    if (head_fd < 0) {
+        return;
+    }
+    fd = openat(head_fd, BTRFSTRANS_JOURNAL_DIR_NAME, O_RDONLY | O_DIRECTORY);
+    close(head_fd);
+    dir = fd < 0 ? NULL : fdopendir(fd);
+    if (!dir) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+
+    while ((de = readdir(dir))) {
+        owner = strtol(de->d_name, &end, 10);
+        if (*end == '_' && owner > 0 && owner != getpid() &&
+            (pid ? owner == pid : kill(owner, 0) && errno == ESRCH) && !journal_needs(ctx, de->d_name)) {
+            remove_stage(dirfd(dir), de->d_name);
+        }
+    }
+    closedir(dir);
+}
+
+/*
+ * Reaps the writable, merge and savepoint snapshots of process pid, or of
+ * all processes that don't exist anymore if pid is 0. Their names start
+ * with the pid of their creator.
+ */
+static int reap_dead_writers(btrfstrans_ctx* ctx, pid_t pid) {
+    static const char* prefixes[] = {
+        LIBBTRFSTRANS_WR_SNAP_NAME_PREFIX,
+        LIBBTRFSTRANS_MERGE_SNAP_NAME_PREFIX,
+        LIBBTRFSTRANS_SAVEPOINT_NAME_PREFIX
+    };
+    struct dirent* de;
+    pid_t owner;
+    char* end;
+    DIR* dir;
+    int fd;
+
+    fd = dup(ctx->root_fd);
+    dir = fd < 0 ? NULL : fdopendir(fd);
+    if (!dir) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return E_ACCESS;
+    }
+
+    while ((de = readdir(dir))) {
+        for (size_t i = 0; i < sizeof(prefixes) / sizeof(prefixes[0]); i++) {
+            size_t len = strlen(prefixes[i]);
+
+            if (strncmp(de->d_name, prefixes[i], len)) {
+                continue;
+            }
+            owner = strtol(de->d_name + len, &end, 10);
+            if (*end == '_' && owner > 0 && owner != getpid() &&
+                (pid ? owner == pid : kill(owner, 0) && errno == ESRCH) && !group_needs(ctx, de->d_name)) {
+                reap_subvolume(ctx->root_fd, de->d_name);
+            }
+            break;
+        }
+    }
+    closedir(dir);
+
+    reap_dead_stages(ctx, pid);
+    return SUCCESS;
+}
+
+/*
+ * Write leases bound how long a pessimistic writer may keep the write
+ * lock. When a lease runs out, the lease thread of the writer's process
+ * reaps its snapshot and drops the lock on its behalf, so a hung writer
+ * doesn't stall all others; the writer gets E_LEASEEXPIRED from commit,
+ * savepoint and rollback. 0 (the default) means no lease.
+ */
+int btrfstrans_ctx_set_write_lease(btrfstrans_ctx* ctx, int lease_ms) {
+    if (lease_ms < 0) {
+        log_error("invalid write lease %d", lease_ms);
+        return E_UNSPECIFIED;
+    }
+
+    __atomic_store_n(&ctx->write_lease_ms, lease_ms, __ATOMIC_RELAXED);
+    return SUCCESS;
+}
+
+int btrfstrans_set_write_lease(int lease_ms) {
+    if (lease_ms < 0) {
+        log_error("invalid write lease %d", lease_ms);
+        return E_UNSPECIFIED;
+    }
+
+    legacy_write_lease_ms = lease_ms;
+    return legacy_ctx ? btrfstrans_ctx_set_write_lease(legacy_ctx, lease_ms) : SUCCESS;
+}
+
+/*
+ * Turns changesets on for the volume, see collect_changes(). Every process
+ * writes them from its next commit on.
+ */
+int btrfstrans_ctx_enable_changesets(btrfstrans_ctx* ctx) {
+    if (mkdirat(ctx->root_fd, BTRFSTRANS_CHANGES_NAME, 0755) && errno != EEXIST) {
+        log_error("can't create changeset directory %s/%s - %s", ctx->root_path,
+            BTRFSTRANS_CHANGES_NAME, strerror(errno));
+        return E_ACCESS;
+    }
+    return open_changes(ctx) < 0 ? E_ACCESS : SUCCESS;
+}
+
+int btrfstrans_enable_changesets() {
+    if (!legacy_ctx) {
+        log_error("libbtrfstrans was not configured");
+        return E_WRONGSTATE;
+    }
+    return btrfstrans_ctx_enable_changesets(legacy_ctx);
+}
+
+/*
+ * Delivers the changes of the commits from from_seq up to the current head
+ * to fn and returns in *next_seq the commit to continue with.
+ */
+int btrfstrans_ctx_read_changes(btrfstrans_ctx* ctx, unsigned long long from_seq, unsigned long long* next_seq,
+    btrfstrans_change_fn fn, void* arg) {
+    unsigned long long head_seq, seq;
+    char name[32];
+    char* line = NULL;
+    size_t line_cap = 0;
+    ssize_t len;
+    FILE* fp;
+    int dir_fd, fd;
+    int ret;
+
+    ret = read_seq(ctx->root_fd, BTRFSTRANS_HEAD_NAME, &head_seq);
+    if (ret) {
+        return ret;
+    }
+    if (from_seq == 0) {
+        *next_seq = head_seq + 1;
+        return SUCCESS;
+    }
+
+    seq = from_seq;
+    if (seq <= head_seq && head_seq - seq >= BTRFSTRANS_CHANGES_KEEP) {
+        // fell behind the changesets that are kept
+        ret = fn(head_seq, BTRFSTRANS_CHANGE_ALL, "", arg);
+        if (!ret) {
+            seq = head_seq + 1;
+        }
+    }
+
+    dir_fd = open_changes(ctx);
+    while (!ret && seq <= head_seq) {
+        snprintf(name, sizeof(name), "%llu", seq);
+        fd = dir_fd < 0 ? -1 : openat(dir_fd, name, O_RDONLY);
+        fp = fd < 0 ? NULL : fdopen(fd, "r");
+        if (!fp) {
+            // committed without changesets, or dropped in the meantime
+            if (fd >= 0) {
+                close(fd);
+            }
+            ret = fn(seq, BTRFSTRANS_CHANGE_ALL, "", arg);
+        } else {
+            while (!ret && (len = getline(&line, &line_cap, fp)) > 0) {
+                if (line[len - 1] == '\n') {
+                    line[--len] = '\0';
+                }
+                ret = fn(seq, line[0], len > 2 ? line + 2 : "", arg);
+            }
+            fclose(fp);
+        }
+        if (!ret) {
+            seq++;
+        }
+    }
+
+    free(line);
+    *next_seq = seq;
+    return ret;
+}
+
+int btrfstrans_read_changes(unsigned long long from_seq, unsigned long long* next_seq, btrfstrans_change_fn fn, void* arg) {
+    if (!legacy_ctx) {
+        log_error("libbtrfstrans was not configured");
+        return E_WRONGSTATE;
+    }
+    return btrfstrans_ctx_read_changes(legacy_ctx, from_seq, next_seq, fn, arg);
+}
+
+/*
+ * Waits until head has at least sequence seq, or timeout_ms passed (< 0:
+ * forever).
+ */
+int btrfstrans_ctx_wait_commit(btrfstrans_ctx* ctx, unsigned long long seq, int timeout_ms) {
+    unsigned long long head_seq, deadline = 0, now, slice;
+    struct timespec ts;
+    uint32_t word;
+    int ret;
+
+    if (timeout_ms >= 0) {
+        deadline = monotonic_ns() + timeout_ms * 1000000ULL;
+    }
+    for (;;) {
+        // read before head: a swap in between changes it, so we don't sleep
+        word = __atomic_load_n(&ctx->shm->commit_futex, __ATOMIC_ACQUIRE);
+        ret = read_seq(ctx->root_fd, BTRFSTRANS_HEAD_NAME, &head_seq);
+        if (ret) {
+            return ret;
+        }
+        if (head_seq >= seq) {
+            return SUCCESS;
+        }
+
+        // a committer killed between the swap and notify_commit() wakes nobody
+        slice = BTRFSTRANS_CHANGES_WAIT_SLICE_MS * 1000000ULL;
+        if (timeout_ms >= 0) {
+            now = monotonic_ns();
+            if (now >= deadline) {
+                return E_TIMEOUT;
+            }
+            if (deadline - now < slice) {
+                slice = deadline - now;
+            }
+        }
+        ts.tv_sec = slice / 1000000000ULL;
+        ts.tv_nsec = slice % 1000000000ULL;
+        syscall(SYS_futex, &ctx->shm->commit_futex, FUTEX_WAIT, word, &ts, NULL, 0);
+    }
+}
+
+int btrfstrans_wait_commit(unsigned long long seq, int timeout_ms) {
+    if (!legacy_ctx) {
+        log_error("libbtrfstrans was not configured");
+        return E_WRONGSTATE;
+    }
+    return btrfstrans_ctx_wait_commit(legacy_ctx, seq, timeout_ms);
+}
+
+// called with lease_mutex held, txn is off the list already
+static void revoke_lease(btrfstrans_txn* txn) {
+    log_error("write lease of %s expired, releasing the write lock", txn->writable_subvolume_path);
+    if (!txn->journal) {
+        reap_subvolume(txn->ctx->root_fd, txn->writable_subvolume_name);
+    }
+    txn->lease_revoked = 1;
+    release_write_lock(txn);
+    stats_count(BTRFSTRANS_COUNTER_LEASE_EXPIRIES);
+}
+
+static void* lease_main(void* arg) {
+    unsigned long long now, next;
+    btrfstrans_txn** pp;
+    btrfstrans_txn* txn;
+    struct timespec deadline;
+
+    pthread_mutex_lock(&lease_mutex);
+    for (;;) {
+        now = monotonic_ns();
+        next = 0;
+        for (pp = &lease_list; (txn = *pp); ) {
+            if (txn->lease_expiry <= now) {
+                // a busy writer is revoked as soon as lease_unhold() wakes us
+                if (!txn->lease_busy) {
+                    *pp = txn->lease_next;
+                    revoke_lease(txn);
+                    continue;
+                }
+            } else if (!next || txn->lease_expiry < next) {
+                next = txn->lease_expiry;
+            }
+            pp = &txn->lease_next;
+        }
+
+        if (!next) {
+            pthread_cond_wait(&lease_cond, &lease_mutex);
+        } else {
+            deadline.tv_sec = next / 1000000000ULL;
+            deadline.tv_nsec = next % 1000000000ULL;
+            pthread_cond_timedwait(&lease_cond, &lease_mutex, &deadline);
+        }
+    }
+    pthread_mutex_unlock(&lease_mutex);
+
+    return NULL;
+}
+
+static void lease_begin(btrfstrans_txn* txn) {
+    int lease_ms = __atomic_load_n(&txn->ctx->write_lease_ms, __ATOMIC_RELAXED);
+    pthread_condattr_t attr;
+
+    if (!lease_ms) {
+        return;
+    }
+
+    pthread_mutex_lock(&lease_mutex);
+    if (!lease_running) {
+        // lease expiries are monotonic clock times
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&lease_cond, &attr);
+        pthread_condattr_destroy(&attr);
+        if (pthread_create(&lease_thread, NULL, lease_main, NULL)) {
+            pthread_cond_destroy(&lease_cond);
+            pthread_mutex_unlock(&lease_mutex);
+            log_error("can't start the lease thread, transaction runs without lease");
+            return;
+        }
+        pthread_detach(lease_thread);
+        lease_running = 1;
+    }
+
+    txn->lease_expiry = monotonic_ns() + lease_ms * 1000000ULL;
+    txn->lease_next = lease_list;
+    lease_list = txn;
+    pthread_cond_signal(&lease_cond);
+    pthread_mutex_unlock(&lease_mutex);
+}
+
+/*
+ * Keeps the lease of txn from being revoked while it works on its
+ * snapshot by name. Fails if it was revoked already.
+ */
+static int lease_hold(btrfstrans_txn* txn) {
+    int ret = SUCCESS;
+
+    if (!txn->lease_expiry) {
+        return SUCCESS;
+    }
+
+    pthread_mutex_lock(&lease_mutex);
+    if (txn->lease_revoked) {
+        ret = E_LEASEEXPIRED;
+    } else {
+        txn->lease_busy++;
+    }
+    pthread_mutex_unlock(&lease_mutex);
+    return ret;
+}
+
+static void lease_unhold(btrfstrans_txn* txn) {
+    if (!txn->lease_expiry) {
+        return;
+    }
+
+    pthread_mutex_lock(&lease_mutex);
+    if (--txn->lease_busy == 0 && txn->lease_expiry <= monotonic_ns()) {
+        pthread_cond_signal(&lease_cond);
+    }
+    pthread_mutex_unlock(&lease_mutex);
+}
+
+/*
+ * Takes txn off the lease list for good. Returns E_LEASEEXPIRED if the
+ * lease was revoked before.
+ */
+static int lease_end(btrfstrans_txn* txn) {
+    btrfstrans_txn** pp;
+    int ret;
+
+    if (!txn->lease_expiry) {
+        return SUCCESS;
+    }
+
+    pthread_mutex_lock(&lease_mutex);
+    for (pp = &lease_list; *pp; pp = &(*pp)->lease_next) {
+        if (*pp == txn) {
+            *pp = txn->lease_next;
+            break;
+        }
+    }
+    ret = txn->lease_revoked ? E_LEASEEXPIRED : SUCCESS;
+    pthread_mutex_unlock(&lease_mutex);
+    return ret;
+}
+
+/*
+  these functions redefined here from btrfs-progs. There is some linker error
+  and hence this ugly way out is done */
+
+/*
+ * test if path is a subvolume:
+ * this function return
+ * 0-> path exists but it is not a subvolume
+ * 1-> path exists and it is a subvolume
+ * -1 -> path is unaccessible
+ */
+int test_issubvolume(const char *path) {// from btrfs progs: cmds-subvolume.c
+    struct stat st;
+    int res;
+
+    res = stat(path, &st);
+    if(res < 0 )
+        return -1;
+
+    return (st.st_ino == 256) && S_ISDIR(st.st_mode);
+}
+
+
+/*
+ * test if path is a directory
+ * this function return
+ * 0-> path exists but it is not a directory
+ * 1-> path exists and it is a directory
+ * -1 -> path is unaccessible
+ */
+int test_isdir(const char *path) {// from btrfs progs: cmds-subvolume.c
+    struct stat st;
+    int res;
+
+    res = stat(path, &st);
+    if(res < 0 )
+        return -1;
+
+    return S_ISDIR(st.st_mode);
+}
+
+#define strncpy_null(dest, src) __strncpy_null(dest, src, sizeof(dest))
+char *__strncpy_null(char *dest, const char *src, size_t n)
+{
+	strncpy(dest, src, n);
+	if (n > 0)
+		dest[n - 1] = '\0';
+	return dest;
+}
+
+/*
+ * dirname() and basename() of path without copies on the heap: path is
+ * copied to buf (PATH_MAX bytes), *name points at its last component in
+ * there and the directory holding it is returned, NULL if path is too
+ * long.
+ */
+static const char* split_path(const char* path, char* buf, const char** name) {
+    size_t len = strlen(path);
+    char* slash;
+
+    if (len >= PATH_MAX) {
+        log_error("path too long ('%s')", path);
+        return NULL;
+    }
+    memcpy(buf, path, len + 1);
+    while (len > 1 && buf[len - 1] == '/') {
+        buf[--len] = '\0';
+    }
+
+    slash = strrchr(buf, '/');
+    if (!slash) {
+        *name = buf;
+        return ".";
+    }
+    *name = slash + 1;
+    if (slash == buf) {
+        return "/";
+    }
+    *slash = '\0';
+    return buf;
+}
+
+int create_snapshot(const char* subvol, char* dst, int readonly, int async) // from btrfs progs: cmds-subvolume.c
+{
+    int res, retval;
+    int fd = -1, fddst = -1;
+    int len;
+    const char *newname;
+    const char *dstdir;
+    char buf[PATH_MAX];
+    struct btrfs_ioctl_vol_args_v2 args;
+
+    memset(&args, 0, sizeof(args));
+
+    retval = E_UNSPECIFIED; /* failure */
+    res = test_issubvolume(subvol);
+    if (res < 0) {
+        log_error("error accessing '%s'", subvol);
+        retval = E_ACCESS;
+        goto out;
+    }
+    if (!res) {
+        log_error("'%s' is not a subvolume", subvol);
+        retval = E_NOTASUBVOLUME;
+        goto out;
+    }
+
+    res = test_isdir(dst);
+    if (res == 0) {
+        log_error("'%s' exists and it is not a directory", dst);
+        retval = E_EXISTSANDNOTADIR;
+        goto out;
+    }
+    if (res > 0) { //path exists and is directory
+        if (!split_path(subvol, buf, &newname)) {
+            retval = E_ACCESS;
+            goto out;
+        }
+        dstdir = dst;
+    } else { //path is unaccessible
+        dstdir = split_path(dst, buf, &newname);
+        if (!dstdir) {
+            retval = E_ACCESS;
+            goto out;
+        }
+    }
+
+    if (!strcmp(newname, ".") || !strcmp(newname, "..") || strchr(newname, '/')) {
+        log_error("incorrect snapshot name ('%s')", newname);
+        retval = E_INCORRECTSNAPNAME;
+        goto out;
+    }
+
+    len = strlen(newname);
+    if (len == 0 || len >= BTRFS_VOL_NAME_MAX) {
+        log_error("snapshot name too long ('%s)", newname);
+        retval = E_SNAPNAMETOOLONG;
+        goto out;
+    }
+
+    fddst = open(dstdir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fddst < 0) {
+        log_error("can't access to '%s'", dstdir);
+        retval = E_ACCESS;
+        goto out;
+    }
+
+    fd = open(subvol, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        log_error("can't access to '%s'", subvol);
+        retval = E_ACCESS;
+        goto out;
+    }
+
+    if (readonly) {
+        args.flags |= BTRFS_SUBVOL_RDONLY;
+    }
+    log_debug("create a%s snapshot of '%s' in '%s/%s'", readonly ? " readonly" : "", subvol, dstdir, newname);
+
+    if (async != 0) {
+        args.flags |= BTRFS_SUBVOL_CREATE_ASYNC;
+    }
+
+
+    args.fd = fd;
+
+    strncpy_null(args.name, newname);
+    log_debug("creating snapshot %s/%s of %s", dstdir, newname, subvol);
+
+    unsigned long long t = stats_now();
+    res = ioctl(fddst, BTRFS_IOC_SNAP_CREATE_V2, &args);
+    stats_record(BTRFSTRANS_PHASE_SNAPSHOT, t);
+
+    if (res < 0) {
+        log_error("cannot snapshot '%s' - %s", subvol, strerror(errno));
+        goto out;
+    }
+
+    retval = SUCCESS;
+
+out:
+    if (fd != -1) {
+        close(fd);
+    }
+    if (fddst != -1) {
+        close(fddst);
+    }
+
+    return retval;
+}
+
+
+int create_subvolume(const char* dst) // from btrfs progs: cmds-subvolume.c
+{
+    int retval, res, len;
+    int fddst = -1;
+    const char *newname;
+    const char *dstdir;
+    char buf[PATH_MAX];
+    struct btrfs_ioctl_vol_args args;
+
+    retval = E_UNSPECIFIED; /* failure */
+    res = test_isdir(dst);
+    if (res >= 0) {
+        log_error("'%s' exists", dst);
+        goto out;
+    }
+
+    dstdir = split_path(dst, buf, &newname);
+    if (!dstdir) {
+        retval = E_ACCESS;
+        goto out;
+    }
+
+    if (!strcmp(newname, ".") || !strcmp(newname, "..") || strchr(newname, '/') ) {
+        log_error("incorrect subvolume name ('%s')", newname);
+        retval = E_INCORRECTSVNAME;
+        goto out;
+    }
+
+    len = strlen(newname);
+    if (len == 0 || len >= BTRFS_VOL_NAME_MAX) {
+        log_error("subvolume name too long ('%s)", newname);
+        retval = E_SVNAMETOOLONG;
+        goto out;
+    }
+
+    fddst = open(dstdir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fddst < 0) {
+        log_error("can't access to '%s'", dstdir);
+        retval = E_ACCESS;
+        goto out;
+    }
+
+    log_debug("create subvolume '%s/%s'", dstdir, newname);
+
+    memset(&args, 0, sizeof(args));
+    strncpy_null(args.name, newname);
+
+    res = ioctl(fddst, BTRFS_IOC_SUBVOL_CREATE, &args);
+
+    if (res < 0) {
+        log_error("cannot create subvolume - %s", strerror(errno));
+        goto out;
+    }
+
+    retval = SUCCESS;
+out:
+    if (fddst != -1)
+
+        close(fddst);
+
+    return retval;
+}
+
+
+int delete_subvolume(const char* path) // from btrfs progs: cmds-subvolume.c
+{
+    int res, fd, len, e;
+    struct btrfs_ioctl_vol_args args;
+    const char *dname, *vname;
+    char buf[PATH_MAX], cpath[PATH_MAX];
+
+    res = test_issubvolume(path);
+    if(res<0){
+        log_error("error accessing '%s'", path);
+        return E_ACCESS;
+    }
+    if(!res){
+        log_error("'%s' is not a subvolume", path);
+        return E_NOTASUBVOLUME;
+    }
+
+    dname = split_path(path, buf, &vname);
+    if (!dname) {
+        return E_ACCESS;
+    }
+    // only a path ending in . or .. needs resolving to find the name
+    if (!strcmp(vname, ".") || !strcmp(vname, "..")) {
+        if (!realpath(path, cpath)) {
+            log_error("error accessing '%s'", path);
+            return E_ACCESS;
+        }
+        dname = split_path(cpath, buf, &vname);
+        if (!dname) {
+            return E_ACCESS;
+        }
+    }
+
+    if( !strcmp(vname,".") || !strcmp(vname,"..") || strchr(vname, '/') ){
+        log_error("incorrect subvolume name ('%s')", vname);
+        return E_INCORRECTSVNAME;
+    }
+
+    len = strlen(vname);
+    if (len == 0 || len >= BTRFS_VOL_NAME_MAX) {
+        log_error("snapshot name too long ('%s)", vname);
+        return E_SNAPNAMETOOLONG;
+    }
+
+    fd = open(dname, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        log_error("can't access to '%s'", dname);
+        return E_ACCESS;
+    }
+
+    log_debug("delete subvolume '%s/%s'", dname, vname);
+    memset(&args, 0, sizeof(args));
+    strncpy_null(args.name, vname);
+    unsigned long long t = stats_now();
+    res = ioctl(fd, BTRFS_IOC_SNAP_DESTROY, &args);
+    e = errno;
+    stats_record(BTRFSTRANS_PHASE_DESTROY, t);
+
+    close(fd);
+
+    if(res < 0 ){
+        log_error("cannot delete '%s/%s' - %s", dname, vname, strerror(e));
+        return E_DELETE;
+    }
+
+    return SUCCESS;
+}
+
+static int destroy_subvolume_at(int parent_fd, const char* name) {
+    unsigned long long t = stats_now();
+    struct btrfs_ioctl_vol_args args;
+
+    memset(&args, 0, sizeof(args));
+    strncpy_null(args.name, name);
+    if (ioctl(parent_fd, BTRFS_IOC_SNAP_DESTROY, &args) < 0) {
+        log_error("cannot delete '%s' - %s", name, strerror(errno));
+        return E_DELETE;
+    }
+    stats_record(BTRFSTRANS_PHASE_DESTROY, t);
+    return SUCCESS;
+}
+
+/*
+ * Snapshots the subvolume src_parent_fd/src_name to parent_fd/name.
+ */
+static int snapshot_at(int src_parent_fd, const char* src_name, int parent_fd, const char* name, int readonly) {
+    unsigned long long t = stats_now();
+    struct btrfs_ioctl_vol_args_v2 args;
+    int fd, res;
+
+    fd = openat(src_parent_fd, src_name, O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        return E_ACCESS;
+    }
+
+    memset(&args, 0, sizeof(args));
+    args.fd = fd;
+    if (readonly) {
+        args.flags |= BTRFS_SUBVOL_RDONLY;
+    }
+    strncpy_null(args.name, name);
+
+    res = ioctl(parent_fd, BTRFS_IOC_SNAP_CREATE_V2, &args);
+    close(fd);
+    if (res < 0) {
+        return E_UNSPECIFIED;
+    }
+    stats_record(BTRFSTRANS_PHASE_SNAPSHOT, t);
+    return SUCCESS;
+}
+
+/*
+ * Snapshots src_parent_fd/src_name read-only as it was committed: the
+ * staging directories that journal transactions keep in head are
+ * removed before the snapshot is sealed, so no reader, export or
+ * retained generation ever sees them.
+ */
+static int snapshot_committed(int src_parent_fd, const char* src_name, int parent_fd, const char* name) {
+    int fd, ret;
+
+    ret = snapshot_at(src_parent_fd, src_name, parent_fd, name, BTRFSTRANS_WRITABLE);
+    if (ret) {
+        return ret;
+    }
+    fd = openat(parent_fd, name, O_RDONLY | O_DIRECTORY);
+    ret = fd < 0 ? E_ACCESS : seal_snapshot(fd);
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (ret) {
+        log_error("can't make snapshot %s read-only - %s", name, strerror(errno));
+        destroy_subvolume_at(parent_fd, name);
+    }
+    return ret;
+}
+
+// strips the staging directories of subvolume sv_fd and makes it read-only, if it isn't yet
+static int seal_snapshot(int sv_fd) {
+    __u64 flags;
+
+    if (ioctl(sv_fd, BTRFS_IOC_SUBVOL_GETFLAGS, &flags) < 0) {
+        return E_ACCESS;
+    }
+    if (flags & BTRFS_SUBVOL_RDONLY) {
+        return SUCCESS;
+    }
+    strip_journal(sv_fd);
+    flags |= BTRFS_SUBVOL_RDONLY;
+    if (ioctl(sv_fd, BTRFS_IOC_SUBVOL_SETFLAGS, &flags) < 0) {
+        return E_ACCESS;
+    }
+    return SUCCESS;
+}
+
+static void* reaper_main(void* arg) {
+    struct reaper_entry batch[BTRFSTRANS_REAPER_BATCH];
+    struct timespec deadline;
+    int n;
+
+    pthread_mutex_lock(&reaper_mutex);
+    for (;;) {
+        while (reaper_len == 0 && !reaper_stopping) {
+            pthread_cond_wait(&reaper_cond, &reaper_mutex);
+        }
+        if (reaper_len == 0) {
+            break;
+        }
+
+        for (n = 0; n < BTRFSTRANS_REAPER_BATCH && reaper_len > 0; n++) {
+            batch[n] = reaper_queue[reaper_head];
+            reaper_head = (reaper_head + 1) % BTRFSTRANS_REAPER_QUEUE_LEN;
+            reaper_len--;
+        }
+        reaper_in_flight = n;
+        pthread_mutex_unlock(&reaper_mutex);
+
+        for (int i = 0; i < n; i++) {
+            destroy_subvolume_at(batch[i].parent_fd, batch[i].name);
+            close(batch[i].parent_fd);
+        }
+
+        pthread_mutex_lock(&reaper_mutex);
+        reaper_in_flight = 0;
+        pthread_cond_broadcast(&reaper_idle_cond);
+
+        // every destroyed subvolume is work for the btrfs cleaner thread:
+        // spread it out, unless the process is about to exit
+        if (reaper_rate && !reaper_stopping) {
+            long long ns = 1000000000LL * n / reaper_rate;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += (deadline.tv_nsec + ns) / 1000000000LL;
+            deadline.tv_nsec = (deadline.tv_nsec + ns) % 1000000000LL;
+            while (!reaper_stopping &&
+                pthread_cond_timedwait(&reaper_cond, &reaper_mutex, &deadline) != ETIMEDOUT);
+        }
+    }
+    pthread_mutex_unlock(&reaper_mutex);
+
+    return NULL;
+}
+
+/*
+ * Drains the queue without rate limit when the process exits, so short
+ * lived processes don't leave their old heads behind.
+ */
+static void reaper_shutdown() {
+    pthread_mutex_lock(&reaper_mutex);
+    if (!reaper_running) {
+        pthread_mutex_unlock(&reaper_mutex);
+        return;
+    }
+    reaper_stopping = 1;
+    pthread_cond_broadcast(&reaper_cond);
+    pthread_mutex_unlock(&reaper_mutex);
+
+    pthread_join(reaper_thread, NULL);
+}
+
+static int enqueue_reap(int parent_fd, const char* name) {
+    struct reaper_entry* entry;
+    int fd;
+
+    pthread_mutex_lock(&reaper_mutex);
+    if (!reaper_running) {
+        if (pthread_create(&reaper_thread, NULL, reaper_main, NULL)) {
+            pthread_mutex_unlock(&reaper_mutex);
+            return destroy_subvolume_at(parent_fd, name);
+        }
+        reaper_running = 1;
+        atexit(reaper_shutdown);
+    }
+
+    // the reaper can't keep up, fall back to deleting inline
+    if (reaper_len == BTRFSTRANS_REAPER_QUEUE_LEN || (fd = dup(parent_fd)) < 0) {
+        pthread_mutex_unlock(&reaper_mutex);
+        stats_count(BTRFSTRANS_COUNTER_REAP_INLINE);
+        return destroy_subvolume_at(parent_fd, name);
+    }
+
+    entry = &reaper_queue[(reaper_head + reaper_len) % BTRFSTRANS_REAPER_QUEUE_LEN];
+    entry->parent_fd = fd;
+    strncpy_null(entry->name, name);
+    reaper_len++;
+    pthread_cond_signal(&reaper_cond);
+    pthread_mutex_unlock(&reaper_mutex);
+
+    return SUCCESS;
+}
+
+/*
+ * Renames the subvolume parent_fd/name to a unique name, which makes the
+ * old name available again immediately, and queues it for deletion.
+ */
+static int reap_subvolume(int parent_fd, const char* name) {
+    unsigned long long t = stats_now();
+    char reap_name[BTRFS_VOL_NAME_MAX+1];
+    int ret;
+
+    snprintf(reap_name, sizeof(reap_name), "%s%d_%u", LIBBTRFSTRANS_REAP_NAME_PREFIX,
+        getpid(), __atomic_add_fetch(&reap_counter, 1, __ATOMIC_RELAXED));
+    if (renameat(parent_fd, name, parent_fd, reap_name)) {
+        log_error("renaming %s to %s - %s", name, reap_name, strerror(errno));
+        return E_RENAME;
+    }
+
+    ret = enqueue_reap(parent_fd, reap_name);
+    stats_record(BTRFSTRANS_PHASE_REAP, t);
+    return ret;
+}
+
+/*
+ * Queues reap_* subvolumes under parent_fd that were left behind by
+ * processes which exited before their reaper finished. Our own ones are
+ * already queued.
+ */
+static int reap_leftovers(int parent_fd) {
+    char own_prefix[32];
+    struct dirent* de;
+    DIR* dir;
+    int fd;
+
+    snprintf(own_prefix, sizeof(own_prefix), "%s%d_", LIBBTRFSTRANS_REAP_NAME_PREFIX, getpid());
+
+    fd = dup(parent_fd);
+    if (fd < 0) {
+        return E_ACCESS;
+    }
+    dir = fdopendir(fd);
+    if (!dir) {
+        close(fd);
+        return E_ACCESS;
+    }
+
+    while ((de = readdir(dir))) {
+        if (!strncmp(de->d_name, LIBBTRFSTRANS_REAP_NAME_PREFIX, strlen(LIBBTRFSTRANS_REAP_NAME_PREFIX)) &&
+            strncmp(de->d_name, own_prefix, strlen(own_prefix))) {
+            enqueue_reap(parent_fd, de->d_name);
+        }
+    }
+    closedir(dir);
+
+    return SUCCESS;
+}
+
+/*
+ * Limits the number of subvolume deletions per second issued by the
+ * reaper, 0 means unlimited.
+ */
+int btrfstrans_set_reaper_rate(unsigned int per_second) {
+    pthread_mutex_lock(&reaper_mutex);
+    reaper_rate = per_second;
+    pthread_cond_broadcast(&reaper_cond);
+    pthread_mutex_unlock(&reaper_mutex);
+    return SUCCESS;
+}
+
+/*
+ * Number of subvolumes queued or being deleted by the reaper.
+ */
+int btrfstrans_reaper_queue_depth() {
+    int depth;
+
+    pthread_mutex_lock(&reaper_mutex);
+    depth = reaper_len + reaper_in_flight;
+    pthread_mutex_unlock(&reaper_mutex);
+    return depth;
+}
+
+/*
+ * Waits until the reaper has deleted everything queued so far.
+ */
+int btrfstrans_reaper_flush() {
+    pthread_mutex_lock(&reaper_mutex);
+    while (reaper_running && reaper_len + reaper_in_flight > 0) {
+        pthread_cond_wait(&reaper_idle_cond, &reaper_mutex);
+    }
+    pthread_mutex_unlock(&reaper_mutex);
+    return SUCCESS;
+}
+
+
+/*
+ * Converting a directory into a subvolume. A pool of threads walks the
+ * tree: every thread has a deque of directories, takes the newest one of
+ * its own and, when that is empty, steals the oldest one of another
+ * thread, so the walk stays depth first per thread while big subtrees get
+ * spread out. Queued directories are paths relative to the tree, not open
+ * fds, so the number of open files doesn't grow with the width of the
+ * tree. A directory is finished, its metadata copied or itself removed,
+ * once all directories below it are.
+ */
+enum {
+    WALK_COPY,      // recreate the tree below dst_root_fd
+    WALK_REMOVE     // delete the tree
+};
+
+struct walk_node {
+    struct walk_node* parent;
+    int pending;        // own listing plus unfinished subdirectories, atomic
+    struct stat st;
+    char rel[];         // relative to the tree root, "" for the root
+};
+
+struct walk_deque {
+    pthread_mutex_t mutex;
+    struct walk_node** nodes;
+    int head;           // thieves take here
+    int tail;           // the owner pushes and pops here
+    int cap;
+};
+
+struct hardlink {
+    struct hardlink* next;
+    dev_t dev;
+    ino_t ino;
+    char rel[];         // of the first copy
+};
+
+struct walk {
+    int mode;
+    int src_root_fd;
+    int dst_root_fd;
+    int nthreads;
+    struct walk_deque* deques;
+
+    // idle threads sleep on cond until work is pushed or everything is done
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int idle;
+    int outstanding;    // directories queued or being listed
+    unsigned pushes;    // directories queued so far
+    int error;          // first errno, stops the walk
+
+    pthread_mutex_t links_mutex;
+    struct hardlink* links[BTRFSTRANS_CONVERT_LINK_BUCKETS];
+};
+
+struct walk_worker {
+    struct walk* walk;
+    int index;
+};
+
+static void walk_fail(struct walk* w, int err, const char* what, const char* rel, const char* name) {
+    int expected = 0;
+
+    if (__atomic_compare_exchange_n(&w->error, &expected, err, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        log_error("%s %s%s%s - %s", what, rel, *rel ? "/" : "", name, strerror(err));
+    }
+}
+
+static struct walk_node* walk_new_node(struct walk_node* parent, const char* name, const struct stat* st) {
+    size_t len = parent && *parent->rel ? strlen(parent->rel) + 1 : 0;
+    struct walk_node* node = malloc(sizeof(*node) + len + strlen(name) + 1);
+
+    if (!node) {
+        return NULL;
+    }
+    node->parent = parent;
+    node->pending = 1;
+    node->st = *st;
+    if (len) {
+        sprintf(node->rel, "%s/%s", parent->rel, name);
+    } else {
+        strcpy(node->rel, name);
+    }
+    return node;
+}
+
+static int walk_push(struct walk* w, int self, struct walk_node* node) {
+    struct walk_deque* dq = &w->deques[self];
+    struct walk_node** tmp;
+
+    pthread_mutex_lock(&dq->mutex);
+    if (dq->tail == dq->cap) {
+        // compact first, thieves leave a gap at the front
+        memmove(dq->nodes, dq->nodes + dq->head, (dq->tail - dq->head) * sizeof(*dq->nodes));
+        dq->tail -= dq->head;
+        dq->head = 0;
+        if (dq->tail == dq->cap) {
+            tmp = realloc(dq->nodes, 2 * (dq->cap ? dq->cap : 32) * sizeof(*dq->nodes));
+            if (!tmp) {
+                pthread_mutex_unlock(&dq->mutex);
+                return ENOMEM;
+            }
+            dq->nodes = tmp;
+            dq->cap = 2 * (dq->cap ? dq->cap : 32);
+        }
+    }
+    dq->nodes[dq->tail++] = node;
+    pthread_mutex_unlock(&dq->mutex);
+
+    pthread_mutex_lock(&w->mutex);
+    w->outstanding++;
+    __atomic_add_fetch(&w->pushes, 1, __ATOMIC_RELEASE);
+    if (w->idle) {
+        pthread_cond_signal(&w->cond);
+    }
+    pthread_mutex_unlock(&w->mutex);
+    return 0;
+}
+
+static struct walk_node* walk_take(struct walk* w, int self) {
+    struct walk_node* node = NULL;
+    struct walk_deque* dq;
+
+    for (int i = 0; i < w->nthreads && !node; i++) {
+        dq = &w->deques[(self + i) % w->nthreads];
+        pthread_mutex_lock(&dq->mutex);
+        if (dq->head < dq->tail) {
+            node = i == 0 ? dq->nodes[--dq->tail] : dq->nodes[dq->head++];
+            if (dq->head == dq->tail) {
+                dq->head = dq->tail = 0;
+            }
+        }
+        pthread_mutex_unlock(&dq->mutex);
+    }
+    return node;
+}
+
+// ENOTSUP and EPERM: the destination can't hold it, like 'cp -a' we go on
+static int copy_xattrs(int src_fd, int dst_fd) {
+    char* names = NULL;
+    char* value = NULL;
+    ssize_t len, vlen;
+    size_t cap = 0;
+    int ret = 0;
+
+    len = flistxattr(src_fd, NULL, 0);
+    if (len <= 0) {
+        return len < 0 && errno != ENOTSUP ? errno : 0;
+    }
+    names = malloc(len);
+    if (!names) {
+        return ENOMEM;
+    }
+    len = flistxattr(src_fd, names, len);
+
+    for (char* p = names; len > 0 && p < names + len && !ret; p += strlen(p) + 1) {
+        vlen = fgetxattr(src_fd, p, NULL, 0);
+        if (vlen < 0) {
+            ret = errno;
+            break;
+        }
+        if ((size_t)vlen + 1 > cap) {
+            char* tmp = realloc(value, vlen + 1);
+            if (!tmp) {
+                ret = ENOMEM;
+                break;
+            }
+            value = tmp;
+            cap = vlen + 1;
+        }
+        vlen = fgetxattr(src_fd, p, value, vlen);
+        if (vlen < 0) {
+            ret = errno;
+        } else if (fsetxattr(dst_fd, p, value, vlen, 0) && errno != ENOTSUP && errno != EPERM) {
+            ret = errno;
+        }
+    }
+
+    free(value);
+    free(names);
+    return ret;
+}
+
+// ownership only if we may, mode after it since chown clears setuid bits
+static int copy_meta(int src_fd, int dst_fd, const struct stat* st) {
+    struct timespec times[2] = { st->st_atim, st->st_mtim };
+    int ret;
+
+    if (fchown(dst_fd, st->st_uid, st->st_gid) && errno != EPERM) {
+        return errno;
+    }
+    if (fchmod(dst_fd, st->st_mode & 07777)) {
+        return errno;
+    }
+    ret = copy_xattrs(src_fd, dst_fd);
+    if (ret) {
+        return ret;
+    }
+    return futimens(dst_fd, times) ? errno : 0;
+}
+
+static int copy_file(struct walk* w, struct walk_node* dir, int src_dir_fd, int dst_dir_fd,
+    const char* name, const struct stat* st) {
+    struct hardlink* link = NULL;
+    struct hardlink** bucket;
+    int src_fd, dst_fd = -1;
+    int ret = 0;
+
+    if (st->st_nlink > 1) {
+        bucket = &w->links[(st->st_ino ^ st->st_dev) % BTRFSTRANS_CONVERT_LINK_BUCKETS];
+        pthread_mutex_lock(&w->links_mutex);
+        for (link = *bucket; link && (link->ino != st->st_ino || link->dev != st->st_dev); link = link->next);
+        if (link) {
+            ret = linkat(w->dst_root_fd, link->rel, dst_dir_fd, name, 0) ? errno : 0;
+            pthread_mutex_unlock(&w->links_mutex);
+            return ret;
+        }
+        // created under the mutex, so the other names can link to it at once
+        dst_fd = openat(dst_dir_fd, name, O_WRONLY | O_CREAT | O_EXCL, 0600);
+        link = dst_fd < 0 ? NULL : malloc(sizeof(*link) + strlen(dir->rel) + strlen(name) + 2);
+        if (link) {
+            link->dev = st->st_dev;
+            link->ino = st->st_ino;
+            sprintf(link->rel, "%s%s%s", dir->rel, *dir->rel ? "/" : "", name);
+            link->next = *bucket;
+            *bucket = link;
+        }
+        pthread_mutex_unlock(&w->links_mutex);
+        if (!link) {
+            ret = dst_fd < 0 ? errno : ENOMEM;
+            if (dst_fd >= 0) {
+                close(dst_fd);
+            }
+            return ret;
+        }
+    } else {
+        dst_fd = openat(dst_dir_fd, name, O_WRONLY | O_CREAT | O_EXCL, 0600);
+        if (dst_fd < 0) {
+            return errno;
+        }
+    }
+
+    src_fd = openat(src_dir_fd, name, O_RDONLY | O_NOFOLLOW);
+    if (src_fd < 0) {
+        ret = errno;
+    } else {
+        if (ioctl(dst_fd, FICLONE, src_fd) < 0 && copy_fd_range(src_fd, 0, dst_fd, 0, 0)) {
+            ret = errno ? errno : EIO;
+        }
+        if (!ret) {
+            ret = copy_meta(src_fd, dst_fd, st);
+        }
+        close(src_fd);
+    }
+    if (close(dst_fd) && !ret) {
+        ret = errno;
+    }
+    return ret;
+}
+
+static int copy_special(int src_dir_fd, int dst_dir_fd, const char* name, const struct stat* st) {
+    struct timespec times[2] = { st->st_atim, st->st_mtim };
+    char target[PATH_MAX];
+    ssize_t len;
+
+    if (S_ISLNK(st->st_mode)) {
+        len = readlinkat(src_dir_fd, name, target, sizeof(target) - 1);
+        if (len < 0) {
+            return errno;
+        }
+        target[len] = '\0';
+        if (symlinkat(target, dst_dir_fd, name)) {
+            return errno;
+        }
+    } else {
+        if (mknodat(dst_dir_fd, name, st->st_mode & ~07777, st->st_rdev)) {
+            return errno;
+        }
+        if (fchmodat(dst_dir_fd, name, st->st_mode & 07777, 0)) {
+            return errno;
+        }
+    }
+    if (fchownat(dst_dir_fd, name, st->st_uid, st->st_gid, AT_SYMLINK_NOFOLLOW) && errno != EPERM) {
+        return errno;
+    }
+    return utimensat(dst_dir_fd, name, times, AT_SYMLINK_NOFOLLOW) ? errno : 0;
+}
+
+/*
+ * Called when node and everything below it is done: copies the metadata
+ * of the directory, now that adding entries doesn't change its times
+ * anymore, or removes it. Then the same for the parent if it was the last.
+ */
+static void walk_finish(struct walk* w, struct walk_node* node) {
+    struct walk_node* parent;
+    const char* rel;
+    int src_fd, dst_fd, err;
+
+    while (node && __atomic_sub_fetch(&node->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+        rel = *node->rel ? node->rel : ".";
+        if (!__atomic_load_n(&w->error, __ATOMIC_RELAXED)) {
+            if (w->mode == WALK_COPY) {
+                src_fd = openat(w->src_root_fd, rel, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+                dst_fd = openat(w->dst_root_fd, rel, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+                err = src_fd < 0 || dst_fd < 0 ? errno : copy_meta(src_fd, dst_fd, &node->st);
+                if (src_fd >= 0) {
+                    close(src_fd);
+                }
+                if (dst_fd >= 0) {
+                    close(dst_fd);
+                }
+                if (err) {
+                    walk_fail(w, err, "copying metadata of", node->rel, "");
+                }
+            } else if (*node->rel && unlinkat(w->src_root_fd, node->rel, AT_REMOVEDIR)) {
+                walk_fail(w, errno, "removing", node->rel, "");
+            }
+        }
+        parent = node->parent;
+        free(node);
+        node = parent;
+    }
+}
+
+static void walk_dir(struct walk* w, int self, struct walk_node* node) {
+    const char* rel = *node->rel ? node->rel : ".";
+    struct walk_node* child;
+    struct dirent* de;
+    struct stat st;
+    int src_fd, dst_fd = -1;
+    int err = 0;
+    DIR* dir;
+
+    src_fd = openat(w->src_root_fd, rel, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    dir = src_fd < 0 ? NULL : fdopendir(src_fd);
+    if (!dir) {
+        walk_fail(w, errno, "reading", node->rel, "");
+        if (src_fd >= 0) {
+            close(src_fd);
+        }
+        return;
+    }
+    if (w->mode == WALK_COPY) {
+        dst_fd = openat(w->dst_root_fd, rel, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+        if (dst_fd < 0) {
+            walk_fail(w, errno, "opening copy of", node->rel, "");
+            closedir(dir);
+            return;
+        }
+    }
+
+    while (!err && !__atomic_load_n(&w->error, __ATOMIC_RELAXED) && (de = readdir(dir))) {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) {
+            continue;
+        }
+        if (fstatat(src_fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW)) {
+            err = errno;
+        } else if (S_ISDIR(st.st_mode)) {
+            // a nested subvolume or mount has another st_dev
+            if (st.st_dev != node->st.st_dev) {
+                err = EXDEV;
+            } else if (w->mode == WALK_COPY && mkdirat(dst_fd, de->d_name, 0700)) {
+                err = errno;
+            } else {
+                child = walk_new_node(node, de->d_name, &st);
+                if (!child) {
+                    err = ENOMEM;
+                } else {
+                    __atomic_add_fetch(&node->pending, 1, __ATOMIC_RELAXED);
+                    err = walk_push(w, self, child);
+                    if (err) {
+                        __atomic_sub_fetch(&node->pending, 1, __ATOMIC_RELAXED);
+                        free(child);
+                    }
+                }
+            }
+        } else if (w->mode == WALK_REMOVE) {
+            err = unlinkat(src_fd, de->d_name, 0) ? errno : 0;
+        } else if (S_ISREG(st.st_mode)) {
+            err = copy_file(w, node, src_fd, dst_fd, de->d_name, &st);
+        } else {
+            err = copy_special(src_fd, dst_fd, de->d_name, &st);
+        }
+        if (err) {
+            walk_fail(w, err, w->mode == WALK_COPY ? "copying" : "removing", node->rel, de->d_name);
+        }
+    }
+
+    closedir(dir);
+    if (dst_fd >= 0) {
+        close(dst_fd);
+    }
+}
+
+static void* walk_main(void* arg) {
+    struct walk_worker* worker = arg;
+    struct walk* w = worker->walk;
+    struct walk_node* node;
+    unsigned pushes;
+
+    for (;;) {
+        pushes = __atomic_load_n(&w->pushes, __ATOMIC_ACQUIRE);
+        node = walk_take(w, worker->index);
+        if (!node) {
+            pthread_mutex_lock(&w->mutex);
+            if (w->outstanding == 0) {
+                pthread_cond_broadcast(&w->cond);
+                pthread_mutex_unlock(&w->mutex);
+                break;
+            }
+            // pushed after we looked, without seeing us idle
+            if (w->pushes != pushes) {
+                pthread_mutex_unlock(&w->mutex);
+                continue;
+            }
+            // woken by walk_push(), or by the last thread leaving
+            w->idle++;
+            pthread_cond_wait(&w->cond, &w->mutex);
+            w->idle--;
+            pthread_mutex_unlock(&w->mutex);
+            continue;
+        }
+
+        // after an error the queue is only drained
+        if (!__atomic_load_n(&w->error, __ATOMIC_RELAXED)) {
+            walk_dir(w, worker->index, node);
+        }
+        walk_finish(w, node);
+
+        pthread_mutex_lock(&w->mutex);
+        if (--w->outstanding == 0) {
+            pthread_cond_broadcast(&w->cond);
+        }
+        pthread_mutex_unlock(&w->mutex);
+    }
+    return NULL;
+}
+
+/*
+ * Walks the tree below src_root_fd with nthreads threads; returns 0 or
+ * the first errno.
+ */
+static int walk_tree(int mode, int src_root_fd, int dst_root_fd, int nthreads) {
+    struct walk_worker workers[BTRFSTRANS_CONVERT_MAX_THREADS];
+    pthread_t threads[BTRFSTRANS_CONVERT_MAX_THREADS];
+    struct walk_deque deques[BTRFSTRANS_CONVERT_MAX_THREADS];
+    struct walk_node* root;
+    struct hardlink* link;
+    struct walk* w;
+    struct stat st;
+    int started = 0, ret;
+
+    if (fstat(src_root_fd, &st)) {
+        return errno;
+    }
+    w = calloc(1, sizeof(*w));
+    root = walk_new_node(NULL, "", &st);
+    if (!w || !root) {
+        free(w);
+        free(root);
+        return ENOMEM;
+    }
+    w->mode = mode;
+    w->src_root_fd = src_root_fd;
+    w->dst_root_fd = dst_root_fd;
+    w->nthreads = nthreads;
+    w->deques = deques;
+    memset(deques, 0, sizeof(deques));
+    for (int i = 0; i < nthreads; i++) {
+        pthread_mutex_init(&deques[i].mutex, NULL);
+    }
+    pthread_mutex_init(&w->mutex, NULL);
+    pthread_cond_init(&w->cond, NULL);
+    pthread_mutex_init(&w->links_mutex, NULL);
+
+    ret = walk_push(w, 0, root);
+    if (ret) {
+        free(root);
+    }
+
+    for (int i = 0; i < nthreads && !ret; i++) {
+        workers[i].walk = w;
+        workers[i].index = i;
+        if (pthread_create(&threads[i], NULL, walk_main, &workers[i])) {
+            break;
+        }
+        started++;
+    }
+    if (started == 0 && !ret) {
+        // no threads to be had, do it ourselves
+        workers[0].walk = w;
+        workers[0].index = 0;
+        walk_main(&workers[0]);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    if (!ret) {
+        ret = w->error;
+    }
+    for (int b = 0; b < BTRFSTRANS_CONVERT_LINK_BUCKETS; b++) {
+        while ((link = w->links[b])) {
+            w->links[b] = link->next;
+            free(link);
+        }
+    }
+    for (int i = 0; i < nthreads; i++) {
+        free(deques[i].nodes);
+        pthread_mutex_destroy(&deques[i].mutex);
+    }
+    pthread_mutex_destroy(&w->mutex);
+    pthread_cond_destroy(&w->cond);
+    pthread_mutex_destroy(&w->links_mutex);
+    free(w);
+    return ret;
+}
+
+/*
+ * Makes the directory path a subvolume with the same contents. The tree is
+ * recreated in the new subvolume <path>_svol by nthreads threads (0: one
+ * per CPU), regular files as reflinks, with modes, owners (as far as we
+ * may), xattrs, times and hardlinks. The subvolume then takes the place of
+ * the directory in a single exchange and the old tree is removed. If
+ * anything fails before the exchange, the subvolume is deleted again and
+ * path is untouched. The tree must not change meanwhile and must not
+ * contain subvolumes or mount points. Returns 0 or a negative errno; 0
+ * once path is a subvolume, even if (with a warning) the old tree could
+ * not be removed completely from <path>_svol.
+ */
+int btrfstrans_make_subvolume(const char* path, int nthreads) {
+    char svol_path[PATH_MAX];
+    int src_fd, dst_fd;
+    int ret;
+
+    ret = test_issubvolume(path);
+    if (ret == 1) {
+        return 0; // already a subvolume, no action needed
+    }
+    else if (ret < 0) {
+        log_error("%s: %s is inaccessible", __func__, path);
+        return -EINVAL;
+    }
+
+    if (nthreads <= 0) {
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (nthreads < 1) {
+        nthreads = 1;
+    } else if (nthreads > BTRFSTRANS_CONVERT_MAX_THREADS) {
+        nthreads = BTRFSTRANS_CONVERT_MAX_THREADS;
+    }
+
+    if (snprintf(svol_path, sizeof(svol_path), "%s_svol", path) >= (int)sizeof(svol_path)) {
+        log_error("%s: path %s is too long", __func__, path);
+        return -ENAMETOOLONG;
+    }
+
+    ret = create_subvolume(svol_path);
+    if (ret) {
+        log_error("%s: can't create subvolume '%s'", __func__, svol_path);
+        return -EINVAL;
+    }
+
+    src_fd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    dst_fd = open(svol_path, O_RDONLY | O_DIRECTORY);
+    if (src_fd < 0 || dst_fd < 0) {
+        ret = errno;
+    } else {
+        ret = walk_tree(WALK_COPY, src_fd, dst_fd, nthreads);
+    }
+    if (dst_fd >= 0) {
+        close(dst_fd);
+    }
+
+    if (!ret && renameat2(AT_FDCWD, svol_path, AT_FDCWD, path, RENAME_EXCHANGE)) {
+        ret = errno;
+        log_error("%s: exchanging %s and %s - %s", __func__, svol_path, path, strerror(ret));
+    }
+    if (ret) {
+        if (src_fd >= 0) {
+            close(src_fd);
+        }
+        delete_subvolume(svol_path);
+        return -ret;
+    }
+
+    // src_fd still is the old tree, now at svol_path
+    ret = walk_tree(WALK_REMOVE, src_fd, -1, nthreads);
+    close(src_fd);
+    if (!ret && rmdir(svol_path)) {
+        ret = errno;
+    }
+    if (ret) {
+        log_warn("%s: %s is a subvolume now, but the old tree is left at %s - %s", __func__, path, svol_path,
+            strerror(ret));
+    }
+    return 0;
+}
+
+/*
+ * Function to make a directory in btrfs volume a sub-volume
+ */
+int make_subvolume(const char* path) {
+    return btrfstrans_make_subvolume(path, 0);
+}
+
+
+static int exists(const char* path) {
+    int ret;
+    struct stat st;
+    ret = stat(path, &st);
+    if (ret < 0) {
+        return 0;
+    } else {
+        return 1;
+    }
+}
+
+static int exists_at(int dirfd, const char* name) {
+    struct stat st;
+    return fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) == 0;
+}
+
+static int exists_one_of(const char* path1, const char* path2, const char* path3) {
+    return exists(path1) || exists(path2) || exists(path3);
+}
+
+/*
+ * The commit sequence number is stored as an xattr on the root directory
+ * of a head. Snapshots inherit it, so a writable snapshot knows which
+ * commit it was based on. A head without the xattr has sequence 0.
+ */
+static int read_seq(int parent_fd, const char* name, unsigned long long* seq) {
+    char buf[32];
+    ssize_t len;
+    int fd;
+
+    fd = openat(parent_fd, name, O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        log_error("can't open %s - %s", name, strerror(errno));
+        return E_ACCESS;
+    }
+    len = fgetxattr(fd, BTRFSTRANS_SEQ_XATTR, buf, sizeof(buf) - 1);
+    if (len < 0 && errno == ENODATA) {
+        len = 0;
+    } else if (len < 0) {
+        log_error("can't read commit sequence of %s - %s", name, strerror(errno));
+        close(fd);
+        return E_ACCESS;
+    }
+    close(fd);
+
+    buf[len] = '\0';
+    *seq = strtoull(buf, NULL, 10);
+    return SUCCESS;
+}
+
+static int write_seq(int sv_fd, unsigned long long seq) {
+    char buf[32];
+    int len;
+
+    len = snprintf(buf, sizeof(buf), "%llu", seq);
+    if (fsetxattr(sv_fd, BTRFSTRANS_SEQ_XATTR, buf, len, 0)) {
+        log_error("can't write commit sequence - %s", strerror(errno));
+        return E_ACCESS;
+    }
+    return SUCCESS;
+}
+
+/*
+ * Intent log: right before swapping head a commit records the sequence
+ * number and the name of the snapshot it installs as an xattr of the
+ * volume root, and removes it once the old head is handed to the reaper.
+ * Both happen under the rename lock, and the xattr is metadata of the
+ * same btrfs tree as the renames, so after any crash the record agrees
+ * with the subvolumes and at most one commit is in doubt.
+ */
+struct intent_record {
+    uint32_t magic;
+    uint32_t crc;           // of the record with crc = 0
+    uint64_t seq;           // of the head being installed
+    int32_t pid;
+    char name[BTRFS_VOL_NAME_MAX+1];    // the snapshot, old head once swapped
+};
+
+static uint32_t crc32_buf(const void* buf, size_t len) {
+    const unsigned char* p = buf;
+    uint32_t crc = ~0U;
+
+    for (size_t i = 0; i < len; i++) {
+        crc ^= p[i];
+        for (int k = 0; k < 8; k++) {
+            crc = (crc >> 1) ^ (0xEDB88320U & -(crc & 1));
+        }
+    }
+    return ~crc;
+}
+
+static uint32_t intent_crc(const struct intent_record* rec) {
+    struct intent_record tmp = *rec;
+
+    tmp.crc = 0;
+    return crc32_buf(&tmp, sizeof(tmp));
+}
+
+static int write_intent(btrfstrans_txn* txn, unsigned long long seq) {
+    struct intent_record rec;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.magic = BTRFSTRANS_INTENT_MAGIC;
+    rec.seq = seq;
+    rec.pid = getpid();
+    strncpy_null(rec.name, txn->writable_subvolume_name);
+    rec.crc = intent_crc(&rec);
+
+    if (fsetxattr(txn->ctx->root_fd, BTRFSTRANS_INTENT_XATTR, &rec, sizeof(rec), 0)) {
+        log_error("can't write intent record - %s", strerror(errno));
+        return E_ACCESS;
+    }
+    return SUCCESS;
+}
+
+static void clear_intent(btrfstrans_ctx* ctx) {
+    if (fremovexattr(ctx->root_fd, BTRFSTRANS_INTENT_XATTR) && errno != ENODATA) {
+        log_error("can't remove intent record - %s", strerror(errno));
+    }
+}
+
+/*
+ * Completes or rolls back the commit described by a leftover intent
+ * record; must be called with the rename lock held. Whether head was
+ * swapped decides, and the snapshot is only reaped if its sequence number
+ * says it is the one the record describes: a pessimistic writer may have
+ * reused its name since.
+ */
+static int recover_intent(btrfstrans_ctx* ctx) {
+    struct intent_record rec;
+    unsigned long long head_seq, seq, expected;
+    char name[32];
+    ssize_t len;
+    int ret;
+
+    len = fgetxattr(ctx->root_fd, BTRFSTRANS_INTENT_XATTR, &rec, sizeof(rec));
+    if (len < 0) {
+        return errno == ENODATA ? SUCCESS : E_ACCESS;
+    }
+    if (len != sizeof(rec) || rec.magic != BTRFSTRANS_INTENT_MAGIC || rec.crc != intent_crc(&rec)) {
+        // the orphan sweeps still find the snapshots
+        log_error("dropping damaged intent record of %s", ctx->root_path);
+        clear_intent(ctx);
+        return E_CORRUPT;
+    }
+    rec.name[BTRFS_VOL_NAME_MAX] = '\0';
+
+    ret = read_seq(ctx->root_fd, BTRFSTRANS_HEAD_NAME, &head_seq);
+    if (ret) {
+        return ret;
+    }
+
+    if (head_seq >= rec.seq) {
+        log_warn("completing commit %llu of process %d", (unsigned long long)rec.seq, rec.pid);
+        expected = rec.seq - 1;
+    } else {
+        log_warn("rolling back commit %llu of process %d", (unsigned long long)rec.seq, rec.pid);
+        expected = rec.seq;
+        snprintf(name, sizeof(name), "%llu", (unsigned long long)rec.seq);
+        unlinkat(ctx->txlog_fd, name, 0);
+        if (open_changes(ctx) >= 0) {
+            unlinkat(ctx->changes_fd, name, 0);
+        }
+    }
+
+    if (exists_at(ctx->root_fd, rec.name) && read_seq(ctx->root_fd, rec.name, &seq) == SUCCESS && seq == expected) {
+        reap_subvolume(ctx->root_fd, rec.name);
+    }
+
+    clear_intent(ctx);
+    return SUCCESS;
+}
+
+/*
+ * Group record of a multi-domain commit, an xattr of domains/ named after
+ * the committing process. It lists the sequence number and snapshot of
+ * every domain; like an intent record it is written when all of them are
+ * staged and removed once all heads are swapped and the old ones reaped.
+ * Each domain recovers its own entry under its own rename lock, so after
+ * a crash the record lives until the last of them was opened again.
+ */
+struct group_entry {
+    uint64_t seq;           // of the head being installed
+    char domain[BTRFSTRANS_DOMAIN_NAME_MAX+1];
+    char name[BTRFSTRANS_DOMAIN_NAME_MAX+1];    // the snapshot, old head once swapped
+};
+
+struct group_record {
+    uint32_t magic;
+    uint32_t crc;           // of the used part with crc = 0
+    int32_t pid;
+    uint32_t count;
+    struct group_entry entries[BTRFSTRANS_MAX_DOMAINS];
+};
+
+static size_t group_size(const struct group_record* rec) {
+    return offsetof(struct group_record, entries) + rec->count * sizeof(struct group_entry);
+}
+
+static uint32_t group_crc(const struct group_record* rec) {
+    struct group_record tmp = *rec;
+
+    tmp.crc = 0;
+    return crc32_buf(&tmp, group_size(&tmp));
+}
+
+static int write_group(btrfstrans_multi* multi, const unsigned long long* head_seqs, char* xattr, size_t size) {
+    struct group_record rec;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.magic = BTRFSTRANS_GROUP_MAGIC;
+    rec.pid = getpid();
+    rec.count = multi->n;
+    for (int k = 0; k < multi->n; k++) {
+        rec.entries[k].seq = head_seqs[k] + 1;
+        strncpy_null(rec.entries[k].domain, multi->txns[k]->ctx->domain);
+        if (snprintf(rec.entries[k].name, sizeof(rec.entries[k].name), "%s",
+                multi->txns[k]->writable_subvolume_name) >= (int)sizeof(rec.entries[k].name)) {
+            log_error("snapshot name %s too long for the group record", multi->txns[k]->writable_subvolume_name);
+            return E_INVALIDNAME;
+        }
+    }
+    rec.crc = group_crc(&rec);
+
+    snprintf(xattr, size, "%s%d.%u", BTRFSTRANS_GROUP_XATTR_PREFIX, getpid(),
+        __atomic_add_fetch(&tx_counter, 1, __ATOMIC_RELAXED));
+    if (fsetxattr(multi->txns[0]->ctx->domains_fd, xattr, &rec, group_size(&rec), XATTR_CREATE)) {
+        log_error("can't write group record - %s", strerror(errno));
+        return E_ACCESS;
+    }
+    return SUCCESS;
+}
+
+static void clear_group(btrfstrans_ctx* ctx, const char* xattr) {
+    if (fremovexattr(ctx->domains_fd, xattr) && errno != ENODATA) {
+        log_error("can't remove group record - %s", strerror(errno));
+    }
+}
+
+// 0 if xattr of domains/ is a valid group record, 1 if it is none or gone
+static int read_group(btrfstrans_ctx* ctx, const char* xattr, struct group_record* rec) {
+    ssize_t len;
+
+    if (strncmp(xattr, BTRFSTRANS_GROUP_XATTR_PREFIX, strlen(BTRFSTRANS_GROUP_XATTR_PREFIX))) {
+        return 1;
+    }
+
+    // another domain may have removed it in the meantime
+    len = fgetxattr(ctx->domains_fd, xattr, rec, sizeof(*rec));
+    if (len < 0) {
+        return 1;
+    }
+    if (len < (ssize_t)offsetof(struct group_record, entries) || rec->magic != BTRFSTRANS_GROUP_MAGIC ||
+        rec->count > BTRFSTRANS_MAX_DOMAINS || (size_t)len != group_size(rec) || rec->crc != group_crc(rec)) {
+        log_error("dropping damaged group record %s", xattr);
+        clear_group(ctx, xattr);
+        return 1;
+    }
+    for (uint32_t i = 0; i < rec->count; i++) {
+        rec->entries[i].domain[BTRFSTRANS_DOMAIN_NAME_MAX] = '\0';
+        rec->entries[i].name[BTRFSTRANS_DOMAIN_NAME_MAX] = '\0';
+    }
+    return 0;
+}
+
+// the names of all xattrs of domains/, NULL if there are none
+static char* list_groups(btrfstrans_ctx* ctx, ssize_t* len) {
+    char* list;
+
+    *len = flistxattr(ctx->domains_fd, NULL, 0);
+    if (*len <= 0) {
+        return NULL;
+    }
+    list = malloc(*len);
+    if (!list) {
+        return NULL;
+    }
+    *len = flistxattr(ctx->domains_fd, list, *len);
+    if (*len <= 0) {
+        free(list);
+        return NULL;
+    }
+    return list;
+}
+
+/*
+ * Whether a group record still names the snapshot name of our domain. The
+ * sweeps for snapshots of dead writers must leave those to recovery.
+ */
+static int group_needs(btrfstrans_ctx* ctx, const char* name) {
+    struct group_record rec;
+    ssize_t len;
+    char *list, *p;
+    int found = 0;
+
+    if (!ctx->domain[0]) {
+        return 0;
+    }
+
+    list = list_groups(ctx, &len);
+    for (p = list; p && p < list + len && !found; p += strlen(p) + 1) {
+        if (read_group(ctx, p, &rec)) {
+            continue;
+        }
+        for (uint32_t i = 0; i < rec.count; i++) {
+            found |= !strcmp(rec.entries[i].domain, ctx->domain) && !strcmp(rec.entries[i].name, name);
+        }
+    }
+    free(list);
+    return found;
+}
+
+/*
+ * Does the part of our domain in the multi-domain commit of the group
+ * record xattr: swaps its snapshot in unless head already has the new
+ * sequence number, and reaps the old head. The domain that finds all
+ * heads swapped removes the record.
+ */
+static void recover_group(btrfstrans_ctx* ctx, const char* xattr) {
+    struct group_record rec;
+    struct group_entry* e = NULL;
+    unsigned long long head_seq, seq;
+    int done = 1;
+    int fd;
+
+    if (read_group(ctx, xattr, &rec)) {
+        return;
+    }
+    for (uint32_t i = 0; i < rec.count; i++) {
+        if (!strcmp(rec.entries[i].domain, ctx->domain)) {
+            e = &rec.entries[i];
+        }
+    }
+    if (!e || read_seq(ctx->root_fd, BTRFSTRANS_HEAD_NAME, &head_seq)) {
+        return;
+    }
+
+    if (head_seq < e->seq) {
+        if (!exists_at(ctx->root_fd, e->name) || read_seq(ctx->root_fd, e->name, &seq) || seq != e->seq) {
+            log_error("snapshot %s of commit %llu of domain %s is gone, can't complete it",
+                e->name, (unsigned long long)e->seq, ctx->domain);
+            return;
+        }
+        log_warn("completing commit %llu of process %d in domain %s",
+            (unsigned long long)e->seq, rec.pid, ctx->domain);
+        if (renameat2(ctx->root_fd, e->name, ctx->root_fd, BTRFSTRANS_HEAD_NAME, RENAME_EXCHANGE)) {
+            log_error("exchanging %s and head of domain %s - %s", e->name, ctx->domain, strerror(errno));
+            return;
+        }
+        notify_commit(ctx);
+    }
+
+    if (exists_at(ctx->root_fd, e->name) && read_seq(ctx->root_fd, e->name, &seq) == SUCCESS && seq == e->seq - 1) {
+        reap_subvolume(ctx->root_fd, e->name);
+    }
+
+    for (uint32_t i = 0; i < rec.count && done; i++) {
+        fd = openat(ctx->domains_fd, rec.entries[i].domain, O_RDONLY | O_DIRECTORY);
+        done = fd >= 0 && read_seq(fd, BTRFSTRANS_HEAD_NAME, &seq) == SUCCESS && seq >= rec.entries[i].seq;
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    if (done) {
+        clear_group(ctx, xattr);
+    }
+}
+
+/*
+ * Completes the multi-domain commits that died after writing their group
+ * record, as far as our domain is concerned; must be called with the
+ * rename lock held, like recover_intent().
+ */
+static int recover_groups(btrfstrans_ctx* ctx) {
+    ssize_t len;
+    char *list, *p;
+
+    if (!ctx->domain[0]) {
+        return SUCCESS;
+    }
+
+    list = list_groups(ctx, &len);
+    for (p = list; p && p < list + len; p += strlen(p) + 1) {
+        recover_group(ctx, p);
+    }
+    free(list);
+    return SUCCESS;
+}
+
+/*
+ * Journal record of a rename-journal commit, an xattr of the volume root
+ * like the intent record. Written once the staged files, their manifest
+ * and the txlog entry are complete, it decides the commit: from then on
+ * recovery publishes the staging directory it names instead of dropping
+ * it. It is removed after head carries the new sequence number and the
+ * staging directory is gone.
+ */
+struct journal_record {
+    uint32_t magic;
+    uint32_t crc;           // of the record with crc = 0
+    uint64_t seq;           // of the head being published
+    int32_t pid;
+    char name[32];          // staging directory in head/.btrfstrans_journal
+};
+
+static uint32_t journal_crc(const struct journal_record* rec) {
+    struct journal_record tmp = *rec;
+
+    tmp.crc = 0;
+    return crc32_buf(&tmp, sizeof(tmp));
+}
+
+static int write_journal(btrfstrans_txn* txn, unsigned long long seq) {
+    struct journal_record rec;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.magic = BTRFSTRANS_JOURNAL_MAGIC;
+    rec.seq = seq;
+    rec.pid = getpid();
+    strncpy_null(rec.name, txn->stage_name);
+    rec.crc = journal_crc(&rec);
+
+    if (fsetxattr(txn->ctx->root_fd, BTRFSTRANS_JOURNAL_XATTR, &rec, sizeof(rec), 0)) {
+        log_error("can't write journal record - %s", strerror(errno));
+        return E_ACCESS;
+    }
+    return SUCCESS;
+}
+
+static void clear_journal(btrfstrans_ctx* ctx) {
+    if (fremovexattr(ctx->root_fd, BTRFSTRANS_JOURNAL_XATTR) && errno != ENODATA) {
+        log_error("can't remove journal record - %s", strerror(errno));
+    }
+}
+
+// without a record rec->magic is 0
+static int read_journal(btrfstrans_ctx* ctx, struct journal_record* rec) {
+    ssize_t len;
+
+    len = fgetxattr(ctx->root_fd, BTRFSTRANS_JOURNAL_XATTR, rec, sizeof(*rec));
+    if (len < 0 && errno == ENODATA) {
+        rec->magic = 0;
+        return SUCCESS;
+    } else if (len < 0) {
+        return E_ACCESS;
+    }
+    if (len != sizeof(*rec) || rec->magic != BTRFSTRANS_JOURNAL_MAGIC || rec->crc != journal_crc(rec)) {
+        return E_CORRUPT;
+    }
+    rec->name[sizeof(rec->name) - 1] = '\0';
+    return SUCCESS;
+}
+
+// whether the staging directory name belongs to a decided commit
+static int journal_needs(btrfstrans_ctx* ctx, const char* name) {
+    struct journal_record rec;
+
+    return read_journal(ctx, &rec) == SUCCESS && rec.magic && !strcmp(rec.name, name);
+}
+
+static char* read_manifest(int stage_fd) {
+    struct stat st;
+    char* buf;
+    ssize_t len;
+    int fd;
+
+    fd = openat(stage_fd, BTRFSTRANS_MANIFEST_NAME, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    buf = fstat(fd, &st) ? NULL : malloc(st.st_size + 1);
+    len = buf ? pread(fd, buf, st.st_size, 0) : -1;
+    close(fd);
+    if (len != st.st_size) {
+        free(buf);
+        return NULL;
+    }
+    buf[len] = '\0';
+    return buf;
+}
+
+/*
+ * Completes the rename-journal commit described by a leftover journal
+ * record; must be called with the rename lock held. If head doesn't carry
+ * its sequence number yet the manifest is replayed, renames already done
+ * are recognized by the missing staged file. The record is only dropped
+ * once that succeeded.
+ */
+static int recover_journal(btrfstrans_ctx* ctx) {
+    struct journal_record rec;
+    unsigned long long head_seq;
+    char name[32];
+    char* manifest = NULL;
+    int head_fd, dir_fd, stage_fd = -1;
+    int ret;
+
+    ret = read_journal(ctx, &rec);
+    if (ret == E_CORRUPT) {
+        // reap_dead_writers() still finds the staging directory
+        log_error("dropping damaged journal record of %s", ctx->root_path);
+        clear_journal(ctx);
+        return ret;
+    } else if (ret || !rec.magic) {
+        return ret;
+    }
+
+    ret = read_seq(ctx->root_fd, BTRFSTRANS_HEAD_NAME, &head_seq);
+    if (ret) {
+        return ret;
+    }
+    head_fd = openat(ctx->root_fd, BTRFSTRANS_HEAD_NAME, O_RDONLY | O_DIRECTORY);
+    if (head_fd < 0) {
+        return E_ACCESS;
+    }
+    dir_fd = openat(head_fd, BTRFSTRANS_JOURNAL_DIR_NAME, O_RDONLY | O_DIRECTORY);
+
+    if (head_seq < rec.seq) {
+        stage_fd = dir_fd < 0 ? -1 : openat(dir_fd, rec.name, O_RDONLY | O_DIRECTORY);
+        manifest = stage_fd < 0 ? NULL : read_manifest(stage_fd);
+        if (!manifest) {
+            // nothing was renamed before the manifest was complete
+            log_error("staged files of commit %llu are gone, rolling it back", (unsigned long long)rec.seq);
+            snprintf(name, sizeof(name), "%llu", (unsigned long long)rec.seq);
+            unlinkat(ctx->txlog_fd, name, 0);
+            if (open_changes(ctx) >= 0) {
+                unlinkat(ctx->changes_fd, name, 0);
+            }
+            ret = E_CORRUPT;
+        } else {
+            log_warn("completing commit %llu of process %d", (unsigned long long)rec.seq, rec.pid);
+            ret = publish_journal(head_fd, stage_fd, manifest, rec.seq);
+            free(manifest);
+            if (ret) {
+                close(stage_fd);
+                close(dir_fd);
+                close(head_fd);
+                return ret;
+            }
+        }
+        if (stage_fd >= 0) {
+            close(stage_fd);
+        }
+    }
+
+    if (dir_fd >= 0) {
+        remove_stage(dir_fd, rec.name);
+        close(dir_fd);
+    }
+    close(head_fd);
+    clear_journal(ctx);
+    return ret;
+}
+
+/*
+ * Returns a copy of filename relative to the subvolume root, without
+ * leading, trailing or duplicate '/'.
+ */
+static char* normalized_path(const char* filename) {
+    char* path;
+    char* dst;
+    const char* src;
+
+    path = malloc(strlen(filename) + 1);
+    if (!path) {
+        return NULL;
+    }
+
+    dst = path;
+    for (src = filename; *src; src++) {
+        if (*src == '/' && (dst == path || dst[-1] == '/')) {
+            continue;
+        }
+        *dst++ = *src;
+    }
+    if (dst > path && dst[-1] == '/') {
+        dst--;
+    }
+    *dst = '\0';
+    return path;
+}
+
+/*
+ * Remembers a path modified by the transaction, see normalized_path().
+ */
+static int record_write(btrfstrans_txn* txn, const char* filename) {
+    char* path;
+
+    if (txn->state != STATE_WRITE) {
+        return SUCCESS;
+    }
+
+    if (txn->write_set_len == txn->write_set_cap) {
+        int cap = txn->write_set_cap ? 2 * txn->write_set_cap : 64;
+        char** tmp = realloc(txn->write_set, cap * sizeof(char*));
+        if (!tmp) {
+            return -ENOMEM;
+        }
+        txn->write_set = tmp;
+        txn->write_set_cap = cap;
+    }
+
+    path = normalized_path(filename);
+    if (!path) {
+        return -ENOMEM;
+    }
+
+    txn->write_set[txn->write_set_len++] = path;
+    return SUCCESS;
+}
+
+static void clear_write_set(btrfstrans_txn* txn) {
+    for (int i = 0; i < txn->write_set_len; i++) {
+        free(txn->write_set[i]);
+    }
+    txn->write_set_len = 0;
+}
+
+/*
+ * Two paths conflict if they are equal or one is an ancestor of the other.
+ */
+static int paths_overlap(const char* a, const char* b) {
+    size_t la = strlen(a);
+    size_t lb = strlen(b);
+    size_t l = la < lb ? la : lb;
+
+    if (la == 0 || lb == 0) {
+        return 1;
+    }
+    if (strncmp(a, b, l)) {
+        return 0;
+    }
+    return la == lb || (la < lb ? b[l] : a[l]) == '/';
+}
+
+/*
+ * Checks the write sets of the transactions committed after from_seq up to
+ * and including to_seq against the write set of txn.
+ */
+static int check_conflicts(btrfstrans_txn* txn, unsigned long long from_seq, unsigned long long to_seq) {
+    char name[32];
+    char* line = NULL;
+    size_t line_cap = 0;
+    ssize_t len;
+    FILE* fp;
+    int fd;
+    int conflict = 0;
+
+    for (unsigned long long seq = from_seq + 1; seq <= to_seq && !conflict; seq++) {
+        snprintf(name, sizeof(name), "%llu", seq);
+        fd = openat(txn->ctx->txlog_fd, name, O_RDONLY);
+        fp = fd < 0 ? NULL : fdopen(fd, "r");
+        if (!fp) {
+            // the write set is gone from the log, we can't prove anything
+            log_error("write set of commit %llu is not available", seq);
+            if (fd >= 0) {
+                close(fd);
+            }
+            free(line);
+            return E_CONFLICT;
+        }
+
+        while (!conflict && (len = getline(&line, &line_cap, fp)) > 0) {
+            if (line[len - 1] == '\n') {
+                line[len - 1] = '\0';
+            }
+            for (int i = 0; i < txn->write_set_len; i++) {
+                if (paths_overlap(line, txn->write_set[i])) {
+                    log_error("'%s' was modified by commit %llu", txn->write_set[i], seq);
+                    conflict = 1;
+                    break;
+                }
+            }
+        }
+        fclose(fp);
+    }
+
+    free(line);
+    return conflict ? E_CONFLICT : SUCCESS;
+}
+
+/*
+ * Stores the write set of txn as commit seq and drops write sets that fell
+ * out of the conflict detection window.
+ */
+static int write_txlog(btrfstrans_txn* txn, unsigned long long seq) {
+    btrfstrans_ctx* ctx = txn->ctx;
+    char name[32];
+    FILE* fp;
+    int fd;
+
+    snprintf(name, sizeof(name), "%llu", seq);
+    fd = openat(ctx->txlog_fd, name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    fp = fd < 0 ? NULL : fdopen(fd, "w");
+    if (!fp) {
+        log_error("can't create commit log entry %s%s", ctx->txlog_path, name);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return E_ACCESS;
+    }
+    for (int i = 0; i < txn->write_set_len; i++) {
+        fprintf(fp, "%s\n", txn->write_set[i]);
+    }
+    if (fclose(fp)) {
+        log_error("can't write commit log entry %s%s", ctx->txlog_path, name);
+        return E_ACCESS;
+    }
+
+    if (seq > BTRFSTRANS_TXLOG_KEEP) {
+        snprintf(name, sizeof(name), "%llu", seq - BTRFSTRANS_TXLOG_KEEP);
+        unlinkat(ctx->txlog_fd, name, 0);
+    }
+
+    return SUCCESS;
+}
+
+/*
+ * Changesets: for every commit changes/<seq> lists what the transaction
+ * created (C), modified (M) and deleted (D), one "<kind> <path>" line each,
+ * paths relative to head. They are only written once some process enabled
+ * them for the volume by creating changes/.
+ *
+ * Created and modified paths come from the btrfs generation numbers, like
+ * 'btrfs subvolume find-new': a tree search limited to tree blocks newer
+ * than the generation the writable snapshot was created in finds the
+ * inodes the transaction touched, without reading the rest of the tree.
+ * Deleted inodes leave nothing behind to find; those are the paths of the
+ * write set that are gone. A "*" line means the changes couldn't be
+ * determined and subscribers must assume anything changed.
+ */
+
+// key types and objectids of the btrfs on-disk format, see ctree.h
+#ifndef BTRFS_INODE_ITEM_KEY
+#define BTRFS_INODE_ITEM_KEY 1
+#endif
+#ifndef BTRFS_FIRST_FREE_OBJECTID
+#define BTRFS_FIRST_FREE_OBJECTID 256ULL
+#endif
+
+#define CHANGES_PATHS_SIZE 65536
+
+/*
+ * Returns in *gen the btrfs generation the subvolume sv_fd was created in,
+ * 0 if it can't be found out.
+ */
+static int subvolume_generation(int sv_fd, unsigned long long* gen) {
+    struct btrfs_ioctl_get_subvol_info_args info;
+
+    *gen = 0;
+    if (ioctl(sv_fd, BTRFS_IOC_GET_SUBVOL_INFO, &info) < 0) {
+        log_error("can't get the generation of a subvolume - %s", strerror(errno));
+        return E_UNSPECIFIED;
+    }
+    *gen = info.otransid;
+    return SUCCESS;
+}
+
+/*
+ * Returns the fd of changes/, -1 if changesets aren't enabled for the
+ * volume. Another process may enable them at any time, so a context that
+ * didn't find the directory yet looks again.
+ */
+static int open_changes(btrfstrans_ctx* ctx) {
+    int fd = __atomic_load_n(&ctx->changes_fd, __ATOMIC_ACQUIRE);
+    int expected = -1;
+
+    if (fd >= 0) {
+        return fd;
+    }
+    fd = openat(ctx->root_fd, BTRFSTRANS_CHANGES_NAME, O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        return -1;
+    }
+    if (!__atomic_compare_exchange_n(&ctx->changes_fd, &expected, fd, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        // another thread was faster
+        close(fd);
+        fd = expected;
+    }
+    return fd;
+}
+
+// writes one line per path of the inode ino in the subvolume sv_fd
+static int emit_inode(FILE* fp, int sv_fd, int kind, __u64 ino, struct btrfs_data_container* paths) {
+    struct btrfs_ioctl_ino_path_args args;
+
+    memset(&args, 0, sizeof(args));
+    args.inum = ino;
+    args.size = CHANGES_PATHS_SIZE;
+    args.fspath = (uintptr_t)paths;
+    if (ioctl(sv_fd, BTRFS_IOC_INO_PATHS, &args) < 0) {
+        // removed again by the transaction
+        return errno == ENOENT ? SUCCESS : E_ACCESS;
+    }
+    if (paths->elem_missed) {
+        return E_UNSPECIFIED;
+    }
+    for (__u32 i = 0; i < paths->elem_cnt; i++) {
+        fprintf(fp, "%c %s\n", kind, (char*)paths->val + paths->val[i]);
+    }
+    return SUCCESS;
+}
+
+// finds the inodes of sv_fd changed after generation gen
+static int search_changed_inodes(FILE* fp, int sv_fd, unsigned long long gen) {
+    struct btrfs_ioctl_search_args args;
+    struct btrfs_ioctl_search_key* sk = &args.key;
+    struct btrfs_ioctl_search_header sh;
+    struct btrfs_data_container* paths;
+    __u64 inode_gen, inode_transid;
+    unsigned long off;
+    int ret = SUCCESS;
+
+    paths = malloc(CHANGES_PATHS_SIZE);
+    if (!paths) {
+        return E_UNSPECIFIED;
+    }
+
+    memset(&args, 0, sizeof(args));
+    sk->tree_id = 0;    // the subvolume of sv_fd
+    // the subvolume root directory itself changes with every commit
+    sk->min_objectid = BTRFS_FIRST_FREE_OBJECTID + 1;
+    sk->max_objectid = (__u64)-1;
+    sk->min_type = BTRFS_INODE_ITEM_KEY;
+    sk->max_type = BTRFS_INODE_ITEM_KEY;
+    sk->max_offset = (__u64)-1;
+    sk->min_transid = gen + 1;
+    sk->max_transid = (__u64)-1;
+
+    while (!ret) {
+        sk->nr_items = 4096;
+        if (ioctl(sv_fd, BTRFS_IOC_TREE_SEARCH, &args) < 0) {
+            log_error("tree search for changed inodes failed - %s", strerror(errno));
+            ret = E_ACCESS;
+            break;
+        }
+        if (sk->nr_items == 0) {
+            break;
+        }
+
+        off = 0;
+        for (__u32 i = 0; i < sk->nr_items && !ret; i++) {
+            memcpy(&sh, args.buf + off, sizeof(sh));
+            off += sizeof(sh);
+            // the key range returns all items between the inode items
+            if (sh.type == BTRFS_INODE_ITEM_KEY) {
+                // generation and transid lead struct btrfs_inode_item
+                memcpy(&inode_gen, args.buf + off, sizeof(inode_gen));
+                memcpy(&inode_transid, args.buf + off + sizeof(inode_gen), sizeof(inode_transid));
+                if (le64toh(inode_transid) > gen) {
+                    ret = emit_inode(fp, sv_fd, le64toh(inode_gen) > gen ? BTRFSTRANS_CHANGE_CREATED :
+                        BTRFSTRANS_CHANGE_MODIFIED, sh.objectid, paths);
+                }
+            }
+            off += sh.len;
+        }
+
+        // the inode item is the first item of an inode, skip to the next
+        if (sh.objectid == (__u64)-1) {
+            break;
+        }
+        sk->min_objectid = sh.objectid + 1;
+        sk->min_type = BTRFS_INODE_ITEM_KEY;
+        sk->min_offset = 0;
+    }
+
+    free(paths);
+    return ret;
+}
+
+/*
+ * Builds the changeset of txn from its writable snapshot into a buffer
+ * from malloc(). Changesets that can't be determined become "*".
+ */
+static void collect_changes(btrfstrans_txn* txn, char** buf, size_t* len) {
+    char all[] = { BTRFSTRANS_CHANGE_ALL, '\n', '\0' };
+    struct stat st;
+    FILE* fp;
+    int ret = E_UNSPECIFIED;
+
+    *buf = NULL;
+    fp = open_memstream(buf, len);
+    if (!fp) {
+        return;
+    }
+
+    if (txn->base_gen) {
+        ret = search_changed_inodes(fp, txn->writable_fd, txn->base_gen);
+    }
+    for (int i = 0; !ret && i < txn->write_set_len; i++) {
+        if (fstatat(txn->writable_fd, txn->write_set[i], &st, AT_SYMLINK_NOFOLLOW) && errno == ENOENT) {
+            fprintf(fp, "%c %s\n", BTRFSTRANS_CHANGE_DELETED, txn->write_set[i]);
+        }
+    }
+
+    if (fclose(fp) || ret) {
+        // a partial changeset would hide changes
+        free(*buf);
+        *buf = strdup(all);
+        *len = *buf ? 2 : 0;
+    }
+}
+
+/*
+ * Stores the changeset of commit seq and drops the one that fell out of
+ * the window kept for subscribers.
+ */
+static int write_changes(btrfstrans_ctx* ctx, unsigned long long seq, const char* buf, size_t len) {
+    char name[32];
+    ssize_t n;
+    int fd;
+
+    snprintf(name, sizeof(name), "%llu", seq);
+    fd = openat(ctx->changes_fd, name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        log_error("can't create changeset %s/%s/%s", ctx->root_path, BTRFSTRANS_CHANGES_NAME, name);
+        return E_ACCESS;
+    }
+    while (len > 0) {
+        n = write(fd, buf, len);
+        if (n < 0) {
+            log_error("can't write changeset %s/%s/%s - %s", ctx->root_path, BTRFSTRANS_CHANGES_NAME,
+                name, strerror(errno));
+            close(fd);
+            unlinkat(ctx->changes_fd, name, 0);
+            return E_ACCESS;
+        }
+        buf += n;
+        len -= n;
+    }
+    close(fd);
+
+    if (seq > BTRFSTRANS_CHANGES_KEEP) {
+        snprintf(name, sizeof(name), "%llu", seq - BTRFSTRANS_CHANGES_KEEP);
+        unlinkat(ctx->changes_fd, name, 0);
+    }
+    return SUCCESS;
+}
+
+// wakes up the subscribers of ctx after a head swap
+static void notify_commit(btrfstrans_ctx* ctx) {
+    __atomic_add_fetch(&ctx->shm->commit_futex, 1, __ATOMIC_RELEASE);
+    syscall(SYS_futex, &ctx->shm->commit_futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/*
+ * Creates all missing parent directories of rel inside the subvolume sv_fd.
+ */
+static int make_parents(int sv_fd, const char* rel) {
+    char path[strlen(rel) + 1];
+    char* p;
+
+    strcpy(path, rel);
+    for (p = path; (p = strchr(p, '/')); p++) {
+        *p = '\0';
+        if (mkdirat(sv_fd, path, 0755) && errno != EEXIST) {
+            return E_ACCESS;
+        }
+        *p = '/';
+    }
+    return SUCCESS;
+}
+
+/*
+ * Copies length bytes (up to EOF if length is 0) between two open files
+ * without reflinks: copy_file_range() keeps the data in the kernel, plain
+ * read()/write() is the last resort.
+ */
+static int copy_fd_range(int fd_src, off_t src_offset, int fd_dst, off_t dst_offset, off_t length) {
+    char buf[65536];
+    ssize_t len;
+    size_t chunk;
+    int use_copy_range = 1;
+    int to_eof = length == 0;
+
+    while (to_eof || length > 0) {
+        chunk = to_eof || length > (1L << 30) ? 1UL << 30 : (size_t)length;
+
+        if (use_copy_range) {
+            len = copy_file_range(fd_src, &src_offset, fd_dst, &dst_offset, chunk, 0);
+            if (len < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+                use_copy_range = 0;
+                continue;
+            }
+        } else {
+            len = pread(fd_src, buf, chunk < sizeof(buf) ? chunk : sizeof(buf), src_offset);
+            if (len > 0) {
+                if (pwrite(fd_dst, buf, len, dst_offset) != len) {
+                    return E_ACCESS;
+                }
+                src_offset += len;
+                dst_offset += len;
+            }
+        }
+
+        if (len < 0) {
+            return E_ACCESS;
+        }
+        if (len == 0) {
+            break;
+        }
+        if (!to_eof) {
+            length -= len;
+        }
+    }
+    return SUCCESS;
+}
+
+/*
+ * Copies a regular file; same-volume copies are reflinks and only cost
+ * metadata.
+ */
+static int clone_file(int src_dirfd, const char* src, int dst_dirfd, const char* dst, mode_t mode) {
+    int fd_src, fd_dst;
+    int ret = SUCCESS;
+
+    fd_src = openat(src_dirfd, src, O_RDONLY);
+    if (fd_src < 0) {
+        return E_ACCESS;
+    }
+    fd_dst = openat(dst_dirfd, dst, O_WRONLY | O_CREAT | O_TRUNC, mode);
+    if (fd_dst < 0) {
+        close(fd_src);
+        return E_ACCESS;
+    }
+
+    if (ioctl(fd_dst, FICLONE, fd_src) < 0) {
+        ret = copy_fd_range(fd_src, 0, fd_dst, 0, 0);
+    }
+
+    close(fd_src);
+    if (close(fd_dst)) {
+        ret = E_ACCESS;
+    }
+    return ret;
+}
+
+/*
+ * Replays the final state of every path in the write set from the
+ * subvolume src_fd onto the subvolume dst_fd.
+ */
+static int merge_write_set(btrfstrans_txn* txn, int src_fd, int dst_fd) {
+    struct stat st;
+    const char* path;
+    int ret;
+
+    for (int i = 0; i < txn->write_set_len; i++) {
+        path = txn->write_set[i];
+
+        if (fstatat(src_fd, path, &st, AT_SYMLINK_NOFOLLOW)) {
+            // removed by this transaction
+            if (unlinkat(dst_fd, path, 0) && errno != ENOENT &&
+                unlinkat(dst_fd, path, AT_REMOVEDIR) && errno != ENOENT) {
+                log_error("can't remove %s while merging", path);
+                return E_DELETE;
+            }
+            continue;
+        }
+
+        ret = make_parents(dst_fd, path);
+        if (ret) {
+            log_error("can't create parents of %s while merging", path);
+            return ret;
+        }
+
+        if (S_ISDIR(st.st_mode)) {
+            if (mkdirat(dst_fd, path, st.st_mode & 07777) && errno != EEXIST) {
+                log_error("can't create %s while merging", path);
+                return E_ACCESS;
+            }
+        } else if (S_ISREG(st.st_mode)) {
+            ret = clone_file(src_fd, path, dst_fd, path, st.st_mode & 07777);
+            if (ret) {
+                log_error("can't copy %s while merging", path);
+                return ret;
+            }
+        }
+    }
+
+    return SUCCESS;
+}
+
+/*
+ * Returns the cached fd of the subvolume of txn and points name to
+ * filename relative to it, or returns a negative error.
+ */
+static int resolve_path(btrfstrans_txn* txn, const char* filename, const char** name) {
+    const char* rel = filename + strspn(filename, "/");
+    int ret;
+
+    if (!*rel || !strcmp(rel, ".") || !strcmp(rel, "..")) {
+        log_error("Invalid filename '%s'", filename);
+        return -E_INVALIDNAME;
+    }
+
+    *name = rel;
+    if (txn && txn->state == STATE_READ) {
+        log_debug("path to read is %s%s", txn->specific_readonly_sv_path, rel);
+        return txn->readonly_fd;
+    } else if (txn && txn->state == STATE_WRITE) {
+        // whatever isn't a plain write needs the snapshot
+        if (txn->journal && (ret = switch_to_snapshot(txn))) {
+            return -ret;
+        }
+        log_debug("path to write is %s%s", txn->writable_subvolume_path, rel);
+        return txn->writable_fd;
+    } else {
+        log_error("not in a transaction");
+        return -E_WRONGSTATE;
+    }
+}
+
+/*
+ * Translates fopen() modes to open() flags.
+ */
+static int fopen_flags(const char* modes) {
+    int flags;
+
+    switch (modes[0]) {
+    case 'r':
+        flags = 0;
+        break;
+    case 'w':
+        flags = O_CREAT | O_TRUNC;
+        break;
+    case 'a':
+        flags = O_CREAT | O_APPEND;
+        break;
+    default:
+        return -1;
+    }
+
+    if (strchr(modes, '+')) {
+        flags |= O_RDWR;
+    } else {
+        flags |= modes[0] == 'r' ? O_RDONLY : O_WRONLY;
+    }
+    if (strchr(modes, 'x')) {
+        flags |= O_EXCL;
+    }
+    if (strchr(modes, 'e')) {
+        flags |= O_CLOEXEC;
+    }
+    return flags;
+}
+
+/*
+ * Rename journal. A write transaction that starts on it has no snapshot:
+ * every file it opens for writing is staged as file <i> of a directory of
+ * its own in head/.btrfstrans_journal, i being the index of the path in
+ * the write set, and the commit renames the staged files over their paths
+ * in head, see commit_journal(). Everything else - reads, appends,
+ * directories, hard links, more than journal_limit paths - switches the
+ * transaction to a writable snapshot of head with the staged files copied
+ * in, and from then on it is like any other.
+ */
+
+// index of path in the write set, -1 if it isn't there
+static int journal_find(btrfstrans_txn* txn, const char* path) {
+    for (int i = 0; i < txn->write_set_len; i++) {
+        if (!strcmp(txn->write_set[i], path)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// renames must not leave head, so no "." or ".." components
+static int plain_path(const char* path) {
+    const char* p = path;
+    size_t len;
+
+    do {
+        len = strcspn(p, "/");
+        if (len == 0 || (len == 1 && p[0] == '.') || (len == 2 && p[0] == '.' && p[1] == '.')) {
+            return 0;
+        }
+        p += len;
+    } while (*p++);
+    return 1;
+}
+
+/*
+ * Removes the staging directory name from the journal directory dir_fd.
+ */
+static void remove_stage(int dir_fd, const char* name) {
+    struct dirent* de;
+    DIR* dir;
+    int fd;
+
+    fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY);
+    dir = fd < 0 ? NULL : fdopendir(fd);
+    if (!dir) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+    while ((de = readdir(dir))) {
+        if (strcmp(de->d_name, ".") && strcmp(de->d_name, "..")) {
+            unlinkat(dirfd(dir), de->d_name, 0);
+        }
+    }
+    closedir(dir);
+
+    if (unlinkat(dir_fd, name, AT_REMOVEDIR) && errno != ENOENT) {
+        log_error("can't remove staging directory %s - %s", name, strerror(errno));
+    }
+}
+
+/*
+ * Removes the staging directories a snapshot inherited from head; their
+ * transactions stage again in the head they commit to.
+ */
+static void strip_journal(int sv_fd) {
+    struct dirent* de;
+    DIR* dir;
+    int fd;
+
+    fd = openat(sv_fd, BTRFSTRANS_JOURNAL_DIR_NAME, O_RDONLY | O_DIRECTORY);
+    dir = fd < 0 ? NULL : fdopendir(fd);
+    if (!dir) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+    while ((de = readdir(dir))) {
+        if (strcmp(de->d_name, ".") && strcmp(de->d_name, "..")) {
+            remove_stage(dirfd(dir), de->d_name);
+        }
+    }
+    closedir(dir);
+    unlinkat(sv_fd, BTRFSTRANS_JOURNAL_DIR_NAME, AT_REMOVEDIR);
+}
+
+static int open_stage(btrfstrans_txn* txn, int sv_fd) {
+    int dir_fd, ret;
+
+    if (mkdirat(sv_fd, BTRFSTRANS_JOURNAL_DIR_NAME, 0755) && errno != EEXIST) {
+        log_error("can't create %s - %s", BTRFSTRANS_JOURNAL_DIR_NAME, strerror(errno));
+        return E_ACCESS;
+    }
+    dir_fd = openat(sv_fd, BTRFSTRANS_JOURNAL_DIR_NAME, O_RDONLY | O_DIRECTORY);
+    if (dir_fd < 0) {
+        log_error("can't open %s - %s", BTRFSTRANS_JOURNAL_DIR_NAME, strerror(errno));
+        return E_ACCESS;
+    }
+
+    ret = mkdirat(dir_fd, txn->stage_name, 0700);
+    if (ret && errno == EEXIST) {
+        // left over by an earlier process with our pid
+        remove_stage(dir_fd, txn->stage_name);
+        ret = mkdirat(dir_fd, txn->stage_name, 0700);
+    }
+    txn->stage_fd = ret ? -1 : openat(dir_fd, txn->stage_name, O_RDONLY | O_DIRECTORY);
+    if (txn->stage_fd < 0) {
+        log_error("can't create staging directory %s - %s", txn->stage_name, strerror(errno));
+    }
+    close(dir_fd);
+    return txn->stage_fd < 0 ? E_ACCESS : SUCCESS;
+}
+
+// removes our staging directory from whichever head it is in
+static void drop_stage(btrfstrans_txn* txn) {
+    int dir_fd;
+
+    if (txn->stage_fd < 0) {
+        return;
+    }
+    dir_fd = openat(txn->stage_fd, "..", O_RDONLY | O_DIRECTORY);
+    if (dir_fd >= 0) {
+        remove_stage(dir_fd, txn->stage_name);
+        close(dir_fd);
+    }
+    close(txn->stage_fd);
+    txn->stage_fd = -1;
+}
+
+static void close_journal(btrfstrans_txn* txn) {
+    for (int i = 0; i < BTRFSTRANS_JOURNAL_MAX_FILES; i++) {
+        if (txn->journal_fds[i] >= 0) {
+            close(txn->journal_fds[i]);
+            txn->journal_fds[i] = -1;
+        }
+    }
+    if (txn->stage_fd >= 0) {
+        close(txn->stage_fd);
+        txn->stage_fd = -1;
+    }
+}
+
+/*
+ * Reflinks the staged file i into the directory dir_fd as name, with its
+ * metadata. Returns the new file opened read-write or -1.
+ */
+static int clone_staged(btrfstrans_txn* txn, int i, int dir_fd, const char* name) {
+    struct stat st;
+    int fd;
+
+    if (fstat(txn->journal_fds[i], &st)) {
+        return -1;
+    }
+    // replaced rather than truncated, as the rename would
+    if (unlinkat(dir_fd, name, 0) && errno != ENOENT) {
+        return -1;
+    }
+    fd = openat(dir_fd, name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+        return -1;
+    }
+    if ((ioctl(fd, FICLONE, txn->journal_fds[i]) < 0 && copy_fd_range(txn->journal_fds[i], 0, fd, 0, 0)) ||
+        copy_meta(txn->journal_fds[i], fd, &st)) {
+        close(fd);
+        unlinkat(dir_fd, name, 0);
+        return -1;
+    }
+    txn->journal_ctime[i] = st.st_ctim;
+    return fd;
+}
+
+static int copy_staged(btrfstrans_txn* txn, int i) {
+    int fd;
+
+    if (make_parents(txn->writable_fd, txn->write_set[i])) {
+        return E_ACCESS;
+    }
+    fd = clone_staged(txn, i, txn->writable_fd, txn->write_set[i]);
+    if (fd < 0) {
+        log_error("can't copy staged %s - %s", txn->write_set[i], strerror(errno));
+        return E_ACCESS;
+    }
+    close(fd);
+    return SUCCESS;
+}
+
+/*
+ * Gives a journal transaction the writable snapshot it started without.
+ * The snapshot is of the current head, which is fine as long as nothing
+ * committed since touched the write set. Files the user opened stay on
+ * the staged copies; sync_staged() picks up what is written to them
+ * afterwards.
+ */
+static int switch_to_snapshot(btrfstrans_txn* txn) {
+    btrfstrans_ctx* ctx = txn->ctx;
+    unsigned long long head_seq;
+    int ret;
+
+    if (!txn->journal) {
+        return SUCCESS;
+    }
+
+    ret = lease_hold(txn);
+    if (ret) {
+        return ret;
+    }
+    ret = acquire_rename_lock(ctx);
+    if (!ret) {
+        ret = read_seq(ctx->root_fd, BTRFSTRANS_HEAD_NAME, &head_seq);
+        if (!ret && head_seq != txn->base_seq) {
+            ret = check_conflicts(txn, txn->base_seq, head_seq);
+        }
+        if (!ret) {
+            ret = snapshot_at(ctx->root_fd, BTRFSTRANS_HEAD_NAME, ctx->root_fd, txn->writable_subvolume_name, BTRFSTRANS_WRITABLE);
+        }
+        release_rename_lock(ctx);
+    }
+
+    if (!ret) {
+        txn->base_seq = head_seq;
+        txn->writable_fd = openat(ctx->root_fd, txn->writable_subvolume_name, O_RDONLY | O_DIRECTORY);
+        if (txn->writable_fd < 0) {
+            reap_subvolume(ctx->root_fd, txn->writable_subvolume_name);
+            ret = E_ACCESS;
+        } else {
+            subvolume_generation(txn->writable_fd, &txn->base_gen);
+        }
+    }
+    for (int i = 0; !ret && i < txn->write_set_len; i++) {
+        if (txn->journal_fds[i] >= 0) {
+            ret = copy_staged(txn, i);
+        } else if (unlinkat(txn->writable_fd, txn->write_set[i], 0) && errno != ENOENT) {
+            ret = E_DELETE;
+        }
+    }
+
+    if (ret) {
+        log_error("couldn't switch the transaction to %s", txn->writable_subvolume_path);
+        if (txn->writable_fd >= 0) {
+            close(txn->writable_fd);
+            txn->writable_fd = -1;
+            reap_subvolume(ctx->root_fd, txn->writable_subvolume_name);
+        }
+        lease_unhold(txn);
+        return ret;
+    }
+
+    // an expiring lease reaps the snapshot from now on
+    txn->journal = 0;
+    txn->journal_len = txn->write_set_len;
+    lease_unhold(txn);
+
+    drop_stage(txn);
+    stats_count(BTRFSTRANS_COUNTER_JOURNAL_SWITCHES);
+    return SUCCESS;
+}
+
+/*
+ * Copies the staged files written to since the switch to the snapshot
+ * into it once more.
+ */
+static int sync_staged(btrfstrans_txn* txn) {
+    struct stat st;
+    int ret;
+
+    for (int i = 0; i < txn->journal_len; i++) {
+        if (txn->journal_fds[i] < 0) {
+            continue;
+        }
+        if (fstat(txn->journal_fds[i], &st)) {
+            return E_ACCESS;
+        }
+        if (st.st_ctim.tv_sec == txn->journal_ctime[i].tv_sec && st.st_ctim.tv_nsec == txn->journal_ctime[i].tv_nsec) {
+            continue;
+        }
+        ret = copy_staged(txn, i);
+        if (ret) {
+            return ret;
+        }
+    }
+    return SUCCESS;
+}
+
+/*
+ * Opens filename with fopen() modes on the rename journal. Returns 1 if
+ * it did, with the result in *fp, and 0 if the transaction has to switch
+ * to its snapshot for it.
+ */
+static int journal_fopen(btrfstrans_txn* txn, const char* filename, const char* modes, FILE** fp) {
+    btrfstrans_ctx* ctx = txn->ctx;
+    struct stat st;
+    char name[16];
+    char* path;
+    char* slash;
+    int head_fd, src_fd = -1, fd = -1, flags, i, ok, added = 0;
+
+    flags = fopen_flags(modes);
+    if (modes[0] != 'w' || flags < 0 || (flags & O_EXCL)) {
+        return 0;
+    }
+    path = normalized_path(filename);
+    if (!path || !plain_path(path)) {
+        free(path);
+        return 0;
+    }
+    i = journal_find(txn, path);
+    if (i < 0 && txn->write_set_len >= txn->journal_limit) {
+        free(path);
+        return 0;
+    }
+
+    head_fd = openat(ctx->root_fd, BTRFSTRANS_HEAD_NAME, O_RDONLY | O_DIRECTORY);
+    ok = head_fd >= 0;
+    if (ok && i < 0) {
+        // only plain files can be replaced by a rename
+        src_fd = openat(head_fd, path, O_RDONLY | O_NOFOLLOW | O_NONBLOCK);
+        if (src_fd >= 0) {
+            ok = !fstat(src_fd, &st) && S_ISREG(st.st_mode) && st.st_nlink == 1;
+        } else if (errno == ENOENT && (slash = strrchr(path, '/'))) {
+            *slash = '\0';
+            ok = !fstatat(head_fd, path, &st, 0) && S_ISDIR(st.st_mode);
+            *slash = '/';
+        } else {
+            ok = errno == ENOENT;
+        }
+    }
+    // the old head with the staging directory may have been retired and sealed
+    if (ok) {
+        ok = restage(txn, head_fd) == SUCCESS;
+    }
+    if (ok && i < 0) {
+        ok = record_write(txn, path) == SUCCESS;
+        i = txn->write_set_len - 1;
+        added = ok;
+    }
+    if (head_fd >= 0) {
+        close(head_fd);
+    }
+    free(path);
+    if (!ok) {
+        if (src_fd >= 0) {
+            close(src_fd);
+        }
+        return 0;
+    }
+
+    snprintf(name, sizeof(name), "%d", i);
+    fd = openat(txn->stage_fd, name, flags | O_CREAT | O_TRUNC, 0666);
+    if (fd >= 0 && txn->journal_fds[i] < 0) {
+        txn->journal_fds[i] = openat(txn->stage_fd, name, O_RDONLY);
+        if (txn->journal_fds[i] < 0) {
+            close(fd);
+            fd = -1;
+        } else if (src_fd >= 0) {
+            // the staged file replaces the one in head
+            if (fchown(fd, st.st_uid, st.st_gid) && errno != EPERM) {
+                log_error("can't change owner of staged %s - %s", txn->write_set[i], strerror(errno));
+            }
+            fchmod(fd, st.st_mode & 07777);
+            copy_xattrs(src_fd, fd);
+        }
+    }
+    if (src_fd >= 0) {
+        close(src_fd);
+    }
+
+    if (fd < 0 && added) {
+        // without a staged file the entry would read as deleted
+        free(txn->write_set[--txn->write_set_len]);
+    }
+    *fp = fd < 0 ? NULL : fdopen(fd, modes);
+    if (fd >= 0 && !*fp) {
+        close(fd);
+    }
+    return 1;
+}
+
+/*
+ * Unlinks filename on the rename journal, like journal_fopen() returns 0
+ * if the transaction has to switch to its snapshot for it.
+ */
+static int journal_unlink(btrfstrans_txn* txn, const char* filename, int* result) {
+    struct stat st;
+    char name[16];
+    char* path;
+    int head_fd, i, ok;
+
+    path = normalized_path(filename);
+    if (!path || !plain_path(path)) {
+        free(path);
+        return 0;
+    }
+
+    i = journal_find(txn, path);
+    if (i >= 0) {
+        free(path);
+        if (txn->journal_fds[i] < 0) {
+            errno = ENOENT;
+            *result = -1;
+            return 1;
+        }
+        close(txn->journal_fds[i]);
+        txn->journal_fds[i] = -1;
+        snprintf(name, sizeof(name), "%d", i);
+        unlinkat(txn->stage_fd, name, 0);
+        *result = 0;
+        return 1;
+    }
+
+    // directories and missing paths are left to unlinkat() on the snapshot
+    head_fd = txn->write_set_len < txn->journal_limit ?
+        openat(txn->ctx->root_fd, BTRFSTRANS_HEAD_NAME, O_RDONLY | O_DIRECTORY) : -1;
+    ok = head_fd >= 0 && !fstatat(head_fd, path, &st, AT_SYMLINK_NOFOLLOW) && !S_ISDIR(st.st_mode);
+    if (head_fd >= 0) {
+        close(head_fd);
+    }
+    ok = ok && record_write(txn, path) == SUCCESS;
+    free(path);
+    if (!ok) {
+        return 0;
+    }
+    *result = 0;
+    return 1;
+}
+
+/*
+ * Renames the staged files of a manifest over their paths in head_fd,
+ * removes the deleted ones and gives head sequence number seq. Can be
+ * repeated after a crash: a staged file that is gone was renamed already.
+ */
+static int publish_journal(int head_fd, int stage_fd, char* manifest, unsigned long long seq) {
+    char name[16];
+    char *line, *end;
+    int i = 0, err;
+
+    for (line = manifest; (end = strchr(line, '\n')); line = end + 1, i++) {
+        *end = '\0';
+        err = 0;
+        if (line[0] == 'W') {
+            snprintf(name, sizeof(name), "%d", i);
+            if (renameat(stage_fd, name, head_fd, line + 2)) {
+                err = errno;
+                if (err == ENOENT && exists_at(stage_fd, name)) {
+                    err = make_parents(head_fd, line + 2) || renameat(stage_fd, name, head_fd, line + 2) ? errno : 0;
+                } else if (err == ENOENT) {
+                    err = 0;
+                }
+            }
+        } else if (unlinkat(head_fd, line + 2, 0) && errno != ENOENT) {
+            err = errno;
+        }
+        if (err) {
+            log_error("can't publish %s - %s", line + 2, strerror(err));
+            *end = '\n';
+            return E_RENAME;
+        }
+        *end = '\n';
+    }
+    return write_seq(head_fd, seq);
+}
+
+/*
+ * Makes sure the staging directory is in the head we publish to. A commit
+ * through a snapshot installs a head without it, the staged files are
+ * then reflinked into a new one.
+ */
+static int restage(btrfstrans_txn* txn, int head_fd) {
+    struct stat head_st, st;
+    char name[16];
+    int fd, ret;
+
+    if (txn->stage_fd >= 0) {
+        if (fstat(head_fd, &head_st) || fstat(txn->stage_fd, &st)) {
+            return E_ACCESS;
+        }
+        // every subvolume has a device number of its own
+        if (st.st_dev == head_st.st_dev) {
+            return SUCCESS;
+        }
+        close(txn->stage_fd);
+        txn->stage_fd = -1;
+    }
+
+    ret = open_stage(txn, head_fd);
+    for (int i = 0; !ret && i < txn->write_set_len; i++) {
+        if (txn->journal_fds[i] < 0) {
+            continue;
+        }
+        snprintf(name, sizeof(name), "%d", i);
+        fd = clone_staged(txn, i, txn->stage_fd, name);
+        if (fd < 0) {
+            log_error("can't restage %s - %s", txn->write_set[i], strerror(errno));
+            return E_ACCESS;
+        }
+        close(txn->journal_fds[i]);
+        txn->journal_fds[i] = fd;
+    }
+    return ret;
+}
+
+/*
+ * Writes the manifest of the write set into the staging directory, line
+ * i being "W <path>" for staged file <i> or "D <path>" for a deletion.
+ * The manifest is returned in *buf as well.
+ */
+static int write_manifest(btrfstrans_txn* txn, char** buf, size_t* len) {
+    FILE* fp;
+    int fd, ret = SUCCESS;
+
+    *buf = NULL;
+    fp = open_memstream(buf, len);
+    if (!fp) {
+        return E_UNSPECIFIED;
+    }
+    for (int i = 0; i < txn->write_set_len; i++) {
+        fprintf(fp, "%c %s\n", txn->journal_fds[i] >= 0 ? 'W' : 'D', txn->write_set[i]);
+    }
+    if (fclose(fp)) {
+        free(*buf);
+        *buf = NULL;
+        return E_UNSPECIFIED;
+    }
+
+    fd = openat(txn->stage_fd, BTRFSTRANS_MANIFEST_NAME, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0 || write(fd, *buf, *len) != (ssize_t)*len ||
+        (txn->durability == BTRFSTRANS_DURABILITY_FSYNC && fsync(fd))) {
+        ret = E_ACCESS;
+    }
+    if (fd >= 0 && close(fd)) {
+        ret = E_ACCESS;
+    }
+    if (ret) {
+        log_error("can't write manifest of %s - %s", txn->stage_name, strerror(errno));
+    }
+    return ret;
+}
+
+// what head holds before the commit tells created from modified paths
+static void journal_changes(btrfstrans_txn* txn, int head_fd, char** buf, size_t* len) {
+    char all[] = { BTRFSTRANS_CHANGE_ALL, '\n', '\0' };
+    struct stat st;
+    int found;
+    FILE* fp;
+
+    *buf = NULL;
+    fp = open_memstream(buf, len);
+    if (!fp) {
+        return;
+    }
+
+    for (int i = 0; i < txn->write_set_len; i++) {
+        found = !fstatat(head_fd, txn->write_set[i], &st, AT_SYMLINK_NOFOLLOW);
+        if (txn->journal_fds[i] >= 0) {
+            fprintf(fp, "%c %s\n", found ? BTRFSTRANS_CHANGE_MODIFIED : BTRFSTRANS_CHANGE_CREATED, txn->write_set[i]);
+        } else if (found) {
+            fprintf(fp, "%c %s\n", BTRFSTRANS_CHANGE_DELETED, txn->write_set[i]);
+        }
+    }
+
+    if (fclose(fp)) {
+        free(*buf);
+        *buf = strdup(all);
+        *len = *buf ? 2 : 0;
+    }
+}
+
+/*
+ * Flushes a published journal commit, returns -1 like fsync(). btrfs
+ * logs the new name of a file with it; deletions need their directory.
+ */
+static int fsync_published(btrfstrans_txn* txn) {
+    char* slash;
+    int head_fd, fd, ret = 0;
+
+    head_fd = openat(txn->ctx->root_fd, BTRFSTRANS_HEAD_NAME, O_RDONLY | O_DIRECTORY);
+    if (head_fd < 0) {
+        return -1;
+    }
+    for (int i = 0; i < txn->write_set_len && !ret; i++) {
+        if (txn->journal_fds[i] >= 0) {
+            ret = fsync(txn->journal_fds[i]);
+            continue;
+        }
+        slash = strrchr(txn->write_set[i], '/');
+        if (slash) {
+            *slash = '\0';
+            fd = openat(head_fd, txn->write_set[i], O_RDONLY | O_DIRECTORY);
+            *slash = '/';
+        } else {
+            fd = dup(head_fd);
+        }
+        if (fd >= 0) {
+            ret = fsync(fd);
+            close(fd);
+        }
+    }
+    // the sequence number
+    if (!ret) {
+        ret = fsync(head_fd);
+    }
+    close(head_fd);
+    return ret;
+}
+
+/*
+ * Commits a transaction still on the rename journal. Under the rename
+ * lock the write set is checked against the commits since base_seq, the
+ * manifest, txlog entry and journal record are written and the staged
+ * files renamed into head. Readers only look at generation snapshots,
+ * which are taken under the rename lock as well and sealed without the
+ * staging directories, so they see all of the commit or nothing, as with
+ * a head swap, and never what is still staged.
+ */
+static int commit_journal(btrfstrans_txn* txn, unsigned long long* transid) {
+    unsigned long long t = stats_now(), t_phase;
+    btrfstrans_ctx* ctx = txn->ctx;
+    unsigned long long head_seq = 0;
+    char* manifest = NULL;
+    size_t manifest_len = 0;
+    char* changes = NULL;
+    size_t changes_len = 0;
+    int changes_written = 0;
+    int recorded = 0;
+    int head_fd = -1;
+    int ret;
+
+    ret = lease_end(txn);
+    if (ret) {
+        log_error("the write lease of the transaction expired");
+        stats_count(BTRFSTRANS_COUNTER_COMMIT_ERRORS);
+        discard_transaction(txn);
+        return ret;
+    }
+
+    ret = acquire_rename_lock(ctx);
+    if (ret) {
+        stats_count(BTRFSTRANS_COUNTER_COMMIT_ERRORS);
+        discard_transaction(txn);
+        return ret;
+    }
+    crash_point("rename_locked");
+
+    // a journal commit left half published goes first
+    ret = recover_journal(ctx);
+    if (!ret || ret == E_CORRUPT) {
+        ret = read_seq(ctx->root_fd, BTRFSTRANS_HEAD_NAME, &head_seq);
+    }
+    if (!ret && head_seq != txn->base_seq) {
+        t_phase = stats_now();
+        ret = check_conflicts(txn, txn->base_seq, head_seq);
+        stats_record(BTRFSTRANS_PHASE_CONFLICT_CHECK, t_phase);
+    }
+    if (!ret) {
+        head_fd = openat(ctx->root_fd, BTRFSTRANS_HEAD_NAME, O_RDONLY | O_DIRECTORY);
+        ret = head_fd < 0 ? E_ACCESS : restage(txn, head_fd);
+    }
+    if (!ret && txn->durability == BTRFSTRANS_DURABILITY_FSYNC) {
+        t_phase = stats_now();
+        for (int i = 0; !ret && i < txn->write_set_len; i++) {
+            if (txn->journal_fds[i] >= 0 && fsync(txn->journal_fds[i])) {
+                log_error("can't fsync staged %s - %s", txn->write_set[i], strerror(errno));
+                ret = E_ACCESS;
+            }
+        }
+        stats_record(BTRFSTRANS_PHASE_FSYNC, t_phase);
+    }
+    if (!ret && open_changes(ctx) >= 0) {
+        t_phase = stats_now();
+        journal_changes(txn, head_fd, &changes, &changes_len);
+        stats_record(BTRFSTRANS_PHASE_CHANGESET, t_phase);
+    }
+    if (ret) {
+        goto discard;
+    }
+
+    t_phase = stats_now();
+    ret = write_manifest(txn, &manifest, &manifest_len);
+    if (!ret) {
+        ret = write_txlog(txn, head_seq + 1);
+    }
+    if (!ret && changes) {
+        ret = write_changes(ctx, head_seq + 1, changes, changes_len);
+        changes_written = !ret;
+    }
+    if (ret) {
+        goto discard;
+    }
+    crash_point("txlog");
+
+    ret = write_journal(txn, head_seq + 1);
+    if (ret) {
+        goto discard;
+    }
+    recorded = 1;
+    // log the record before any of the renames can be
+    if (txn->durability == BTRFSTRANS_DURABILITY_FSYNC && fsync(ctx->root_fd)) {
+        log_error("can't flush journal record - %s", strerror(errno));
+        ret = E_ACCESS;
+        goto discard;
+    }
+    stats_record(BTRFSTRANS_PHASE_TXLOG, t_phase);
+    crash_point("journal");
+
+    t_phase = stats_now();
+    ret = publish_journal(head_fd, txn->stage_fd, manifest, head_seq + 1);
+    if (ret) {
+        // the record decided the commit, it can only be completed
+        ret = recover_journal(ctx);
+    }
+    if (ret) {
+        log_error("commit %llu is left to recovery", head_seq + 1);
+        // recovery needs the staging directory
+        close_journal(txn);
+        free(manifest);
+        free(changes);
+        close(head_fd);
+        release_rename_lock(ctx);
+        discard_transaction(txn);
+        stats_count(BTRFSTRANS_COUNTER_COMMIT_ERRORS);
+        return E_RENAME;
+    }
+    stats_record(BTRFSTRANS_PHASE_PUBLISH, t_phase);
+    crash_point("published");
+
+    drop_stage(txn);
+    clear_journal(ctx);
+    crash_point("journal_cleared");
+
+    release_rename_lock(ctx);
+    close(head_fd);
+    free(manifest);
+    stats_count(BTRFSTRANS_COUNTER_JOURNAL_COMMITS);
+
+    ret = finish_commit(txn, head_seq + 1, changes, transid);
+    if (ret) {
+        return ret;
+    }
+    stats_record(BTRFSTRANS_PHASE_COMMIT, t);
+
+    log_debug("finished committing transaction");
+
+    return SUCCESS;
+
+discard:
+    if (recorded) {
+        clear_journal(ctx);
+    }
+    if (changes_written) {
+        unstage_changes(ctx, head_seq + 1);
+    }
+    free(changes);
+    free(manifest);
+    if (head_fd >= 0) {
+        close(head_fd);
+    }
+    release_rename_lock(ctx);
+    discard_transaction(txn);
+    stats_count(ret == E_CONFLICT ? BTRFSTRANS_COUNTER_CONFLICTS : BTRFSTRANS_COUNTER_COMMIT_ERRORS);
+    return ret;
+}
+
+FILE* btrfstrans_txn_fopen(btrfstrans_txn* txn, const char *__restrict filename, const char *__restrict modes) {
+    const char* name;
+    FILE* fp;
+    int dirfd, fd, flags;
+
+    if (txn && txn->state == STATE_WRITE && txn->journal && journal_fopen(txn, filename, modes, &fp)) {
+        return fp;
+    }
+
+    dirfd = resolve_path(txn, filename, &name);
+    flags = fopen_flags(modes);
+    if (dirfd < 0 || flags < 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if (strpbrk(modes, "wa+")) {
+        record_write(txn, name);
+    }
+
+    fd = openat(dirfd, name, flags, 0666);
+    if (fd < 0) {
+        return NULL;
+    }
+    fp = fdopen(fd, modes);
+    if (!fp) {
+        close(fd);
+    }
+    return fp;
+}
+
+FILE* btrfstrans_fopen(const char *__restrict filename, const char *__restrict modes) {
+    return btrfstrans_txn_fopen(legacy_txn, filename, modes);
+}
+
+
+int btrfstrans_fclose(FILE* fp){
+
+    return fclose(fp);
+}
+
+int btrfstrans_txn_mkdir(btrfstrans_txn* txn, const char* path, __mode_t mode){
+    const char* name;
+
+    int dirfd = resolve_path(txn, path, &name);
+    if (dirfd >= 0) {
+        record_write(txn, name);
+        return mkdirat(dirfd, name, mode);
+    } else {
+        return -dirfd;
+    }
+}
+
+int btrfstrans_mkdir(const char* path, __mode_t mode){
+    return btrfstrans_txn_mkdir(legacy_txn, path, mode);
+}
+
+int btrfstrans_txn_rmdir(btrfstrans_txn* txn, const char* path){
+    const char* name;
+
+    int dirfd = resolve_path(txn, path, &name);
+    if (dirfd >= 0) {
+        record_write(txn, name);
+        return unlinkat(dirfd, name, AT_REMOVEDIR);
+    } else {
+        return -dirfd;
+    }
+}
+
+int btrfstrans_rmdir(const char* path){
+    return btrfstrans_txn_rmdir(legacy_txn, path);
+}
+
+int btrfstrans_txn_unlink(btrfstrans_txn* txn, const char* path){
+    const char* name;
+    int ret;
+
+    if (txn && txn->state == STATE_WRITE && txn->journal && journal_unlink(txn, path, &ret)) {
+        return ret;
+    }
+
+    int dirfd = resolve_path(txn, path, &name);
+    if (dirfd >= 0) {
+        record_write(txn, name);
+        return unlinkat(dirfd, name, 0);
+    } else {
+        return -dirfd;
+    }
+}
+
+int btrfstrans_unlink(const char* path){
+    return btrfstrans_txn_unlink(legacy_txn, path);
+}
+
+int btrfstrans_txn_stat(btrfstrans_txn* txn, const char* __restrict file, struct stat* __restrict buf) {
+    const char* name;
+
+    int dirfd = resolve_path(txn, file, &name);
+    if (dirfd >= 0) {
+        return fstatat(dirfd, name, buf, 0);
+    } else {
+        return -dirfd;
+    }
+}
+
+int btrfstrans_stat(const char* __restrict file, struct stat* __restrict buf) {
+    return btrfstrans_txn_stat(legacy_txn, file, buf);
+}
+
+/*
+ * Brings the file src_path (any absolute or cwd relative path) into the
+ * write transaction txn as dst. Files on the same btrfs volume are
+ * reflinked, so the cost doesn't depend on their size.
+ */
+int btrfstrans_txn_import(btrfstrans_txn* txn, const char* src_path, const char* dst) {
+    const char* name;
+    struct stat st;
+    int dirfd;
+
+    dirfd = resolve_path(txn, dst, &name);
+    if (dirfd < 0 || txn->state != STATE_WRITE) {
+        return dirfd < 0 ? -dirfd : E_WRONGSTATE;
+    }
+
+    if (stat(src_path, &st) || !S_ISREG(st.st_mode)) {
+        log_error("can't import '%s', not a regular file", src_path);
+        return E_ACCESS;
+    }
+
+    record_write(txn, name);
+    return clone_file(AT_FDCWD, src_path, dirfd, name, st.st_mode & 07777);
+}
+
+int btrfstrans_import(const char* src_path, const char* dst) {
+    return btrfstrans_txn_import(legacy_txn, src_path, dst);
+}
+
+/*
+ * Copies the file src of the current head into the write transaction txn
+ * as dst, e.g. to keep an old version under a new name.
+ */
+int btrfstrans_txn_import_from_head(btrfstrans_txn* txn, const char* src, const char* dst) {
+    const char* src_name = src + strspn(src, "/");
+    const char* name;
+    struct stat st;
+    int head_fd, dirfd, ret;
+
+    dirfd = resolve_path(txn, dst, &name);
+    if (dirfd < 0 || txn->state != STATE_WRITE) {
+        return dirfd < 0 ? -dirfd : E_WRONGSTATE;
+    }
+
+    head_fd = openat(txn->ctx->root_fd, BTRFSTRANS_HEAD_NAME, O_RDONLY | O_DIRECTORY);
+    if (head_fd < 0) {
+        log_error("can't open %s", txn->ctx->head_subvolume_path);
+        return E_ACCESS;
+    }
+
+    if (fstatat(head_fd, src_name, &st, 0) || !S_ISREG(st.st_mode)) {
+        log_error("can't import '%s' from head, not a regular file", src);
+        close(head_fd);
+        return E_ACCESS;
+    }
+
+    record_write(txn, name);
+    ret = clone_file(head_fd, src_name, dirfd, name, st.st_mode & 07777);
+    close(head_fd);
+    return ret;
+}
+
+int btrfstrans_import_from_head(const char* src, const char* dst) {
+    return btrfstrans_txn_import_from_head(legacy_txn, src, dst);
+}
+
+/*
+ * Copies length bytes (up to EOF if length is 0) from src_path at
+ * src_offset into dst of the write transaction txn at dst_offset,
+ * creating dst if needed. Uses FICLONERANGE if possible and falls back to
+ * copy_file_range(), e.g. for unaligned ranges or other filesystems.
+ */
+int btrfstrans_txn_clone_range(btrfstrans_txn* txn, const char* src_path, off_t src_offset,
+    const char* dst, off_t dst_offset, off_t length) {
+    struct file_clone_range range;
+    const char* name;
+    struct stat st;
+    int dirfd, fd_src, fd_dst, ret;
+
+    dirfd = resolve_path(txn, dst, &name);
+    if (dirfd < 0 || txn->state != STATE_WRITE) {
+        return dirfd < 0 ? -dirfd : E_WRONGSTATE;
+    }
+
+    fd_src = open(src_path, O_RDONLY);
+    if (fd_src < 0 || fstat(fd_src, &st)) {
+        log_error("can't open '%s' - %s", src_path, strerror(errno));
+        if (fd_src >= 0) {
+            close(fd_src);
+        }
+        return E_ACCESS;
+    }
+
+    record_write(txn, name);
+    fd_dst = openat(dirfd, name, O_WRONLY | O_CREAT, st.st_mode & 07777);
+    if (fd_dst < 0) {
+        log_error("can't open '%s' - %s", name, strerror(errno));
+        close(fd_src);
+        return E_ACCESS;
+    }
+
+    range.src_fd = fd_src;
+    range.src_offset = src_offset;
+    range.src_length = length;
+    range.dest_offset = dst_offset;
+    if (ioctl(fd_dst, FICLONERANGE, &range) < 0) {
+        ret = copy_fd_range(fd_src, src_offset, fd_dst, dst_offset, length);
+    } else {
+        ret = SUCCESS;
+    }
+
+    close(fd_src);
+    if (close(fd_dst)) {
+        ret = E_ACCESS;
+    }
+    return ret;
+}
+
+int btrfstrans_clone_range(const char* src_path, off_t src_offset, const char* dst,
+    off_t dst_offset, off_t length) {
+    return btrfstrans_txn_clone_range(legacy_txn, src_path, src_offset, dst, dst_offset, length);
+}
+
+/*
+ * btrfstrans_submit() runs batches through io_uring when the library is
+ * built with BTRFSTRANS_HAVE_LIBURING and the kernel supports it (direct
+ * descriptors, 5.15+). Otherwise the chains of a batch are spread over a
+ * small pool of threads doing the same operations synchronously. The pool
+ * is shared by all transactions of the process and takes chains from the
+ * queued jobs in order.
+ */
+struct batch_job {
+    struct batch_job* next;
+    struct btrfstrans_op* ops;
+    const char** paths;     // of ops[i], relative to dirfd
+    int n;
+    int dirfd;
+    int* chain_starts;
+    int nchains;
+    int next_chain;
+    int done_chains;
+    int files[BTRFSTRANS_BATCH_MAX_FILES];  // the fds, on io_uring >= 0 for the slots opened
+};
+
+static pthread_mutex_t batch_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t batch_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t batch_done_cond = PTHREAD_COND_INITIALIZER;
+static struct batch_job* batch_jobs; // jobs with chains left to start
+static int batch_threads;
+
+#ifdef BTRFSTRANS_HAVE_LIBURING
+// the fixed file table belongs to the ring, so batches take turns on it
+static pthread_mutex_t batch_ring_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct io_uring batch_ring;
+static int batch_ring_state; // 0 -> untried, 1 -> ready, -1 -> unavailable
+#endif
+
+static int run_op(struct batch_job* job, struct btrfstrans_op* op) {
+    int* fd = op->opcode >= BTRFSTRANS_OP_OPEN ? &job->files[op->file] : NULL;
+    const char* path = job->paths[op - job->ops];
+    ssize_t len;
+    int ret = 0;
+
+    switch (op->opcode) {
+    case BTRFSTRANS_OP_MKDIR:
+        ret = mkdirat(job->dirfd, path, op->mode);
+        break;
+    case BTRFSTRANS_OP_RMDIR:
+        ret = unlinkat(job->dirfd, path, AT_REMOVEDIR);
+        break;
+    case BTRFSTRANS_OP_UNLINK:
+        ret = unlinkat(job->dirfd, path, 0);
+        break;
+    case BTRFSTRANS_OP_OPEN:
+        if (*fd >= 0) {
+            close(*fd);
+        }
+        *fd = openat(job->dirfd, path, op->open_flags, op->mode);
+        ret = *fd < 0 ? -1 : 0;
+        break;
+    case BTRFSTRANS_OP_WRITE:
+        len = pwrite(*fd, op->buf, op->len, op->offset);
+        if (len >= 0) {
+            return len;
+        }
+        ret = -1;
+        break;
+    case BTRFSTRANS_OP_FSYNC:
+        ret = fsync(*fd);
+        break;
+    case BTRFSTRANS_OP_CLOSE:
+        ret = close(*fd);
+        *fd = -1;
+        break;
+    default:
+        return -EINVAL;
+    }
+
+    return ret < 0 ? -errno : 0;
+}
+
+/*
+ * Runs the chain starting at ops[start]; like io_uring, a failed or short
+ * operation cancels the rest of its chain.
+ */
+static void run_chain(struct batch_job* job, int start) {
+    struct btrfstrans_op* op;
+    int failed = 0;
+    int i = start;
+
+    do {
+        op = &job->ops[i];
+        if (failed) {
+            op->result = -ECANCELED;
+            continue;
+        }
+        op->result = run_op(job, op);
+        if (op->result < 0 || (op->opcode == BTRFSTRANS_OP_WRITE && (size_t)op->result < op->len)) {
+            failed = 1;
+        }
+    } while ((op->flags & BTRFSTRANS_OP_LINK) && ++i < job->n);
+}
 
-    //printf("libbtrfstrans: Create subvolume '%s/%s'\n", dstdir, newname);
+static void* batch_worker_main(void* arg) {
+    struct batch_job* job;
+    int chain;
 
-    struct btrfs_ioctl_vol_args args;
+    pthread_mutex_lock(&batch_mutex);
+    for (;;) {
+        while (!batch_jobs) {
+            pthread_cond_wait(&batch_cond, &batch_mutex);
+        }
+        job = batch_jobs;
+        chain = job->next_chain++;
+        if (job->next_chain == job->nchains) {
+            batch_jobs = job->next;
+        }
+        pthread_mutex_unlock(&batch_mutex);
 
-    memset(&args, 0, sizeof(args));
-    strncpy_null(args.name, newname);
+        run_chain(job, job->chain_starts[chain]);
 
-    res = ioctl(fddst, BTRFS_IOC_SUBVOL_CREATE, &args);
+        pthread_mutex_lock(&batch_mutex);
+        if (++job->done_chains == job->nchains) {
+            pthread_cond_broadcast(&batch_done_cond);
+        }
+    }
 
-    if (res < 0) {
-        fprintf(stderr, "ERROR: cannot create subvolume - %s\n", strerror(errno));
-        printf("ERROR: cannot create subvolume - %s\n", strerror(errno));
-        goto out;
+    return NULL;
+}
+
+static int submit_threaded(struct batch_job* job) {
+    struct batch_job** tail;
+    pthread_t thread;
+
+    pthread_mutex_lock(&batch_mutex);
+    while (batch_threads < BTRFSTRANS_BATCH_THREADS) {
+        if (pthread_create(&thread, NULL, batch_worker_main, NULL)) {
+            break;
+        }
+        pthread_detach(thread);
+        batch_threads++;
+    }
+    if (batch_threads == 0) {
+        pthread_mutex_unlock(&batch_mutex);
+        for (int c = 0; c < job->nchains; c++) {
+            run_chain(job, job->chain_starts[c]);
+        }
+    } else if (job->nchains > 0) {
+        for (tail = &batch_jobs; *tail; tail = &(*tail)->next);
+        *tail = job;
+        pthread_cond_broadcast(&batch_cond);
+        while (job->done_chains < job->nchains) {
+            pthread_cond_wait(&batch_done_cond, &batch_mutex);
+        }
+        pthread_mutex_unlock(&batch_mutex);
+    } else {
+        pthread_mutex_unlock(&batch_mutex);
     }
 
-    retval = SUCCESS;
-out:
-    if (fddst != -1)
+    // files the batch didn't close itself
 
-        close(fddst);
-    free(inherit);
+    for (int i = 0; i < BTRFSTRANS_BATCH_MAX_FILES; i++) {
+        if (job->files[i] >= 0) {
+            close(job->files[i]);
+        }
+    }
+    return SUCCESS;
+}
 
-    return retval;
+#ifdef BTRFSTRANS_HAVE_LIBURING
+static int batch_ring_ready() {
+    if (batch_ring_state == 0) {
+        batch_ring_state = -1;
+        if (io_uring_queue_init(BTRFSTRANS_BATCH_RING_ENTRIES, &batch_ring, 0) == 0) {
+            if (io_uring_register_files_sparse(&batch_ring, BTRFSTRANS_BATCH_MAX_FILES) == 0) {
+                batch_ring_state = 1;
+            } else {
+                io_uring_queue_exit(&batch_ring);
+            }
+        }
+    }
+    return batch_ring_state == 1;
 }
 
+/*
+ * Waits for all submitted but not yet completed operations.
+ */
+static void reap_completions(int* in_flight) {
+    struct io_uring_cqe* cqe;
+    struct btrfstrans_op* op;
+
+    while (*in_flight > 0 && io_uring_wait_cqe(&batch_ring, &cqe) == 0) {
+        // NULL for the closes of close_slots()
+        op = io_uring_cqe_get_data(cqe);
+        if (op) {
+            op->result = cqe->res;
+        }
+        io_uring_cqe_seen(&batch_ring, cqe);
+        (*in_flight)--;
+    }
+}
 
-int delete_subvolume(const char* path) // from btrfs progs: cmds-subvolume.c
-{
-    int res, fd, len, e;
-    struct btrfs_ioctl_vol_args args;
-    char *dname, *vname, *cpath;
+/*
+ * Submits the ops queued since ops[*queued] up to ops[end] and waits for
+ * them. Entries the kernel didn't take would stay in the ring for the
+ * next batch, so then the ring is given up and the ops from the first
+ * one not taken on fail with the error.
+ */
+static int flush_uring(struct batch_job* job, int* queued, int end, int* in_flight) {
+    int ret = end > *queued ? io_uring_submit(&batch_ring) : 0;
 
-    res = test_issubvolume(path);
-    if(res<0){
-        fprintf(stderr, "ERROR: error accessing '%s'\n", path);
-        return E_ACCESS;
+    if (ret > 0) {
+        *in_flight += ret;
     }
-    if(!res){
-        fprintf(stderr, "ERROR: '%s' is not a subvolume\n", path);
-        return E_NOTASUBVOLUME;
+    reap_completions(in_flight);
+    if (ret < 0 || ret < end - *queued) {
+        log_error("can't submit batch operations to io_uring - %s", strerror(ret < 0 ? -ret : EAGAIN));
+        for (int i = *queued + (ret > 0 ? ret : 0); i < job->n; i++) {
+            job->ops[i].result = ret < 0 ? ret : -EAGAIN;
+        }
+        io_uring_queue_exit(&batch_ring);
+        batch_ring_state = -1;
+        return E_UNSPECIFIED;
     }
+    *queued = end;
+    return SUCCESS;
+}
 
-    cpath = realpath(path, 0);
-    dname = strdup(cpath);
-    dname = dirname(dname);
-    vname = strdup(cpath);
-    vname = basename(vname);
-    free(cpath);
+/*
+ * Empties the fixed file slots the batch opened, in job->files, like
+ * submit_threaded() closes what the batch left open: the table belongs
+ * to the ring, and the next batch must not reach a file through a slot
+ * it didn't open. A slot the batch closed itself just fails with EBADF.
+ */
+static void close_slots(struct batch_job* job, int* in_flight) {
+    struct io_uring_sqe* sqe;
+    int ret;
 
-    if( !strcmp(vname,".") || !strcmp(vname,"..") || strchr(vname, '/') ){
-        fprintf(stderr, "ERROR: incorrect subvolume name ('%s')\n", vname);
-        return E_INCORRECTSVNAME;
+    for (int i = 0; i < BTRFSTRANS_BATCH_MAX_FILES; i++) {
+        if (job->files[i] < 0) {
+            continue;
+        }
+        sqe = io_uring_get_sqe(&batch_ring);
+        if (!sqe) {
+            ret = io_uring_submit(&batch_ring);
+            if (ret > 0) {
+                *in_flight += ret;
+            }
+            reap_completions(in_flight);
+            sqe = ret < 0 ? NULL : io_uring_get_sqe(&batch_ring);
+        }
+        if (!sqe) {
+            // dropping the ring drops its file table as well
+            log_error("can't close the files of a batch on io_uring");
+            io_uring_queue_exit(&batch_ring);
+            batch_ring_state = -1;
+            return;
+        }
+        io_uring_prep_close_direct(sqe, i);
+        io_uring_sqe_set_data(sqe, NULL);
+        job->files[i] = -1;
     }
-
-    len = strlen(vname);
-    if (len == 0 || len >= BTRFS_VOL_NAME_MAX) {
-        fprintf(stderr, "ERROR: snapshot name too long ('%s)\n", vname);
-        return E_SNAPNAMETOOLONG;
+    ret = io_uring_submit(&batch_ring);
+    if (ret > 0) {
+        *in_flight += ret;
     }
-
-    DIR *dirstream;
-    fd = open_file_or_dir(dname, &dirstream);
-    if (fd < 0) {
-        fprintf(stderr, "ERROR: can't access to '%s'\n", dname);
-        return E_ACCESS;
+    reap_completions(in_flight);
+    if (ret < 0) {
+        log_error("can't close the files of a batch on io_uring - %s", strerror(-ret));
+        io_uring_queue_exit(&batch_ring);
+        batch_ring_state = -1;
     }
+}
 
-    //printf("libbtrfstrans: Delete subvolume '%s/%s'\n", dname, vname);
-    strncpy_null(args.name, vname);
-    res = ioctl(fd, BTRFS_IOC_SNAP_DESTROY, &args);
-    e = errno;
+static int submit_uring(struct batch_job* job) {
+    struct btrfstrans_op* op;
+    struct io_uring_sqe *sqe, *prev;
+    int in_flight = 0, queued = 0;
+    int end;
 
-    close(fd);
+    for (int c = 0; c < job->nchains; c++) {
+        end = c + 1 < job->nchains ? job->chain_starts[c + 1] : job->n;
 
-    if(res < 0 ){
-        fprintf( stderr, "ERROR: cannot delete '%s/%s' - %s\n", dname, vname, strerror(e));
-        return E_DELETE;
+        // a chain must not be split across submissions; it fits into the empty ring
+        if (io_uring_sq_space_left(&batch_ring) < (unsigned)(end - job->chain_starts[c]) &&
+            flush_uring(job, &queued, job->chain_starts[c], &in_flight)) {
+            return E_UNSPECIFIED;
+        }
+
+        prev = NULL;
+        for (int i = job->chain_starts[c]; i < end; i++) {
+            op = &job->ops[i];
+            sqe = io_uring_get_sqe(&batch_ring);
+            if (!sqe) {
+                // not with the space checked above; the chain ends here and the rest fails
+                if (prev) {
+                    prev->flags &= ~IOSQE_IO_LINK;
+                }
+                if (!flush_uring(job, &queued, i, &in_flight)) {
+                    for (; i < job->n; i++) {
+                        job->ops[i].result = -EBUSY;
+                    }
+                    close_slots(job, &in_flight);
+                }
+                return E_UNSPECIFIED;
+            }
+
+            switch (op->opcode) {
+            case BTRFSTRANS_OP_MKDIR:
+                io_uring_prep_mkdirat(sqe, job->dirfd, job->paths[i], op->mode);
+                break;
+            case BTRFSTRANS_OP_RMDIR:
+                io_uring_prep_unlinkat(sqe, job->dirfd, job->paths[i], AT_REMOVEDIR);
+                break;
+            case BTRFSTRANS_OP_UNLINK:
+                io_uring_prep_unlinkat(sqe, job->dirfd, job->paths[i], 0);
+                break;
+            case BTRFSTRANS_OP_OPEN:
+                io_uring_prep_openat_direct(sqe, job->dirfd, job->paths[i], op->open_flags, op->mode, op->file);
+                job->files[op->file] = op->file;
+                break;
+            case BTRFSTRANS_OP_WRITE:
+                io_uring_prep_write(sqe, op->file, op->buf, op->len, op->offset);
+                sqe->flags |= IOSQE_FIXED_FILE;
+                break;
+            case BTRFSTRANS_OP_FSYNC:
+                io_uring_prep_fsync(sqe, op->file, 0);
+                sqe->flags |= IOSQE_FIXED_FILE;
+                break;
+            case BTRFSTRANS_OP_CLOSE:
+                io_uring_prep_close_direct(sqe, op->file);
+                break;
+            }
+            if (i + 1 < end) {
+                sqe->flags |= IOSQE_IO_LINK;
+            }
+            io_uring_sqe_set_data(sqe, op);
+            prev = sqe;
+        }
     }
 
+    if (flush_uring(job, &queued, job->n, &in_flight)) {
+        return E_UNSPECIFIED;
+    }
+    close_slots(job, &in_flight);
     return SUCCESS;
 }
-
+#endif
 
 /*
- * Function to make a directory in btrfs volume a sub-volume
+ * Runs n operations on the write transaction txn and stores the outcome
+ * of each one in its result field. Returns SUCCESS if all of them
+ * succeeded.
  */
-int make_subvolume(const char* path) {
-    int ret = 0;
-    char svol_path[MAX_PATH_LEN];
+int btrfstrans_txn_submit(btrfstrans_txn* txn, struct btrfstrans_op* ops, int n) {
+    unsigned long long t = stats_now();
+    struct batch_job job;
+    int chain_starts[n > 0 ? n : 1];
+    const char* paths[n > 0 ? n : 1];
+    int ret;
 
-    ret = test_issubvolume(path);
-    if (ret == 1) {
-        return 0; // already a subvolume, no action needed
-    }
-    else if (ret < 0) {
-        printf("ERROR %s: path is inaccessable\n", __func__);
-        return -EINVAL;
+    if (!txn || txn->state != STATE_WRITE) {
+        log_error("not a write transaction");
+        return E_WRONGSTATE;
     }
 
-    ret = snprintf(svol_path, MAX_PATH_LEN, "%s_svol", path);
-    if (ret >= MAX_PATH_LEN) {
-        printf("ERROR %s: Path longer than buffer, allocate larger buffer.\n",
-            __func__);
-        return -ENOMEM;
-    }
-    else if (ret < 0) {
-        printf("ERROR %s: Error in writing string.\n", __func__);
-        return -ENOMEM;
+    memset(&job, 0, sizeof(job));
+    job.ops = ops;
+    job.n = n;
+    job.chain_starts = chain_starts;
+    job.paths = paths;
+    for (int i = 0; i < BTRFSTRANS_BATCH_MAX_FILES; i++) {
+        job.files[i] = -1;
     }
 
-    //printf("%s\n", svol_path);
+    // all of the batch is checked before any of it counts as written
+    for (int i = 0; i < n; i++) {
+        struct btrfstrans_op* op = &ops[i];
 
-    ret = create_subvolume(svol_path);
-    if (ret) {
-        printf("ERROR in %s: can't create subvolume '%s'\n", __func__,
-            svol_path);
-        return -EINVAL;
+        paths[i] = NULL;
+        if (i == 0 || !(ops[i - 1].flags & BTRFSTRANS_OP_LINK)) {
+            chain_starts[job.nchains++] = i;
+        } else if (i - chain_starts[job.nchains - 1] >= BTRFSTRANS_BATCH_MAX_CHAIN) {
+            log_error("chain of batch operation %d is longer than %d", i, BTRFSTRANS_BATCH_MAX_CHAIN);
+            return E_UNSPECIFIED;
+        }
+
+        if (op->opcode < BTRFSTRANS_OP_MKDIR || op->opcode > BTRFSTRANS_OP_CLOSE ||
+            (op->opcode >= BTRFSTRANS_OP_OPEN && (op->file < 0 || op->file >= BTRFSTRANS_BATCH_MAX_FILES))) {
+            log_error("invalid operation %d in batch", i);
+            return E_UNSPECIFIED;
+        }
+        if (op->opcode <= BTRFSTRANS_OP_OPEN) {
+            paths[i] = op->path + strspn(op->path, "/");
+            if (!*paths[i] || !strcmp(paths[i], ".") || !strcmp(paths[i], "..")) {
+                log_error("Invalid filename in batch operation %d", i);
+                return E_INVALIDNAME;
+            }
+        }
     }
 
-    //
-    //  We execute following commands to make existing directory a subvolume:
-    //   cp -rf --reflink=always path/* svol_path/.
-    //   rm -rf path/
-    //   mv svol_path path
-    //
+    ret = switch_to_snapshot(txn);
+    if (ret) {
+        return ret;
+    }
+    job.dirfd = txn->writable_fd;
+    for (int i = 0; i < n; i++) {
+        struct btrfstrans_op* op = &ops[i];
 
-    char cmd[MAX_PATH_LEN];
-    ret = snprintf(cmd, MAX_PATH_LEN, "cp -rf --reflink=always %s/* %s/.", path,
-        svol_path);
-    if (ret >= MAX_PATH_LEN) {
-        printf("ERROR %s: Path longer than buffer, allocate larger buffer.\n",
-            __func__);
-        return -ENOMEM;
+        if (paths[i] && (op->opcode != BTRFSTRANS_OP_OPEN || (op->open_flags & (O_WRONLY | O_RDWR | O_CREAT | O_TRUNC)))) {
+            record_write(txn, paths[i]);
+        }
+        op->result = 0;
     }
-    else if (ret < 0) {
-        printf("ERROR %s: Error in writing string.\n", __func__);
-        return -ENOMEM;
+
+#ifdef BTRFSTRANS_HAVE_LIBURING
+    pthread_mutex_lock(&batch_ring_mutex);
+    if (batch_ring_ready()) {
+        ret = submit_uring(&job);
+        pthread_mutex_unlock(&batch_ring_mutex);
+    } else {
+        pthread_mutex_unlock(&batch_ring_mutex);
+        ret = submit_threaded(&job);
     }
-    //printf("%s\n", cmd);
-    ret = system(cmd);
-    if (ret < 0) {
-        printf("Error in executing command\n");
+#else
+    ret = submit_threaded(&job);
+#endif
+    if (ret) {
         return ret;
     }
+    stats_record(BTRFSTRANS_PHASE_SUBMIT, t);
 
-    ret = snprintf(cmd, MAX_PATH_LEN, "rm -rf %s/", path);
-    if (ret >= MAX_PATH_LEN) {
-        printf("ERROR %s: Path longer than buffer, allocate larger buffer.\n",
-            __func__);
-        return -ENOMEM;
+    for (int i = 0; i < n; i++) {
+        if (ops[i].result < 0) {
+            return E_UNSPECIFIED;
+        }
     }
-    else if (ret < 0) {
-        printf("ERROR %s: Error in writing string.\n", __func__);
-        return -ENOMEM;
+    return SUCCESS;
+}
+
+int btrfstrans_submit(struct btrfstrans_op* ops, int n) {
+    if (state != STATE_WRITE) {
+        log_error("transaction was not started or libbtrfstrans is in the wrong state(state=%d)", state);
+        return E_WRONGSTATE;
     }
-    //printf("%s\n", cmd);
-    ret = system(cmd);
-    if (ret < 0) {
-        printf("Error in executing command\n");
-        return ret;
+
+    return btrfstrans_txn_submit(legacy_txn, ops, n);
+}
+
+/*
+ * Asynchronous start and commit. Requests are queued for a small pool of
+ * threads, created on demand. A start in pessimistic mode only tries the
+ * write lock: while it is taken the request goes back to the queue with a
+ * growing delay, so waiting for the lock occupies no thread and the
+ * holder's commit always finds one. A request ends on a pool thread by
+ * calling its callback, then, unless the callback fetched the result,
+ * setting its state to DONE and adding 1 to its eventfd.
+ */
+enum async_op {
+    ASYNC_BEGIN,
+    ASYNC_COMMIT
+};
+
+struct btrfstrans_async {
+    int op;
+    int legacy;             // through the original API, see btrfstrans_async_result()
+    btrfstrans_ctx* ctx;
+    btrfstrans_txn* txn;    // to commit, or the one started
+    unsigned long long transid;
+    unsigned long long deadline;    // of the wait for the write lock, 0: none
+    unsigned long long not_before;  // of the next try to take it
+    unsigned int poll_us;
+    int efd;
+    btrfstrans_async_fn fn;
+    void* arg;
+
+    // protected by async_mutex
+    int state;
+    int canceled;
+    int result;
+    btrfstrans_async* next;
+};
+
+static pthread_mutex_t async_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t async_cond;
+static int async_running;
+static int async_threads;
+static int async_idle;
+static btrfstrans_async* async_queue;
+static btrfstrans_async** async_tail = &async_queue;
+// the request whose callback runs on this thread, NULL once the callback fetched its result
+static __thread btrfstrans_async* async_completing;
+
+static void async_enqueue(btrfstrans_async* req) {
+    req->next = NULL;
+    *async_tail = req;
+    async_tail = &req->next;
+    pthread_cond_signal(&async_cond);
+}
+
+/*
+ * Called and returns with async_mutex held; req may be gone afterwards.
+ * The callback runs before the request is marked done and efd is
+ * signalled: until then nobody but the callback can release it.
+ */
+static void async_complete(btrfstrans_async* req, int ret) {
+    btrfstrans_async_fn fn = req->fn;
+    void* arg = req->arg;
+    uint64_t one = 1;
+    int efd = req->efd;
+    int released;
+
+    req->result = ret;
+    if (fn) {
+        pthread_mutex_unlock(&async_mutex);
+        async_completing = req;
+        fn(req, arg);
+        released = !async_completing;
+        async_completing = NULL;
+        pthread_mutex_lock(&async_mutex);
+        if (released) {
+            return;
+        }
     }
+    req->state = BTRFSTRANS_ASYNC_DONE;
+    pthread_mutex_unlock(&async_mutex);
 
-    ret = snprintf(cmd, MAX_PATH_LEN, "mv %s %s", svol_path, path);
-    if (ret >= MAX_PATH_LEN) {
-        printf("ERROR %s: Path longer than buffer, allocate larger buffer.\n",
-            __func__);
-        return -ENOMEM;
+    if (efd >= 0 && write(efd, &one, sizeof(one)) != sizeof(one)) {
+        log_error("can't signal completion of an asynchronous request - %s", strerror(errno));
     }
-    else if (ret < 0) {
-        printf("ERROR %s: Error in writing string.\n", __func__);
-        return -ENOMEM;
+    pthread_mutex_lock(&async_mutex);
+}
+
+static void async_run(btrfstrans_async* req) {
+    int ret;
+
+    if (req->canceled) {
+        async_complete(req, E_CANCELED);
+        return;
     }
-    //printf("%s\n", cmd);
-    ret = system(cmd);
-    if (ret < 0) {
-        printf("Error in executing command\n");
-        return ret;
+    req->state = BTRFSTRANS_ASYNC_RUNNING;
+    pthread_mutex_unlock(&async_mutex);
+
+    if (req->op == ASYNC_COMMIT) {
+        ret = btrfstrans_txn_commit(req->txn, &req->transid);
+        req->txn = NULL;
+    } else {
+        ret = btrfstrans_txn_begin_timeout(req->ctx, &req->txn, 0);
     }
 
-    return ret;
+    pthread_mutex_lock(&async_mutex);
+    if (req->op == ASYNC_BEGIN && ret == E_TIMEOUT && !req->canceled &&
+        (!req->deadline || monotonic_ns() < req->deadline)) {
+        req->state = BTRFSTRANS_ASYNC_LOCKING;
+        req->not_before = monotonic_ns() + req->poll_us * 1000ULL;
+        if (req->poll_us < BTRFSTRANS_LOCK_POLL_MAX) {
+            req->poll_us *= 2;
+        }
+        async_enqueue(req);
+        return;
+    }
+
+    if (req->op == ASYNC_BEGIN && req->canceled) {
+        if (ret == SUCCESS) {
+            // nothing was done in it yet
+            pthread_mutex_unlock(&async_mutex);
+            btrfstrans_txn_abort(req->txn);
+            pthread_mutex_lock(&async_mutex);
+            req->txn = NULL;
+        }
+        ret = E_CANCELED;
+    }
+    async_complete(req, ret);
 }
 
+static void* async_main(void* arg) {
+    btrfstrans_async **pp, *req;
+    unsigned long long now, next;
+    struct timespec deadline;
+
+    pthread_mutex_lock(&async_mutex);
+    for (;;) {
+        now = monotonic_ns();
+        next = 0;
+        for (pp = &async_queue; (req = *pp); pp = &req->next) {
+            if (req->not_before <= now || req->canceled) {
+                break;
+            }
+            if (!next || req->not_before < next) {
+                next = req->not_before;
+            }
+        }
 
-static int exists(const char* path) {
-    int ret;
-    struct stat st;
-    ret = stat(path, &st);
-    if (ret < 0) {
-        return 0;
-    } else {
-        return 1;
+        if (!req) {
+            async_idle++;
+            if (!next) {
+                pthread_cond_wait(&async_cond, &async_mutex);
+            } else {
+                deadline.tv_sec = next / 1000000000ULL;
+                deadline.tv_nsec = next % 1000000000ULL;
+                pthread_cond_timedwait(&async_cond, &async_mutex, &deadline);
+            }
+            async_idle--;
+            continue;
+        }
+
+        *pp = req->next;
+        if (!*pp) {
+            async_tail = pp;
+        }
+        async_run(req);
     }
+    pthread_mutex_unlock(&async_mutex);
+
+    return NULL;
 }
 
-static int exists_one_of(const char* path1, const char* path2, const char* path3) {
-    return exists(path1) || exists(path2) || exists(path3);
+static int async_submit(btrfstrans_async* req) {
+    pthread_condattr_t attr;
+    pthread_t thread;
+
+    req->state = BTRFSTRANS_ASYNC_QUEUED;
+    req->poll_us = BTRFSTRANS_LOCK_POLL_MIN;
+
+    pthread_mutex_lock(&async_mutex);
+    if (!async_running) {
+        // not_before is a monotonic clock time
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&async_cond, &attr);
+        pthread_condattr_destroy(&attr);
+        async_running = 1;
+    }
+    if (!async_idle && async_threads < BTRFSTRANS_ASYNC_THREADS) {
+        if (pthread_create(&thread, NULL, async_main, NULL) == 0) {
+            pthread_detach(thread);
+            async_threads++;
+        } else if (!async_threads) {
+            pthread_mutex_unlock(&async_mutex);
+            log_error("can't start a thread for asynchronous requests");
+            return E_UNSPECIFIED;
+        }
+    }
+    async_enqueue(req);
+    pthread_mutex_unlock(&async_mutex);
+    return SUCCESS;
 }
 
-static int exist_both_of(const char* path1, const char* path2) {
-    return exists(path1) && exists(path2);
+static btrfstrans_async* new_async(int op, int efd, btrfstrans_async_fn fn, void* arg) {
+    btrfstrans_async* req = calloc(1, sizeof(*req));
+
+    if (!req) {
+        log_error("can't allocate asynchronous request");
+        return NULL;
+    }
+    req->op = op;
+    req->efd = efd;
+    req->fn = fn;
+    req->arg = arg;
+    return req;
 }
 
-static int assemble_path(const char* filename, char* assembled_path) {
-    if (!strcmp(filename, ".") || !strcmp(filename, "..") || !strcmp(filename, "/")) {
-        fprintf(stderr, "ERROR: Invalid filename '%s'\n", filename);
-        printf("invalid file name\n");
+/*
+ * Starts a write transaction on ctx in the background, see
+ * btrfstrans_txn_begin_timeout() for timeout_ms.
+ */
+int btrfstrans_txn_begin_async(btrfstrans_ctx* ctx, int timeout_ms, int efd, btrfstrans_async_fn fn, void* arg,
+    btrfstrans_async** reqp) {
+    btrfstrans_async* req;
+    int ret;
 
-        return E_INVALIDNAME;
+    req = new_async(ASYNC_BEGIN, efd, fn, arg);
+    if (!req) {
+        return E_UNSPECIFIED;
     }
+    req->ctx = ctx;
+    req->deadline = timeout_ms < 0 ? 0 : monotonic_ns() + timeout_ms * 1000000ULL;
 
-    if (state == STATE_READ) {
-        strcpy(assembled_path, specific_readonly_sv_path);
-        strcat(assembled_path, filename);
-        printf("path to read is %s\n", assembled_path);
-        return SUCCESS;
-    } else if ( state == STATE_WRITE) {
-        strcpy(assembled_path, writable_subvolume_path);
-        strcat(assembled_path, filename);
-        printf("path to write is %s\n", assembled_path);
-        return SUCCESS;
-    } else {
-        printf("Wrong state\n");
-        return E_WRONGSTATE;
+    *reqp = req;
+    ret = async_submit(req);
+    if (ret) {
+        *reqp = NULL;
+        free(req);
     }
+    return ret;
 }
 
-FILE* btrfstrans_fopen(const char *__restrict filename, const char *__restrict modes) {
-    char assembled_path[257];
+/*
+ * Commits txn in the background; the handle belongs to the request until
+ * it is done.
+ */
+int btrfstrans_txn_commit_async(btrfstrans_txn* txn, int efd, btrfstrans_async_fn fn, void* arg,
+    btrfstrans_async** reqp) {
+    btrfstrans_async* req;
+    int ret;
 
-    int ret = assemble_path(filename, assembled_path);
-    if (!ret) {
-        return fopen(assembled_path, modes);
-    } else {
-        return NULL;
+    if (!txn || txn->state != STATE_WRITE) {
+        log_error("not a write transaction");
+        return E_WRONGSTATE;
     }
-}
 
+    req = new_async(ASYNC_COMMIT, efd, fn, arg);
+    if (!req) {
+        return E_UNSPECIFIED;
+    }
+    req->ctx = txn->ctx;
+    req->txn = txn;
 
-int btrfstrans_fclose(FILE* fp){
+    *reqp = req;
+    ret = async_submit(req);
+    if (ret) {
+        *reqp = NULL;
+        free(req);
+    }
+    return ret;
+}
 
-    return fclose(fp);
+int btrfstrans_async_state(btrfstrans_async* req) {
+    int ret;
+
+    pthread_mutex_lock(&async_mutex);
+    ret = req->state;
+    pthread_mutex_unlock(&async_mutex);
+    return ret;
 }
 
-int btrfstrans_mkdir(const char* path, __mode_t mode){
-    char assembled_path[257];
+/*
+ * A start can be cancelled until it is done, a commit only while it is
+ * queued. The request still ends as usual, with E_CANCELED.
+ */
+int btrfstrans_async_cancel(btrfstrans_async* req) {
+    int ret = SUCCESS;
 
-    int ret = assemble_path(path, assembled_path);
-    if (!ret) {
-        return mkdir(assembled_path, mode);
+    pthread_mutex_lock(&async_mutex);
+    if (req->state == BTRFSTRANS_ASYNC_DONE || (req->op == ASYNC_COMMIT && req->state != BTRFSTRANS_ASYNC_QUEUED)) {
+        ret = E_WRONGSTATE;
     } else {
-        return ret;
+        req->canceled = 1;
+        req->not_before = 0;
+        pthread_cond_broadcast(&async_cond);
     }
+    pthread_mutex_unlock(&async_mutex);
+    return ret;
 }
 
-int btrfstrans_rmdir(const char* path){
-    char assembled_path[257];
+/*
+ * Returns the result of a finished request and releases it; fails with
+ * E_WRONGSTATE, keeping it, while it isn't done. Its callback may fetch
+ * it before it is marked done.
+ */
+int btrfstrans_async_result(btrfstrans_async* req, btrfstrans_txn** txn, unsigned long long* transid) {
+    int ret;
 
-    int ret = assemble_path(path, assembled_path);
-    if (!ret) {
-        return rmdir(assembled_path);
+    if (req != async_completing && btrfstrans_async_state(req) != BTRFSTRANS_ASYNC_DONE) {
+        return E_WRONGSTATE;
+    }
+
+    ret = req->result;
+    if (req->op == ASYNC_COMMIT && transid) {
+        *transid = req->transid;
+    }
+    // a cancelled commit leaves the transaction running
+    if (req->legacy && (req->op == ASYNC_BEGIN ? !ret : ret == E_CANCELED)) {
+        legacy_txn = req->txn;
+        state = STATE_WRITE;
     } else {
-        return ret;
+        if (req->legacy) {
+            state = STATE_INITIALIZED;
+        }
+        if (txn) {
+            *txn = req->txn;
+        }
+    }
+    if (req == async_completing) {
+        async_completing = NULL;
     }
+    free(req);
+    return ret;
 }
 
-int btrfstrans_unlink(const char* path){
-    char assembled_path[257];
+/*
+ * The original API: the transaction started becomes the running one when
+ * the result is fetched. Until then the synchronous calls fail with
+ * E_WRONGSTATE.
+ */
+int btrfstrans_start_async(int timeout_ms, int efd, btrfstrans_async_fn fn, void* arg, btrfstrans_async** reqp) {
+    btrfstrans_async* req;
+    int ret;
 
-    int ret = assemble_path(path, assembled_path);
-    if (!ret) {
-        return unlink(assembled_path);
-    } else {
-        return ret;
+    if (state != STATE_INITIALIZED) {
+        log_error("libbtrfstrans was not configured or is in the wrong state (state=%d)", state);
+        return E_WRONGSTATE;
+    }
+
+    req = new_async(ASYNC_BEGIN, efd, fn, arg);
+    if (!req) {
+        return E_UNSPECIFIED;
+    }
+    req->legacy = 1;
+    req->ctx = legacy_ctx;
+    req->deadline = timeout_ms < 0 ? 0 : monotonic_ns() + timeout_ms * 1000000ULL;
+
+    state = STATE_ASYNC;
+    *reqp = req;
+    ret = async_submit(req);
+    if (ret) {
+        state = STATE_INITIALIZED;
+        *reqp = NULL;
+        free(req);
     }
+    return ret;
 }
 
-int btrfstrans_stat(const char* __restrict file, struct stat* __restrict buf) {
-    char assembled_path[257];
+int btrfstrans_commit_async(int efd, btrfstrans_async_fn fn, void* arg, btrfstrans_async** reqp) {
+    btrfstrans_async* req;
+    int ret;
 
-    int ret = assemble_path(file, assembled_path);
-    if (!ret) {
-        return stat(file, buf);
-    } else {
-        return ret;
+    if (state != STATE_WRITE) {
+        log_error("transaction was not started or libbtrfstrans is in the wrong state(state=%d)", state);
+        return E_WRONGSTATE;
+    }
+
+    req = new_async(ASYNC_COMMIT, efd, fn, arg);
+    if (!req) {
+        return E_UNSPECIFIED;
+    }
+    req->legacy = 1;
+    req->ctx = legacy_ctx;
+    req->txn = legacy_txn;
+
+    legacy_txn = NULL;
+    state = STATE_ASYNC;
+    *reqp = req;
+    ret = async_submit(req);
+    if (ret) {
+        legacy_txn = req->txn;
+        state = STATE_WRITE;
+        *reqp = NULL;
+        free(req);
     }
+    return ret;
 }
 
 static void signal_callback_handler(int signum) {
-    printf("\nlibbtrfstrans: Caught signal: %d\n", signum);
+    log_warn("caught signal %d", signum);
     if (state == STATE_READ) {
-        printf("stopping ro transaction...\n");
+        log_info("stopping ro transaction");
         stop_ro_transaction();
     } else if (state == STATE_WRITE) {
-        printf("aborting write transaction...\n");
+        log_info("aborting write transaction");
         abort_transaction();
     }
 
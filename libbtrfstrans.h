@@ -3,6 +3,10 @@
 
 #include <sys/stat.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 #ifndef BUILD_ASSERT
 #define BUILD_ASSERT(x)
 #endif
@@ -22,23 +26,314 @@ enum libbtrfstrans_error
     E_DELETE,
     E_WRONGSTATE,
     E_CORRUPT,
-    E_INVALIDNAME
+    E_INVALIDNAME,
+    E_CONFLICT,
+    E_TIMEOUT,
+    E_LEASEEXPIRED,
+    E_CANCELED
 };
 
+/*
+ * Concurrency modes for write transactions:
+ *  PESSIMISTIC -> one writer at a time, the write lock is held from
+ *                 start_transaction() until commit/abort (default)
+ *  OPTIMISTIC  -> every writer works on its own wr_snap_<txid>; conflicts
+ *                 with transactions committed in the meantime are detected
+ *                 at commit time and reported as E_CONFLICT
+ */
+#define BTRFSTRANS_MODE_PESSIMISTIC 0
+#define BTRFSTRANS_MODE_OPTIMISTIC 1
+
+/*
+ * Durability of a commit:
+ *  NONE   -> nothing is flushed, a crash may lose the commit
+ *  ASYNC  -> a btrfs transaction commit is started and its transid is
+ *            returned, see btrfstrans_wait_durable()
+ *  SYNCFS -> the btrfs volume (and only it) is flushed (default)
+ *  FSYNC  -> only the files written by the transaction and the volume
+ *            root are flushed
+ */
+#define BTRFSTRANS_DURABILITY_NONE 0
+#define BTRFSTRANS_DURABILITY_ASYNC 1
+#define BTRFSTRANS_DURABILITY_SYNCFS 2
+#define BTRFSTRANS_DURABILITY_FSYNC 3
+
+/*
+ * Handle based API. A context is one opened volume root and may be shared
+ * by all threads of the process. A transaction handle is used by one
+ * thread at a time; any number of read-only and write transactions may run
+ * concurrently, within a process as well as across processes.
+ * btrfstrans_txn_commit(), btrfstrans_txn_abort() and btrfstrans_txn_end()
+ * release the handle whatever they return, except E_WRONGSTATE.
+ */
+typedef struct btrfstrans_ctx btrfstrans_ctx;
+typedef struct btrfstrans_txn btrfstrans_txn;
+
+int btrfstrans_ctx_open(const char* path, btrfstrans_ctx** ctx);
+int btrfstrans_ctx_close(btrfstrans_ctx* ctx);
+int btrfstrans_ctx_set_mode(btrfstrans_ctx* ctx, int mode);
+int btrfstrans_ctx_set_durability(btrfstrans_ctx* ctx, int level);
+int btrfstrans_ctx_set_prewarm(btrfstrans_ctx* ctx, int enabled);
+int btrfstrans_ctx_set_write_lease(btrfstrans_ctx* ctx, int lease_ms);
+int btrfstrans_ctx_wait_durable(btrfstrans_ctx* ctx, unsigned long long transid);
+int btrfstrans_ctx_wait_durable_batch(btrfstrans_ctx* ctx, const unsigned long long* transids, int n);
+
+/*
+ * The inter-process locks are released by the kernel when their holder
+ * dies, and the next holder cleans up the snapshots it left behind.
+ * btrfstrans_txn_begin_timeout() fails with E_TIMEOUT when the write lock
+ * of pessimistic mode isn't free within timeout_ms (0: try once, < 0:
+ * wait forever). With a write lease of lease_ms > 0 a pessimistic writer
+ * that keeps the write lock longer loses it and its changes, commit then
+ * fails with E_LEASEEXPIRED.
+ */
+int btrfstrans_txn_begin(btrfstrans_ctx* ctx, btrfstrans_txn** txn);
+int btrfstrans_txn_begin_timeout(btrfstrans_ctx* ctx, btrfstrans_txn** txn, int timeout_ms);
+
+/*
+ * Asynchronous start and commit for event loops: the blocking steps run on
+ * a pool of library threads and waiting for the write lock occupies none
+ * of them. A request reports its end by calling fn (if not NULL) on a
+ * pool thread, then marking itself done and adding 1 to the eventfd efd
+ * (if efd >= 0). Its state can be polled at any time;
+ * btrfstrans_async_result() returns what the blocking call would have,
+ * hands out the started transaction and the transid, and releases the
+ * request. fn may fetch the result itself, before the request shows as
+ * done; the request is then gone and efd is not signalled. A start can
+ * be cancelled until it is done, a commit while it is still queued; the
+ * request then ends with E_CANCELED and a cancelled commit leaves the
+ * transaction running. Requests must be done before their context is
+ * closed. After btrfstrans_start_async() or btrfstrans_commit_async()
+ * the synchronous calls fail with E_WRONGSTATE until the result is
+ * fetched.
+ */
+#define BTRFSTRANS_ASYNC_QUEUED 0
+#define BTRFSTRANS_ASYNC_LOCKING 1      // waiting for the write lock
+#define BTRFSTRANS_ASYNC_RUNNING 2
+#define BTRFSTRANS_ASYNC_DONE 3
+
+typedef struct btrfstrans_async btrfstrans_async;
+typedef void (*btrfstrans_async_fn)(btrfstrans_async* req, void* arg);
+
+int btrfstrans_txn_begin_async(btrfstrans_ctx* ctx, int timeout_ms, int efd, btrfstrans_async_fn fn, void* arg,
+    btrfstrans_async** req);
+int btrfstrans_txn_commit_async(btrfstrans_txn* txn, int efd, btrfstrans_async_fn fn, void* arg,
+    btrfstrans_async** req);
+int btrfstrans_async_state(btrfstrans_async* req);
+int btrfstrans_async_cancel(btrfstrans_async* req);
+int btrfstrans_async_result(btrfstrans_async* req, btrfstrans_txn** txn, unsigned long long* transid);
+
+/*
+ * Small write transactions commit through a rename journal instead of a
+ * snapshot: a transaction starts without a snapshot, the files it writes
+ * are staged in head below .btrfstrans_journal (a reserved name) and the
+ * commit renames them into place under the rename lock. It stays on the
+ * journal as long as it only opens files with "w" or "w+" and unlinks
+ * them, for up to max_files distinct paths (default
+ * BTRFSTRANS_JOURNAL_DEFAULT_FILES). Anything else, more files, a
+ * savepoint or a retention policy switches it to a snapshot on the fly,
+ * which costs what the start saved; files opened before keep working.
+ * The switch takes a fresh snapshot: prewarmed snapshots (see
+ * btrfstrans_ctx_set_prewarm()) are only taken while max_files is 0.
+ * Read-only transactions, exports, prewarmed snapshots and conflict
+ * detection see no difference: they all snapshot head under the rename
+ * lock, without the staging directory. head itself is changed in place,
+ * so only code reading it directly, bypassing the library, can see a
+ * commit in progress. 0 always uses snapshots.
+ */
+#define BTRFSTRANS_JOURNAL_DEFAULT_FILES 4
+#define BTRFSTRANS_JOURNAL_MAX_FILES 64
+
+int btrfstrans_ctx_set_journal_files(btrfstrans_ctx* ctx, int max_files);
+int btrfstrans_txn_set_durability(btrfstrans_txn* txn, int level);
+int btrfstrans_txn_commit(btrfstrans_txn* txn, unsigned long long* transid);
+int btrfstrans_txn_abort(btrfstrans_txn* txn);
+
+/*
+ * Savepoints inside a write transaction, numbered from 0 in the order they
+ * are set. Rolling back is a subvolume swap, its cost doesn't depend on
+ * the amount of data written since the savepoint.
+ */
+int btrfstrans_txn_savepoint(btrfstrans_txn* txn, int* savepoint);
+int btrfstrans_txn_rollback_to(btrfstrans_txn* txn, int savepoint);
+int btrfstrans_txn_release_savepoint(btrfstrans_txn* txn, int savepoint);
+
+/*
+ * Changesets: what every commit created, modified and deleted, for keeping
+ * caches of head without rescanning it. btrfstrans_ctx_enable_changesets()
+ * turns them on for the volume, in all processes from their next commit
+ * on. btrfstrans_ctx_read_changes() calls fn for every change of the
+ * commits from from_seq up to head and returns in *next_seq where to
+ * continue; from_seq 0 just returns the next commit to come. A change of
+ * kind BTRFSTRANS_CHANGE_ALL, with an empty path, stands for anything in
+ * head: it is delivered for commits whose changeset isn't available. A
+ * non-zero return of fn stops the delivery and is returned, its commit is
+ * delivered in full again next time. btrfstrans_ctx_wait_commit() sleeps
+ * until head has at least sequence seq. Finding the changed files needs
+ * CAP_SYS_ADMIN, without it every changeset is ALL.
+ */
+#define BTRFSTRANS_CHANGE_CREATED 'C'
+#define BTRFSTRANS_CHANGE_MODIFIED 'M'
+#define BTRFSTRANS_CHANGE_DELETED 'D'
+#define BTRFSTRANS_CHANGE_ALL '*'
+
+typedef int (*btrfstrans_change_fn)(unsigned long long seq, int kind, const char* path, void* arg);
+
+int btrfstrans_ctx_enable_changesets(btrfstrans_ctx* ctx);
+int btrfstrans_ctx_read_changes(btrfstrans_ctx* ctx, unsigned long long from_seq, unsigned long long* next_seq,
+    btrfstrans_change_fn fn, void* arg);
+int btrfstrans_ctx_wait_commit(btrfstrans_ctx* ctx, unsigned long long seq, int timeout_ms);
+
+/*
+ * Incremental export for backups: with a spool directory set, every
+ * committed head is written there as a btrfs send stream against the
+ * previously exported one, named <parent seq>-<seq>.btrfs (parent 0: a
+ * full stream). 'btrfs receive' of the streams in name order replays the
+ * commits on another volume, see 'drive_operator.sh replay'. Needs
+ * CAP_SYS_ADMIN. btrfstrans_ctx_flush_spool() waits until the commits made
+ * through ctx are exported.
+ */
+int btrfstrans_ctx_set_spool(btrfstrans_ctx* ctx, const char* spool_path);
+int btrfstrans_ctx_flush_spool(btrfstrans_ctx* ctx);
+
+int btrfstrans_txn_begin_ro(btrfstrans_ctx* ctx, btrfstrans_txn** txn);
+int btrfstrans_txn_end(btrfstrans_txn* txn);
+
+/*
+ * Retention: with a policy set, every commit keeps the head it replaces
+ * as a read-only generation instead of deleting it, for the last keep
+ * generations and those that were head less than seconds ago (0 turns a
+ * rule off, both 0 turns retention off and drops the retained ones). The
+ * policy holds for the volume, in all processes. Retained generations are
+ * listed newest first with the time they stopped being head, read with
+ * btrfstrans_txn_begin_ro_at() and made head again with
+ * btrfstrans_ctx_revert(). A revert is a commit of its own, taking one
+ * snapshot and one exchange whatever the size of the data, and retains
+ * the head it replaces; optimistic transactions started before it fail
+ * with E_CONFLICT.
+ */
+typedef int (*btrfstrans_generation_fn)(unsigned long long seq, long long retired, void* arg);
+
+int btrfstrans_ctx_set_retention(btrfstrans_ctx* ctx, int keep, long long seconds);
+int btrfstrans_ctx_list_retained(btrfstrans_ctx* ctx, btrfstrans_generation_fn fn, void* arg);
+int btrfstrans_txn_begin_ro_at(btrfstrans_ctx* ctx, unsigned long long seq, btrfstrans_txn** txn);
+int btrfstrans_ctx_revert(btrfstrans_ctx* ctx, unsigned long long seq);
+
+/*
+ * Domains: independent volumes below <root>/domains/<name>, each with its
+ * own head, snapshots and locks, so writers of different domains never
+ * wait for each other. Names are up to BTRFSTRANS_DOMAIN_NAME_MAX of
+ * [A-Za-z0-9_-]; a domain is created when it is first opened.
+ *
+ * A multi-domain transaction writes to up to BTRFSTRANS_MAX_DOMAINS
+ * distinct domains of one root, given as their contexts, and commits to
+ * all of them or none, also across crashes. btrfstrans_multi_txn()
+ * returns the write transaction of ctxs[i] for the file operations; it
+ * must not be committed or aborted on its own. Commit and abort release
+ * the multi-domain transaction whatever they return. Its transactions
+ * lock their domains in the order of the domain names, so a thread must
+ * not hold other write transactions on those domains.
+ */
+#define BTRFSTRANS_DOMAIN_NAME_MAX 63
+#define BTRFSTRANS_MAX_DOMAINS 16
+
+typedef struct btrfstrans_multi btrfstrans_multi;
+
+int btrfstrans_ctx_open_domain(const char* root, const char* domain, btrfstrans_ctx** ctx);
+int btrfstrans_multi_begin(btrfstrans_ctx** ctxs, int n, btrfstrans_multi** multi);
+btrfstrans_txn* btrfstrans_multi_txn(btrfstrans_multi* multi, int i);
+int btrfstrans_multi_commit(btrfstrans_multi* multi);
+int btrfstrans_multi_abort(btrfstrans_multi* multi);
+
+FILE* btrfstrans_txn_fopen(btrfstrans_txn* txn, const char *__restrict __filename, const char *__restrict __modes);
+int btrfstrans_txn_mkdir(btrfstrans_txn* txn, const char* path, __mode_t mode);
+int btrfstrans_txn_rmdir(btrfstrans_txn* txn, const char* path);
+int btrfstrans_txn_unlink(btrfstrans_txn* txn, const char* path);
+int btrfstrans_txn_stat(btrfstrans_txn* txn, const char* __restrict file, struct stat* __restrict buf);
+
+int btrfstrans_txn_import(btrfstrans_txn* txn, const char* src_path, const char* dst);
+int btrfstrans_txn_import_from_head(btrfstrans_txn* txn, const char* src, const char* dst);
+int btrfstrans_txn_clone_range(btrfstrans_txn* txn, const char* src_path, off_t src_offset,
+    const char* dst, off_t dst_offset, off_t length);
+
+/*
+ * Logging, for all contexts of the process. Nothing is logged unless a
+ * level is set here or in $BTRFSTRANS_LOG_LEVEL (a number or a name):
+ * failures are reported by the return codes, btrfstrans_strerror() names
+ * them and btrfstrans_last_error() returns the message of the last error
+ * in the calling thread. Messages above BTRFSTRANS_LOG_COMPILED_LEVEL
+ * (default INFO) are compiled out of the library. The sink, stderr if
+ * NULL, must be thread-safe and is best set before the library is used.
+ * In async mode messages are queued in a ring, dropped while it is full,
+ * and a library thread calls the sink; btrfstrans_log_flush() waits until
+ * the ones logged so far are delivered.
+ */
+#define BTRFSTRANS_LOG_NONE 0
+#define BTRFSTRANS_LOG_ERROR 1
+#define BTRFSTRANS_LOG_WARN 2
+#define BTRFSTRANS_LOG_INFO 3
+#define BTRFSTRANS_LOG_DEBUG 4
+
+typedef void (*btrfstrans_log_fn)(int level, const char* msg, void* arg);
+
+int btrfstrans_set_log_level(int level);
+int btrfstrans_set_log_sink(btrfstrans_log_fn fn, void* arg);
+int btrfstrans_set_log_async(int enabled);
+int btrfstrans_log_flush();
+const char* btrfstrans_strerror(int err);
+const char* btrfstrans_last_error();
+
+/*
+ * The original API: one implicit context and transaction per process.
+ * Not thread-safe.
+ */
 int init_libbtrfstrans(const char* path);
+int btrfstrans_set_mode(int mode);
+int btrfstrans_set_durability(int level);
+int btrfstrans_set_txn_durability(int level);
 
 int start_transaction();
+int start_transaction_timeout(int timeout_ms);
 int commit_transaction();
+int btrfstrans_commit(unsigned long long* transid);
+int btrfstrans_start_async(int timeout_ms, int efd, btrfstrans_async_fn fn, void* arg, btrfstrans_async** req);
+int btrfstrans_commit_async(int efd, btrfstrans_async_fn fn, void* arg, btrfstrans_async** req);
+int btrfstrans_wait_durable(unsigned long long transid);
+int btrfstrans_wait_durable_batch(const unsigned long long* transids, int n);
 int abort_transaction();
 
+int btrfstrans_savepoint(int* savepoint);
+int btrfstrans_rollback_to(int savepoint);
+int btrfstrans_release_savepoint(int savepoint);
+
+int btrfstrans_set_prewarm(int enabled);
+int btrfstrans_set_journal_files(int max_files);
+int btrfstrans_set_write_lease(int lease_ms);
+
+int btrfstrans_enable_changesets();
+int btrfstrans_read_changes(unsigned long long from_seq, unsigned long long* next_seq, btrfstrans_change_fn fn, void* arg);
+int btrfstrans_wait_commit(unsigned long long seq, int timeout_ms);
+int btrfstrans_set_spool(const char* spool_path);
+int btrfstrans_flush_spool();
+
+// the reaper is shared by all contexts of the process
+int btrfstrans_set_reaper_rate(unsigned int per_second);
+int btrfstrans_reaper_queue_depth();
+int btrfstrans_reaper_flush();
+
 int start_ro_transaction();
+int start_ro_transaction_at(unsigned long long generation);
 int stop_ro_transaction();
+int btrfstrans_set_retention(int keep, long long seconds);
+int btrfstrans_list_retained(btrfstrans_generation_fn fn, void* arg);
+int btrfstrans_revert(unsigned long long generation);
 
 int test_issubvolume(const char *path);
 int test_isdir(const char *path);
 
 int create_snapshot(const char* subvol, char* dst, int readonly, int async); // from btrfs progs: cmds-subvolume.c
 int make_subvolume(const char *path);
+int btrfstrans_make_subvolume(const char* path, int nthreads); // nthreads 0: one per CPU
 int create_subvolume(const char* dst);
 int delete_subvolume(const char* path);
 
@@ -49,4 +344,54 @@ int btrfstrans_rmdir(const char* path);
 int btrfstrans_unlink(const char* path);
 int btrfstrans_stat(const char* __restrict file, struct stat* __restrict buf);
 
+int btrfstrans_import(const char* src_path, const char* dst);
+int btrfstrans_import_from_head(const char* src, const char* dst);
+int btrfstrans_clone_range(const char* src_path, off_t src_offset, const char* dst,
+    off_t dst_offset, off_t length);
+
+/*
+ * Batched operations on the subvolume of the running write transaction.
+ * Files are referred to by a slot (0..BTRFSTRANS_BATCH_MAX_FILES-1) that
+ * OPEN fills and CLOSE releases. An op with BTRFSTRANS_OP_LINK set starts
+ * or continues a chain: the next op only runs after it succeeded, and is
+ * completed with -ECANCELED otherwise. Chains run concurrently and in no
+ * particular order relative to each other. A chain holds at most
+ * BTRFSTRANS_BATCH_MAX_CHAIN ops.
+ */
+#define BTRFSTRANS_BATCH_MAX_FILES 256
+#define BTRFSTRANS_BATCH_MAX_CHAIN 256
+#define BTRFSTRANS_OP_LINK 1
+
+enum btrfstrans_opcode
+{
+    BTRFSTRANS_OP_MKDIR = 1,
+    BTRFSTRANS_OP_RMDIR,
+    BTRFSTRANS_OP_UNLINK,
+    BTRFSTRANS_OP_OPEN,
+    BTRFSTRANS_OP_WRITE,
+    BTRFSTRANS_OP_FSYNC,
+    BTRFSTRANS_OP_CLOSE
+};
+
+struct btrfstrans_op
+{
+    int opcode;
+    int flags;
+    const char* path;   // MKDIR, RMDIR, UNLINK, OPEN
+    int open_flags;     // OPEN
+    mode_t mode;        // MKDIR, OPEN
+    int file;           // OPEN, WRITE, FSYNC, CLOSE
+    const void* buf;    // WRITE
+    size_t len;         // WRITE
+    off_t offset;       // WRITE
+    int result;         // out: >= 0 on success (bytes written for WRITE), -errno otherwise
+};
+
+int btrfstrans_txn_submit(btrfstrans_txn* txn, struct btrfstrans_op* ops, int n);
+int btrfstrans_submit(struct btrfstrans_op* ops, int n);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* LIBBTRFSTRANS_H_ */
@@ -0,0 +1,461 @@
+#ifndef LIBBTRFSTRANS_HPP_
+#define LIBBTRFSTRANS_HPP_
+
+/*
+ * C++17 layer over the handle based API of libbtrfstrans.h. Contexts,
+ * transactions and files are move-only owners of their C handle: a write
+ * transaction that is neither committed nor aborted when it goes out of
+ * scope, also through an exception, is aborted, so the write lock is
+ * never left behind. Errors are thrown as btrfstrans::Error with the E_*
+ * code, or std::system_error for failed file system calls.
+ *
+ * The concurrency mode, durability and commit engine are template
+ * parameters of the context, set once when it is opened:
+ *
+ *   btrfstrans::Context<btrfstrans::mode::Optimistic,
+ *                       btrfstrans::durability::Async> ctx("/mnt/vol");
+ *   for (;;) {
+ *       auto txn = ctx.begin();
+ *       txn.open("counter", "w").print("%d\n", n);
+ *       try {
+ *           ctx.wait_durable(txn.commit());
+ *           break;
+ *       } catch (const btrfstrans::Conflict&) {
+ *       }
+ *   }
+ *
+ * Paths are passed on as they are when they are NUL-terminated already
+ * (const char*, std::string, std::filesystem::path); a std::string_view
+ * is copied to the stack.
+ */
+#include <cerrno>
+#include <climits>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <type_traits>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "libbtrfstrans.h"
+
+namespace btrfstrans {
+
+namespace mode {
+struct Pessimistic {
+    static constexpr int value = BTRFSTRANS_MODE_PESSIMISTIC;
+};
+struct Optimistic {
+    static constexpr int value = BTRFSTRANS_MODE_OPTIMISTIC;
+};
+} // namespace mode
+
+namespace durability {
+struct None {
+    static constexpr int value = BTRFSTRANS_DURABILITY_NONE;
+};
+// commit() returns the btrfs transid to pass to Context::wait_durable()
+struct Async {
+    static constexpr int value = BTRFSTRANS_DURABILITY_ASYNC;
+};
+struct Syncfs {
+    static constexpr int value = BTRFSTRANS_DURABILITY_SYNCFS;
+};
+struct Fsync {
+    static constexpr int value = BTRFSTRANS_DURABILITY_FSYNC;
+};
+} // namespace durability
+
+namespace engine {
+// small transactions commit through the rename journal, see btrfstrans_ctx_set_journal_files()
+template <int MaxFiles = BTRFSTRANS_JOURNAL_DEFAULT_FILES>
+struct Journal {
+    static_assert(MaxFiles > 0 && MaxFiles <= BTRFSTRANS_JOURNAL_MAX_FILES, "journal size out of range");
+    static constexpr int max_files = MaxFiles;
+};
+struct Snapshot {
+    static constexpr int max_files = 0;
+};
+} // namespace engine
+
+// the message is the error and the last one the library reported in the thread, see btrfstrans_last_error()
+class Error : public std::runtime_error {
+public:
+    Error(int code, const char* call)
+        : std::runtime_error(message(code, call)), code_(code) {}
+
+    int code() const noexcept { return code_; }
+
+private:
+    static std::string message(int code, const char* call) {
+        std::string msg = std::string(call) + ": " + btrfstrans_strerror(code);
+        const char* detail = btrfstrans_last_error();
+
+        if (*detail) {
+            msg = msg + " (" + detail + ")";
+        }
+        return msg;
+    }
+
+    int code_;
+};
+
+// an optimistic commit lost against one committed since its start; begin again
+class Conflict : public Error {
+public:
+    explicit Conflict(const char* call) : Error(E_CONFLICT, call) {}
+};
+
+namespace detail {
+
+inline void check(int ret, const char* call) {
+    if (ret) {
+        throw Error(ret, call);
+    }
+}
+
+// the file operations return -1 and errno when the system call fails, an E_* code otherwise
+inline void check_io(int ret, const char* call) {
+    if (ret == -1) {
+        throw std::system_error(errno, std::generic_category(), call);
+    }
+    check(ret, call);
+}
+
+/*
+ * A NUL-terminated path for the C API. Only meant to be a by-value
+ * parameter: it may point into itself.
+ */
+class CPath {
+public:
+    CPath(const char* path) noexcept : path_(path) {}
+    CPath(const std::string& path) noexcept : path_(path.c_str()) {}
+    CPath(const std::filesystem::path& path) noexcept : path_(path.c_str()) {}
+    CPath(std::string_view path) {
+        if (path.size() >= sizeof(buf_)) {
+            throw std::system_error(ENAMETOOLONG, std::generic_category(), "btrfstrans path");
+        }
+        std::memcpy(buf_, path.data(), path.size());
+        buf_[path.size()] = '\0';
+        path_ = buf_;
+    }
+    CPath(const CPath&) = delete;
+    CPath& operator=(const CPath&) = delete;
+
+    const char* c_str() const noexcept { return path_; }
+
+private:
+    const char* path_;
+    char buf_[PATH_MAX];
+};
+
+struct CloseCtx {
+    void operator()(btrfstrans_ctx* ctx) const noexcept { btrfstrans_ctx_close(ctx); }
+};
+struct AbortTxn {
+    void operator()(btrfstrans_txn* txn) const noexcept { btrfstrans_txn_abort(txn); }
+};
+struct EndTxn {
+    void operator()(btrfstrans_txn* txn) const noexcept { btrfstrans_txn_end(txn); }
+};
+struct CloseFile {
+    void operator()(FILE* fp) const noexcept { std::fclose(fp); }
+};
+
+} // namespace detail
+
+/*
+ * A file opened in a transaction. Files written by a write transaction
+ * must be closed before it commits.
+ */
+class File {
+public:
+    explicit File(FILE* fp) noexcept : fp_(fp) {}
+
+    FILE* get() const noexcept { return fp_.get(); }
+    explicit operator bool() const noexcept { return static_cast<bool>(fp_); }
+
+    size_t read(void* buf, size_t len) {
+        size_t n = std::fread(buf, 1, len, fp_.get());
+
+        if (n < len && std::ferror(fp_.get())) {
+            throw std::system_error(errno, std::generic_category(), "fread");
+        }
+        return n;
+    }
+
+    void write(const void* buf, size_t len) {
+        if (std::fwrite(buf, 1, len, fp_.get()) != len) {
+            throw std::system_error(errno, std::generic_category(), "fwrite");
+        }
+    }
+
+    void write(std::string_view s) { write(s.data(), s.size()); }
+
+    File& print(const char* format, ...) __attribute__((format(printf, 2, 3))) {
+        va_list ap;
+        int ret;
+
+        va_start(ap, format);
+        ret = std::vfprintf(fp_.get(), format, ap);
+        va_end(ap);
+        if (ret < 0) {
+            throw std::system_error(errno, std::generic_category(), "vfprintf");
+        }
+        return *this;
+    }
+
+    // reports what the destructor can't: a failed flush of buffered data
+    void close() {
+        if (std::fclose(fp_.release())) {
+            throw std::system_error(errno, std::generic_category(), "fclose");
+        }
+    }
+
+private:
+    std::unique_ptr<FILE, detail::CloseFile> fp_;
+};
+
+namespace detail {
+
+// what read-only and write transactions share
+template <class Txn>
+class FileOps {
+public:
+    File open(CPath path, const char* modes = "r") const {
+        FILE* fp = btrfstrans_txn_fopen(txn(), path.c_str(), modes);
+
+        if (!fp) {
+            throw std::system_error(errno, std::generic_category(), "btrfstrans_txn_fopen");
+        }
+        return File(fp);
+    }
+
+    struct stat stat(CPath path) const {
+        struct stat buf;
+
+        check_io(btrfstrans_txn_stat(txn(), path.c_str(), &buf), "btrfstrans_txn_stat");
+        return buf;
+    }
+
+    bool exists(CPath path) const {
+        struct stat buf;
+        int ret = btrfstrans_txn_stat(txn(), path.c_str(), &buf);
+
+        if (ret == -1 && errno == ENOENT) {
+            return false;
+        }
+        check_io(ret, "btrfstrans_txn_stat");
+        return true;
+    }
+
+private:
+    btrfstrans_txn* txn() const {
+        btrfstrans_txn* txn = static_cast<const Txn*>(this)->get();
+
+        if (!txn) {
+            throw Error(E_WRONGSTATE, "btrfstrans transaction");
+        }
+        return txn;
+    }
+};
+
+} // namespace detail
+
+/*
+ * A snapshot of head as of its start; ended by the destructor or end().
+ */
+class ReadTransaction : public detail::FileOps<ReadTransaction> {
+public:
+    explicit ReadTransaction(btrfstrans_txn* txn) noexcept : txn_(txn) {}
+
+    btrfstrans_txn* get() const noexcept { return txn_.get(); }
+    bool active() const noexcept { return static_cast<bool>(txn_); }
+
+    void end() {
+        if (txn_) {
+            detail::check(btrfstrans_txn_end(txn_.release()), "btrfstrans_txn_end");
+        }
+    }
+
+private:
+    std::unique_ptr<btrfstrans_txn, detail::EndTxn> txn_;
+};
+
+/*
+ * A write transaction; aborted by the destructor unless it was committed
+ * or aborted. Both release it whatever they throw.
+ */
+template <class Mode, class Durability>
+class WriteTransaction : public detail::FileOps<WriteTransaction<Mode, Durability>> {
+public:
+    explicit WriteTransaction(btrfstrans_txn* txn) noexcept : txn_(txn) {}
+
+    btrfstrans_txn* get() const noexcept { return txn_.get(); }
+    bool active() const noexcept { return static_cast<bool>(txn_); }
+
+    void mkdir(detail::CPath path, mode_t mode = 0755) {
+        detail::check_io(btrfstrans_txn_mkdir(txn(), path.c_str(), mode), "btrfstrans_txn_mkdir");
+    }
+
+    void rmdir(detail::CPath path) {
+        detail::check_io(btrfstrans_txn_rmdir(txn(), path.c_str()), "btrfstrans_txn_rmdir");
+    }
+
+    void unlink(detail::CPath path) {
+        detail::check_io(btrfstrans_txn_unlink(txn(), path.c_str()), "btrfstrans_txn_unlink");
+    }
+
+    void import(detail::CPath src_path, detail::CPath dst) {
+        detail::check_io(btrfstrans_txn_import(txn(), src_path.c_str(), dst.c_str()), "btrfstrans_txn_import");
+    }
+
+    void import_from_head(detail::CPath src, detail::CPath dst) {
+        detail::check_io(btrfstrans_txn_import_from_head(txn(), src.c_str(), dst.c_str()),
+            "btrfstrans_txn_import_from_head");
+    }
+
+    void clone_range(detail::CPath src_path, off_t src_offset, detail::CPath dst, off_t dst_offset, off_t length) {
+        detail::check_io(btrfstrans_txn_clone_range(txn(), src_path.c_str(), src_offset, dst.c_str(), dst_offset,
+            length), "btrfstrans_txn_clone_range");
+    }
+
+    int savepoint() {
+        int savepoint;
+
+        detail::check(btrfstrans_txn_savepoint(txn(), &savepoint), "btrfstrans_txn_savepoint");
+        return savepoint;
+    }
+
+    void rollback_to(int savepoint) {
+        detail::check(btrfstrans_txn_rollback_to(txn(), savepoint), "btrfstrans_txn_rollback_to");
+    }
+
+    void release_savepoint(int savepoint) {
+        detail::check(btrfstrans_txn_release_savepoint(txn(), savepoint), "btrfstrans_txn_release_savepoint");
+    }
+
+    /*
+     * Returns the btrfs transid with durability::Async, 0 otherwise. Only
+     * optimistic transactions can throw Conflict.
+     */
+    unsigned long long commit() {
+        unsigned long long transid = 0;
+        int ret;
+
+        if constexpr (std::is_same_v<Durability, durability::Async>) {
+            ret = btrfstrans_txn_commit(txn(), &transid);
+        } else {
+            ret = btrfstrans_txn_commit(txn(), nullptr);
+        }
+        txn_.release();
+        if constexpr (std::is_same_v<Mode, mode::Optimistic>) {
+            if (ret == E_CONFLICT) {
+                throw Conflict("btrfstrans_txn_commit");
+            }
+        }
+        detail::check(ret, "btrfstrans_txn_commit");
+        return transid;
+    }
+
+    void abort() {
+        if (txn_) {
+            detail::check(btrfstrans_txn_abort(txn_.release()), "btrfstrans_txn_abort");
+        }
+    }
+
+private:
+    btrfstrans_txn* txn() const {
+        if (!txn_) {
+            throw Error(E_WRONGSTATE, "btrfstrans transaction");
+        }
+        return txn_.get();
+    }
+
+    std::unique_ptr<btrfstrans_txn, detail::AbortTxn> txn_;
+};
+
+/*
+ * An opened volume root or domain, closed by the destructor. Its
+ * transactions must end first.
+ */
+template <class Mode = mode::Pessimistic, class Durability = durability::Syncfs, class Engine = engine::Journal<>>
+class Context {
+public:
+    using Write = WriteTransaction<Mode, Durability>;
+    using Read = ReadTransaction;
+
+    explicit Context(detail::CPath root) {
+        btrfstrans_ctx* ctx;
+
+        detail::check(btrfstrans_ctx_open(root.c_str(), &ctx), "btrfstrans_ctx_open");
+        ctx_.reset(ctx);
+        configure();
+    }
+
+    Context(detail::CPath root, detail::CPath domain) {
+        btrfstrans_ctx* ctx;
+
+        detail::check(btrfstrans_ctx_open_domain(root.c_str(), domain.c_str(), &ctx), "btrfstrans_ctx_open_domain");
+        ctx_.reset(ctx);
+        configure();
+    }
+
+    btrfstrans_ctx* get() const noexcept { return ctx_.get(); }
+
+    // timeout_ms as for btrfstrans_txn_begin_timeout(), throws Error with E_TIMEOUT
+    Write begin(int timeout_ms = -1) {
+        btrfstrans_txn* txn;
+
+        detail::check(btrfstrans_txn_begin_timeout(ctx_.get(), &txn, timeout_ms), "btrfstrans_txn_begin_timeout");
+        return Write(txn);
+    }
+
+    Read begin_ro() {
+        btrfstrans_txn* txn;
+
+        detail::check(btrfstrans_txn_begin_ro(ctx_.get(), &txn), "btrfstrans_txn_begin_ro");
+        return Read(txn);
+    }
+
+    // a retained generation, see btrfstrans_ctx_set_retention()
+    Read begin_ro_at(unsigned long long seq) {
+        btrfstrans_txn* txn;
+
+        detail::check(btrfstrans_txn_begin_ro_at(ctx_.get(), seq, &txn), "btrfstrans_txn_begin_ro_at");
+        return Read(txn);
+    }
+
+    void wait_durable(unsigned long long transid) {
+        static_assert(std::is_same_v<Durability, durability::Async>, "only asynchronous commits return a transid");
+        detail::check(btrfstrans_ctx_wait_durable(ctx_.get(), transid), "btrfstrans_ctx_wait_durable");
+    }
+
+private:
+    // the defaults of a new context need no call
+    void configure() {
+        if constexpr (Mode::value != BTRFSTRANS_MODE_PESSIMISTIC) {
+            detail::check(btrfstrans_ctx_set_mode(ctx_.get(), Mode::value), "btrfstrans_ctx_set_mode");
+        }
+        if constexpr (Durability::value != BTRFSTRANS_DURABILITY_SYNCFS) {
+            detail::check(btrfstrans_ctx_set_durability(ctx_.get(), Durability::value),
+                "btrfstrans_ctx_set_durability");
+        }
+        if constexpr (Engine::max_files != BTRFSTRANS_JOURNAL_DEFAULT_FILES) {
+            detail::check(btrfstrans_ctx_set_journal_files(ctx_.get(), Engine::max_files),
+                "btrfstrans_ctx_set_journal_files");
+        }
+    }
+
+    std::unique_ptr<btrfstrans_ctx, detail::CloseCtx> ctx_;
+};
+
+} // namespace btrfstrans
+
+#endif /* LIBBTRFSTRANS_HPP_ */
@@ -1,3 +1,7 @@
 #!/bin/sh
+# add -DBTRFSTRANS_HAVE_LIBURING and -luring to run btrfstrans_submit() on io_uring
 gcc -static -Wall -o libbtrfstrans libbtrfstrans.c rw-file.c \
     -L/home/ubuntu/524/txn_btrfs/btrfs-progs -lbtrfs -lpthread
+gcc -Wall -o btrfstrans-stat tools/btrfstrans-stat.c -lrt
+gcc -Wall -o btrfstrans-changes tools/btrfstrans-changes.c libbtrfstrans.c \
+    -L/home/ubuntu/524/txn_btrfs/btrfs-progs -lbtrfs -lpthread
@@ -0,0 +1,65 @@
+/*
+ * Follows the commits of a volume and prints what each one changed, one
+ * "<seq> <kind> <path>" line per change (kinds as in libbtrfstrans.h, '*'
+ * meaning anything may have changed). Starts with the next commit, or with
+ * commit -s if given. Changesets are enabled for the volume with -e.
+ *
+ * Build: gcc -Wall -o btrfstrans-changes tools/btrfstrans-changes.c libbtrfstrans.c \
+ *            -L../btrfs-progs -lbtrfs -lpthread
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "../libbtrfstrans.h"
+
+static void usage(const char* prog) {
+    fprintf(stderr, "usage: %s -p volume_root [-s first_seq] [-e]\n", prog);
+    exit(2);
+}
+
+static int print_change(unsigned long long seq, int kind, const char* path, void* arg) {
+    printf("%llu %c %s\n", seq, kind, path);
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    unsigned long long seq = 0;
+    const char* root = NULL;
+    btrfstrans_ctx* ctx;
+    int enable = 0, opt, ret;
+
+    while ((opt = getopt(argc, argv, "p:s:e")) != -1) {
+        switch (opt) {
+        case 'p': root = optarg; break;
+        case 's': seq = strtoull(optarg, NULL, 10); break;
+        case 'e': enable = 1; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (!root) {
+        usage(argv[0]);
+    }
+
+    // every change shows up as it comes, also in a pipe
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    if (btrfstrans_ctx_open(root, &ctx)) {
+        return 1;
+    }
+    if (enable && btrfstrans_ctx_enable_changesets(ctx)) {
+        return 1;
+    }
+
+    for (;;) {
+        ret = btrfstrans_ctx_read_changes(ctx, seq, &seq, print_change, NULL);
+        if (!ret) {
+            ret = btrfstrans_ctx_wait_commit(ctx, seq, -1);
+        }
+        if (ret) {
+            fprintf(stderr, "ERROR: following %s failed - %s (%s)\n", root, btrfstrans_strerror(ret), btrfstrans_last_error());
+            btrfstrans_ctx_close(ctx);
+            return 1;
+        }
+    }
+}
@@ -0,0 +1,170 @@
+/*
+ * Live view of the libbtrfstrans statistics segment.
+ *
+ * Prints, every interval, the number of samples, the rate and the latency
+ * percentiles of every transaction phase seen since the previous report
+ * (or since the segment was created with -c), followed by the counters.
+ * Phases without samples in the interval are left out. With -c the rate
+ * is over the time btrfstrans-stat has been running.
+ *
+ * Build: gcc -Wall -o btrfstrans-stat tools/btrfstrans-stat.c -lrt
+ */
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "../btrfstrans_stats.h"
+
+static const char* phase_names[BTRFSTRANS_PHASE_COUNT] = BTRFSTRANS_PHASE_NAMES;
+static const char* counter_names[BTRFSTRANS_COUNTER_COUNT] = BTRFSTRANS_COUNTER_NAMES;
+
+static void usage(const char* prog) {
+    fprintf(stderr, "usage: %s [-i interval_seconds] [-n reports] [-c]\n", prog);
+    exit(2);
+}
+
+static void snapshot(const struct btrfstrans_stats* stats, struct btrfstrans_stats* copy) {
+    const uint64_t* src = (const uint64_t*)stats->counters;
+    uint64_t* dst = copy->counters;
+    size_t n = (sizeof(*stats) - offsetof(struct btrfstrans_stats, counters)) / sizeof(uint64_t);
+
+    // field by field, the library updates them concurrently
+    for (size_t i = 0; i < n; i++) {
+        dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    }
+}
+
+// lower bound of the bucket holding the sample of rank ceil(q * count)
+static uint64_t percentile(const uint64_t* buckets, uint64_t count, double q) {
+    uint64_t rank = (uint64_t)(q * count + 0.999999), seen = 0;
+
+    if (rank == 0) {
+        rank = 1;
+    }
+    for (int b = 0; b < BTRFSTRANS_HIST_BUCKETS; b++) {
+        seen += buckets[b];
+        if (seen >= rank) {
+            return btrfstrans_hist_lower(b);
+        }
+    }
+    return btrfstrans_hist_lower(BTRFSTRANS_HIST_BUCKETS - 1);
+}
+
+static void print_ns(uint64_t ns) {
+    if (ns < 10000) {
+        printf(" %8lluns", (unsigned long long)ns);
+    } else if (ns < 10000000) {
+        printf(" %8.1fus", ns / 1e3);
+    } else {
+        printf(" %8.1fms", ns / 1e6);
+    }
+}
+
+static void report(const struct btrfstrans_stats* cur, const struct btrfstrans_stats* prev, double seconds) {
+    uint64_t buckets[BTRFSTRANS_HIST_BUCKETS];
+
+    printf("%-16s %10s %10s %10s %10s %10s %10s %10s\n",
+        "phase", "count", "rate/s", "mean", "p50", "p99", "p99.9", "max");
+    for (int p = 0; p < BTRFSTRANS_PHASE_COUNT; p++) {
+        const struct btrfstrans_hist* h = &cur->hist[p];
+        const struct btrfstrans_hist* o = &prev->hist[p];
+        uint64_t count = h->count - o->count;
+
+        if (count == 0) {
+            continue;
+        }
+        for (int b = 0; b < BTRFSTRANS_HIST_BUCKETS; b++) {
+            buckets[b] = h->buckets[b] - o->buckets[b];
+        }
+        printf("%-16s %10llu %10.1f", phase_names[p], (unsigned long long)count, count / seconds);
+        print_ns((h->sum_ns - o->sum_ns) / count);
+        print_ns(percentile(buckets, count, 0.5));
+        print_ns(percentile(buckets, count, 0.99));
+        print_ns(percentile(buckets, count, 0.999));
+        // the maximum is only kept since the segment was created
+        print_ns(h->max_ns);
+        printf("\n");
+    }
+    for (int c = 0; c < BTRFSTRANS_COUNTER_COUNT; c++) {
+        printf("%s=%llu%s", counter_names[c], (unsigned long long)(cur->counters[c] - prev->counters[c]),
+            c == BTRFSTRANS_COUNTER_COUNT - 1 ? "\n\n" : " ");
+    }
+    fflush(stdout);
+}
+
+static double now() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char** argv) {
+    struct btrfstrans_stats *stats, *cur, *prev, *tmp;
+    double interval = 1, last, t;
+    int reports = -1, cumulative = 0, opt, fd;
+
+    while ((opt = getopt(argc, argv, "i:n:c")) != -1) {
+        switch (opt) {
+        case 'i': interval = atof(optarg); break;
+        case 'n': reports = atoi(optarg); break;
+        case 'c': cumulative = 1; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (interval <= 0) {
+        usage(argv[0]);
+    }
+
+    fd = shm_open(BTRFSTRANS_STATS_SHM_NAME, O_RDONLY, 0);
+    if (fd < 0) {
+        fprintf(stderr, "ERROR: can't open %s - %s (no process has used the library yet?)\n",
+            BTRFSTRANS_STATS_SHM_NAME, strerror(errno));
+        return 1;
+    }
+    stats = mmap(NULL, sizeof(*stats), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (stats == MAP_FAILED) {
+        fprintf(stderr, "ERROR: can't map %s - %s\n", BTRFSTRANS_STATS_SHM_NAME, strerror(errno));
+        return 1;
+    }
+    if (stats->magic != BTRFSTRANS_STATS_MAGIC || stats->version != BTRFSTRANS_STATS_VERSION ||
+        stats->phases != BTRFSTRANS_PHASE_COUNT || stats->buckets != BTRFSTRANS_HIST_BUCKETS) {
+        fprintf(stderr, "ERROR: %s has another layout, rebuild btrfstrans-stat\n", BTRFSTRANS_STATS_SHM_NAME);
+        return 1;
+    }
+
+    cur = calloc(1, sizeof(*cur));
+    prev = calloc(1, sizeof(*prev));
+    if (!cur || !prev) {
+        fprintf(stderr, "ERROR: out of memory\n");
+        return 1;
+    }
+    if (!cumulative) {
+        snapshot(stats, prev);
+    }
+    last = now();
+
+    while (reports != 0) {
+        usleep(interval * 1e6);
+        snapshot(stats, cur);
+        t = now();
+        report(cur, prev, t - last);
+        if (!cumulative) {
+            tmp = prev;
+            prev = cur;
+            cur = tmp;
+            last = t;
+        }
+        if (reports > 0) {
+            reports--;
+        }
+    }
+    return 0;
+}